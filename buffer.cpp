@@ -135,6 +135,15 @@ bool Buffer::rewind(uint32_t amt) {
    return false;
 }
 
+bool Buffer::skip(uint32_t amt) {
+   if ((rptr + amt) <= wptr) {
+      rptr += amt;
+      return true;
+   }
+   error = true;
+   return false;
+}
+
 bool Buffer::reset() {
    rptr = 0;
    wptr = 0;
@@ -49,6 +49,7 @@ public:
    short readShort();
    char *readUTF8();   //must qfree this
    bool rewind(uint32_t amt);
+   bool skip(uint32_t amt);
    bool reset();
    bool write(const void *data, uint32_t len);
    bool writeLong(uint64_t val);
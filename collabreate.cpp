@@ -1232,6 +1232,14 @@ void handle_control_msg(Buffer &b, int command) {
          msg(PLUGIN_NAME": Received Auth Challenge\n");
 #endif
          if (b.read(challenge, sizeof(challenge))) {
+            //newer servers append the highest protocol version they speak
+            protocol = PROTOCOL_VERSION;
+            if ((b.size() - b.get_rlen()) >= sizeof(int)) {
+               int server_max = b.readInt();
+               if (server_max > PROTOCOL_VERSION) {
+                  protocol = server_max < PROTOCOL_VERSION_MAX ? server_max : PROTOCOL_VERSION_MAX;
+               }
+            }
             if (do_auth(challenge, sizeof(challenge)) != 0) {
                cleanup();         //user canceled dialog
             }
@@ -1415,6 +1423,22 @@ void handle_control_msg(Buffer &b, int command) {
          setLastUpdate(updateid);
          break;
       }
+      case MSG_BULK_UPDATES: {
+         //a block of complete update packets sent during catch up
+         int count = b.readInt();
+         for (int i = 0; i < count && !b.has_error(); i++) {
+            int len = b.readInt();
+            if (len < (int)(2 * sizeof(int)) || (b.size() - b.get_rlen()) < (len - sizeof(int))) {
+               msg(PLUGIN_NAME": malformed bulk update packet\n");
+               break;
+            }
+            Buffer update(b.get_buf() + b.get_rlen(), len - sizeof(int));
+            msg_dispatcher(update);
+            //skip over the update just dispatched
+            b.skip(len - sizeof(int));
+         }
+         break;
+      }
       case MSG_AUTH_REQUEST:  //client should never receive this
       case MSG_PROJECT_JOIN_REQUEST:  //client should never receive this
       case MSG_PROJECT_NEW_REQUEST:  //client should never receive this
@@ -41,6 +41,8 @@
 #define PLUGIN_NAME "collabREate"
 
 #define PROTOCOL_VERSION             2 
+//highest protocol version this plugin can negotiate with a server
+#define PROTOCOL_VERSION_MAX         3
 
 #define COMMAND_BYTE_PATCHED         1
 #define COMMAND_CMT_CHANGED          2
@@ -150,6 +152,7 @@
 #define MSG_GET_PROJ_PERMS_REPLY     1021
 #define MSG_SET_PROJ_PERMS           1022
 #define MSG_SET_PROJ_PERMS_REPLY     1023
+#define MSG_BULK_UPDATES             1024
 
 #define MSG_ERROR                    1100
 #define MSG_FATAL                    1101
@@ -195,6 +198,7 @@ extern bool publish;
 extern bool userPublish;
 extern bool subscribe;
 extern bool supress;
+extern int protocol;
 
 extern char **optLabels;
 
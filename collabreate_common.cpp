@@ -38,6 +38,8 @@
 bool publish  = true;
 bool userPublish  = true;
 bool subscribe = true;
+//protocol version negotiated with the server during authentication
+int protocol = PROTOCOL_VERSION;
 
 char username[64];
 static unsigned char pwhash[16];
@@ -401,7 +403,7 @@ void sendAuthData(unsigned char *challenge, int challenge_len) {
    Buffer auth;
    auth.writeInt(MSG_AUTH_REQUEST);
    //send plugin protocol version
-   auth.writeInt(PROTOCOL_VERSION);
+   auth.writeInt(protocol);
    //send user name
    auth.writeUTF8(username);
    //send hmac
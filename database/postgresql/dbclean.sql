@@ -5,6 +5,8 @@ DROP TABLE tracker;
 DROP TABLE forklist;
 DROP TABLE snapshots;
 DROP SEQUENCE snapshots_sid_seq;
+DROP TABLE dictionaries;
+DROP TABLE checkpoints;
 DROP TABLE updates;
 DROP SEQUENCE updates_updateid_seq;
 DROP TABLE tablename;
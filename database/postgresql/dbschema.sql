@@ -54,6 +54,9 @@ CREATE TABLE projects (
    pub BIGINT,
    snapupdateid BIGINT DEFAULT 0, -- replaces entire snapshot table
    protocol INTEGER NOT NULL,     --server protocol used to create this project
+   archive TEXT,                  --archive file holding the project's updates, NULL while they are in updates
+   deleted BOOLEAN NOT NULL DEFAULT false, --set by collab_mgr, the server purges the project in the background
+   migrated BIGINT,               --updates stored so far by a collab_mgr import, NULL if the project was not imported
    PRIMARY KEY (pid)
 );
 
@@ -74,9 +77,41 @@ CREATE TABLE updates (
    cmd INTEGER,
    data BYTEA,
    created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   dictid INTEGER,  --NULL if data is stored uncompressed, 0 if compressed without a dictionary
+   ea BIGINT,       --address the update applies to, NULL for enums, structures, etc.
+   supkey BYTEA,    --kind and target of the update, NULL if later updates never supersede it
+   superseded BOOLEAN NOT NULL DEFAULT false,  --set by compaction, catch up skips these
    PRIMARY KEY (updateid,pid)
 );
 
+--lets catch up skip the commands a client does not subscribe to
+CREATE INDEX updates_pid_cmd_index ON updates(pid,cmd,updateid);
+--address range scoped catch up
+CREATE INDEX updates_pid_ea_index ON updates(pid,ea,updateid);
+--finds the earlier updates to the same target during compaction
+CREATE INDEX updates_pid_supkey_index ON updates(pid,supkey,updateid) WHERE supkey IS NOT NULL;
+
+--one row per compaction run, every update of the project up to updateid
+--that has been superseded by a later one has been marked as such
+CREATE TABLE checkpoints (
+   pid INTEGER REFERENCES projects(pid) ON DELETE CASCADE,
+   updateid BIGINT NOT NULL,
+   superseded BIGINT NOT NULL,  --updates marked superseded by this run
+   bytes BIGINT NOT NULL,       --stored size of those updates
+   created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   PRIMARY KEY (pid,updateid)
+);
+
+--preset dictionaries for compressing updates.data, rows are never modified or
+--deleted so that previously compressed updates can always be read back
+CREATE TABLE dictionaries (
+   dictid SERIAL UNIQUE NOT NULL,
+   pid INTEGER,  --project trained on, NULL for a global dictionary. not a reference, forks keep using their parent's dictionaries
+   data BYTEA NOT NULL,
+   created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   PRIMARY KEY (dictid)
+);
+
 CREATE SEQUENCE snapshots_sid_seq;
 
 CREATE TABLE forklist (
@@ -118,7 +153,9 @@ $$ LANGUAGE plpgsql;
 CREATE OR REPLACE FUNCTION copy_updates(ppid integer, maxid integer, lpid integer) RETURNS VOID AS $$
 DECLARE
 BEGIN
-   INSERT INTO updates (SELECT updateid,userid,lpid,cmd,data,created FROM updates WHERE pid = ppid AND updateid <= maxid);
+   --updates superseded after maxid are still current in the fork
+   INSERT INTO updates (updateid,userid,pid,cmd,data,created,dictid,ea,supkey,superseded)
+      (SELECT updateid,userid,lpid,cmd,data,created,dictid,ea,supkey,false FROM updates WHERE pid = ppid AND updateid <= maxid);
 END;
 $$ LANGUAGE plpgsql;
 
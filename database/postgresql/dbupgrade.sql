@@ -0,0 +1,71 @@
+--  IDA Pro Collabreation/Synchronization Plugin
+--  Copyright (C) 2008 Chris Eagle <cseagle at gmail d0t com>
+--  Copyright (C) 2008 Tim Vidas <tvidas at gmail d0t com>
+--
+--
+--  This program is free software; you can redistribute it and/or modify it
+--  under the terms of the GNU General Public License as published by the Free
+--  Software Foundation; either version 2 of the License, or (at your option)
+--  any later version.
+--
+--  This program is distributed in the hope that it will be useful, but WITHOUT
+--  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+--  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+--  more details.
+--
+--  You should have received a copy of the GNU General Public License along with
+--  this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+--  Place, Suite 330, Boston, MA 02111-1307 USA
+
+--used to bring a collabreate db created by an older dbschema.sql up to date,
+--the server's queries fail to prepare until it has been run. Stop the server
+--first, then something like:
+-- psql -U collab collabDB
+-- psql> \i dbupgrade.sql
+--It only adds what is missing, so it is safe to run more than once. Needs
+--postgres 9.6 or later for ADD COLUMN IF NOT EXISTS, on postgres 11 or later
+--the columns with defaults are added without rewriting updates.
+
+BEGIN;
+
+ALTER TABLE projects ADD COLUMN IF NOT EXISTS archive TEXT;
+ALTER TABLE projects ADD COLUMN IF NOT EXISTS deleted BOOLEAN NOT NULL DEFAULT false;
+ALTER TABLE projects ADD COLUMN IF NOT EXISTS migrated BIGINT;
+
+ALTER TABLE updates ADD COLUMN IF NOT EXISTS dictid INTEGER;
+ALTER TABLE updates ADD COLUMN IF NOT EXISTS ea BIGINT;
+ALTER TABLE updates ADD COLUMN IF NOT EXISTS supkey BYTEA;
+ALTER TABLE updates ADD COLUMN IF NOT EXISTS superseded BOOLEAN NOT NULL DEFAULT false;
+
+CREATE INDEX IF NOT EXISTS updates_pid_cmd_index ON updates(pid,cmd,updateid);
+CREATE INDEX IF NOT EXISTS updates_pid_ea_index ON updates(pid,ea,updateid);
+CREATE INDEX IF NOT EXISTS updates_pid_supkey_index ON updates(pid,supkey,updateid) WHERE supkey IS NOT NULL;
+
+CREATE TABLE IF NOT EXISTS checkpoints (
+   pid INTEGER REFERENCES projects(pid) ON DELETE CASCADE,
+   updateid BIGINT NOT NULL,
+   superseded BIGINT NOT NULL,
+   bytes BIGINT NOT NULL,
+   created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   PRIMARY KEY (pid,updateid)
+);
+
+CREATE TABLE IF NOT EXISTS dictionaries (
+   dictid SERIAL UNIQUE NOT NULL,
+   pid INTEGER,
+   data BYTEA NOT NULL,
+   created TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+   PRIMARY KEY (dictid)
+);
+
+--forks copy the new columns as well
+CREATE OR REPLACE FUNCTION copy_updates(ppid integer, maxid integer, lpid integer) RETURNS VOID AS $$
+DECLARE
+BEGIN
+   --updates superseded after maxid are still current in the fork
+   INSERT INTO updates (updateid,userid,pid,cmd,data,created,dictid,ea,supkey,superseded)
+      (SELECT updateid,userid,lpid,cmd,data,created,dictid,ea,supkey,false FROM updates WHERE pid = ppid AND updateid <= maxid);
+END;
+$$ LANGUAGE plpgsql;
+
+COMMIT;
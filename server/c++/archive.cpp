@@ -0,0 +1,535 @@
+/*
+   collabREate archive.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "db_support.h"
+#include "maintenance.h"
+#include "bulk_load.h"
+#include "archive.h"
+
+using namespace std;
+
+#define DEFAULT_ARCHIVE_LEVEL 9
+
+//archives are written out in pieces of roughly this size
+#define ARCHIVE_CHUNK 0x100000
+
+static bool gzReadFully(gzFile gz, void *buf, uint32_t len) {
+   return len == 0 || gzread(gz, buf, len) == (int)len;
+}
+
+static bool execOk(PGconn *conn, const char *sql) {
+   PGresult *res = PQexec(conn, sql);
+   bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+   if (!ok) {
+      fprintf(stderr, "%s %s\n", sql, PQerrorMessage(conn));
+   }
+   PQclear(res);
+   return ok;
+}
+
+/**
+ * @param dbm the connection manager that owns this Archiver
+ * @param m the maintenance thread to tell about restored projects
+ * @param p the server configuration
+ */
+Archiver::Archiver(DatabaseConnectionManager *dbm, Maintenance *m, map<string,string> *p) {
+   cm = dbm;
+   maint = m;
+   props = p;
+   dbConn = NULL;
+   sem_init(&lock, 0, 1);
+   touchConn = NULL;
+   sem_init(&touchLock, 0, 1);
+   dir = getStringOption(p, "ARCHIVE_DIR", "archive");
+   level = getIntOption(p, "ARCHIVE_COMPRESSION_LEVEL", DEFAULT_ARCHIVE_LEVEL);
+}
+
+/**
+ * connect opens the archiver's own connection the first time it is needed,
+ * most servers never archive anything.  Must be called with the lock held
+ */
+bool Archiver::connect() {
+   if (dbConn == NULL) {
+      dbConn = connectDatabase(props);
+      if (dbConn != NULL) {
+         init_queries();
+      }
+   }
+   return dbConn != NULL;
+}
+
+void Archiver::init_queries() {
+   //only ever used with the lock held, so unlike the connection
+   //manager's statements these need no semaphores of their own
+   PGresult *res = PQprepare(dbConn, "idleProjects",
+                   "select p.pid,p.gpid,p.hash,p.description,p.pub,p.sub,coalesce(p.touched,p.created)::text from projects p "
+                   "where p.archive is null and p.snapupdateid = 0 "
+                   "and coalesce(p.touched,p.created) < now() - $1 * interval '1 day' "
+                   "and exists (select 1 from updates u where u.pid = p.pid) order by p.pid;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "idleProjects: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "archiveUpdates",
+                   "select updateid,userid,cmd,data,dictid from updates where pid = $1 order by updateid asc;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "archiveUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //a project touched since it was found idle has been joined meanwhile
+   res = PQprepare(dbConn, "markArchived",
+                   "update projects set archive = $2 where pid = $1 and archive is null "
+                   "and coalesce(touched,created)::text = $3;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "markArchived: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "dropArchived",
+                   "delete from updates where pid = $1 and updateid <= $2;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "dropArchived: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //superseded flags aren't archived, compaction starts over on restore
+   res = PQprepare(dbConn, "dropCheckpoints",
+                   "delete from checkpoints where pid = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "dropCheckpoints: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "touchProject",
+                   "update projects set touched = now() where pid = $1 returning archive;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "touchProject: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "markRestored",
+                   "update projects set archive = null where pid = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "markRestored: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+}
+
+string Archiver::archiveName(const string &gpid) {
+   return dir + "/" + gpid + ".gz";
+}
+
+/**
+ * archiveIdle archives every project that has not been touched in a
+ * number of days and that nobody is connected to
+ * @param days the number of days a project must have been idle
+ * @return the number of projects archived, -1 on error
+ */
+int Archiver::archiveIdle(int days) {
+   int archived = 0;
+   sem_wait(&lock);
+   if (!connect()) {
+      sem_post(&lock);
+      return -1;
+   }
+   if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "Archiver: unable to create %s: %s\n", dir.c_str(), strerror(errno));
+      sem_post(&lock);
+      return -1;
+   }
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int ndays = htonl(days);
+   const char * const parms[1] = {(char*)&ndays};
+   PGresult *rset = PQexecPrepared(dbConn, "idleProjects", 1, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "idleProjects: %s\n", PQerrorMessage(dbConn));
+      archived = -1;
+   }
+   sem_post(&lock);
+   if (archived == 0) {
+      int rows = PQntuples(rset);
+      for (int i = 0; i < rows; i++) {
+         int pid = ntohl(*(int*)PQgetvalue(rset, i, 0));
+         //one project at a time, so a restore never waits for the whole pass
+         sem_wait(&lock);
+         //clients are added to a project before it is restored, so one
+         //that is still joining is already counted here
+         if (cm->projects.numClients(pid) == 0 &&
+             archiveProject(pid, PQgetvalue(rset, i, 1), PQgetvalue(rset, i, 2), PQgetvalue(rset, i, 3),
+                            ntohll(*(uint64_t*)PQgetvalue(rset, i, 4)), ntohll(*(uint64_t*)PQgetvalue(rset, i, 5)),
+                            PQgetvalue(rset, i, 6))) {
+            archived++;
+         }
+         sem_post(&lock);
+      }
+   }
+   PQclear(rset);
+   return archived;
+}
+
+/**
+ * archiveProject writes every update of a project to its archive file, then
+ * drops them from the updates table.  The file is complete and on disk
+ * before the database refers to it
+ */
+bool Archiver::archiveProject(int pid, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub,
+                              const char *touched) {
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int npid = htonl(pid);
+   const char * const parms[1] = {(char*)&npid};
+
+   string name = archiveName(gpid);
+   string tmp = name + ".tmp";
+   int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd < 0) {
+      fprintf(stderr, "Archiver: unable to create %s: %s\n", tmp.c_str(), strerror(errno));
+      return false;
+   }
+   //rows arrive one at a time, the project's history is never held in memory
+   if (!PQsendQueryPrepared(dbConn, "archiveUpdates", 1, parms, plens, pformats, 1) ||
+       !PQsetSingleRowMode(dbConn)) {
+      fprintf(stderr, "archiveUpdates: %s\n", PQerrorMessage(dbConn));
+      close(fd);
+      unlink(tmp.c_str());
+      return false;
+   }
+   char mode[8];
+   snprintf(mode, sizeof(mode), "wb%d", level);
+   gzFile gz = gzdopen(dup(fd), mode);
+   bool ok = gz != NULL;
+
+   //the same layout as an export, so an archive can be gunzipped and imported
+   Buffer os;
+   uint8_t *gbytes = toByteArray(gpid);
+   uint8_t *hbytes = toByteArray(hash);
+   os.write(FILE_SIG, strlen(FILE_SIG));
+   os.writeInt(FILE_VER);
+   os.write(gbytes, gpid.length() / 2);
+   os.write(hbytes, hash.length() / 2);
+   os.writeLong(sub);
+   os.writeLong(pub);
+   os.writeUTF(desc);
+   delete [] gbytes;
+   delete [] hbytes;
+
+   uint64_t last = 0;
+   int rows = 0;
+   Buffer update;
+   PGresult *rset;
+   //every result has to be collected, even after a failure, before the
+   //connection can be used again
+   while ((rset = PQgetResult(dbConn)) != NULL) {
+      ExecStatusType qres = PQresultStatus(rset);
+      if (qres == PGRES_SINGLE_TUPLE && ok) {
+         uint64_t updateid = *(uint64_t*)PQgetvalue(rset, 0, 0);
+         int uid = PQgetisnull(rset, 0, 1) ? 0 : ntohl(*(int*)PQgetvalue(rset, 0, 1));
+         int cmd = ntohl(*(int*)PQgetvalue(rset, 0, 2));
+         const uint8_t *data = (const uint8_t*)PQgetvalue(rset, 0, 3);
+         int dlen = PQgetlength(rset, 0, 3);
+         //archives hold uncompressed updates, the file as a whole is compressed
+         if (!PQgetisnull(rset, 0, 4)) {
+            update.reset();
+            if (!cm->unpackUpdate(data, dlen, ntohl(*(int*)PQgetvalue(rset, 0, 4)), update)) {
+               fprintf(stderr, "Archiver: unable to decompress update %llu of project %d\n",
+                       (unsigned long long)ntohll(updateid), pid);
+               ok = false;
+            }
+            data = update.get_buf();
+            dlen = update.size();
+         }
+         if (ok) {
+            os.writeInt(TAG);
+            os.writeLong(updateid);
+            os.writeInt(uid);
+            os.writeInt(pid);
+            os.writeInt(cmd);
+            os.writeInt(dlen);
+            os.write(data, dlen);
+            last = ntohll(updateid);
+            rows++;
+            if (os.size() >= ARCHIVE_CHUNK) {
+               ok = gzwrite(gz, os.get_buf(), os.size()) == (int)os.size();
+               os.reset();
+            }
+         }
+      }
+      else if (qres != PGRES_TUPLES_OK && qres != PGRES_SINGLE_TUPLE) {
+         fprintf(stderr, "archiveUpdates: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(rset);
+   }
+   //nothing to archive, the project lost its updates since it was found idle
+   bool empty = ok && rows == 0;
+   ok = ok && !empty;
+   if (ok) {
+      os.writeInt(ENDTAG);
+      ok = gzwrite(gz, os.get_buf(), os.size()) == (int)os.size();
+   }
+   if (gz != NULL && gzclose(gz) != Z_OK) {
+      ok = false;
+   }
+   ok = ok && fsync(fd) == 0;
+   close(fd);
+   if (!ok || rename(tmp.c_str(), name.c_str()) == -1) {
+      if (!empty) {
+         fprintf(stderr, "Archiver: unable to write %s\n", name.c_str());
+      }
+      unlink(tmp.c_str());
+      return false;
+   }
+
+   ok = execOk(dbConn, "BEGIN;");
+   if (ok) {
+      static const int aformats[3] = {1, 0, 0};
+      const int alens[3] = {4, 0, 0};
+      const char * const aparms[3] = {(char*)&npid, name.c_str(), touched};
+      PGresult *res = PQexecPrepared(dbConn, "markArchived", 3, aparms, alens, aformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "markArchived: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      else if (strcmp(PQcmdTuples(res), "1") != 0) {
+         //somebody joined while the archive was being written
+         ok = false;
+      }
+      PQclear(res);
+   }
+   if (ok) {
+      static const int dlens[2] = {4, 8};
+      static const int dformats[2] = {1, 1};
+      uint64_t nlast = htonll(last);
+      const char * const dparms[2] = {(char*)&npid, (char*)&nlast};
+      PGresult *res = PQexecPrepared(dbConn, "dropArchived", 2, dparms, dlens, dformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "dropArchived: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(res);
+   }
+   if (ok) {
+      PGresult *res = PQexecPrepared(dbConn, "dropCheckpoints", 1, parms, plens, pformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "dropCheckpoints: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(res);
+   }
+   if (!execOk(dbConn, ok ? "COMMIT;" : "ROLLBACK;") || !ok) {
+      unlink(name.c_str());
+      return false;
+   }
+   if (maint) {
+      maint->forget(pid);
+   }
+
+   char buf[256];
+   snprintf(buf, sizeof(buf), "archived project %d: %d updates to %s", pid, rows, name.c_str());
+   logln(buf, LINFO);
+   return true;
+}
+
+/**
+ * touch marks a project as touched, on the connection kept for joins,
+ * the touch waits on an archive of the project that is being committed
+ * @param pid the local pid of the project
+ * @param name receives the name of the project's archive, empty if the
+ * project isn't archived
+ * @return false on error
+ */
+bool Archiver::touch(int pid, string &name) {
+   sem_wait(&touchLock);
+   if (touchConn == NULL) {
+      touchConn = connectDatabase(props);
+      if (touchConn == NULL) {
+         sem_post(&touchLock);
+         return false;
+      }
+      PGresult *res = PQprepare(touchConn, "touchProject",
+                      "update projects set touched = now() where pid = $1 returning archive;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "touchProject: %s\n", PQerrorMessage(touchConn));
+      }
+      PQclear(res);
+   }
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int npid = htonl(pid);
+   const char * const parms[1] = {(char*)&npid};
+   PGresult *rset = PQexecPrepared(touchConn, "touchProject", 1, parms, plens, pformats, 1);
+   bool ok = PQresultStatus(rset) == PGRES_TUPLES_OK;
+   if (!ok) {
+      fprintf(stderr, "touchProject: %s\n", PQerrorMessage(touchConn));
+   }
+   else if (PQntuples(rset) > 0 && !PQgetisnull(rset, 0, 0)) {
+      name = PQgetvalue(rset, 0, 0);
+   }
+   PQclear(rset);
+   sem_post(&touchLock);
+   return ok;
+}
+
+/**
+ * restore brings the updates of an archived project back into the
+ * updates table and marks the project as touched
+ * @param pid the local pid of the project
+ * @return true if the project's updates are in the updates table
+ */
+bool Archiver::restore(int pid) {
+   string name;
+   if (!touch(pid, name)) {
+      return false;
+   }
+   if (name.length() == 0) {
+      return true;
+   }
+   //the archive may have been restored by another join since, so look again
+   //with the lock held
+   name = "";
+   sem_wait(&lock);
+   if (!connect()) {
+      sem_post(&lock);
+      return false;
+   }
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int npid = htonl(pid);
+   const char * const parms[1] = {(char*)&npid};
+   PGresult *rset = PQexecPrepared(dbConn, "touchProject", 1, parms, plens, pformats, 1);
+   bool ok = PQresultStatus(rset) == PGRES_TUPLES_OK;
+   if (!ok) {
+      fprintf(stderr, "touchProject: %s\n", PQerrorMessage(dbConn));
+   }
+   else if (PQntuples(rset) > 0 && !PQgetisnull(rset, 0, 0)) {
+      name = PQgetvalue(rset, 0, 0);
+   }
+   PQclear(rset);
+   if (!ok || name.length() == 0) {
+      sem_post(&lock);
+      return ok;
+   }
+
+   gzFile gz = gzopen(name.c_str(), "rb");
+   if (gz == NULL) {
+      fprintf(stderr, "Archiver: unable to open %s\n", name.c_str());
+      sem_post(&lock);
+      return false;
+   }
+   //skip over the project description, the project row is still there
+   uint8_t head[8 + 4 + GPID_SIZE + MD5_SIZE + 8 + 8 + 2];
+   uint8_t desc[0x10000];
+   ok = gzReadFully(gz, head, sizeof(head)) && memcmp(head, FILE_SIG, 8) == 0 &&
+        gzReadFully(gz, desc, (head[sizeof(head) - 2] << 8) | head[sizeof(head) - 1]);
+   //one COPY for the whole project rather than an insert per update
+   Buffer copy;
+   ok = ok && execOk(dbConn, "BEGIN;") && BulkLoader::copyStart(dbConn, true, copy);
+   bool copying = ok;
+
+   int count = 0;
+   uint64_t last = 0;
+   bool ended = false;
+   while (ok) {
+      uint8_t rec[4 + 8 + 4 + 4 + 4 + 4];
+      uint32_t tag;
+      if (!gzReadFully(gz, &tag, sizeof(tag))) {
+         break;
+      }
+      if (ntohl(tag) == ENDTAG) {
+         ended = true;
+         break;
+      }
+      if (ntohl(tag) != TAG || !gzReadFully(gz, rec + 4, sizeof(rec) - 4)) {
+         break;
+      }
+      uint64_t updateid = ((uint64_t)ntohl(*(uint32_t*)(rec + 4)) << 32) | ntohl(*(uint32_t*)(rec + 8));
+      int uid = ntohl(*(uint32_t*)(rec + 12));
+      int cmd = ntohl(*(uint32_t*)(rec + 20));
+      uint32_t dlen = ntohl(*(uint32_t*)(rec + 24));
+      if (dlen > 0x1000000) {
+         break;
+      }
+      uint8_t *raw = new uint8_t[dlen];
+      if (!gzReadFully(gz, raw, dlen)) {
+         delete [] raw;
+         break;
+      }
+
+      //stored exactly as post would have stored it, under its old updateid
+      BulkLoader::copyRow(cm, copy, &updateid, uid, pid, cmd, raw, dlen);
+      delete [] raw;
+      if (copy.size() >= ARCHIVE_CHUNK && !BulkLoader::copySend(dbConn, copy)) {
+         fprintf(stderr, "Archiver: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      last = ntohll(updateid);
+      count++;
+   }
+   gzclose(gz);
+   if (!ended) {
+      fprintf(stderr, "Archiver: %s is truncated or corrupt\n", name.c_str());
+      ok = false;
+   }
+   if (copying) {
+      ok = BulkLoader::copyEnd(dbConn, copy, ok ? NULL : "archive not restored") && ok;
+   }
+   if (ok) {
+      PGresult *res = PQexecPrepared(dbConn, "markRestored", 1, parms, plens, pformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "markRestored: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(res);
+   }
+   if (PQtransactionStatus(dbConn) != PQTRANS_IDLE) {
+      ok = execOk(dbConn, ok ? "COMMIT;" : "ROLLBACK;") && ok;
+   }
+   if (ok) {
+      unlink(name.c_str());
+      if (maint) {
+         //compaction starts over with the restored history
+         maint->forget(pid);
+         maint->touch(pid, last);
+      }
+      char buf[256];
+      snprintf(buf, sizeof(buf), "restored project %d: %d updates from %s", pid, count, name.c_str());
+      logln(buf, LINFO);
+   }
+   sem_post(&lock);
+   return ok;
+}
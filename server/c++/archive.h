@@ -0,0 +1,92 @@
+/*
+   collabREate archive.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __ARCHIVE_H
+#define __ARCHIVE_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <libpq-fe.h>
+#include <semaphore.h>
+
+using namespace std;
+
+class DatabaseConnectionManager;
+class Maintenance;
+
+/**
+ * Archiver
+ * This class moves the updates of projects that nobody has touched in a
+ * while out of the updates table and into gzip compressed archive files,
+ * one per project, in the export file format.  An archived project stays
+ * in the projects table, so it is still listed, and the first client to
+ * join it brings its updates back.
+ */
+
+class Archiver {
+public:
+   /**
+    * @param dbm the connection manager that owns this Archiver
+    * @param m the maintenance thread to tell about restored projects
+    * @param p the server configuration
+    */
+   Archiver(DatabaseConnectionManager *dbm, Maintenance *m, map<string,string> *p);
+
+   /**
+    * archiveIdle archives every project that has not been touched in a
+    * number of days and that nobody is connected to
+    * @param days the number of days a project must have been idle
+    * @return the number of projects archived, -1 on error
+    */
+   int archiveIdle(int days);
+
+   /**
+    * restore brings the updates of an archived project back into the
+    * updates table and marks the project as touched
+    * @param pid the local pid of the project
+    * @return true if the project's updates are in the updates table
+    */
+   bool restore(int pid);
+
+private:
+   bool connect();
+   void init_queries();
+   bool touch(int pid, string &name);
+   bool archiveProject(int pid, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub,
+                       const char *touched);
+   string archiveName(const string &gpid);
+
+   DatabaseConnectionManager *cm;
+   Maintenance *maint;
+   map<string,string> *props;
+   PGconn *dbConn;
+   //archiving and restoring are serialized, a project is never both at once,
+   //held one project at a time
+   sem_t lock;
+   //joins touch their project on a connection of their own, so the many
+   //that have nothing to restore never wait on an archive pass
+   PGconn *touchConn;
+   sem_t touchLock;
+   string dir;
+   int level;
+};
+
+#endif
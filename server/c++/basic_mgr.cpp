@@ -54,7 +54,7 @@ BasicConnectionManager::BasicConnectionManager(map<string,string> *p) : Connecti
  * @param response the calculated response from the plugin to check 
  * @return the user id of an authenticated user, or INVALID_USER
  */
-int BasicConnectionManager::authenticate(Client *c, string user, const uint8_t *challenge, int clen, const uint8_t *response, int rlen) {
+int BasicConnectionManager::authenticate(Client *c, const char *user, const uint8_t *challenge, uint32_t clen, const uint8_t *response, uint32_t rlen) {
    //always authenticate in basic mode
    c->setUserPub(FULL_PERMISSIONS);
    c->setUserSub(FULL_PERMISSIONS);
@@ -69,8 +69,7 @@ int BasicConnectionManager::authenticate(Client *c, string user, const uint8_t *
  * @param data the 'data' portion of the command (the comment text, etc)
  */
 void BasicConnectionManager::post(Client *src, int cmd, uint8_t *data, int dlen) {
-   queue.push_back(new Packet(src, data, dlen, 0));   //add a new packet with the binary data to the queue
-   sem_post(&queueSem);  //notify is the compliment to wait
+   enqueue(new Packet(src, data, dlen, 0));   //add a new packet with the binary data to the queue
 }
 
 /**
@@ -262,7 +261,7 @@ int BasicConnectionManager::snapforkProject(Client *c, int spid, const string &d
  * @return the new project id on success, -1 on failure
  */
 
-int BasicConnectionManager::migrateProject(int owner, string gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub) {
+int BasicConnectionManager::migrateProject(int owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub) {
    ::logln("migrating in BASIC mode doesn't make sense!", LERROR);
    return -1;
 }
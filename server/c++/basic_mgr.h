@@ -58,7 +58,7 @@ public:
     * @param response the calculated response from the plugin to check 
     * @return the user id of an authenticated user, or INVALID_USER
     */
-   int authenticate(Client *c, string user, const uint8_t *challenge, int clen, const uint8_t *response, int rlen);
+   int authenticate(Client *c, const char *user, const uint8_t *challenge, uint32_t clen, const uint8_t *response, uint32_t rlen);
 
    /**
     * migrateUpdate is very similar to 'post', migrateUpdate only 
@@ -185,7 +185,7 @@ public:
     * @return the new project id on success, -1 on failure
     */
 
-   int migrateProject(int owner, string gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
+   int migrateProject(int owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
 
    /**
     * addProject adds a project to the database and reflector (or merely a reflector in non-DB mode) 
@@ -0,0 +1,372 @@
+/*
+   collabREate bench.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * collab_bench simulates a room full of plugins.  Each simulated client
+ * authenticates and joins a project exactly as the IDA plugin does, the
+ * publishers then send a weighted mix of updates at a fixed rate while
+ * every client times the updates the server relays to it.  Once publishing
+ * stops, fresh clients join each project and time a full catch up, over a
+ * link throttled to a given rate if asked.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "bench.h"
+
+using namespace std;
+
+//how long to wait for acks and relayed updates once publishing stops
+#define DRAIN_SECONDS 10
+//how long a single catch up may take
+#define CATCHUP_SECONDS 300
+
+struct CommandName {
+   const char *name;
+   int cmd;
+};
+
+static CommandName commandNames[] = {
+   {"patch", COMMAND_BYTE_PATCHED},
+   {"cmt", COMMAND_CMT_CHANGED},
+   {"ti", COMMAND_TI_CHANGED},
+   {"code", COMMAND_MAKE_CODE},
+   {"rename", COMMAND_RENAMED},
+   {"func", COMMAND_ADD_FUNC},
+   {"cref", COMMAND_ADD_CREF},
+   {"dref", COMMAND_ADD_DREF},
+   {NULL, 0}
+};
+
+//roughly what an analyst produces: mostly names and comments
+#define DEFAULT_MIX "rename:40,cmt:30,patch:5,ti:10,code:5,func:5,cref:3,dref:2"
+
+/**
+ * parseMix reads a list of command:weight pairs, commands may be given
+ * by number or by one of the names in commandNames
+ * @param mix the list, such as "rename:50,cmt:30,1:20"
+ * @param opts receives the parsed mix
+ * @return false if the list is malformed
+ */
+static bool parseMix(const char *mix, BenchOptions &opts) {
+   opts.mix.clear();
+   opts.totalWeight = 0;
+   char *copy = strdup(mix);
+   char *save = NULL;
+   bool ok = true;
+   for (char *tok = strtok_r(copy, ",", &save); tok != NULL && ok; tok = strtok_r(NULL, ",", &save)) {
+      BenchCommand bc;
+      char *colon = strchr(tok, ':');
+      bc.weight = 1;
+      if (colon) {
+         *colon = 0;
+         bc.weight = atoi(colon + 1);
+      }
+      bc.cmd = 0;
+      for (int i = 0; commandNames[i].name; i++) {
+         if (strcmp(tok, commandNames[i].name) == 0) {
+            bc.cmd = commandNames[i].cmd;
+         }
+      }
+      if (bc.cmd == 0 && isNumeric(tok)) {
+         bc.cmd = atoi(tok);
+      }
+      if (bc.cmd <= 0 || bc.cmd >= MSG_CONTROL_FIRST || bc.weight <= 0) {
+         fprintf(stderr, "collab_bench: bad mix entry '%s'\n", tok);
+         ok = false;
+      }
+      else {
+         opts.mix.push_back(bc);
+         opts.totalWeight += bc.weight;
+      }
+   }
+   free(copy);
+   return ok && !opts.mix.empty();
+}
+
+static void totals(vector<BenchClient*> &clients, uint64_t &pub, uint64_t &ack, uint64_t &del) {
+   pub = ack = del = 0;
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      uint64_t p, a, d;
+      (*i)->getCounts(p, a, d);
+      pub += p;
+      ack += a;
+      del += d;
+   }
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options]\n", prog);
+   fprintf(stderr, "   -s host      server to connect to (127.0.0.1)\n");
+   fprintf(stderr, "   -p port      server port (5042)\n");
+   fprintf(stderr, "   -u user      user to authenticate as, ignored by basic mode servers\n");
+   fprintf(stderr, "   -P password  password for user\n");
+   fprintf(stderr, "   -j count     number of projects to create (1)\n");
+   fprintf(stderr, "   -n count     publishing clients per project (4)\n");
+   fprintf(stderr, "   -l count     subscribe only clients per project (0)\n");
+   fprintf(stderr, "   -k count     clients per project that time a full catch up at the end (1)\n");
+   fprintf(stderr, "   -r rate      updates per second per publisher, 0 for as fast as possible (100)\n");
+   fprintf(stderr, "   -d seconds   how long to publish (10)\n");
+   fprintf(stderr, "   -b bytes     size of each update's data, at least %d (64)\n", BENCH_MIN_PAYLOAD);
+   fprintf(stderr, "   -m mix       weighted commands, by number or name (%s)\n", DEFAULT_MIX);
+   fprintf(stderr, "   -v version   highest protocol version to negotiate (%d)\n", PROTOCOL_VERSION_MAX);
+   fprintf(stderr, "   -z           ask for deflate compressed frames, protocol %d and up\n", PROTOCOL_COMPRESSION);
+   fprintf(stderr, "   -t KB/s      the rate catch up clients read at, to time catch up over a slow link (0, no limit)\n");
+   fprintf(stderr, "command names:");
+   for (int i = 0; commandNames[i].name; i++) {
+      fprintf(stderr, " %s=%d", commandNames[i].name, commandNames[i].cmd);
+   }
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   BenchOptions opts;
+   opts.host = "127.0.0.1";
+   opts.port = 5042;
+   opts.projects = 1;
+   opts.publishers = 4;
+   opts.listeners = 0;
+   opts.catchup = 1;
+   opts.rate = 100;
+   opts.duration = 10;
+   opts.payload = 64;
+   opts.proto = PROTOCOL_VERSION_MAX;
+   opts.compress = false;
+   opts.throttle = 0;
+   const char *mix = DEFAULT_MIX;
+
+   int opt;
+   while ((opt = getopt(argc, argv, "s:p:u:P:j:n:l:k:r:d:b:m:v:zt:")) != -1) {
+      switch (opt) {
+         case 's':
+            opts.host = optarg;
+            break;
+         case 'p':
+            opts.port = atoi(optarg);
+            break;
+         case 'u':
+            opts.user = optarg;
+            break;
+         case 'P':
+            opts.password = optarg;
+            break;
+         case 'j':
+            opts.projects = atoi(optarg);
+            break;
+         case 'n':
+            opts.publishers = atoi(optarg);
+            break;
+         case 'l':
+            opts.listeners = atoi(optarg);
+            break;
+         case 'k':
+            opts.catchup = atoi(optarg);
+            break;
+         case 'r':
+            opts.rate = atof(optarg);
+            break;
+         case 'd':
+            opts.duration = atoi(optarg);
+            break;
+         case 'b':
+            opts.payload = atoi(optarg);
+            break;
+         case 'm':
+            mix = optarg;
+            break;
+         case 'v':
+            opts.proto = atoi(optarg);
+            break;
+         case 'z':
+            opts.compress = true;
+            break;
+         case 't':
+            opts.throttle = atoi(optarg);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (!parseMix(mix, opts) || opts.projects < 1 || opts.publishers < 0 || opts.listeners < 0 ||
+       opts.publishers + opts.listeners < 1 || opts.catchup < 0 || opts.rate < 0 || opts.duration < 1 ||
+       opts.proto < PROTOCOL_VERSION || opts.proto > PROTOCOL_VERSION_MAX || opts.throttle < 0) {
+      usage(argv[0]);
+   }
+   opts.payload = max(opts.payload, BENCH_MIN_PAYLOAD);
+   signal(SIGPIPE, SIG_IGN);
+   //progress is worth seeing as it happens even when redirected to a file
+   setvbuf(stdout, NULL, _IOLBF, 0);
+
+   //a hash nobody else will ever open keeps each run in projects of its own
+   vector<BenchProject*> projects;
+   for (int i = 0; i < opts.projects; i++) {
+      BenchProject *bp = new BenchProject;
+      char seed[128];
+      snprintf(seed, sizeof(seed), "collab_bench %d %ld %d", getpid(), (long)time(NULL), i);
+      uint8_t *h = toByteArray(getMD5(string(seed)));
+      memcpy(bp->hash, h, MD5_SIZE);
+      delete [] h;
+      bp->index = i;
+      bp->lpid = -1;
+      bp->lastAcked = 0;
+      pthread_mutex_init(&bp->lock, NULL);
+      projects.push_back(bp);
+   }
+
+   int members = opts.publishers + opts.listeners;
+   vector<BenchClient*> clients;
+   vector<uint64_t> connectTimes;
+   uint64_t connectStart = benchNow();
+   for (int i = 0; i < opts.projects; i++) {
+      for (int j = 0; j < members; j++) {
+         BenchClient *c = new BenchClient(clients.size(), projects[i], &opts);
+         clients.push_back(c);
+         if (!c->connect(j == 0, j < opts.publishers)) {
+            fprintf(stderr, "collab_bench: setup failed\n");
+            for (vector<BenchClient*>::iterator ci = clients.begin(); ci != clients.end(); ci++) {
+               delete *ci;
+            }
+            return 1;
+         }
+         connectTimes.push_back(c->connectNs);
+      }
+   }
+   double connectSecs = (benchNow() - connectStart) / 1e9;
+   printf("%s, protocol %d%s, %d project(s) of %d publisher(s) and %d listener(s)\n",
+          clients[0]->isBasic() ? "no authentication" : "authenticated", clients[0]->getProto(),
+          clients[0]->isCompressed() ? " compressed" : "", opts.projects, opts.publishers, opts.listeners);
+   printf("connected %d clients in %.3f s\n", (int)clients.size(), connectSecs);
+   printLatency("connect", connectTimes);
+
+   uint64_t start = benchNow();
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      (*i)->start();
+   }
+   uint64_t pub, ack, del;
+   uint64_t lastPub = 0, lastDel = 0;
+   for (int s = 1; s <= opts.duration; s++) {
+      benchSleepUntil(start + s * 1000000000ULL);
+      totals(clients, pub, ack, del);
+      printf("%4d s  published %llu/s  delivered %llu/s\n", s, (unsigned long long)(pub - lastPub),
+             (unsigned long long)(del - lastDel));
+      lastPub = pub;
+      lastDel = del;
+   }
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      (*i)->stopPublishing();
+   }
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      (*i)->joinPublisher();
+   }
+   double elapsed = (benchNow() - start) / 1e9;
+
+   //let the acks and relayed updates still in flight arrive
+   uint64_t deadline = benchNow() + DRAIN_SECONDS * 1000000000ULL;
+   int quiet = 0;
+   lastDel = (uint64_t)-1;
+   while (benchNow() < deadline) {
+      totals(clients, pub, ack, del);
+      quiet = (del == lastDel) ? quiet + 1 : 0;
+      if (ack >= pub && quiet >= 3) {
+         break;
+      }
+      lastDel = del;
+      usleep(100000);
+   }
+   totals(clients, pub, ack, del);
+   //every acked update should reach every other member of its project
+   uint64_t expected = ack * (members - 1);
+
+   printf("published   %llu updates, %.0f/s\n", (unsigned long long)pub, pub / elapsed);
+   printf("acked       %llu updates, %.0f/s\n", (unsigned long long)ack, ack / elapsed);
+   printf("delivered   %llu of %llu expected, %.0f/s\n", (unsigned long long)del,
+          (unsigned long long)expected, del / elapsed);
+   vector<uint64_t> latencies;
+   vector<uint64_t> ackLatencies;
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      (*i)->close();
+      latencies.insert(latencies.end(), (*i)->latencies.begin(), (*i)->latencies.end());
+      ackLatencies.insert(ackLatencies.end(), (*i)->ackLatencies.begin(), (*i)->ackLatencies.end());
+   }
+   printLatency("ack", ackLatencies);
+   printLatency("delivery", latencies);
+
+   if (opts.catchup > 0) {
+      vector<BenchClient*> late;
+      for (int i = 0; i < opts.projects; i++) {
+         if (projects[i]->lastAcked == 0) {
+            //basic mode servers don't keep updates
+            printf("catch up    project %d: nothing to catch up on\n", i);
+            continue;
+         }
+         for (int j = 0; j < opts.catchup; j++) {
+            BenchClient *c = new BenchClient(clients.size() + late.size(), projects[i], &opts);
+            c->limitRate(opts.throttle * 1024ULL);
+            if (!c->connect(false, false)) {
+               delete c;
+               continue;
+            }
+            c->start();
+            late.push_back(c);
+         }
+      }
+      //everybody asks at once, as after a server restart
+      for (vector<BenchClient*>::iterator i = late.begin(); i != late.end(); i++) {
+         (*i)->requestUpdates((*i)->getProject()->lastAcked);
+      }
+      vector<uint64_t> catchupTimes;
+      for (vector<BenchClient*>::iterator i = late.begin(); i != late.end(); i++) {
+         BenchClient *c = *i;
+         if (!c->waitCaughtUp(CATCHUP_SECONDS)) {
+            printf("catch up    project %d did not finish within %d s\n", c->getProject()->index, CATCHUP_SECONDS);
+            continue;
+         }
+         double secs = c->getCatchupTime() / 1e9;
+         printf("catch up    project %d: %llu updates, %.1f KB (%.1f KB on the wire) in %.1f ms, %.0f updates/s\n",
+                c->getProject()->index, (unsigned long long)c->getCatchupUpdates(), c->getCatchupBytes() / 1024.0,
+                c->getCatchupWire() / 1024.0, secs * 1000, secs > 0 ? c->getCatchupUpdates() / secs : 0.0);
+         catchupTimes.push_back(c->getCatchupTime());
+      }
+      printLatency("catch up", catchupTimes);
+      for (vector<BenchClient*>::iterator i = late.begin(); i != late.end(); i++) {
+         delete *i;
+      }
+   }
+
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      delete *i;
+   }
+   for (vector<BenchProject*>::iterator i = projects.begin(); i != projects.end(); i++) {
+      pthread_mutex_destroy(&(*i)->lock);
+      delete *i;
+   }
+   return 0;
+}
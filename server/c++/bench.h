@@ -0,0 +1,235 @@
+/*
+   collabREate bench.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "utils.h"
+#include "compress.h"
+
+using namespace std;
+
+//marks an update as one of ours, it follows the 8 byte address at the start of each payload
+#define BENCH_MAGIC "BNCH"
+//address, magic, send time, sender and sequence number
+#define BENCH_MIN_PAYLOAD (8 + 4 + 8 + 4 + 4)
+
+/**
+ * one COMMAND_* in the mix of updates the publishers send
+ */
+struct BenchCommand {
+   int cmd;
+   int weight;
+};
+
+/**
+ * the settings of a benchmark run, filled in from the command line
+ */
+struct BenchOptions {
+   string host;
+   int port;
+   string user;
+   string password;
+   int projects;
+   int publishers;         //per project
+   int listeners;          //per project, subscribe only
+   int catchup;            //per project, join after publishing stops
+   double rate;            //updates per second per publisher, 0 for flat out
+   int duration;           //seconds
+   int payload;            //bytes of data in each update
+   int proto;              //highest protocol version to offer
+   bool compress;          //ask for deflate compressed frames, protocol 4 and up
+   int throttle;           //KB/s the catch up clients read at, 0 for no limit
+   vector<BenchCommand> mix;
+   int totalWeight;
+};
+
+/**
+ * a project created for the run, all of its clients share one of these
+ */
+struct BenchProject {
+   int index;
+   uint8_t hash[MD5_SIZE];
+   int lpid;
+   //the largest updateid acknowledged to any of the project's publishers
+   uint64_t lastAcked;
+   pthread_mutex_t lock;
+};
+
+/**
+ * BenchClient
+ * A single simulated plugin.  It speaks the same handshake as the IDA
+ * plugin, then publishes updates from one thread while a second thread
+ * reads everything the server sends back and times it.
+ */
+class BenchClient {
+public:
+   BenchClient(int id, BenchProject *proj, const BenchOptions *opts);
+   ~BenchClient();
+
+   /**
+    * connect opens a connection, authenticates, and creates or joins the project
+    * @param create true to create the project instead of joining it
+    * @param publish true if this client will publish updates
+    * @return false if any step of the handshake failed
+    */
+   bool connect(bool create, bool publish);
+
+   //connect and authenticate, join comes next
+   bool open();
+
+   /**
+    * join lists the project's hash and joins the first project found,
+    * or creates a new project for the hash
+    * @param create true to create the project instead of joining it
+    * @param pub the publish permissions to ask for
+    * @param sub the subscribe permissions to ask for
+    * @param desc the description of a new project
+    * @return false if the project could not be joined
+    */
+   bool join(bool create, uint64_t pub, uint64_t sub, const string &desc);
+
+   //send any frame, updates should go through sendUpdate so they are timed
+   bool sendFrame(int cmd, const Buffer &payload);
+   bool sendUpdate(int cmd, const Buffer &data, uint64_t stamp);
+
+   /**
+    * start launches the reader thread and, for publishers, the publisher thread
+    */
+   void start();
+
+   /**
+    * requestUpdates asks for every update in the project and times
+    * how long it takes for the last one to arrive
+    * @param target the updateid that marks the end of the catch up
+    */
+   void requestUpdates(uint64_t target);
+
+   /**
+    * waitCaughtUp waits for a catch up started by requestUpdates
+    * @param seconds the most seconds to wait
+    * @return false if the catch up did not finish in time
+    */
+   bool waitCaughtUp(int seconds);
+
+   //ask the publisher thread to finish
+   void stopPublishing();
+   //wait for the publisher thread
+   void joinPublisher();
+   //close the connection and wait for the reader thread
+   void close();
+
+   //the counters are updated by both threads, read them through here
+   void getCounts(uint64_t &pub, uint64_t &ack, uint64_t &del);
+
+   int getProto() {return proto;};
+   bool isBasic() {return basic;};
+   BenchProject *getProject() {return project;};
+   //for clients that only learn their project after connecting
+   void setProject(BenchProject *p) {project = p;};
+   //offer no more than this protocol version, call before open
+   void limitProto(int v) {maxProto = min(maxProto, v);};
+   //read no faster than this many bytes per second, call before open
+   void limitRate(uint64_t bytesPerSec) {rate = bytesPerSec;};
+   bool isCompressed() {return inflater != NULL;};
+   uint64_t getCatchupTime() {return catchupNs;};
+   uint64_t getCatchupUpdates() {return catchupUpdates;};
+   uint64_t getCatchupBytes() {return catchupBytes;};
+   uint64_t getCatchupWire() {return catchupWire;};
+
+   //nanoseconds from the start of open to the join reply
+   uint64_t connectNs;
+   //publish to delivery, in nanoseconds, of updates received from other clients
+   vector<uint64_t> latencies;
+   //publish to MSG_ACK_UPDATEID, in nanoseconds, of our own updates
+   vector<uint64_t> ackLatencies;
+
+private:
+   bool handshake();
+   void setTimeout(int seconds);
+   bool readFrame(int &cmd, vector<uint8_t> &payload);
+   void publishOne(uint32_t seq, uint64_t stamp);
+   void received(uint64_t updateid, const uint8_t *data, uint32_t len, uint64_t now);
+
+   static void *reader(void *arg);
+   static void *publisher(void *arg);
+
+   int id;
+   BenchProject *project;
+   const BenchOptions *opts;
+   NetworkIO *nio;
+   int proto;
+   int maxProto;
+   //set once deflate has been asked for, MSG_COMPRESSED frames are inflated by readFrame
+   StreamDecompressor *inflater;
+   //read pacing, the time the next read may start
+   uint64_t rate;
+   uint64_t nextRead;
+   bool basic;
+   bool publishing;
+   bool stopping;
+   bool readerRunning;
+   bool publisherRunning;
+   pthread_t readerThread;
+   pthread_t publisherThread;
+   unsigned int seed;
+
+   pthread_mutex_t lock;
+   //send times of updates that have not been acknowledged yet, in order
+   deque<uint64_t> pending;
+   uint64_t published;
+   uint64_t acked;
+   uint64_t delivered;
+
+   //catch up state, only touched by the reader once requestUpdates has run
+   uint64_t openStart;
+
+   bool catchingUp;
+   uint64_t catchupTarget;
+   uint64_t catchupStart;
+   uint64_t catchupNs;
+   uint64_t catchupUpdates;
+   uint64_t catchupBytes;
+   //bytes read off the socket during the catch up, compressed or not
+   uint64_t catchupWire;
+   sem_t caughtUp;
+};
+
+//monotonic time in nanoseconds
+uint64_t benchNow();
+void benchSleepUntil(uint64_t when);
+
+/**
+ * printLatency sorts a set of times in nanoseconds and prints their
+ * percentiles in microseconds
+ * @param label the name printed in front of the line
+ * @param v the times, sorted in place
+ */
+void printLatency(const char *label, vector<uint64_t> &v);
+
+#endif
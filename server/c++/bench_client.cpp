@@ -0,0 +1,595 @@
+/*
+   collabREate bench_client.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "bench.h"
+
+using namespace std;
+
+//seconds to wait for each reply while connecting and joining
+#define HANDSHAKE_TIMEOUT 30
+//nanoseconds a throttled reader may fall behind its schedule and still catch up
+#define THROTTLE_SLACK 100000000ULL
+
+uint64_t benchNow() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void benchSleepUntil(uint64_t when) {
+   struct timespec ts;
+   ts.tv_sec = when / 1000000000ULL;
+   ts.tv_nsec = when % 1000000000ULL;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+   }
+}
+
+static uint64_t getLong(const uint8_t *p) {
+   uint64_t val;
+   memcpy(&val, p, sizeof(val));
+   return ntohll(val);
+}
+
+static uint32_t getInt(const uint8_t *p) {
+   uint32_t val;
+   memcpy(&val, p, sizeof(val));
+   return ntohl(val);
+}
+
+BenchClient::BenchClient(int id, BenchProject *proj, const BenchOptions *opts) {
+   this->id = id;
+   project = proj;
+   this->opts = opts;
+   nio = NULL;
+   proto = PROTOCOL_VERSION;
+   maxProto = opts->proto;
+   inflater = NULL;
+   rate = 0;
+   nextRead = 0;
+   basic = false;
+   publishing = false;
+   stopping = false;
+   readerRunning = false;
+   publisherRunning = false;
+   seed = id * 2654435761U + time(NULL);
+   pthread_mutex_init(&lock, NULL);
+   published = 0;
+   acked = 0;
+   delivered = 0;
+   connectNs = 0;
+   openStart = 0;
+   catchingUp = false;
+   catchupTarget = 0;
+   catchupStart = 0;
+   catchupNs = 0;
+   catchupUpdates = 0;
+   catchupBytes = 0;
+   catchupWire = 0;
+   sem_init(&caughtUp, 0, 0);
+}
+
+BenchClient::~BenchClient() {
+   close();
+   delete inflater;
+   pthread_mutex_destroy(&lock);
+   sem_destroy(&caughtUp);
+}
+
+/**
+ * readFrame reads one complete frame from the server, a MSG_COMPRESSED
+ * frame is inflated and the frame it carries is returned in its place
+ * @param cmd receives the frame's command
+ * @param payload receives everything after the command
+ * @return false if the server sent MSG_ERROR or MSG_FATAL, the message is printed
+ */
+bool BenchClient::readFrame(int &cmd, vector<uint8_t> &payload) {
+   uint32_t len = nio->readInt();
+   cmd = nio->readInt();
+   if (len < 8) {
+      throw IOException("short frame");
+   }
+   payload.resize(len - 8);
+   if (len > 8) {
+      nio->readFully(&payload[0], len - 8);
+   }
+   if (catchingUp) {
+      catchupWire += len;
+   }
+   if (rate) {
+      //a slow link, the server only gets to send as fast as we read.  Time
+      //spent waiting on the server counts towards the link's schedule, a
+      //link that sat idle for a while starts over
+      uint64_t now = benchNow();
+      if (now > nextRead + THROTTLE_SLACK) {
+         nextRead = now;
+      }
+      nextRead += len * 1000000000ULL / rate;
+      benchSleepUntil(nextRead);
+   }
+   if (cmd == MSG_COMPRESSED) {
+      if (inflater == NULL) {
+         fprintf(stderr, "client %d: received a compressed frame that was never asked for\n", id);
+         throw IOException("compressed");
+      }
+      Buffer inflated;
+      if (!inflater->decompress(payload.empty() ? NULL : &payload[0], payload.size(), inflated) ||
+          inflated.size() < 8 || getInt(inflated.get_buf()) != inflated.size()) {
+         fprintf(stderr, "client %d: unable to inflate a compressed frame\n", id);
+         throw IOException("compressed");
+      }
+      cmd = getInt(inflated.get_buf() + 4);
+      payload.assign(inflated.get_buf() + 8, inflated.get_buf() + inflated.size());
+   }
+   if (cmd == MSG_ERROR || cmd == MSG_FATAL) {
+      Buffer b(payload.empty() ? NULL : &payload[0], payload.size());
+      char *msg = b.readUTF();
+      fprintf(stderr, "client %d: server said: %s\n", id, msg ? msg : "");
+      free(msg);
+      return false;
+   }
+   return true;
+}
+
+bool BenchClient::sendFrame(int cmd, const Buffer &payload) {
+   Buffer f;
+   f.writeInt(payload.size() + 8);
+   f.writeInt(cmd);
+   f.write(payload.get_buf(), payload.size());
+   return nio->sendAll(f.get_buf(), f.size()) == f.size();
+}
+
+/**
+ * handshake answers the server's challenge, or accepts the automatic
+ * authentication of a basic mode server
+ * @return true once the client is authenticated
+ */
+bool BenchClient::handshake() {
+   int cmd;
+   vector<uint8_t> p;
+   if (!readFrame(cmd, p)) {
+      return false;
+   }
+   if (cmd == MSG_AUTH_REPLY) {
+      //basic mode, nothing to prove
+      basic = true;
+      return p.size() >= 4 && getInt(&p[0]) == AUTH_REPLY_SUCCESS;
+   }
+   if (cmd != MSG_INITIAL_CHALLENGE || p.size() < CHALLENGE_SIZE) {
+      fprintf(stderr, "client %d: expected a challenge, got message %d\n", id, cmd);
+      return false;
+   }
+   //servers that predate version negotiation send only the challenge
+   int serverMax = p.size() >= CHALLENGE_SIZE + 4 ? getInt(&p[CHALLENGE_SIZE]) : PROTOCOL_VERSION;
+   int offered = p.size() >= CHALLENGE_SIZE + 8 ? getInt(&p[CHALLENGE_SIZE + 4]) : COMPRESS_NONE;
+   proto = min(serverMax, maxProto);
+
+   //the server keys the hmac with the md5 of the password, just like the plugin
+   uint8_t *key = toByteArray(getMD5(opts->password));
+   uint8_t mac[EVP_MAX_MD_SIZE];
+   unsigned int mlen = 0;
+   HMAC(EVP_md5(), key, MD5_SIZE, &p[0], CHALLENGE_SIZE, mac, &mlen);
+   delete [] key;
+
+   Buffer b;
+   b.writeInt(proto);
+   b.writeUTF(opts->user);
+   b.write(mac, MD5_SIZE);
+   if (proto >= PROTOCOL_COMPRESSION) {
+      //off unless asked for, compressed frames blur the latencies being measured
+      int compress = opts->compress ? offered & COMPRESS_DEFLATE : COMPRESS_NONE;
+      b.writeInt(compress);
+      if (compress != COMPRESS_NONE) {
+         //anything after the auth reply may arrive compressed
+         inflater = new StreamDecompressor();
+      }
+   }
+   if (!sendFrame(MSG_AUTH_REQUEST, b)) {
+      return false;
+   }
+   do {
+      if (!readFrame(cmd, p)) {
+         return false;
+      }
+   } while (cmd != MSG_AUTH_REPLY);
+   if (p.size() < 4 || getInt(&p[0]) != AUTH_REPLY_SUCCESS) {
+      fprintf(stderr, "client %d: authentication failed for user '%s'\n", id, opts->user.c_str());
+      return false;
+   }
+   return true;
+}
+
+/**
+ * open connects to the server and authenticates
+ * @return false if the connection or authentication failed
+ */
+bool BenchClient::open() {
+   openStart = benchNow();
+   try {
+      nio = new NetworkIO(opts->host.c_str(), opts->port);
+   } catch (IOException &e) {
+      fprintf(stderr, "client %d: unable to connect to %s:%d\n", id, opts->host.c_str(), opts->port);
+      return false;
+   }
+   //a server that never answers shouldn't hang the run
+   setTimeout(HANDSHAKE_TIMEOUT);
+   if (rate) {
+      //keep the kernel from soaking up more than a slow link would hold
+      int buf = 0x10000;
+      setsockopt(nio->getFileDescriptor(), SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+   }
+   try {
+      return handshake();
+   } catch (IOException &e) {
+      fprintf(stderr, "client %d: connection lost during the handshake\n", id);
+      return false;
+   }
+}
+
+bool BenchClient::join(bool create, uint64_t pub, uint64_t sub, const string &desc) {
+   try {
+      int cmd;
+      vector<uint8_t> p;
+      Buffer list;
+      list.write(project->hash, MD5_SIZE);
+      if (!sendFrame(MSG_PROJECT_LIST, list)) {
+         return false;
+      }
+      do {
+         if (!readFrame(cmd, p)) {
+            return false;
+         }
+      } while (cmd != MSG_PROJECT_LIST);
+
+      int lpid = -1;
+      Buffer lb(p.empty() ? NULL : &p[0], p.size());
+      int nump = lb.readInt();
+      for (int i = 0; i < nump && !lb.has_error(); i++) {
+         int pid = lb.readInt();
+         uint64_t snap = lb.readLong();
+         free(lb.readUTF());
+         lb.readLong();
+         lb.readLong();
+         if (snap == 0 && lpid < 0) {
+            lpid = pid;
+         }
+      }
+
+      Buffer req;
+      if (create) {
+         req.write(project->hash, MD5_SIZE);
+         req.writeUTF(desc);
+         req.writeLong(pub);
+         req.writeLong(sub);
+         cmd = MSG_PROJECT_NEW_REQUEST;
+      }
+      else {
+         if (lpid < 0) {
+            fprintf(stderr, "client %d: project %d is not in the project list\n", id, project->index);
+            return false;
+         }
+         pthread_mutex_lock(&project->lock);
+         project->lpid = lpid;
+         pthread_mutex_unlock(&project->lock);
+         req.writeInt(lpid);
+         req.writeLong(pub);
+         req.writeLong(sub);
+         cmd = MSG_PROJECT_JOIN_REQUEST;
+      }
+      if (!sendFrame(cmd, req)) {
+         return false;
+      }
+      do {
+         if (!readFrame(cmd, p)) {
+            return false;
+         }
+      } while (cmd != MSG_PROJECT_JOIN_REPLY);
+      if (p.size() < 4 || getInt(&p[0]) != JOIN_REPLY_SUCCESS) {
+         fprintf(stderr, "client %d: unable to %s project %d\n", id, create ? "create" : "join", project->index);
+         return false;
+      }
+   } catch (IOException &e) {
+      fprintf(stderr, "client %d: connection lost joining project %d\n", id, project->index);
+      return false;
+   }
+   connectNs = benchNow() - openStart;
+   //from here on the reader waits as long as it takes
+   setTimeout(0);
+   return true;
+}
+
+void BenchClient::setTimeout(int seconds) {
+   struct timeval tv;
+   tv.tv_sec = seconds;
+   tv.tv_usec = 0;
+   setsockopt(nio->getFileDescriptor(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+bool BenchClient::connect(bool create, bool publish) {
+   publishing = publish;
+   char desc[64];
+   snprintf(desc, sizeof(desc), "collab_bench project %d", project->index);
+   return open() && join(create, publish ? FULL_PERMISSIONS : 0, FULL_PERMISSIONS, desc);
+}
+
+void BenchClient::start() {
+   readerRunning = pthread_create(&readerThread, NULL, reader, this) == 0;
+   if (publishing) {
+      publisherRunning = pthread_create(&publisherThread, NULL, publisher, this) == 0;
+   }
+}
+
+/**
+ * publishOne sends a single update picked from the mix.  The payload starts
+ * with a pseudo random address so the server's address based filtering and
+ * keying see realistic data, followed by what is needed to time the update.
+ * @param seq the sequence number of this update
+ * @param stamp the time the update is considered sent
+ */
+void BenchClient::publishOne(uint32_t seq, uint64_t stamp) {
+   int pick = rand_r(&seed) % opts->totalWeight;
+   int cmd = opts->mix[0].cmd;
+   for (vector<BenchCommand>::const_iterator i = opts->mix.begin(); i != opts->mix.end(); i++) {
+      if (pick < i->weight) {
+         cmd = i->cmd;
+         break;
+      }
+      pick -= i->weight;
+   }
+   Buffer d;
+   d.writeLong(0x401000 + (rand_r(&seed) % 0x100000));
+   d.write(BENCH_MAGIC, 4);
+   d.writeLong(stamp);
+   d.writeInt(id);
+   d.writeInt(seq);
+   while (d.size() < opts->payload) {
+      d.write(0);
+   }
+   if (!sendUpdate(cmd, d, stamp)) {
+      stopping = true;
+   }
+}
+
+/**
+ * sendUpdate publishes an update and starts timing its acknowledgement
+ * @param cmd the COMMAND_* of the update
+ * @param data the data of the update
+ * @param stamp the time the update is considered sent
+ * @return false if the connection is gone
+ */
+bool BenchClient::sendUpdate(int cmd, const Buffer &data, uint64_t stamp) {
+   pthread_mutex_lock(&lock);
+   pending.push_back(stamp);
+   published++;
+   pthread_mutex_unlock(&lock);
+   return sendFrame(cmd, data);
+}
+
+/**
+ * publisher sends updates until told to stop.  Updates are sent on a
+ * fixed schedule and stamped with the time they were due rather than the
+ * time they went out, so a server that stalls the publisher is charged
+ * for the stall instead of quietly lowering the offered load.
+ */
+void *BenchClient::publisher(void *arg) {
+   BenchClient *c = (BenchClient*)arg;
+   uint64_t interval = c->opts->rate > 0 ? (uint64_t)(1000000000.0 / c->opts->rate) : 0;
+   //stagger the clients so they don't all fire on the same tick
+   uint64_t next = benchNow() + (interval ? rand_r(&c->seed) % interval : 0);
+   for (uint32_t seq = 0; !c->stopping; seq++) {
+      if (interval) {
+         benchSleepUntil(next);
+         c->publishOne(seq, next);
+         next += interval;
+      }
+      else {
+         c->publishOne(seq, benchNow());
+      }
+   }
+   return NULL;
+}
+
+/**
+ * received handles one update relayed by the server
+ * @param updateid the id the server assigned to the update
+ * @param data the update's data
+ * @param len the length of data
+ * @param when the time the update arrived
+ */
+void BenchClient::received(uint64_t updateid, const uint8_t *data, uint32_t len, uint64_t when) {
+   if (catchingUp) {
+      catchupUpdates++;
+      catchupBytes += len + 16;
+      if (updateid >= catchupTarget) {
+         catchupNs = when - catchupStart;
+         catchingUp = false;
+         sem_post(&caughtUp);
+      }
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   delivered++;
+   pthread_mutex_unlock(&lock);
+   if (len >= BENCH_MIN_PAYLOAD && memcmp(data + 8, BENCH_MAGIC, 4) == 0) {
+      uint64_t stamp = getLong(data + 12);
+      if (when >= stamp) {
+         latencies.push_back(when - stamp);
+      }
+   }
+}
+
+/**
+ * reader times everything the server sends until the connection closes
+ */
+void *BenchClient::reader(void *arg) {
+   BenchClient *c = (BenchClient*)arg;
+   vector<uint8_t> p;
+   int cmd;
+   try {
+      while (true) {
+         if (!c->readFrame(cmd, p)) {
+            continue;
+         }
+         uint64_t when = benchNow();
+         if (cmd < MSG_CONTROL_FIRST) {
+            if (p.size() >= 8) {
+               c->received(getLong(&p[0]), &p[8], p.size() - 8, when);
+            }
+            continue;
+         }
+         switch (cmd) {
+            case MSG_ACK_UPDATEID: {
+               if (p.size() < 8) {
+                  break;
+               }
+               //the server keeps updateids in network order and writeLong
+               //swaps them once more on the way out, undo that
+               uint64_t updateid = htonll(getLong(&p[0]));
+               pthread_mutex_lock(&c->lock);
+               //the server acks each publisher's updates in the order they were sent
+               if (!c->pending.empty()) {
+                  c->ackLatencies.push_back(when - c->pending.front());
+                  c->pending.pop_front();
+               }
+               c->acked++;
+               pthread_mutex_unlock(&c->lock);
+               pthread_mutex_lock(&c->project->lock);
+               if (updateid > c->project->lastAcked) {
+                  c->project->lastAcked = updateid;
+               }
+               pthread_mutex_unlock(&c->project->lock);
+               break;
+            }
+            case MSG_BULK_UPDATES: {
+               //[int count] followed by complete update frames
+               uint32_t pos = 4;
+               while (pos + 16 <= p.size()) {
+                  uint32_t flen = getInt(&p[pos]);
+                  if (flen < 16 || pos + flen > p.size()) {
+                     break;
+                  }
+                  c->received(getLong(&p[pos + 8]), &p[pos + 16], flen - 16, when);
+                  pos += flen;
+               }
+               break;
+            }
+            default:
+               break;
+         }
+      }
+   } catch (IOException &e) {
+   }
+   return NULL;
+}
+
+void BenchClient::requestUpdates(uint64_t target) {
+   catchupTarget = target;
+   catchupUpdates = 0;
+   catchupBytes = 0;
+   catchupWire = 0;
+   catchingUp = true;
+   catchupStart = benchNow();
+   Buffer b;
+   b.writeLong(0);
+   if (!sendFrame(MSG_SEND_UPDATES, b)) {
+      catchingUp = false;
+   }
+}
+
+bool BenchClient::waitCaughtUp(int seconds) {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += seconds;
+   while (sem_timedwait(&caughtUp, &ts) == -1) {
+      if (errno != EINTR) {
+         return false;
+      }
+   }
+   return true;
+}
+
+void BenchClient::stopPublishing() {
+   stopping = true;
+}
+
+void BenchClient::joinPublisher() {
+   if (publisherRunning) {
+      pthread_join(publisherThread, NULL);
+      publisherRunning = false;
+   }
+}
+
+void BenchClient::close() {
+   stopping = true;
+   joinPublisher();
+   if (nio) {
+      //wakes the reader out of its read
+      shutdown(nio->getFileDescriptor(), SHUT_RDWR);
+   }
+   if (readerRunning) {
+      pthread_join(readerThread, NULL);
+      readerRunning = false;
+   }
+   if (nio) {
+      nio->close();
+      delete nio;
+      nio = NULL;
+   }
+}
+
+void BenchClient::getCounts(uint64_t &pub, uint64_t &ack, uint64_t &del) {
+   pthread_mutex_lock(&lock);
+   pub = published;
+   ack = acked;
+   del = delivered;
+   pthread_mutex_unlock(&lock);
+}
+
+static double percentile(const vector<uint64_t> &v, double p) {
+   size_t i = (size_t)(p * v.size());
+   return v[min(i, v.size() - 1)] / 1000.0;
+}
+
+void printLatency(const char *label, vector<uint64_t> &v) {
+   if (v.empty()) {
+      printf("%-12s no samples\n", label);
+      return;
+   }
+   sort(v.begin(), v.end());
+   printf("%-12s p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f us (%llu samples)\n", label,
+          percentile(v, 0.5), percentile(v, 0.9), percentile(v, 0.99), percentile(v, 0.999),
+          v.back() / 1000.0, (unsigned long long)v.size());
+}
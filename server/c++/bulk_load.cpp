@@ -0,0 +1,369 @@
+/*
+   collabREate bulk_load.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "db_support.h"
+#include "maintenance.h"
+#include "bulk_load.h"
+
+using namespace std;
+
+//the signature, flags and header extension length that open binary COPY data
+static const char copySig[11] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', (char)0xff, '\r', '\n', 0};
+
+static bool execOk(PGconn *conn, const char *sql) {
+   PGresult *res = PQexec(conn, sql);
+   bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+   if (!ok) {
+      fprintf(stderr, "%s %s\n", sql, PQerrorMessage(conn));
+   }
+   PQclear(res);
+   return ok;
+}
+
+//COPY fields are a length followed by the value, a length of -1 is NULL
+static void copyField(Buffer &b, const void *val, int len) {
+   b.writeInt(val ? len : -1);
+   if (val) {
+      b.write(val, len);
+   }
+}
+
+/**
+ * @param dbm the connection manager that owns this BulkLoader
+ * @param m the maintenance thread to tell about new updates
+ * @param p the server configuration
+ */
+BulkLoader::BulkLoader(DatabaseConnectionManager *dbm, Maintenance *m, map<string,string> *p) {
+   cm = dbm;
+   maint = m;
+   props = p;
+   sem_init(&lock, 0, 1);
+   int conns = getIntOption(props, "BULK_LOAD_CONNECTIONS", 4);
+   sem_init(&slots, 0, conns > 0 ? conns : 1);
+}
+
+/**
+ * acquire hands out a connection of the loader's own, a COPY can't share a
+ * connection with anything else.  Connections are opened the first time
+ * they are needed and waited for once BULK_LOAD_CONNECTIONS are busy
+ * @return the connection, NULL if the database can't be reached
+ */
+LoadConnection *BulkLoader::acquire() {
+   sem_wait(&slots);
+   LoadConnection *lc = NULL;
+   sem_wait(&lock);
+   if (!idle.empty()) {
+      lc = idle.back();
+      idle.pop_back();
+   }
+   sem_post(&lock);
+   if (lc == NULL) {
+      PGconn *conn = connectDatabase(props);
+      if (conn == NULL) {
+         sem_post(&slots);
+         return NULL;
+      }
+      init_queries(conn);
+      lc = new LoadConnection;
+      lc->dbConn = conn;
+   }
+   return lc;
+}
+
+/**
+ * release returns a connection from acquire for the next block
+ */
+void BulkLoader::release(LoadConnection *lc) {
+   sem_wait(&lock);
+   idle.push_back(lc);
+   sem_post(&lock);
+   sem_post(&slots);
+}
+
+void BulkLoader::init_queries(PGconn *dbConn) {
+   PGresult *res = PQprepare(dbConn, "lockMigrated",
+                   "select coalesce(migrated,0) from projects where pid = $1 and not deleted for update;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "lockMigrated: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "setMigrated",
+                   "update projects set migrated = $2 where pid = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "setMigrated: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "getMigrated",
+                   "select coalesce(migrated,0) from projects where pid = $1 and not deleted;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "getMigrated: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+}
+
+/**
+ * load stores a block of migrated updates.  A block that has already been
+ * stored, because the manager resent it after losing our reply, is
+ * acknowledged without storing it again
+ * @param newowner the uid to attribute the updates to
+ * @param pid the local pid of the project being imported
+ * @param first the position of the block's first update in the export
+ * @param block the updates, laid out as for nextMigrateRecord
+ * @param len the length of the block
+ * @param count the number of updates in the block
+ * @return the number of updates of the export stored so far, -1 on error
+ */
+int64_t BulkLoader::load(int newowner, int pid, int64_t first, const uint8_t *block, int len, int count) {
+   static const int plens[2] = {4, 8};
+   static const int pformats[2] = {1, 1};
+   int npid = htonl(pid);
+   int64_t done = -1;
+   LoadConnection *lc = acquire();
+   if (lc == NULL) {
+      return -1;
+   }
+   PGconn *dbConn = lc->dbConn;
+   if (!execOk(dbConn, "BEGIN;")) {
+      release(lc);
+      return -1;
+   }
+   const char * const parms[1] = {(char*)&npid};
+   PGresult *rset = PQexecPrepared(dbConn, "lockMigrated", 1, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "lockMigrated: %s\n", PQerrorMessage(dbConn));
+   }
+   else if (PQntuples(rset) == 1) {
+      done = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+
+   bool ok = done >= 0;
+   if (ok && first != done) {
+      if (first + count > done) {
+         fprintf(stderr, "BulkLoader: project %d has %lld updates imported, refusing a block starting at %lld\n",
+                 pid, (long long)done, (long long)first);
+         done = -1;
+      }
+      //else a block we already have
+      ok = false;
+   }
+   if (ok && copyBlock(lc, newowner, pid, block, len, count)) {
+      uint64_t total = htonll(first + count);
+      const char * const sparms[2] = {(char*)&npid, (char*)&total};
+      rset = PQexecPrepared(dbConn, "setMigrated", 2, sparms, plens, pformats, 1);
+      if (PQresultStatus(rset) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "setMigrated: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(rset);
+   }
+   else {
+      ok = false;
+   }
+
+   uint64_t last = 0;
+   if (ok) {
+      //the sequence hands out increasing ids, our own last one is the largest
+      rset = PQexec(dbConn, "select currval('updates_updateid_seq');");
+      if (PQresultStatus(rset) == PGRES_TUPLES_OK && PQntuples(rset) == 1) {
+         last = strtoull(PQgetvalue(rset, 0, 0), NULL, 10);
+      }
+      PQclear(rset);
+   }
+   if (ok && execOk(dbConn, "COMMIT;")) {
+      done = first + count;
+      if (maint && last) {
+         maint->touch(pid, last);
+      }
+   }
+   else {
+      execOk(dbConn, "ROLLBACK;");
+      if (first == done) {
+         //the block itself failed
+         done = -1;
+      }
+   }
+   release(lc);
+   return done;
+}
+
+/**
+ * copyStart starts a binary COPY into updates, inside a transaction
+ * @param dbConn the connection to copy on, tied up until copyEnd
+ * @param ids true if the rows carry the updateids they are to be stored under
+ * @param copy receives the start of the COPY data
+ * @return false if the COPY could not be started
+ */
+bool BulkLoader::copyStart(PGconn *dbConn, bool ids, Buffer &copy) {
+   PGresult *res = PQexec(dbConn, ids ? "COPY updates (updateid,userid,pid,cmd,data,dictid,ea,supkey) FROM STDIN BINARY;" :
+                                        "COPY updates (userid,pid,cmd,data,dictid,ea,supkey) FROM STDIN BINARY;");
+   if (PQresultStatus(res) != PGRES_COPY_IN) {
+      fprintf(stderr, "BulkLoader: %s\n", PQerrorMessage(dbConn));
+      PQclear(res);
+      return false;
+   }
+   PQclear(res);
+   copy.reset();
+   copy.write(copySig, sizeof(copySig));
+   copy.writeInt(0);
+   copy.writeInt(0);
+   return true;
+}
+
+/**
+ * copyRow adds an update to a COPY, compressed, addressed and keyed just
+ * as post would store it
+ */
+void BulkLoader::copyRow(DatabaseConnectionManager *cm, Buffer &copy, const uint64_t *updateid, int uid, int pid,
+                         int cmd, const uint8_t *data, int dlen) {
+   Buffer packed;
+   Buffer key;
+   int dictid = 0;
+   bool isPacked = cm->packUpdate(pid, data, dlen, packed, dictid);
+   uint64_t ea;
+   bool hasEa = updateAddress(data, dlen, &ea);
+   bool hasKey = updateKey(data, dlen, key);
+   int nuid = htonl(uid);
+   int npid = htonl(pid);
+   int ncmd = htonl(cmd);
+   dictid = htonl(dictid);
+   ea = htonll(ea);
+
+   copy.writeShort(updateid ? 8 : 7);
+   if (updateid) {
+      copyField(copy, updateid, 8);
+   }
+   copyField(copy, uid ? &nuid : NULL, 4);
+   copyField(copy, &npid, 4);
+   copyField(copy, &ncmd, 4);
+   if (isPacked) {
+      copyField(copy, packed.get_buf(), packed.size());
+   }
+   else {
+      copyField(copy, data, dlen);
+   }
+   //a NULL dictid marks an update that is stored uncompressed
+   copyField(copy, isPacked ? &dictid : NULL, 4);
+   copyField(copy, hasEa ? &ea : NULL, 8);
+   copyField(copy, hasKey ? key.get_buf() : NULL, key.size());
+}
+
+/**
+ * copySend hands the COPY data gathered so far to the database
+ * @return false on error
+ */
+bool BulkLoader::copySend(PGconn *dbConn, Buffer &copy) {
+   bool ok = copy.size() == 0 || PQputCopyData(dbConn, (const char*)copy.get_buf(), copy.size()) == 1;
+   copy.reset();
+   return ok;
+}
+
+/**
+ * copyEnd sends what is left of a COPY and finishes it
+ * @param err the reason to abandon the COPY, NULL to finish it
+ * @return true if the rows were stored
+ */
+bool BulkLoader::copyEnd(PGconn *dbConn, Buffer &copy, const char *err) {
+   if (err == NULL) {
+      copy.writeShort(-1);
+      if (!copySend(dbConn, copy)) {
+         err = PQerrorMessage(dbConn);
+      }
+   }
+   if (PQputCopyEnd(dbConn, err) != 1) {
+      err = PQerrorMessage(dbConn);
+   }
+   PGresult *res = PQgetResult(dbConn);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "BulkLoader: %s\n", err ? err : PQerrorMessage(dbConn));
+      err = "";
+   }
+   PQclear(res);
+   //collect whatever else the COPY left behind
+   while ((res = PQgetResult(dbConn)) != NULL) {
+      PQclear(res);
+   }
+   return err == NULL;
+}
+
+/**
+ * copyBlock sends a block of updates to the database with a binary COPY.
+ * Must be called inside a transaction
+ */
+bool BulkLoader::copyBlock(LoadConnection *lc, int newowner, int pid, const uint8_t *block, int len, int count) {
+   PGconn *dbConn = lc->dbConn;
+   Buffer &copy = lc->copy;
+   if (!copyStart(dbConn, false, copy)) {
+      return false;
+   }
+   const uint8_t *p = block;
+   const uint8_t *end = block + len;
+   const char *err = NULL;
+   for (int i = 0; i < count; i++) {
+      const uint8_t *data;
+      int cmd;
+      int dlen;
+      if (!nextMigrateRecord(p, end, cmd, data, dlen)) {
+         err = "malformed block";
+         break;
+      }
+      copyRow(cm, copy, NULL, newowner, pid, cmd, data, dlen);
+   }
+   return copyEnd(dbConn, copy, err);
+}
+
+/**
+ * migrated looks up how much of an import has been stored
+ * @param pid the local pid of the project being imported
+ * @return the number of updates stored so far, -1 if there is no such project
+ */
+int64_t BulkLoader::migrated(int pid) {
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int npid = htonl(pid);
+   const char * const parms[1] = {(char*)&npid};
+   int64_t done = -1;
+   LoadConnection *lc = acquire();
+   if (lc != NULL) {
+      PGconn *dbConn = lc->dbConn;
+      PGresult *rset = PQexecPrepared(dbConn, "getMigrated", 1, parms, plens, pformats, 1);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+         fprintf(stderr, "getMigrated: %s\n", PQerrorMessage(dbConn));
+      }
+      else if (PQntuples(rset) == 1) {
+         done = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+      }
+      PQclear(rset);
+      release(lc);
+   }
+   return done;
+}
@@ -0,0 +1,135 @@
+/*
+   collabREate bulk_load.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __BULK_LOAD_H
+#define __BULK_LOAD_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <libpq-fe.h>
+#include <semaphore.h>
+
+#include "buffer.h"
+
+using namespace std;
+
+class DatabaseConnectionManager;
+class Maintenance;
+
+//a COPY ties up its connection until it ends
+struct LoadConnection {
+   PGconn *dbConn;
+   Buffer copy;
+};
+
+/**
+ * BulkLoader
+ * Stores the updates of an imported project a block at a time with a
+ * binary COPY rather than one insert per update.  Each block goes in
+ * within a single transaction along with the count of updates imported
+ * so far, so an interrupted import can pick up exactly where it stopped.
+ * Blocks of different imports load side by side, each on a connection of
+ * the loader's own.
+ */
+
+class BulkLoader {
+public:
+   /**
+    * @param dbm the connection manager that owns this BulkLoader
+    * @param m the maintenance thread to tell about new updates
+    * @param p the server configuration
+    */
+   BulkLoader(DatabaseConnectionManager *dbm, Maintenance *m, map<string,string> *p);
+
+   /**
+    * load stores a block of migrated updates
+    * @param newowner the uid to attribute the updates to
+    * @param pid the local pid of the project being imported
+    * @param first the position of the block's first update in the export
+    * @param block the updates, laid out as for nextMigrateRecord
+    * @param len the length of the block
+    * @param count the number of updates in the block
+    * @return the number of updates of the export stored so far, -1 on error
+    */
+   int64_t load(int newowner, int pid, int64_t first, const uint8_t *block, int len, int count);
+
+   /**
+    * migrated looks up how much of an import has been stored
+    * @param pid the local pid of the project being imported
+    * @return the number of updates stored so far, -1 if there is no such project
+    */
+   int64_t migrated(int pid);
+
+   /**
+    * copyStart starts a binary COPY into updates, inside a transaction
+    * @param dbConn the connection to copy on, tied up until copyEnd
+    * @param ids true if the rows carry the updateids they are to be stored under
+    * @param copy receives the start of the COPY data
+    * @return false if the COPY could not be started
+    */
+   static bool copyStart(PGconn *dbConn, bool ids, Buffer &copy);
+
+   /**
+    * copyRow adds an update to a COPY, compressed, addressed and keyed just
+    * as post would store it
+    * @param cm the connection manager that compresses the update
+    * @param copy the COPY data
+    * @param updateid the updateid in network order, for a COPY started with ids
+    * @param uid the userid, 0 for none
+    * @param pid the local pid of the project
+    * @param cmd the update's command
+    * @param data the update's payload
+    * @param dlen the length of the payload
+    */
+   static void copyRow(DatabaseConnectionManager *cm, Buffer &copy, const uint64_t *updateid, int uid, int pid,
+                       int cmd, const uint8_t *data, int dlen);
+
+   /**
+    * copySend hands the COPY data gathered so far to the database
+    * @return false on error
+    */
+   static bool copySend(PGconn *dbConn, Buffer &copy);
+
+   /**
+    * copyEnd sends what is left of a COPY and finishes it
+    * @param err the reason to abandon the COPY, NULL to finish it
+    * @return true if the rows were stored
+    */
+   static bool copyEnd(PGconn *dbConn, Buffer &copy, const char *err);
+
+private:
+   LoadConnection *acquire();
+   void release(LoadConnection *lc);
+   void init_queries(PGconn *dbConn);
+   bool copyBlock(LoadConnection *lc, int newowner, int pid, const uint8_t *block, int len, int count);
+
+   DatabaseConnectionManager *cm;
+   Maintenance *maint;
+   map<string,string> *props;
+   //connections that aren't loading a block right now
+   vector<LoadConnection*> idle;
+   sem_t lock;
+   //one per connection the loader may open, BULK_LOAD_CONNECTIONS of them
+   sem_t slots;
+};
+
+#endif
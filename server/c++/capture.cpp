@@ -0,0 +1,237 @@
+/*
+   collabREate capture.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "capture.h"
+
+using namespace std;
+
+//buffered frames are pushed out to the file at least this often, in nanoseconds
+#define CAPTURE_FLUSH_INTERVAL 1000000000ULL
+
+static uint64_t monotonic() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t getInt(const uint8_t *p) {
+   uint32_t val;
+   memcpy(&val, p, sizeof(val));
+   return ntohl(val);
+}
+
+CaptureWriter::CaptureWriter(const string &dir, const string &peer, int port) {
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   start = monotonic();
+   frameStart = start;
+   lastFlush = start;
+
+   char stamp[32];
+   struct tm tm;
+   strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", gmtime_r(&now.tv_sec, &tm));
+   char buf[64];
+   snprintf(buf, sizeof(buf), "-%d-%09ld", port, now.tv_nsec);
+   //colons in v6 addresses are fine on every system the server builds on
+   name = dir + "/" + stamp + "-" + peer + buf + CAPTURE_SUFFIX;
+   f = fopen(name.c_str(), "wb");
+   if (f == NULL) {
+      fprintf(stderr, "CaptureWriter: unable to create %s: %s\n", name.c_str(), strerror(errno));
+      return;
+   }
+   Buffer hdr;
+   hdr.write(CAPTURE_SIG, 8);
+   hdr.writeInt(CAPTURE_VER);
+   hdr.writeLong(now.tv_sec * 1000000000ULL + now.tv_nsec);
+   hdr.writeUTF(peer);
+   hdr.writeInt(port);
+   //the header goes out now so a capture is never left empty
+   if (fwrite(hdr.get_buf(), hdr.size(), 1, f) != 1 || fflush(f) != 0) {
+      close();
+   }
+}
+
+CaptureWriter::~CaptureWriter() {
+   close();
+}
+
+void CaptureWriter::close() {
+   if (f) {
+      if (fclose(f) != 0) {
+         fprintf(stderr, "CaptureWriter: error writing %s\n", name.c_str());
+      }
+      f = NULL;
+   }
+}
+
+/**
+ * received collects the bytes of the frame being read and records it
+ * once it is complete
+ * @param data bytes just read from the connection
+ * @param len the number of bytes read
+ */
+void CaptureWriter::received(const void *data, uint32_t len) {
+   if (f == NULL) {
+      return;
+   }
+   if (frame.size() == 0) {
+      frameStart = monotonic();
+   }
+   frame.write(data, len);
+   while (frame.size() >= 8) {
+      uint32_t flen = getInt(frame.get_buf());
+      if (flen < 8 || flen > CAPTURE_MAX_FRAME) {
+         fprintf(stderr, "CaptureWriter: lost the framing of %s, capture stopped\n", name.c_str());
+         close();
+         return;
+      }
+      if ((uint32_t)frame.size() < flen) {
+         break;
+      }
+      record(frame.get_buf(), flen);
+      //the client reads exactly one frame at a time, this is nearly always empty
+      uint32_t rest = frame.size() - flen;
+      if (rest == 0) {
+         frame.reset();
+      }
+      else {
+         Buffer tail(frame.get_buf() + flen, rest);
+         frame.reset();
+         frame.write(tail.get_buf(), rest);
+      }
+   }
+}
+
+void CaptureWriter::record(const uint8_t *data, uint32_t len) {
+   uint32_t cmd = getInt(data + 4);
+   if (cmd == MSG_AUTH_REQUEST && len > 12) {
+      //keep the protocol version, drop the credentials
+      len = 12;
+   }
+   Buffer hdr;
+   hdr.writeLong(frameStart - start);
+   hdr.writeInt(len);
+   hdr.writeInt(cmd);
+   if (fwrite(hdr.get_buf(), hdr.size(), 1, f) != 1 || (len > 8 && fwrite(data + 8, len - 8, 1, f) != 1)) {
+      fprintf(stderr, "CaptureWriter: error writing %s, capture stopped\n", name.c_str());
+      close();
+      return;
+   }
+   //idle stretches can be long, don't leave a burst sitting in the buffer
+   if (frameStart - lastFlush >= CAPTURE_FLUSH_INTERVAL) {
+      fflush(f);
+      lastFlush = frameStart;
+   }
+}
+
+CaptureReader::CaptureReader() {
+   f = NULL;
+   start = 0;
+   port = 0;
+}
+
+CaptureReader::~CaptureReader() {
+   close();
+}
+
+void CaptureReader::close() {
+   if (f) {
+      fclose(f);
+      f = NULL;
+   }
+}
+
+static bool readInt(FILE *f, uint32_t &val) {
+   uint8_t b[4];
+   if (fread(b, sizeof(b), 1, f) != 1) {
+      return false;
+   }
+   val = getInt(b);
+   return true;
+}
+
+static bool readLong(FILE *f, uint64_t &val) {
+   uint32_t hi, lo;
+   if (!readInt(f, hi) || !readInt(f, lo)) {
+      return false;
+   }
+   val = ((uint64_t)hi << 32) | lo;
+   return true;
+}
+
+bool CaptureReader::open(const char *file) {
+   close();
+   f = fopen(file, "rb");
+   if (f == NULL) {
+      fprintf(stderr, "CaptureReader: unable to open %s: %s\n", file, strerror(errno));
+      return false;
+   }
+   char sig[8];
+   uint32_t ver, p;
+   uint8_t l[2];
+   if (fread(sig, sizeof(sig), 1, f) != 1 || memcmp(sig, CAPTURE_SIG, 8) != 0 ||
+       !readInt(f, ver) || ver != CAPTURE_VER || !readLong(f, start) || fread(l, sizeof(l), 1, f) != 1) {
+      fprintf(stderr, "CaptureReader: %s is not a collabREate capture\n", file);
+      close();
+      return false;
+   }
+   uint32_t alen = (l[0] << 8) | l[1];
+   vector<char> addr(alen + 1);
+   if ((alen && fread(&addr[0], alen, 1, f) != 1) || !readInt(f, p)) {
+      fprintf(stderr, "CaptureReader: %s is truncated\n", file);
+      close();
+      return false;
+   }
+   peer.assign(&addr[0], alen);
+   port = p;
+   return true;
+}
+
+bool CaptureReader::next(CaptureRecord &r) {
+   uint32_t len, cmd;
+   if (f == NULL || !readLong(f, r.offset) || !readInt(f, len) || !readInt(f, cmd) ||
+       len < 8 || len > CAPTURE_MAX_FRAME) {
+      return false;
+   }
+   r.cmd = cmd;
+   r.payload.reset();
+   if (len > 8) {
+      uint8_t *data = new uint8_t[len - 8];
+      bool ok = fread(data, len - 8, 1, f) == 1;
+      if (ok) {
+         r.payload.write(data, len - 8);
+      }
+      delete [] data;
+      if (!ok) {
+         return false;
+      }
+   }
+   return true;
+}
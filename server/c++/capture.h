@@ -0,0 +1,128 @@
+/*
+   collabREate capture.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "utils.h"
+#include "buffer.h"
+
+using namespace std;
+
+#define CAPTURE_SIG "COLLCAP1"
+#define CAPTURE_VER 1
+#define CAPTURE_SUFFIX ".cap"
+//anything claiming to be longer than this means we have lost the framing
+#define CAPTURE_MAX_FRAME 0x1000000
+
+/*
+ * A capture file holds every frame one plugin connection sent to the server.
+ *
+ *    [sig 8][int version][long start][UTF peer][int port]
+ *    [long offset][int len][int cmd][len - 8 bytes of payload]
+ *    ...
+ *
+ * start is the wall clock time the connection was accepted in nanoseconds,
+ * offset is the time each frame arrived in nanoseconds after start.  All
+ * values are in network byte order.  MSG_AUTH_REQUEST frames keep only the
+ * protocol version, the user name and hmac are never written.
+ */
+
+/**
+ * one frame read back from a capture
+ */
+struct CaptureRecord {
+   uint64_t offset;
+   int cmd;
+   Buffer payload;
+};
+
+/**
+ * CaptureWriter
+ * Records the frames arriving on one connection.  It is handed the
+ * bytes exactly as the connection reads them and puts the frames back
+ * together itself, so the client's parsing code is left alone.
+ */
+class CaptureWriter : public StreamTap {
+public:
+   /**
+    * @param dir the directory to create the capture in
+    * @param peer the address of the plugin
+    * @param port the port of the plugin
+    */
+   CaptureWriter(const string &dir, const string &peer, int port);
+   ~CaptureWriter();
+
+   void received(const void *data, uint32_t len);
+
+private:
+   void record(const uint8_t *frame, uint32_t len);
+   void close();
+
+   FILE *f;
+   string name;
+   Buffer frame;
+   uint64_t start;         //monotonic time the capture began
+   uint64_t frameStart;    //monotonic time the first byte of the current frame arrived
+   uint64_t lastFlush;
+};
+
+/**
+ * CaptureReader
+ * Reads the frames back out of a capture file
+ */
+class CaptureReader {
+public:
+   CaptureReader();
+   ~CaptureReader();
+
+   /**
+    * open opens a capture and reads its header
+    * @param file the capture to read
+    * @return false if the file is not a capture
+    */
+   bool open(const char *file);
+
+   /**
+    * next reads the next frame
+    * @param r receives the frame
+    * @return false at the end of the capture, or if it is truncated
+    */
+   bool next(CaptureRecord &r);
+
+   void close();
+
+   //wall clock time the connection was accepted, in nanoseconds
+   uint64_t getStart() {return start;};
+   const string &getPeer() {return peer;};
+   int getPort() {return port;};
+
+private:
+   FILE *f;
+   uint64_t start;
+   string peer;
+   int port;
+};
+
+#endif
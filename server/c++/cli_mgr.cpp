@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <algorithm>
 
 #include "utils.h"
 #include "client.h"
@@ -28,13 +29,32 @@
 #include "cli_mgr.h"
 #include "projectmap.h"
 #include "clientset.h"
+#include "capture.h"
+#include "metrics.h"
+#include "probes.h"
+
+//tracers raise these while attached to the probes of probes.h
+PROBE_SEMAPHORES
 
 Packet::Packet(Client *src, uint8_t *data, int dlen, uint64_t updateid) {
    c = src;
-   d = data;
+   //the caller's buffer is gone long before the dispatch thread gets here
+   uint8_t *copy = new uint8_t[dlen];
+   memcpy(copy, data, dlen);
+   d = copy;
    dataLen = dlen;
    uid = htonll(updateid);
-   memcpy(data + 8, &uid, sizeof(uint64_t));
+   memcpy(copy + 8, &uid, sizeof(uint64_t));
+   //packets are built once the update has been stored
+   times.stored = latencyNow();
+   times.received = src->getReceived();
+   times.dequeued = 0;
+   times.written = 0;
+   times.subscribers = 0;
+}
+
+Packet::~Packet() {
+   delete [] d;
 }
 
 /**
@@ -46,8 +66,14 @@ ConnectionManagerBase::ConnectionManagerBase(map<string,string> *p, bool mode) {
    props = p;
    basicMode = mode;
    done = false;
+   //frames smaller than this go out uncompressed, 0 disables compression
+   compressThreshold = getIntOption(p, "COMPRESSION_THRESHOLD", 512);
+   compressLevel = getIntOption(p, "COMPRESSION_LEVEL", 1);
+   captureDir = getStringOption(p, "CAPTURE_DIR", "");
+   latency = new LatencyTracker(p);
    sem_init(&pidLock, 0, 1);
    sem_init(&queueSem, 0, 0);
+   sem_init(&queueLock, 0, 1);
 }
 
 void ConnectionManagerBase::start() {
@@ -96,6 +122,11 @@ void ConnectionManagerBase::terminate() {
  * @param s the socket to create new client for
  */
 void ConnectionManagerBase::add(NetworkIO *s) {
+   if (captureDir.length() > 0) {
+      s->setTap(new CaptureWriter(captureDir, s->getPeerAddr(), s->getPeerPort()));
+   }
+   metricAdd(METRIC_CONNECTIONS);
+   PROBE2(conn_accept, s->getPeerAddr().c_str(), s->getPeerPort());
    Client *c = new Client(this, s, basicMode);
    c->start();
 }
@@ -115,8 +146,56 @@ static bool clientStats(Client *c, void *user) {
    return true;
 }
 
+struct TrafficRow {
+   int pid;
+   int command;
+   const CommandTraffic *c;
+};
+
+//by project, then the commands that moved the most bytes first
+static bool rowBefore(const TrafficRow &a, const TrafficRow &b) {
+   if (a.pid != b.pid) {
+      return a.pid < b.pid;
+   }
+   return a.c->receivedBytes + a.c->sentBytes > b.c->receivedBytes + b.c->sentBytes;
+}
+
+//the power of two that pct percent of the received payloads fit in
+static uint32_t sizeBound(const CommandTraffic *c, uint64_t pct) {
+   uint64_t want = (c->received * pct + 99) / 100;
+   uint64_t n = 0;
+   for (int i = 0; i < TRAFFIC_SIZE_BUCKETS && want > 0; i++) {
+      n += c->sizes[i];
+      if (n >= want) {
+         return 1U << i;
+      }
+   }
+   return 0;
+}
+
+static void trafficTable(string &sb, vector<TrafficRow> &rows, bool byProject) {
+   char buf[256];
+   sort(rows.begin(), rows.end(), rowBefore);
+   snprintf(buf, sizeof(buf), "%s%7s %10s %13s %9s %9s %10s %13s\n", byProject ? "project " : "",
+            "command", "received", "rx bytes", "avg size", "p99 size", "sent", "tx bytes");
+   sb += buf;
+   for (vector<TrafficRow>::iterator i = rows.begin(); i != rows.end(); i++) {
+      const CommandTraffic *c = (*i).c;
+      char project[16] = "";
+      if (byProject) {
+         snprintf(project, sizeof(project), "%7d ", (*i).pid);
+      }
+      snprintf(buf, sizeof(buf), "%s%7d %10llu %13llu %9llu %9u %10llu %13llu\n", project, (*i).command,
+               (unsigned long long)c->received, (unsigned long long)c->receivedBytes,
+               (unsigned long long)(c->received ? c->receivedBytes / c->received : 0), sizeBound(c, 99),
+               (unsigned long long)c->sent, (unsigned long long)c->sentBytes);
+      sb += buf;
+   }
+}
+
 /**
- * dumpStats dumps send / receive stats for each connected client 
+ * dumpStats dumps send / receive stats for each connected client, followed
+ * by the update traffic of each command, server wide and by project
  */
 string ConnectionManagerBase::dumpStats() {
    string sb = "";   
@@ -127,25 +206,189 @@ string ConnectionManagerBase::dumpStats() {
    else {
       sb = "Stats:\n" + sb;
    }
+   TrafficTotals t;
+   metricTraffic(t);
+   if (!t.empty()) {
+      map<int,CommandTraffic> commands;
+      vector<TrafficRow> rows;
+      for (TrafficTotals::iterator i = t.begin(); i != t.end(); i++) {
+         CommandTraffic &c = commands[(*i).first.second];
+         c.received += (*i).second.received;
+         c.receivedBytes += (*i).second.receivedBytes;
+         c.sent += (*i).second.sent;
+         c.sentBytes += (*i).second.sentBytes;
+         for (int b = 0; b < TRAFFIC_SIZE_BUCKETS; b++) {
+            c.sizes[b] += (*i).second.sizes[b];
+         }
+         TrafficRow r = {(*i).first.first, (*i).first.second, &(*i).second};
+         rows.push_back(r);
+      }
+      vector<TrafficRow> totals;
+      for (map<int,CommandTraffic>::iterator i = commands.begin(); i != commands.end(); i++) {
+         TrafficRow r = {0, (*i).first, &(*i).second};
+         totals.push_back(r);
+      }
+      sb += "\nUpdate traffic by command, payload bytes:\n";
+      trafficTable(sb, totals, false);
+      sb += "\nUpdate traffic by project and command:\n";
+      trafficTable(sb, rows, true);
+   }
    return sb;
 }
 
-static bool dispatch(Client *c, void *user) {
-   Packet *p = (Packet*)user;
+struct Delivery {
+   Packet *p;
+   vector<uint64_t> *written;
+   //when the previous client was done with, each client is charged the
+   //time since then
+   uint64_t last;
+};
+
+static bool deliver(Client *c, void *user) {
+   Delivery *d = (Delivery*)user;
+   Packet *p = d->p;
 
    if (c != p->c) {  //only send to other than originator
-      c->post(p->d, p->dataLen);
+      bool sent = c->post(p->d, p->dataLen);
+      uint64_t now = latencyNow();
+      PROBE4(update_send, p, c->getUid(), (int)sent, now - d->last);
+      c->addSendTime(now - d->last);
+      d->last = now;
+      if (sent) {
+         p->times.written = now;
+         p->times.subscribers++;
+         d->written->push_back(now);
+      }
    }
    else {
       //send updateid back to the originator
       Buffer os;
       os.writeLong(p->uid);
       c->send_data(MSG_ACK_UPDATEID, os.get_buf(), os.size());
+      d->last = latencyNow();
    }
 
    return true;
 }
 
+void ConnectionManagerBase::dispatch(Packet *p) {
+   Delivery d;
+   d.p = p;
+   d.written = &sendTimes;
+   sendTimes.clear();
+   int pid = p->c->getPid();
+   p->times.dequeued = latencyNow();
+   p->times.subscribers = 0;
+   d.last = p->times.dequeued;
+   //get the project associated with this notification
+   projects.loopProject(pid, deliver, &d);
+   PROBE2(update_dispatched, p, p->times.subscribers);
+   //recorded once for all subscribers, the tracker's lock is never held
+   //while a subscriber's send is blocked
+   if (latency->dispatched(pid, p->times, sendTimes.empty() ? NULL : &sendTimes[0])) {
+      char buf[256];
+      UpdateTimes &t = p->times;
+      snprintf(buf, sizeof(buf), "slow update %llu in project %d: command %u from uid %d, "
+               "store %.3f ms, queue %.3f ms, send %.3f ms to %d subscribers, total %.3f ms",
+               (unsigned long long)ntohll(p->uid), pid, ntohl(*(uint32_t*)(p->d + 4)), p->c->getUid(),
+               (t.stored - t.received) / 1e6, (t.dequeued - t.stored) / 1e6,
+               (t.written - t.dequeued) / 1e6, t.subscribers, (t.written - t.received) / 1e6);
+      logln(buf, LINFO);
+   }
+}
+
+/**
+ * getLatency writes the update latency histograms of one or all projects
+ * @param pid the project to write, -1 for every project
+ * @param b the Buffer to write to, see LatencyTracker::write
+ */
+void ConnectionManagerBase::getLatency(int pid, Buffer &b) {
+   latency->write(pid, b);
+}
+
+/**
+ * getLatencyTotals merges the update latency histograms of every project
+ * @param stages receives LATENCY_STAGES histograms
+ */
+void ConnectionManagerBase::getLatencyTotals(Histogram *stages) {
+   latency->totals(stages);
+}
+
+struct Activity {
+   Buffer clients;
+   int count;
+};
+
+static bool writeClient(Client *c, void *user) {
+   Activity *a = (Activity*)user;
+   c->writeActivity(a->clients);
+   a->count++;
+   return true;
+}
+
+/**
+ * writeSnapshot appends the running totals collab_mgr top works from to
+ * a Buffer.  Everything is a total since the server started, two
+ * snapshots taken a known time apart give rates.
+ * @param b the Buffer to write to
+ */
+void ConnectionManagerBase::writeSnapshot(Buffer &b) {
+   MetricTotals *t = new MetricTotals;
+   metricTotals(*t);
+   uint64_t in = 0;
+   uint64_t out = 0;
+   for (int i = 0; i < METRIC_COMMANDS; i++) {
+      in += t->updatesIn[i];
+      out += t->updatesOut[i];
+   }
+   b.writeLong(latencyNow());
+   b.writeLong(in);
+   b.writeLong(out);
+   b.writeLong(t->counters[METRIC_BYTES_IN]);
+   b.writeLong(t->counters[METRIC_BYTES_OUT]);
+   b.writeInt(getQueueDepth());
+   t->histograms[METRIC_DB_EXEC + DB_POST_UPDATE].write(b);
+   t->histograms[METRIC_DB_WAIT + DB_POST_UPDATE].write(b);
+   delete t;
+
+   latency->writeSummary(b);
+
+   map<int,int> counts;
+   projects.clientCounts(counts);
+   b.writeInt(counts.size());
+   for (map<int,int>::iterator i = counts.begin(); i != counts.end(); i++) {
+      b.writeInt((*i).first);
+      b.writeInt((*i).second);
+   }
+
+   //the count isn't known until every client has been written
+   Activity a;
+   a.count = 0;
+   projects.loopClients(writeClient, &a);
+   b.writeInt(a.count);
+   b.append(a.clients);
+}
+
+/**
+ * getQueueDepth inspector to get the number of packets waiting for the
+ * dispatch thread
+ * @return the number of packets
+ */
+int ConnectionManagerBase::getQueueDepth() {
+   sem_wait(&queueLock);
+   int depth = queue.size();
+   sem_post(&queueLock);
+   return depth;
+}
+
+void ConnectionManagerBase::enqueue(Packet *p) {
+   PROBE4(update_enqueue, p, p->c->getPid(), ntohll(p->uid), ntohl(*(uint32_t*)(p->d + 4)));
+   sem_wait(&queueLock);
+   queue.push_back(p);
+   sem_post(&queueLock);
+   sem_post(&queueSem);  //notify is the compliment to wait
+}
+
 /**
  * run perpetually waits to be notified that a new packet has been queued, then
  * sends this packet to other clients according to permissions and project subscription
@@ -155,11 +398,13 @@ void *ConnectionManagerBase::run(void *arg) {
    ConnectionManagerBase *mgr = (ConnectionManagerBase*)arg;
    while (!mgr->done) {
       sem_wait(&mgr->queueSem);
+      sem_wait(&mgr->queueLock);
       Packet *p = mgr->queue[0];
-      //*** does add/remove need to be synchronized on vectors?
       mgr->queue.erase(mgr->queue.begin());
-      //get the project associated with this notification
-      mgr->projects.loopProject(p->c->getPid(), dispatch, p);
+      PROBE2(update_dequeue, p, mgr->queue.size());
+      sem_post(&mgr->queueLock);
+      mgr->dispatch(p);
+      delete p;
    }
 }
 
@@ -200,3 +445,49 @@ string ConnectionManagerBase::listConnections() {
    return sb;
 }
 
+/**
+ * migrateUpdates stores a block of migrated updates one at a time, only
+ * the database mode has a faster way to store them
+ * @param newowner the new uid to attribute the updates to
+ * @param pid the local project id for the migrated project
+ * @param first the position of the block's first update in the export
+ * @param block the updates, laid out as for nextMigrateRecord
+ * @param len the length of the block
+ * @param count the number of updates in the block
+ * @return the number of updates of the export stored so far, -1 on error
+ */
+int64_t ConnectionManagerBase::migrateUpdates(int newowner, int pid, int64_t first, const uint8_t *block, int len, int count) {
+   const uint8_t *p = block;
+   const uint8_t *end = block + len;
+   const uint8_t *data;
+   int cmd;
+   int dlen;
+   for (int i = 0; i < count; i++) {
+      if (!nextMigrateRecord(p, end, cmd, data, dlen)) {
+         return -1;
+      }
+      migrateUpdate(newowner, pid, cmd, data, dlen);
+   }
+   return first + count;
+}
+
+/**
+ * migratedUpdates is used to resume an interrupted import, which needs
+ * a record of how much of it was stored
+ * @param pid the local project id for the migrated project
+ * @return -1, resuming isn't supported
+ */
+int64_t ConnectionManagerBase::migratedUpdates(int pid) {
+   return -1;
+}
+
+/**
+ * archiveProjects moves idle projects out to archive files, only the
+ * database mode keeps enough history for this to be worthwhile
+ * @param days the number of days a project must have been idle
+ * @return the number of projects archived, -1 if archiving isn't supported
+ */
+int ConnectionManagerBase::archiveProjects(int /*days*/) {
+   return -1;
+}
+
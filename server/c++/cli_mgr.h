@@ -30,6 +30,8 @@
 #include <semaphore.h>
 
 #include "projectmap.h"
+#include "latency.h"
+#include "logger.h"
 
 using namespace std;
 
@@ -49,6 +51,7 @@ public:
    const uint8_t *d;
    int dataLen;
    uint64_t uid;
+   UpdateTimes times;
    Packet(Client *src, uint8_t *data, int dlen, uint64_t updateid);
 
    ~Packet();
@@ -68,11 +71,26 @@ protected:
    
    //counting semephore for incoming packets from the server
    sem_t queueSem;
+   //every client thread posts to the queue, guards queue itself
+   sem_t queueLock;
+
+   /**
+    * enqueue hands a packet to the dispatch thread
+    * @param p the packet to dispatch
+    */
+   void enqueue(Packet *p);
 
 public:
    ConnectionManagerBase(map<string,string> *p, bool mode);
    void start();
 
+   /**
+    * dispatch sends a packet to every other client in the project of the
+    * client that posted it and acknowledges it to the poster
+    * @param p the packet to send, still owned by the caller
+    */
+   void dispatch(Packet *p);
+
    /**
     * Add a new connection
     * @param s the socket to create new client for
@@ -99,6 +117,22 @@ public:
     */
    void logln(const string &msg, int verbosity = 0);
 
+   /**
+    * getCompressionThreshold inspector to get the smallest frame that is worth compressing
+    * @return the threshold in bytes, 0 if compression is not offered to plugins
+    */
+   int getCompressionThreshold() {
+      return compressThreshold;
+   }
+
+   /**
+    * getCompressionLevel inspector to get the zlib level used for compressed connections
+    * @return the compression level
+    */
+   int getCompressionLevel() {
+      return compressLevel;
+   }
+
    /**
     * terminate terminates the connection manager
     * it terminates all clients connected to all projects 
@@ -110,6 +144,8 @@ public:
     * calls the terminate function of the associated CollabreateServer
     */
    void Shutdown() {
+      //terminate doesn't return, get the last words out first
+      logFlush();
       ::terminate();
    }
 
@@ -133,6 +169,26 @@ public:
     */
    virtual void migrateUpdate(int newowner, int pid, int cmd, const uint8_t *data, int dlen) = 0;
 
+   /**
+    * migrateUpdates stores a block of migrated updates at once
+    * @param newowner the new uid to attribute the updates to
+    * @param pid the local project id for the migrated project
+    * @param first the position of the block's first update in the export
+    * @param block the updates, laid out as for nextMigrateRecord
+    * @param len the length of the block
+    * @param count the number of updates in the block
+    * @return the number of updates of the export stored so far, -1 on error
+    */
+   virtual int64_t migrateUpdates(int newowner, int pid, int64_t first, const uint8_t *block, int len, int count);
+
+   /**
+    * migratedUpdates is used to resume an interrupted import
+    * @param pid the local project id for the migrated project
+    * @return the number of updates of the export stored so far, -1 if
+    * the import can't be resumed
+    */
+   virtual int64_t migratedUpdates(int pid);
+
    /**
     * post both queues a newly received update to be sent to other clients and (if in DB mode)
     * archives the udpate in the database so that future clients can receive it 
@@ -147,6 +203,36 @@ public:
     */
    string dumpStats();
 
+   /**
+    * getLatency writes the update latency histograms of one or all projects
+    * @param pid the project to write, -1 for every project
+    * @param b the Buffer to write to, see LatencyTracker::write
+    */
+   void getLatency(int pid, Buffer &b);
+
+   /**
+    * getLatencyTotals merges the update latency histograms of every project
+    * @param stages receives LATENCY_STAGES histograms
+    */
+   void getLatencyTotals(Histogram *stages);
+
+   /**
+    * writeSnapshot appends the running totals collab_mgr top works from to
+    * a Buffer: the time, updates in and out, bytes in and out, the
+    * dispatch queue depth, the database post histograms, a latency summary
+    * per project, the client count of each project and each client's
+    * activity
+    * @param b the Buffer to write to
+    */
+   void writeSnapshot(Buffer &b);
+
+   /**
+    * getQueueDepth inspector to get the number of packets waiting for the
+    * dispatch thread
+    * @return the number of packets
+    */
+   int getQueueDepth();
+
    /**
     * sendLatestUpdates sends updates from LastUpdate to current 
     * it is expected that the client has already joined a project before calling this function
@@ -178,6 +264,14 @@ public:
     */
    string listConnections();
 
+   /**
+    * archiveProjects moves idle projects out to archive files, they are
+    * restored the next time somebody joins them
+    * @param days the number of days a project must have been idle
+    * @return the number of projects archived, -1 if archiving isn't supported
+    */
+   virtual int archiveProjects(int days);
+
    /**
     * joinProject joings a particular client to a project so that it can participate in collabREation 
     * @param c the client attempting to join 
@@ -303,6 +397,15 @@ private:
 
    bool basicMode;
 
+   int compressThreshold;
+   int compressLevel;
+   //where every connection's inbound frames are recorded, empty when not capturing
+   string captureDir;
+   //time spent by updates in each stage, per project
+   LatencyTracker *latency;
+   //when the packet being dispatched was written to each subscriber,
+   //only touched by the dispatch thread
+   vector<uint64_t> sendTimes;
 };
 
 
@@ -23,12 +23,31 @@
 #include <string.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <algorithm>
 
 #include "utils.h"
 #include "proj_info.h"
 #include "client.h"
 #include "cli_mgr.h"
 #include "buffer.h"
+#include "metrics.h"
+#include "logger.h"
+#include "probes.h"
+
+//flush a MSG_BULK_UPDATES frame once it holds this many bytes
+#define BULK_UPDATES_SIZE 0x40000
+
+static uint64_t allUpdatesMask() {
+   uint64_t mask = 0;
+   for (uint32_t command = 0; command < MSG_CONTROL_FIRST; command++) {
+      mask |= Client::commandMask(command);
+   }
+   return mask;
+}
+
+//the permission bits of every command an update can carry, built before
+//any client thread can ask for it
+static const uint64_t allUpdates = allUpdatesMask();
 
 /**
  * Client
@@ -57,6 +76,13 @@ Client::Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic) {
    uid = -1;  //user id associated with this connection
    pid = -1;
    authTries = 3;
+   proto = PROTOCOL_VERSION;
+   bulkCount = 0;
+   received = 0;
+   sendTime = 0;
+   sendCount = 0;
+   pthread_mutex_init(&rangeLock, NULL);
+   narrowed = false;
    gpid = "";  //project id associated with this connection
 
    memset(challenge, 0, sizeof(challenge));
@@ -71,8 +97,15 @@ Client::Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic) {
 //   ::logln("New Connection", LINFO);
 
    if (!basicMode) {
-     fill_random(challenge, CHALLENGE_SIZE);
-     send_data(MSG_INITIAL_CHALLENGE, challenge, CHALLENGE_SIZE);
+      Buffer chos;
+      fill_random(challenge, CHALLENGE_SIZE);
+      chos.write(challenge, CHALLENGE_SIZE);
+      //older plugins read only the challenge, newer plugins pick up the
+      //highest protocol version we are willing to speak from the tail
+      chos.writeInt(PROTOCOL_VERSION_MAX);
+      //followed by the compression methods a version 4 plugin may ask for
+      chos.writeInt(cm->getCompressionThreshold() > 0 ? COMPRESS_DEFLATE : COMPRESS_NONE);
+      send_data(MSG_INITIAL_CHALLENGE, chos.get_buf(), chos.size());
    }
    else {
       //these are used only for the 'auto auth' in BASIC mode
@@ -94,6 +127,9 @@ Client::Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic) {
  * @param v apply a verbosity level to the msg
  */
 void Client::log(const string &msg, int v) {
+   if (!logEnabled(v)) {
+      return;
+   }
    char buf[256];
    snprintf(buf, sizeof(buf), "[%s:%d (%s:%d)] %s", conn->getPeerAddr().c_str(), conn->getPeerPort(), username.c_str(), uid, msg.c_str());
    cm->log(buf, v);
@@ -102,13 +138,23 @@ void Client::log(const string &msg, int v) {
 /**
  * post is the function that actually posts updates to clients (if subscribing)
  * @param data the bytearray containing the update to send
+ * @return true if the update was sent to the client
  */
-void Client::post(const uint8_t *data, int dlen) {
-   if (checkPermissions(parseCommand(data, dlen), subscribe)) { 
+bool Client::post(const uint8_t *data, int dlen) {
+   int command = parseCommand(data, dlen);
+   if (checkPermissions(command, subscribe) && inAddressRanges(data, dlen)) { 
       //only post if client is subscribing and is allowed to recieve that particular command
-      conn->sendAll(data, dlen);
+      if (conn->sendFrame(data, dlen) < 0) {
+         return false;
+      }
       //::logln("post- datasize: " + data.length);
-      stats[0][data[7] & 0xff]++;
+      if (command >= 0 && command < MAX_COMMAND) {
+         stats[0][command]++;
+      }
+      //the payload follows the length, command and updateid
+      metricUpdateOut(pid, command, dlen - 16);
+      metricAdd(METRIC_BYTES_OUT, dlen);
+      return true;
    }
    else {
 /*
@@ -117,9 +163,90 @@ void Client::post(const uint8_t *data, int dlen) {
                          + " (probably subscribe permission: "
                          + parseCommand(data) + ")", LINFO3);
 */
+      return false;
    }
 }
 
+/**
+ * postBulk is used during catch up in place of post.  Updates are packed into
+ * a single MSG_BULK_UPDATES frame which is sent once it grows large enough.
+ * Clients that did not negotiate bulk updates are simply handed to post.
+ * This must only be called from the client's own thread
+ * @param data the bytearray containing the update to send
+ */
+void Client::postBulk(const uint8_t *data, int dlen) {
+   if (proto < PROTOCOL_BULK_UPDATES) {
+      post(data, dlen);
+      return;
+   }
+   int command = parseCommand(data, dlen);
+   if (checkPermissions(command, subscribe) && inAddressRanges(data, dlen)) {
+      if (bulkCount == 0) {
+         //leave room for the length, command, and update count filled in by flushBulk
+         bulk.reset();
+         bulk.writeInt(0);
+         bulk.writeInt(MSG_BULK_UPDATES);
+         bulk.writeInt(0);
+      }
+      //each update keeps its own length prefix and updateid
+      bulk.write(data, dlen);
+      bulkCount++;
+      if (command >= 0 && command < MAX_COMMAND) {
+         stats[0][command]++;
+      }
+      metricUpdateOut(pid, command, dlen - 16);
+      if (bulk.size() >= BULK_UPDATES_SIZE) {
+         flushBulk();
+      }
+   }
+}
+
+/**
+ * flushBulk sends any updates that postBulk is still holding
+ */
+void Client::flushBulk() {
+   if (bulkCount > 0) {
+      uint8_t *b = bulk.get_buf();
+      *(uint32_t*)b = htonl(bulk.size());
+      *(uint32_t*)(b + 8) = htonl(bulkCount);
+      //one write for the whole frame so live updates can't land in the middle of it
+      conn->sendFrame(b, bulk.size());
+      stats[0][MSG_BULK_UPDATES]++;
+      metricAdd(METRIC_BYTES_OUT, bulk.size());
+      bulkCount = 0;
+      bulk.reset();
+   }
+}
+
+/**
+ * receivesEverything checks whether this client would be sent every
+ * stored update exactly as it is stored: it subscribes to every command,
+ * has not narrowed its address ranges, and its stream isn't compressed
+ * @return true if stored updates can be sent to the client unfiltered
+ */
+bool Client::receivesEverything() {
+   if ((subscribe & allUpdates) != allUpdates || conn->isCompressing()) {
+      return false;
+   }
+   return !__atomic_load_n(&narrowed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * postFile is used during catch up in place of postBulk for clients that
+ * receive everything, the updates are sent straight from the file
+ * without passing through user space.  This must only be called from
+ * the client's own thread
+ * @param fd the file holding the updates
+ * @param offset the file offset of the first update
+ * @param len the length of the run of complete updates to send
+ * @return false if the updates could not be sent
+ */
+bool Client::postFile(int fd, uint64_t offset, uint64_t len) {
+   //anything postBulk is holding comes first
+   flushBulk();
+   metricAdd(METRIC_BYTES_OUT, len);
+   return conn->sendFile(fd, offset, len) == (int64_t)len;
+}
 
 /**
  * similar to post, but does not check subscription status, and takes command as a arg
@@ -130,9 +257,12 @@ void Client::post(const uint8_t *data, int dlen) {
  */
 void Client::send_data(int command, uint8_t *data, int dlen) {
    if (command >= MSG_CONTROL_FIRST) {
-      conn->writeInt(8 + dlen);
-      conn->writeInt(command);
-      conn->write(data, dlen);
+      Buffer os;
+      os.writeInt(8 + dlen);
+      os.writeInt(command);
+      os.write(data, dlen);
+      conn->sendFrame(os.get_buf(), os.size());
+      metricAdd(METRIC_BYTES_OUT, os.size());
 //      ::logln("send_data- cmd: " + command + " datasize: " + dlen, LINFO3);
       stats[0][command]++;
    }
@@ -164,11 +294,7 @@ void Client::send_error_msg(string theerror, int type) {
    ::logln("Protocol error detected: " + theerror, LERROR);
    Buffer os;
    os.writeUTF(theerror.c_str());
-   uint32_t d = htonl(8 + os.size());
-   conn->sendAll(&d, sizeof(d));
-   type = htonl(type);
-   conn->sendAll(&type, sizeof(type));
-   conn->sendAll(os.get_buf(), os.size());
+   send_data(type, os.get_buf(), os.size());
 }
 
 /**
@@ -177,14 +303,100 @@ void Client::send_error_msg(string theerror, int type) {
 void Client::terminate() {
 //   ::logln("Client " + hash + ":" + conn->getPeerAddr()
 //                      + ":" + conn->getPeerPort() + " terminating", LINFO);
+   PROBE4(conn_close, conn->getPeerAddr().c_str(), conn->getPeerPort(), uid, pid);
    conn->close();
    cm->remove(this);
 }
 
+/**
+ * setAddressRanges limits the updates this client receives to those that
+ * apply to the given address ranges, updates that are not tied to an
+ * address are always received
+ * @param r the ranges of interest, an empty list selects every address
+ */
+void Client::setAddressRanges(const vector<AddressRange> &r) {
+   vector<AddressRange> merged;
+   vector<AddressRange> sorted(r);
+   sort(sorted.begin(), sorted.end());
+   for (vector<AddressRange>::iterator i = sorted.begin(); i != sorted.end(); i++) {
+      if ((*i).first >= (*i).second) {
+         continue;
+      }
+      if (!merged.empty() && (*i).first <= merged.back().second) {
+         merged.back().second = max(merged.back().second, (*i).second);
+      }
+      else {
+         merged.push_back(*i);
+      }
+   }
+   pthread_mutex_lock(&rangeLock);
+   ranges.swap(merged);
+   __atomic_store_n(&narrowed, !ranges.empty(), __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&rangeLock);
+}
+
+/**
+ * getAddressRanges inspector to get the address ranges this client is
+ * interested in, sorted and without overlaps
+ * @param r receives the ranges, empty if the client wants every address
+ */
+void Client::getAddressRanges(vector<AddressRange> &r) {
+   pthread_mutex_lock(&rangeLock);
+   r = ranges;
+   pthread_mutex_unlock(&rangeLock);
+}
+
+/**
+ * inAddressRanges checks an update against the client's address ranges
+ * @param data the update to check
+ * @return true if the client is interested in the update
+ */
+bool Client::inAddressRanges(const uint8_t *data, int dlen) {
+   //most clients never narrow their ranges, they shouldn't pay for the lock
+   if (!__atomic_load_n(&narrowed, __ATOMIC_ACQUIRE)) {
+      return true;
+   }
+   uint64_t ea;
+   bool wanted = true;
+   pthread_mutex_lock(&rangeLock);
+   if (!ranges.empty() && updateAddress(data, dlen, &ea)) {
+      //first range that ends beyond ea
+      vector<AddressRange>::iterator i = upper_bound(ranges.begin(), ranges.end(), AddressRange(ea, ~0ULL));
+      wanted = i != ranges.begin() && ea < (*(i - 1)).second;
+   }
+   pthread_mutex_unlock(&rangeLock);
+   return wanted;
+}
+
 int Client::parseCommand(const uint8_t *data, int dlen) {
    return ntohl(*(int*)(data + 4));
 }
 
+/**
+ * writeActivity appends this client's running totals to a Buffer for
+ * collab_mgr top: user, address, port, pid, updates received, updates
+ * sent, time spent sending live updates, live sends, and the bytes
+ * waiting in its send queue
+ * @param b the Buffer to write to
+ */
+void Client::writeActivity(Buffer &b) {
+   uint64_t rx = 0;
+   uint64_t tx = 0;
+   for (int i = 0; i < MSG_CONTROL_FIRST; i++) {
+      rx += stats[1][i];
+      tx += stats[0][i];
+   }
+   b.writeUTF(username);
+   b.writeUTF(conn->getPeerAddr());
+   b.writeInt(conn->getPeerPort());
+   b.writeInt(pid);
+   b.writeLong(rx);
+   b.writeLong(tx);
+   b.writeLong(sendTime);
+   b.writeLong(sendCount);
+   b.writeInt(conn->sendQueued());
+}
+
 /**
  * dumpStats displace the receive / transmit stats for each command  
  */
@@ -192,13 +404,19 @@ string Client::dumpStats() {
 //   string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + ":" + conn.getPeerPort() + "\n";
    string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + "\n";
    sb += "command     rx     tx\n";
-   for (int i = 0; i < 256; i++) {
+   for (int i = 0; i < MAX_COMMAND; i++) {
       if (stats[0][i] != 0 || stats[1][i] != 0) {
          char buf[128];
          snprintf(buf, sizeof(buf), "%5d %7d %7d\n", i, stats[0][i], stats[1][i]);
          sb += buf;
       }
    }
+   if (conn->isCompressing()) {
+      char buf[128];
+      snprintf(buf, sizeof(buf), "compressed: %llu bytes sent as %llu\n", 
+               (unsigned long long)conn->getFrameBytes(), (unsigned long long)conn->getWireBytes());
+      sb += buf;
+   }
    return sb;
 }
 
@@ -209,24 +427,33 @@ string Client::dumpStats() {
  * @param command the command to check permissions on
  * @param permType the permission types to check (publish/subscribe)
  */
+bool Client::checkPermissions(uint32_t command, uint64_t permType) { 
+//   ::logln("checking for permission " + command, LDEBUG);
+   return (permType & commandMask(command)) != 0;
+}
+
+/**
+ * commandMask maps a command onto the permission bit that controls it
+ * @param command the command to map
+ * @return the MASK_ value for the command, 0 for unknown commands
+ */
 /* These are grouped into 'collabREate' permissions, just so there are less permissions to manage
  * for example all the segment operations (add, del, start/end change, etc) are grouped into 
  * 'segment' permissions. 
  */ 
-bool Client::checkPermissions(uint32_t command, uint64_t permType) { 
-   bool isallowed = false;
-//   ::logln("checking for permission " + command, LDEBUG);
+uint64_t Client::commandMask(uint32_t command) { 
+   uint64_t mask = 0;
    switch(command) {
       case COMMAND_UNDEFINE: {
-         isallowed = ((permType & MASK_UNDEFINE) > 0) ?  true : false; 
+         mask = MASK_UNDEFINE;
          break; 
       }
       case COMMAND_MAKE_CODE: {
-         isallowed = ((permType & MASK_MAKE_CODE) > 0) ?  true : false; 
+         mask = MASK_MAKE_CODE;
          break; 
       }
       case COMMAND_MAKE_DATA: {
-         isallowed = ((permType & MASK_MAKE_DATA) > 0) ?  true : false; 
+         mask = MASK_MAKE_DATA;
          break; 
       }
       case COMMAND_SEGM_ADDED:
@@ -235,12 +462,12 @@ bool Client::checkPermissions(uint32_t command, uint64_t permType) {
       case COMMAND_SEGM_END_CHANGED:
       case COMMAND_SEGM_MOVED:
       case COMMAND_MOVE_SEGM: {
-         isallowed = ((permType & MASK_SEGMENTS) > 0) ?  true : false; 
+         mask = MASK_SEGMENTS;
          break; 
       }
       case COMMAND_SET_STACK_VAR_NAME:  //what category?
       case COMMAND_RENAMED: {
-         isallowed = ((permType & MASK_RENAME) > 0) ?  true : false; 
+         mask = MASK_RENAME;
          break; 
       }
       case COMMAND_FUNC_TAIL_APPENDED:
@@ -251,22 +478,22 @@ bool Client::checkPermissions(uint32_t command, uint64_t permType) {
       case COMMAND_DEL_FUNC:
       case COMMAND_SET_FUNC_START:
       case COMMAND_SET_FUNC_END: {
-         isallowed = ((permType & MASK_FUNCTIONS) > 0) ?  true : false; 
+         mask = MASK_FUNCTIONS;
          break; 
       }
       case COMMAND_BYTE_PATCHED: {
-         isallowed = ((permType & MASK_BYTE_PATCH) > 0) ?  true : false; 
+         mask = MASK_BYTE_PATCH;
          break; 
       }
       case COMMAND_AREA_CMT_CHANGED:
       case COMMAND_CMT_CHANGED: {
-         isallowed = ((permType & MASK_COMMENTS) > 0) ?  true : false; 
+         mask = MASK_COMMENTS;
          break; 
       }
       case COMMAND_TI_CHANGED: //?  //what category?
       case COMMAND_OP_TI_CHANGED: //? //what category?
       case COMMAND_OP_TYPE_CHANGED: {
-         isallowed = ((permType & MASK_OPTYPES) > 0) ?  true : false; 
+         mask = MASK_OPTYPES;
          break; 
       }
       case COMMAND_ENUM_CREATED:
@@ -276,7 +503,7 @@ bool Client::checkPermissions(uint32_t command, uint64_t permType) {
       case COMMAND_ENUM_CMT_CHANGED:
       case COMMAND_ENUM_CONST_CREATED:
       case COMMAND_ENUM_CONST_DELETED: {
-         isallowed = ((permType & MASK_ENUMS) > 0) ?  true : false; 
+         mask = MASK_ENUMS;
          break; 
       }
       case COMMAND_STRUC_CREATED:
@@ -298,22 +525,22 @@ bool Client::checkPermissions(uint32_t command, uint64_t permType) {
       case COMMAND_STRUC_MEMBER_CHANGED_OFFSET:
       case COMMAND_STRUC_MEMBER_CHANGED_ENUM: 
       case COMMAND_CREATE_STRUC_MEMBER_OFFSET: {
-         isallowed = ((permType & MASK_STRUCTS) > 0) ?  true : false; 
+         mask = MASK_STRUCTS;
          break; 
       }
       case COMMAND_VALIDATE_FLIRT_FUNC: {
-         isallowed = ((permType & MASK_FLIRT) > 0) ?  true : false; 
+         mask = MASK_FLIRT;
          break; 
       }
       case COMMAND_THUNK_CREATED: { 
-         isallowed = ((permType & MASK_THUNK) > 0) ?  true : false; 
+         mask = MASK_THUNK;
          break; 
       }
       case COMMAND_ADD_CREF:
       case COMMAND_ADD_DREF:
       case COMMAND_DEL_CREF:
       case COMMAND_DEL_DREF: {
-         isallowed = ((permType & MASK_XREF) > 0) ?  true : false; 
+         mask = MASK_XREF;
          break; 
       }
       default:
@@ -321,7 +548,7 @@ bool Client::checkPermissions(uint32_t command, uint64_t permType) {
          break;
    } //end command switch
    
-   return isallowed;
+   return mask;
 }
 
 uint32_t Client::getPeerPort() {
@@ -365,10 +592,14 @@ void *Client::run(void *arg) {
          if (command < MAX_COMMAND && command > 0) {
             client->stats[1][command]++;
          }
+         metricAdd(METRIC_BYTES_IN, len);
          len -= 8;
          if (command < MSG_CONTROL_FIRST) {
             uint8_t *data = new uint8_t[len];
             client->conn->readFully(data, len);
+            client->received = latencyNow();
+            PROBE4(frame_received, client->pid, client->uid, command, len + 8);
+            metricUpdateIn(client->pid, command, len);
             os.writeInt(len + 16);
             os.writeInt(command);
             os.writeLong(0);  //this is where the updateid will get inserted
@@ -398,6 +629,8 @@ void *Client::run(void *arg) {
             }
          }
          else { //server only command
+            //the body of a control message is read as it is handled
+            PROBE4(frame_received, client->pid, client->uid, command, len + 8);
             switch (command) {
                case MSG_PROJECT_NEW_REQUEST: {
 //                  ::logln("in NEW PROJECT REQUEST", LDEBUG);
@@ -592,9 +825,9 @@ void *Client::run(void *arg) {
                case MSG_AUTH_REQUEST: {
 //                  ::logln("in AUTH REQUEST", LDEBUG);
                   int pluginversion = client->conn->readInt();
-                  if (pluginversion != PROTOCOL_VERSION) {
+                  if (pluginversion < PROTOCOL_VERSION || pluginversion > PROTOCOL_VERSION_MAX) {
                      char buf[256];
-                     snprintf(buf, sizeof(buf), "Version mismatch. plugin: %d server: %d", pluginversion, PROTOCOL_VERSION);
+                     snprintf(buf, sizeof(buf), "Version mismatch. plugin: %d server: %d-%d", pluginversion, PROTOCOL_VERSION, PROTOCOL_VERSION_MAX);
    #ifdef DEBUG
                      fprintf(stderr, "%s\n", buf);
    #endif
@@ -602,6 +835,8 @@ void *Client::run(void *arg) {
    //                  ::logln("Version mismatch. plugin: " + pluginversion + " server: " + PROTOCOL_VERSION, LERROR);
                      goto end_loop;
                   }
+                  //plugin replies with the highest version both sides understand
+                  client->proto = pluginversion;
                   if (!client->authenticated) {
                      uint8_t resp[MD5_SIZE];
                      client->username = client->conn->readUTF();
@@ -611,6 +846,11 @@ void *Client::run(void *arg) {
                         client->send_error("Malformed AUTH_REQUEST");
                         goto end_loop;  //disconnect
                      }
+                     //version 4 plugins follow the hmac with the compression they would like
+                     int compress = COMPRESS_NONE;
+                     if (client->proto >= PROTOCOL_COMPRESSION) {
+                        compress = client->conn->readInt();
+                     }
    
                      client->uid = client->cm->authenticate(client, client->username.c_str(), client->challenge, CHALLENGE_SIZE, resp, MD5_SIZE);
                      if (client->uid != INVALID_USER) {
@@ -629,6 +869,10 @@ void *Client::run(void *arg) {
                         client->authTries--;
                      }
                      client->send_data(MSG_AUTH_REPLY, os.get_buf(), os.size());
+                     if (client->authenticated && (compress & COMPRESS_DEFLATE) && client->cm->getCompressionThreshold() > 0) {
+                        //everything after the auth reply may arrive compressed
+                        client->conn->enableCompression(client->cm->getCompressionLevel(), client->cm->getCompressionThreshold());
+                     }
                      if (client->authTries == 0) {
                         ::logln("too many auth attempts for " + client->getUser(), LERROR);
                         goto end_loop;
@@ -712,10 +956,47 @@ void *Client::run(void *arg) {
                      break;
                   }
    //               ::logln("Received client->send_UPDATES request for " + lastupdate + " to current", LINFO1);
+                  PROBE3(catchup_start, client->pid, client->uid, lastupdate);
                   client->cm->sendLatestUpdates(client, lastupdate);
+                  PROBE2(catchup_done, client->pid, client->uid);
                      
                   break;
                }
+               case MSG_SET_ADDRESS_RANGES: {
+                  //[int count] followed by count [long start][long end) pairs
+                  //plugins that widen their ranges need to catch up on the new ranges from scratch
+                  if (len < 4 || len > MAX_ADDRESS_RANGES * 16 + 4) {
+                     //the frame can't be skipped without reading all of it
+                     ::logln("Malformed MSG_SET_ADDRESS_RANGES - bad length", LERROR);
+                     client->send_error("Invalid address range request");
+                     goto end_loop;  //disconnect
+                  }
+                  uint8_t *data = new uint8_t[len];
+                  client->conn->readFully(data, len);
+                  Buffer b(data, len);
+                  delete [] data;
+                  if (!client->authenticated) {
+                     client->send_error("Authenication required for this operation");
+                     break;
+                  }
+                  if (client->proto < PROTOCOL_ADDRESS_RANGES) {
+                     client->send_error("Address ranges were not negotiated for this connection");
+                     break;
+                  }
+                  int count = b.readInt();
+                  if (count < 0 || count > MAX_ADDRESS_RANGES || count * 16 + 4 != len) {
+                     client->send_error("Invalid address range request");
+                     break;
+                  }
+                  vector<AddressRange> r;
+                  for (int i = 0; i < count; i++) {
+                     uint64_t start = b.readLong();
+                     uint64_t end = b.readLong();
+                     r.push_back(AddressRange(start, end));
+                  }
+                  client->setAddressRanges(r);
+                  break;
+               }
                case MSG_SET_REQ_PERMS: {
 //                  ::logln("Received SET_REQ_PERMS request", LINFO1);
                   uint64_t tpub = client->conn->readLong() & 0x7FFFFFFF;
@@ -831,6 +1112,8 @@ void *Client::run(void *arg) {
    } catch (IOException ex) {
    }
 end_loop:
+   //only this thread reads from conn, so this is where a capture can be finished
+   client->conn->setTap(NULL);
    client->terminate();
    delete client;   
    return NULL;
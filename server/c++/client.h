@@ -22,7 +22,9 @@
 #define __CLIENT_H
 
 #include <string>
+#include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include "utils.h"
 
 using namespace std;
@@ -62,7 +64,8 @@ public:
     * @param v apply a verbosity level to the msg
     */
    void logln(const string &msg, int v = 0) {
-      log(msg + "\n", v);
+      //every message is a line of its own in the log
+      log(msg, v);
    }
 
    /**
@@ -131,11 +134,82 @@ public:
       uid = u;
    }
 
+   /**
+    * getReceived inspector to get the time the last update from this client
+    * was read, only meaningful to the client's own thread
+    * @return the latencyNow() time, 0 if no update has been read
+    */
+   uint64_t getReceived() {
+      return received;
+   }
+
+   /**
+    * addSendTime adds to the time the dispatch thread has spent sending
+    * updates to this client, only called from the dispatch thread
+    * @param ns the time one send took, in nanoseconds
+    */
+   void addSendTime(uint64_t ns) {
+      sendTime += ns;
+      sendCount++;
+   }
+
+   /**
+    * writeActivity appends this client's running totals to a Buffer for
+    * collab_mgr top: user, address, port, pid, updates received, updates
+    * sent, time spent sending live updates, live sends, and the bytes
+    * waiting in its send queue
+    * @param b the Buffer to write to
+    */
+   void writeActivity(Buffer &b);
+
    /**
     * post is the function that actually posts updates to clients (if subscribing)
     * @param data the bytearray containing the update to send
+    * @return true if the update was sent to the client
+    */
+   bool post(const uint8_t *data, int dlen);
+
+   /**
+    * postBulk is used during catch up in place of post.  Updates are packed into
+    * a single MSG_BULK_UPDATES frame which is sent once it grows large enough.
+    * Clients that did not negotiate bulk updates are simply handed to post.
+    * This must only be called from the client's own thread
+    * @param data the bytearray containing the update to send
+    */
+   void postBulk(const uint8_t *data, int dlen);
+
+   /**
+    * flushBulk sends any updates that postBulk is still holding
+    */
+   void flushBulk();
+
+   /**
+    * receivesEverything checks whether this client would be sent every
+    * stored update exactly as it is stored: it subscribes to every command,
+    * has not narrowed its address ranges, and its stream isn't compressed
+    * @return true if stored updates can be sent to the client unfiltered
     */
-   void post(const uint8_t *data, int dlen);
+   bool receivesEverything();
+
+   /**
+    * postFile is used during catch up in place of postBulk for clients that
+    * receive everything, the updates are sent straight from the file
+    * without passing through user space.  This must only be called from
+    * the client's own thread
+    * @param fd the file holding the updates
+    * @param offset the file offset of the first update
+    * @param len the length of the run of complete updates to send
+    * @return false if the updates could not be sent
+    */
+   bool postFile(int fd, uint64_t offset, uint64_t len);
+
+   /**
+    * getProtocol inspector to get the protocol version negotiated with the plugin
+    * @return the negotiated protocol version
+    */
+   int getProtocol() {
+      return proto;
+   }
    
    /**
     * similar to post, but does not check subscription status, and takes command as a arg
@@ -298,7 +372,28 @@ public:
       return username;
    }
 
-private:
+   /**
+    * setAddressRanges limits the updates this client receives to those that
+    * apply to the given address ranges, updates that are not tied to an
+    * address are always received
+    * @param r the ranges of interest, an empty list selects every address
+    */
+   void setAddressRanges(const vector<AddressRange> &r);
+
+   /**
+    * getAddressRanges inspector to get the address ranges this client is
+    * interested in, sorted and without overlaps
+    * @param r receives the ranges, empty if the client wants every address
+    */
+   void getAddressRanges(vector<AddressRange> &r);
+
+   /**
+    * commandMask maps a command onto the permission bit that controls it
+    * @param command the command to map
+    * @return the MASK_ value for the command, 0 for unknown commands
+    */
+   static uint64_t commandMask(uint32_t command);
+
    /**
     * checkPermissions checks to see if the current client has permissions to perform an operation
     * @param command the command to check permissions on
@@ -309,6 +404,14 @@ private:
     * 'segment' permissions. 
     */ 
    bool checkPermissions(uint32_t command, uint64_t permType);  
+
+private:
+   /**
+    * inAddressRanges checks an update against the client's address ranges
+    * @param data the update to check
+    * @return true if the client is interested in the update
+    */
+   bool inAddressRanges(const uint8_t *data, int dlen);
    static int parseCommand(const uint8_t *data, int dlen);
 
    NetworkIO *conn;
@@ -329,12 +432,28 @@ private:
    int uid;  //user id associated with this connection
    int pid;
    int authTries;
+   int proto;  //protocol version negotiated during authentication
    string gpid;  //project id associated with this connection
    uint8_t challenge[CHALLENGE_SIZE];
 
    ConnectionManagerBase *cm;
 
    int stats[2][MAX_COMMAND];
+   //when the last update was read, for latency tracking
+   uint64_t received;
+   //time the dispatch thread has spent sending to this client, and how often
+   uint64_t sendTime;
+   uint64_t sendCount;
+
+   //address ranges of interest, empty for every address
+   vector<AddressRange> ranges;
+   pthread_mutex_t rangeLock;
+   //whether ranges is non empty, read without taking rangeLock
+   bool narrowed;
+
+   //pending MSG_BULK_UPDATES frame built by postBulk
+   Buffer bulk;
+   int bulkCount;
    
    bool basicMode;
 };
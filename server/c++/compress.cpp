@@ -0,0 +1,294 @@
+/*
+   collabREate compress.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+#include <zlib.h>
+#include <set>
+#include <queue>
+
+#include "buffer.h"
+#include "compress.h"
+
+#define CHUNK_SIZE 0x4000
+
+//dictionary training parameters
+#define KGRAM_SIZE 8
+#define SEGMENT_SIZE 32
+#define KGRAM_TABLE_BITS 20
+#define MAX_SAMPLE_BYTES 0x800000
+
+StreamCompressor::StreamCompressor(int level) {
+   memset(&zs, 0, sizeof(zs));
+   if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
+      level = Z_DEFAULT_COMPRESSION;
+   }
+   ok = deflateInit(&zs, level) == Z_OK;
+}
+
+StreamCompressor::~StreamCompressor() {
+   if (ok) {
+      deflateEnd(&zs);
+   }
+}
+
+/**
+ * compress appends the compressed form of data to out
+ * @param data the bytes to compress
+ * @param len the number of bytes to compress
+ * @param out the buffer that receives the compressed bytes
+ * @return false if the stream is no longer usable
+ */
+bool StreamCompressor::compress(const void *data, uint32_t len, Buffer &out) {
+   uint8_t chunk[CHUNK_SIZE];
+   if (!ok) {
+      return false;
+   }
+   zs.next_in = (Bytef*)data;
+   zs.avail_in = len;
+   do {
+      zs.next_out = chunk;
+      zs.avail_out = sizeof(chunk);
+      int res = deflate(&zs, Z_SYNC_FLUSH);
+      if (res != Z_OK && res != Z_BUF_ERROR) {
+         //the peer can't recover from a gap in the stream
+         ok = false;
+         return false;
+      }
+      out.write(chunk, sizeof(chunk) - zs.avail_out);
+   } while (zs.avail_out == 0);
+   return true;
+}
+
+StreamDecompressor::StreamDecompressor() {
+   memset(&zs, 0, sizeof(zs));
+   ok = inflateInit(&zs) == Z_OK;
+}
+
+StreamDecompressor::~StreamDecompressor() {
+   if (ok) {
+      inflateEnd(&zs);
+   }
+}
+
+/**
+ * decompress appends the inflated form of data to out
+ * @param data the compressed bytes of a single MSG_COMPRESSED frame
+ * @param len the number of compressed bytes
+ * @param out the buffer that receives the inflated bytes
+ * @return false if the stream is corrupt
+ */
+bool StreamDecompressor::decompress(const void *data, uint32_t len, Buffer &out) {
+   uint8_t chunk[CHUNK_SIZE];
+   if (!ok) {
+      return false;
+   }
+   zs.next_in = (Bytef*)data;
+   zs.avail_in = len;
+   do {
+      zs.next_out = chunk;
+      zs.avail_out = sizeof(chunk);
+      int res = inflate(&zs, Z_SYNC_FLUSH);
+      if (res != Z_OK && res != Z_BUF_ERROR) {
+         ok = false;
+         return false;
+      }
+      out.write(chunk, sizeof(chunk) - zs.avail_out);
+   } while (zs.avail_out == 0);
+   return zs.avail_in == 0;
+}
+
+/**
+ * compressPayload deflates a single stored update.  Stored updates are small
+ * and compressed independently of each other, so a preset dictionary built
+ * from other updates of the same project provides most of the savings.
+ * @param data the update to compress
+ * @param len the length of the update
+ * @param dict the preset dictionary to use, or NULL
+ * @param level the deflate level to use
+ * @param out the buffer that receives the compressed update
+ * @return true if the update was compressed and came out smaller
+ */
+bool compressPayload(const uint8_t *data, uint32_t len, const Buffer *dict, int level, Buffer &out) {
+   uint8_t chunk[CHUNK_SIZE];
+   z_stream zs;
+   memset(&zs, 0, sizeof(zs));
+   if (deflateInit(&zs, level) != Z_OK) {
+      return false;
+   }
+   if (dict != NULL && dict->size() > 0) {
+      deflateSetDictionary(&zs, dict->get_buf(), dict->size());
+   }
+   unsigned int start = out.size();
+   zs.next_in = (Bytef*)data;
+   zs.avail_in = len;
+   int res;
+   do {
+      zs.next_out = chunk;
+      zs.avail_out = sizeof(chunk);
+      res = deflate(&zs, Z_FINISH);
+      out.write(chunk, sizeof(chunk) - zs.avail_out);
+      if (out.size() - start >= len) {
+         //not worth it, the caller stores the update as is
+         break;
+      }
+   } while (res == Z_OK);
+   deflateEnd(&zs);
+   if (res != Z_STREAM_END || out.size() - start >= len) {
+      out.seek(start);
+      return false;
+   }
+   return true;
+}
+
+/**
+ * decompressPayload inflates an update stored by compressPayload
+ * @param data the compressed update
+ * @param len the length of the compressed update
+ * @param dict the preset dictionary the update was compressed with, or NULL
+ * @param out the buffer that receives the inflated update
+ * @return false if the update is corrupt or needs a different dictionary
+ */
+bool decompressPayload(const uint8_t *data, uint32_t len, const Buffer *dict, Buffer &out) {
+   uint8_t chunk[CHUNK_SIZE];
+   z_stream zs;
+   memset(&zs, 0, sizeof(zs));
+   if (inflateInit(&zs) != Z_OK) {
+      return false;
+   }
+   zs.next_in = (Bytef*)data;
+   zs.avail_in = len;
+   int res;
+   do {
+      zs.next_out = chunk;
+      zs.avail_out = sizeof(chunk);
+      res = inflate(&zs, Z_NO_FLUSH);
+      if (res == Z_NEED_DICT) {
+         //the adler32 of the dictionary is in the stream header, so a
+         //mismatched dictionary is caught here
+         if (dict == NULL || inflateSetDictionary(&zs, dict->get_buf(), dict->size()) != Z_OK) {
+            break;
+         }
+         res = Z_OK;
+      }
+      out.write(chunk, sizeof(chunk) - zs.avail_out);
+   } while (res == Z_OK);
+   inflateEnd(&zs);
+   return res == Z_STREAM_END;
+}
+
+static uint32_t kgramHash(const uint8_t *p) {
+   uint64_t v;
+   memcpy(&v, p, sizeof(v));
+   return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - KGRAM_TABLE_BITS));
+}
+
+static uint32_t scoreSegment(const string &seg, const vector<uint32_t> &freq) {
+   const uint8_t *p = (const uint8_t*)seg.data();
+   uint32_t score = 0;
+   for (size_t i = 0; i + KGRAM_SIZE <= seg.length(); i++) {
+      uint32_t f = freq[kgramHash(p + i)];
+      if (f > 1) {
+         score += f - 1;
+      }
+   }
+   return score;
+}
+
+/**
+ * trainDictionary builds a preset dictionary out of the byte strings that
+ * occur most often across a set of sample updates
+ * @param samples the sample updates, uncompressed
+ * @param maxSize the maximum size of the dictionary
+ * @param dict the buffer that receives the dictionary
+ */
+void trainDictionary(const vector<string> &samples, uint32_t maxSize, Buffer &dict) {
+   vector<uint32_t> freq(1 << KGRAM_TABLE_BITS, 0);
+   vector<uint32_t> seen(1 << KGRAM_TABLE_BITS, 0);
+   size_t nsamples = 0;
+   uint32_t total = 0;
+
+   if (maxSize > MAX_DICTIONARY_SIZE) {
+      maxSize = MAX_DICTIONARY_SIZE;
+   }
+   //count the number of samples that each k-gram appears in, so that one
+   //highly repetitive update can't crowd out everything else
+   for (; nsamples < samples.size() && total < MAX_SAMPLE_BYTES; nsamples++) {
+      const string &s = samples[nsamples];
+      const uint8_t *p = (const uint8_t*)s.data();
+      for (size_t i = 0; i + KGRAM_SIZE <= s.length(); i++) {
+         uint32_t h = kgramHash(p + i);
+         if (seen[h] != nsamples + 1) {
+            seen[h] = nsamples + 1;
+            freq[h]++;
+         }
+      }
+      total += s.length();
+   }
+
+   //carve the samples into fixed size segments and rank the distinct ones
+   set<string> distinct;
+   vector<string> segments;
+   priority_queue<pair<uint32_t, uint32_t> > ranked;
+   for (size_t n = 0; n < nsamples; n++) {
+      const string &s = samples[n];
+      for (size_t i = 0; i + KGRAM_SIZE <= s.length(); i += SEGMENT_SIZE) {
+         string seg = s.substr(i, SEGMENT_SIZE);
+         if (distinct.insert(seg).second) {
+            uint32_t score = scoreSegment(seg, freq);
+            if (score > 0) {
+               ranked.push(make_pair(score, (uint32_t)segments.size()));
+               segments.push_back(seg);
+            }
+         }
+      }
+   }
+
+   //once a k-gram is in the dictionary it adds nothing to other segments, so
+   //scores are refreshed as segments come off the queue and pushed back if
+   //they are no longer the best choice
+   vector<uint32_t> chosen;
+   uint32_t used = 0;
+   while (!ranked.empty() && used < maxSize) {
+      pair<uint32_t, uint32_t> top = ranked.top();
+      ranked.pop();
+      const string &seg = segments[top.second];
+      uint32_t score = scoreSegment(seg, freq);
+      if (score == 0 || used + seg.length() > maxSize) {
+         continue;
+      }
+      if (score < top.first && !ranked.empty() && score < ranked.top().first) {
+         ranked.push(make_pair(score, top.second));
+         continue;
+      }
+      chosen.push_back(top.second);
+      used += seg.length();
+      const uint8_t *p = (const uint8_t*)seg.data();
+      for (size_t i = 0; i + KGRAM_SIZE <= seg.length(); i++) {
+         freq[kgramHash(p + i)] = 0;
+      }
+   }
+
+   //deflate reaches the end of the dictionary with the shortest distances,
+   //so the most valuable segments go last
+   for (size_t i = chosen.size(); i > 0; i--) {
+      const string &seg = segments[chosen[i - 1]];
+      dict.write(seg.data(), seg.length());
+   }
+}
@@ -0,0 +1,117 @@
+/*
+   collabREate compress.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stdint.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+
+using namespace std;
+
+//largest useful preset dictionary, deflate can't reach back any further
+#define MAX_DICTIONARY_SIZE 0x8000
+
+/**
+ * StreamCompressor
+ * A deflate stream that lives as long as a connection.  Each call to
+ * compress emits a sync flushed block, so the peer can inflate every
+ * MSG_COMPRESSED frame as soon as it arrives while still benefiting
+ * from the history of everything sent before it.
+ */
+class StreamCompressor {
+public:
+   StreamCompressor(int level);
+   ~StreamCompressor();
+
+   /**
+    * compress appends the compressed form of data to out
+    * @param data the bytes to compress
+    * @param len the number of bytes to compress
+    * @param out the buffer that receives the compressed bytes
+    * @return false if the stream is no longer usable
+    */
+   bool compress(const void *data, uint32_t len, Buffer &out);
+
+private:
+   z_stream zs;
+   bool ok;
+};
+
+/**
+ * StreamDecompressor
+ * The receiving half of a StreamCompressor
+ */
+class StreamDecompressor {
+public:
+   StreamDecompressor();
+   ~StreamDecompressor();
+
+   /**
+    * decompress appends the inflated form of data to out
+    * @param data the compressed bytes of a single MSG_COMPRESSED frame
+    * @param len the number of compressed bytes
+    * @param out the buffer that receives the inflated bytes
+    * @return false if the stream is corrupt
+    */
+   bool decompress(const void *data, uint32_t len, Buffer &out);
+
+private:
+   z_stream zs;
+   bool ok;
+};
+
+/**
+ * compressPayload deflates a single stored update.  Stored updates are small
+ * and compressed independently of each other, so a preset dictionary built
+ * from other updates of the same project provides most of the savings.
+ * @param data the update to compress
+ * @param len the length of the update
+ * @param dict the preset dictionary to use, or NULL
+ * @param level the deflate level to use
+ * @param out the buffer that receives the compressed update
+ * @return true if the update was compressed and came out smaller
+ */
+bool compressPayload(const uint8_t *data, uint32_t len, const Buffer *dict, int level, Buffer &out);
+
+/**
+ * decompressPayload inflates an update stored by compressPayload
+ * @param data the compressed update
+ * @param len the length of the compressed update
+ * @param dict the preset dictionary the update was compressed with, or NULL
+ * @param out the buffer that receives the inflated update
+ * @return false if the update is corrupt or needs a different dictionary
+ */
+bool decompressPayload(const uint8_t *data, uint32_t len, const Buffer *dict, Buffer &out);
+
+/**
+ * trainDictionary builds a preset dictionary out of the byte strings that
+ * occur most often across a set of sample updates
+ * @param samples the sample updates, uncompressed
+ * @param maxSize the maximum size of the dictionary
+ * @param dict the buffer that receives the dictionary
+ */
+void trainDictionary(const vector<string> &samples, uint32_t maxSize, Buffer &dict);
+
+#endif
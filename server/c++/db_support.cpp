@@ -22,6 +22,7 @@
 #include <map>
 #include <vector>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -29,12 +30,27 @@
 #include <openssl/md5.h>
 
 #include "utils.h"
+#include "compress.h"
 #include "db_support.h"
+#include "maintenance.h"
+#include "archive.h"
+#include "bulk_load.h"
 #include "proj_info.h"
 #include "clientset.h"
+#include "latency.h"
+#include "metrics.h"
+#include "probes.h"
 
 using namespace std;
 
+//in DB_ order, these are also the names the statements are prepared under
+const char *dbStatements[DB_STATEMENTS] = {
+   "postUpdate", "addProject", "addProjectSnap", "addProjectFork", "findProjectsByHash",
+   "findProjectByPid", "findProjectByGpid", "getUserInfo", "getLatestUpdates",
+   "getLatestUpdatesInRanges", "copyUpdates", "projectPermsUpdate", "getDictionary",
+   "findDictionary"
+};
+
 uint8_t *HmacMD5(const uint8_t *msg, int mlen, const uint8_t *key, int klen) {
    uint8_t ipad[64];
    uint8_t opad[64];
@@ -68,10 +84,11 @@ uint8_t *HmacMD5(const uint8_t *msg, int mlen, const uint8_t *key, int klen) {
 void DatabaseConnectionManager::init_queries() {
    sem_init(&pu_sem, 0, 1);
    PGresult *res = PQprepare(dbConn, "postUpdate", 
-                       "insert into updates (userid,pid,cmd,data) values ($1,$2,$3,$4) returning updateid;",
+                       "insert into updates (userid,pid,cmd,data,dictid,ea,supkey) values ($1,$2,$3,$4,$5,$6,$7) returning updateid;",
                        0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "a database created by an older dbschema.sql must first be upgraded with dbupgrade.sql\n");
    }
    PQclear(res);
    sem_init(&ap_sem, 0, 1);
@@ -100,7 +117,7 @@ void DatabaseConnectionManager::init_queries() {
    PQclear(res);
    sem_init(&fpbh_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectsByHash", 
-                   "select p.pid,p.hash,p.gpid,p.description,f.parent,p.snapupdateid,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child where p.hash = $1 order by p.pid asc;",
+                   "select p.pid,p.hash,p.gpid,p.description,f.parent,p.snapupdateid,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child where p.hash = $1 and not p.deleted order by p.pid asc;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       fprintf(stderr, "findProjectsByHash: %s\n", PQerrorMessage(dbConn));
@@ -108,7 +125,7 @@ void DatabaseConnectionManager::init_queries() {
    PQclear(res);
    sem_init(&fpbp_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectByPid", 
-                   "select p.pid,p.hash,p.gpid,p.snapupdateid,p.description,f.parent,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid=f.child where p.pid = $1 order by p.pid asc;",
+                   "select p.pid,p.hash,p.gpid,p.snapupdateid,p.description,f.parent,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid=f.child where p.pid = $1 and not p.deleted order by p.pid asc;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
@@ -116,7 +133,7 @@ void DatabaseConnectionManager::init_queries() {
    PQclear(res);
    sem_init(&fpbg_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectByGpid", 
-                   "select pid,hash,gpid,protocol from projects where gpid = $1 order by pid asc;",
+                   "select pid,hash,gpid,protocol from projects where gpid = $1 and not deleted order by pid asc;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       fprintf(stderr, "findProjectByGpid: %s\n", PQerrorMessage(dbConn));
@@ -132,12 +149,26 @@ void DatabaseConnectionManager::init_queries() {
    PQclear(res);
    sem_init(&glu_sem, 0, 1);
    res = PQprepare(dbConn, "getLatestUpdates", 
-                   "select updateid,cmd,data from updates where updateid > $1 and pid = $2 order by updateid asc;",
+                   "select updateid,cmd,data,dictid from updates where updateid > $1 and pid = $2 and cmd = any($3::int4[]) and not superseded order by updateid asc;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       fprintf(stderr, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
+   //$4 and $5 hold the first and last address of each range, each range is
+   //an index scan of updates(pid,ea,updateid)
+   sem_init(&glur_sem, 0, 1);
+   res = PQprepare(dbConn, "getLatestUpdatesInRanges", 
+                   "select updateid,cmd,data,dictid from updates where updateid > $1 and pid = $2 and cmd = any($3::int4[]) and ea is null and not superseded "
+                   "union all "
+                   "select u.updateid,u.cmd,u.data,u.dictid from generate_subscripts($4::int8[], 1) r(i) join updates u "
+                   "on u.pid = $2 and u.ea between ($4::int8[])[r.i] and ($5::int8[])[r.i] "
+                   "where u.updateid > $1 and u.cmd = any($3::int4[]) and not u.superseded order by 1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "getLatestUpdatesInRanges: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
    sem_init(&cu_sem, 0, 1);
    res = PQprepare(dbConn, "copyUpdates", 
                    "select copy_updates($1, $2, $3);",
@@ -155,10 +186,30 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "projectPermsUpdate: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
+   sem_init(&gd_sem, 0, 1);
+   res = PQprepare(dbConn, "getDictionary", 
+                   "select data from dictionaries where dictid=$1",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "getDictionary: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   sem_init(&fd_sem, 0, 1);
+   res = PQprepare(dbConn, "findDictionary", 
+                   "select dictid from dictionaries where pid=$1 or pid is null order by pid is null, dictid desc limit 1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "findDictionary: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
 }
 
-DatabaseConnectionManager::DatabaseConnectionManager(map<string,string> *p) : ConnectionManagerBase(p, false) {
-//   if (dbConn) return;
+/**
+ * connectDatabase opens a connection to the database named in the config
+ * @param p the server configuration
+ * @return the connection, or NULL if the connection failed
+ */
+PGconn *connectDatabase(map<string,string> *p) {
    map<string,string> dbkeys;
    
    string dbHost = getStringOption(p, "DB_HOST", "");
@@ -187,19 +238,39 @@ DatabaseConnectionManager::DatabaseConnectionManager(map<string,string> *p) : Co
       values[idx] = (*i).second.c_str();
    }
    keywords[idx] = values[idx] = NULL;
-   dbConn = PQconnectdbParams(keywords, values, 0);
+   PGconn *conn = PQconnectdbParams(keywords, values, 0);
 //   memset(dbPass, 0, strlen(dbPass));
+   delete [] keywords;
+   delete [] values;
 
    /* Check to see that the backend connection was successfully made */
-   if (PQstatus(dbConn) != CONNECTION_OK) {
-      fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(dbConn));
-      PQfinish(dbConn);
+   if (PQstatus(conn) != CONNECTION_OK) {
+      fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
+      PQfinish(conn);
+      conn = NULL;
    }
-   else {
+   return conn;
+}
+
+DatabaseConnectionManager::DatabaseConnectionManager(map<string,string> *p) : ConnectionManagerBase(p, false) {
+//   if (dbConn) return;
+   storeLevel = getIntOption(p, "STORE_COMPRESSION_LEVEL", 6);
+   storeMinimum = getIntOption(p, "STORE_COMPRESSION_MIN", 64);
+   slowNs = (uint64_t)getIntOption(p, "DB_SLOW_MS", 0) * 1000000;
+   sem_init(&dict_sem, 0, 1);
+   maint = NULL;
+   archiver = NULL;
+   loader = NULL;
+
+   dbConn = connectDatabase(p);
+   if (dbConn != NULL) {
       init_queries();
+      //background work gets its own connection
+      maint = new Maintenance(this, p);
+      archiver = new Archiver(this, maint, p);
+      loader = new BulkLoader(this, maint, p);
+      maint->start();
    }
-   delete [] keywords;
-   delete [] values;
 }
 
 DatabaseConnectionManager::~DatabaseConnectionManager() {
@@ -223,12 +294,217 @@ DatabaseConnectionManager::~DatabaseConnectionManager() {
    PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE getLatestUpdates;");
    PQclear(res);
+   res = PQexec(dbConn, "DEALLOCATE getLatestUpdatesInRanges;");
+   PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE copyUpdates;");
    PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE projectPermsUpdate;");
    PQclear(res);
+   res = PQexec(dbConn, "DEALLOCATE getDictionary;");
+   PQclear(res);
+   res = PQexec(dbConn, "DEALLOCATE findDictionary;");
+   PQclear(res);
    PQfinish(dbConn);
    dbConn = NULL;
+   for (map<int,Buffer*>::iterator i = dicts.begin(); i != dicts.end(); i++) {
+      delete (*i).second;
+   }
+}
+
+/*
+ * summarize describes the parameters of a statement for the slow
+ * statement log: binary ints as numbers, short printable values as they
+ * are and anything else by its size
+ */
+static string summarize(int nParams, const char * const *parms, const int *plens, const int *pformats) {
+   string res;
+   for (int i = 0; i < nParams; i++) {
+      char buf[64];
+      const char *v = parms[i];
+      int len = pformats[i] ? plens[i] : strlen(v ? v : "");
+      if (v == NULL) {
+         snprintf(buf, sizeof(buf), "NULL");
+      }
+      else if (pformats[i] && len == 4) {
+         snprintf(buf, sizeof(buf), "%d", (int)ntohl(*(uint32_t*)v));
+      }
+      else if (pformats[i] && len == 8) {
+         snprintf(buf, sizeof(buf), "%lld", (long long)ntohll(*(uint64_t*)v));
+      }
+      else {
+         bool printable = len <= 32;
+         for (int j = 0; printable && j < len; j++) {
+            printable = isprint((unsigned char)v[j]) != 0;
+         }
+         if (printable) {
+            snprintf(buf, sizeof(buf), "'%.*s'", len, v);
+         }
+         else {
+            snprintf(buf, sizeof(buf), "<%d bytes>", len);
+         }
+      }
+      if (i) {
+         res += ", ";
+      }
+      res += buf;
+   }
+   return res;
+}
+
+/**
+ * execPrepared runs one of the prepared statements on the shared
+ * connection, timing the wait for the statement's semaphore apart from
+ * the statement itself.  Statements slower than DB_SLOW_MS, wait
+ * included, are logged along with a summary of their parameters.
+ * @param stmt the DB_ statement to run
+ * @param sem the semaphore that serializes the statement
+ * @param nParams the number of parameters
+ * @param parms the parameter values, as for PQexecPrepared
+ * @param plens the parameter lengths
+ * @param pformats the parameter formats
+ * @return the statement's binary result, the caller must PQclear it
+ */
+PGresult *DatabaseConnectionManager::execPrepared(int stmt, sem_t *sem, int nParams, const char * const *parms,
+                                                  const int *plens, const int *pformats) {
+   PROBE1(db_start, dbStatements[stmt]);
+   uint64_t waitStart = latencyNow();
+   sem_wait(sem);
+   uint64_t execStart = latencyNow();
+   PGresult *rset = PQexecPrepared(dbConn, dbStatements[stmt],
+                       nParams, //int nParams,   size of arrays that follow
+                       parms, //parms,  //const char * const *paramValues, array of string values
+                       plens, //const int *paramLengths,
+                       pformats, //const int *paramFormats,
+                       1); //int resultFormat); 0 == text, 1 == binary
+   sem_post(sem);
+   uint64_t done = latencyNow();
+   metricRecord(METRIC_DB_WAIT + stmt, execStart - waitStart);
+   metricRecord(METRIC_DB_EXEC + stmt, done - execStart);
+   PROBE4(db_done, dbStatements[stmt], execStart - waitStart, done - execStart, PQntuples(rset));
+   ExecStatusType qres = PQresultStatus(rset);
+   if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
+      metricAdd(METRIC_DB_ERRORS);
+   }
+   if (slowNs != 0 && done - waitStart >= slowNs) {
+      char buf[256];
+      snprintf(buf, sizeof(buf), "slow statement %s: waited %.3f ms, ran %.3f ms, %s, %d rows, parameters (",
+               dbStatements[stmt], (execStart - waitStart) / 1e6, (done - execStart) / 1e6,
+               PQresStatus(qres), PQntuples(rset));
+      logln(buf + summarize(nParams, parms, plens, pformats) + ")", LINFO);
+   }
+   return rset;
+}
+
+/**
+ * getDictionary finds the preset dictionary with the given id, dictionaries
+ * never change once created so they are cached for the life of the server
+ * @param dictid the id of the dictionary
+ * @return the dictionary or NULL if dictid is 0 or the dictionary can't be loaded
+ */
+Buffer *DatabaseConnectionManager::getDictionary(int dictid) {
+   Buffer *dict = NULL;
+   if (dictid == 0) {
+      return NULL;
+   }
+   sem_wait(&dict_sem);
+   map<int,Buffer*>::iterator it = dicts.find(dictid);
+   if (it != dicts.end()) {
+      dict = (*it).second;
+      metricAdd(METRIC_DICT_HITS);
+   }
+   else {
+      metricAdd(METRIC_DICT_MISSES);
+      static const int plens[1] = {4};
+      static const int pformats[1] = {1};
+      int tdictid = htonl(dictid);
+      const char * const parms[1] = {(char*)&tdictid};
+
+      PGresult *rset = execPrepared(DB_GET_DICTIONARY, &gd_sem, 1, parms, plens, pformats);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+         fprintf(stderr, "getDictionary: %s\n", PQerrorMessage(dbConn));
+      }
+      else {
+         dict = new Buffer(PQgetvalue(rset, 0, 0), PQgetlength(rset, 0, 0));
+         dicts[dictid] = dict;
+      }
+      PQclear(rset);
+   }
+   sem_post(&dict_sem);
+   return dict;
+}
+
+/**
+ * projectDictionary finds the dictionary used to compress new updates for a
+ * project, the most recent dictionary trained for the project itself is
+ * preferred over the most recent global dictionary
+ * @param pid the local project id
+ * @return the dictionary id, or 0 if no dictionary has been trained
+ */
+int DatabaseConnectionManager::projectDictionary(int pid) {
+   int dictid = 0;
+   sem_wait(&dict_sem);
+   map<int,int>::iterator it = projectDicts.find(pid);
+   if (it != projectDicts.end()) {
+      dictid = (*it).second;
+   }
+   else {
+      static const int plens[1] = {4};
+      static const int pformats[1] = {1};
+      int tpid = htonl(pid);
+      const char * const parms[1] = {(char*)&tpid};
+
+      PGresult *rset = execPrepared(DB_FIND_DICTIONARY, &fd_sem, 1, parms, plens, pformats);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+         fprintf(stderr, "findDictionary: %s\n", PQerrorMessage(dbConn));
+      }
+      else {
+         if (PQntuples(rset) == 1) {
+            dictid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
+         }
+         projectDicts[pid] = dictid;
+      }
+      PQclear(rset);
+   }
+   sem_post(&dict_sem);
+   return dictid;
+}
+
+/**
+ * packUpdate compresses an update for storage in the updates table
+ * @param pid the local project id the update belongs to
+ * @param data the update as it is sent to clients
+ * @param out the buffer that receives the compressed update
+ * @param dictid receives the id of the dictionary used
+ * @return true if out should be stored, false to store the update as is
+ */
+bool DatabaseConnectionManager::packUpdate(int pid, const uint8_t *data, int dlen, Buffer &out, int &dictid) {
+   if (storeLevel <= 0 || dlen < storeMinimum) {
+      return false;
+   }
+   dictid = projectDictionary(pid);
+   Buffer *dict = getDictionary(dictid);
+   if (dict == NULL) {
+      dictid = 0;
+   }
+   return compressPayload(data, dlen, dict, storeLevel, out);
+}
+
+/**
+ * unpackUpdate restores an update compressed by packUpdate
+ * @param data the update as stored
+ * @param dictid the dictionary id stored alongside the update
+ * @param out the buffer that receives the update
+ * @return false if the update can't be restored
+ */
+bool DatabaseConnectionManager::unpackUpdate(const uint8_t *data, int dlen, int dictid, Buffer &out) {
+   Buffer *dict = NULL;
+   if (dictid != 0) {
+      dict = getDictionary(dictid);
+      if (dict == NULL) {
+         return false;
+      }
+   }
+   return decompressPayload(data, dlen, dict, out);
 }
 
 /**
@@ -246,14 +522,7 @@ int DatabaseConnectionManager::authenticate(Client *c, const char *user, const u
    //insert into files values(stream_id, fname);
    const char * const parms[1] = {user};
 
-   sem_wait(&gui_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "getUserInfo",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&gui_sem);
+   PGresult *rset = execPrepared(DB_GET_USER_INFO, &gui_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
@@ -304,22 +573,31 @@ void DatabaseConnectionManager::migrateUpdate(int newowner, int pid, int cmd, co
    logln("in migrateUpdate", LINFO4);
    uint64_t updateid = 0;
 
-   const int plens[4] = {4, 4, 4, dlen};
-   static const int pformats[4] = {1, 1, 1, 1};
+   Buffer packed;
+   int dictid = 0;
+   bool isPacked = packUpdate(pid, data, dlen, packed, dictid);
+   const char *stored = isPacked ? (const char*)packed.get_buf() : (const char*)data;
+
+   uint64_t ea;
+   bool hasEa = updateAddress(data, dlen, &ea);
+   Buffer key;
+   bool hasKey = updateKey(data, dlen, key);
+   int hpid = pid;
+
+   const int plens[7] = {4, 4, 4, isPacked ? packed.size() : dlen, 4, 8, key.size()};
+   static const int pformats[7] = {1, 1, 1, 1, 1, 1, 1};
 
    newowner = htonl(newowner);
    pid = htonl(pid);
    cmd = htonl(cmd);
-   const char * const parms[4] = {(char*)&newowner, (char*)&pid, (char*)&cmd, (char*)data};
-
-   sem_wait(&pu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                       4, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&pu_sem);
+   dictid = htonl(dictid);
+   ea = htonll(ea);
+   //a NULL dictid marks an update that is stored uncompressed
+   const char * const parms[7] = {(char*)&newowner, (char*)&pid, (char*)&cmd, stored, 
+                                  isPacked ? (char*)&dictid : NULL, hasEa ? (char*)&ea : NULL,
+                                  hasKey ? (char*)key.get_buf() : NULL};
+
+   PGresult *rset = execPrepared(DB_POST_UPDATE, &pu_sem, 7, parms, plens, pformats);
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
       fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
@@ -328,9 +606,36 @@ void DatabaseConnectionManager::migrateUpdate(int newowner, int pid, int cmd, co
       updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
 //      logln("migrated update: " + updateid + "cmd: " + cmd + "pid: " + pid + " size: " + dlen, LINFO4);
    }
+   if (maint && updateid) {
+      maint->touch(hpid, updateid);
+   }
    PQclear(rset);
 }
 
+/**
+ * migrateUpdates stores a block of migrated updates with a single COPY
+ * @param newowner the new uid to attribute the updates to
+ * @param pid the local project id for the migrated project
+ * @param first the position of the block's first update in the export
+ * @param block the updates, laid out as for nextMigrateRecord
+ * @param len the length of the block
+ * @param count the number of updates in the block
+ * @return the number of updates of the export stored so far, -1 on error
+ */
+int64_t DatabaseConnectionManager::migrateUpdates(int newowner, int pid, int64_t first, const uint8_t *block, int len, int count) {
+   return loader ? loader->load(newowner, pid, first, block, len, count) : -1;
+}
+
+/**
+ * migratedUpdates is used to resume an interrupted import
+ * @param pid the local project id for the migrated project
+ * @return the number of updates of the export stored so far, -1 if
+ * there is no such project
+ */
+int64_t DatabaseConnectionManager::migratedUpdates(int pid) {
+   return loader ? loader->migrated(pid) : -1;
+}
+
 /**
  * post both queues a newly received update to be sent to other clients and (if in DB mode)
  * archives the udpate in the database so that future clients can receive it 
@@ -343,23 +648,33 @@ void DatabaseConnectionManager::migrateUpdate(int newowner, int pid, int cmd, co
 void DatabaseConnectionManager::post(Client *src, int cmd, uint8_t *data, int dlen) {
    uint64_t updateid = 0;
    //db insert
-   const int plens[4] = {4, 4, 4, dlen};
-   static const int pformats[4] = {1, 1, 1, 1};
+   Buffer packed;
+   int dictid = 0;
+   bool isPacked = packUpdate(src->getPid(), data, dlen, packed, dictid);
+   const char *stored = isPacked ? (const char*)packed.get_buf() : (const char*)data;
+
+   //updates not tied to an address get a NULL ea
+   uint64_t ea;
+   bool hasEa = updateAddress(data, dlen, &ea);
+   //and updates that are never superseded get a NULL supkey
+   Buffer key;
+   bool hasKey = updateKey(data, dlen, key);
+
+   const int plens[7] = {4, 4, 4, isPacked ? packed.size() : dlen, 4, 8, key.size()};
+   static const int pformats[7] = {1, 1, 1, 1, 1, 1, 1};
 
    int uid = htonl(src->getUid());
    int pid = htonl(src->getPid());
    cmd = htonl(cmd);
+   dictid = htonl(dictid);
+   ea = htonll(ea);
    
-   const char * const parms[4] = {(char*)&uid, (char*)&pid, (char*)&cmd, (char*)data};
+   //a NULL dictid marks an update that is stored uncompressed
+   const char * const parms[7] = {(char*)&uid, (char*)&pid, (char*)&cmd, stored, 
+                                  isPacked ? (char*)&dictid : NULL, hasEa ? (char*)&ea : NULL,
+                                  hasKey ? (char*)key.get_buf() : NULL};
 
-   sem_wait(&pu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                       4, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&pu_sem);
+   PGresult *rset = execPrepared(DB_POST_UPDATE, &pu_sem, 7, parms, plens, pformats);
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
       fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
@@ -370,11 +685,64 @@ void DatabaseConnectionManager::post(Client *src, int cmd, uint8_t *data, int dl
 //      fprintf(stderr, "Added update: %lld\n", updateid);
 //      fprintf(stderr, "Added update: %lld, cmd: %d, pid: %d, size: %d\n", updateid, cmd, pid, dlen);
 //      logln("Added update: " + updateid + ", cmd: " + cmd + ", pid: " + pid + ", size: " + data.length, LINFO4);
-      queue.push_back(new Packet(src, data, dlen, updateid));   //add a new packet with the binary data to the queue
+      enqueue(new Packet(src, data, dlen, updateid));   //add a new packet with the binary data to the queue
+      if (maint) {
+         maint->touch(src->getPid(), updateid);
+      }
    }
    PQclear(rset);
+}
+
+/**
+ * subscribedCommands lists every update command allowed by a set of subscribe
+ * permissions as a postgres int4[] literal
+ * @param sub the effective subscribe permissions of a client
+ * @return the array literal, "{}" if nothing is subscribed
+ */
+static string subscribedCommands(uint64_t sub) {
+   string cmds = "{";
+   char buf[16];
+   for (uint32_t cmd = 0; cmd < MSG_CONTROL_FIRST; cmd++) {
+      if (sub & Client::commandMask(cmd)) {
+         snprintf(buf, sizeof(buf), cmds.length() > 1 ? ",%u" : "%u", cmd);
+         cmds += buf;
+      }
+   }
+   return cmds + "}";
+}
 
-   sem_post(&queueSem);  //notify is the compliment to wait
+/**
+ * rangeArrays converts address ranges into postgres int8[] literals of the
+ * first and last address in each range.  Addresses are stored in a signed
+ * bigint, so a range that crosses 0x8000000000000000 is split in two
+ * @param ranges sorted, non overlapping ranges
+ * @param firsts receives the first address of each range
+ * @param lasts receives the last address of each range
+ */
+static void rangeArrays(const vector<AddressRange> &ranges, string &firsts, string &lasts) {
+   static const uint64_t signBit = 0x8000000000000000ULL;
+   char buf[32];
+   firsts = "{";
+   lasts = "{";
+   for (vector<AddressRange>::const_iterator i = ranges.begin(); i != ranges.end(); i++) {
+      uint64_t first = (*i).first;
+      uint64_t last = (*i).second - 1;
+      const char *sep = firsts.length() > 1 ? "," : "";
+      if (first < signBit && last >= signBit) {
+         snprintf(buf, sizeof(buf), "%s%lld", sep, (long long)first);
+         firsts += buf;
+         snprintf(buf, sizeof(buf), "%s%lld", sep, (long long)(signBit - 1));
+         lasts += buf;
+         first = signBit;
+         sep = ",";
+      }
+      snprintf(buf, sizeof(buf), "%s%lld", sep, (long long)first);
+      firsts += buf;
+      snprintf(buf, sizeof(buf), "%s%lld", sep, (long long)last);
+      lasts += buf;
+   }
+   firsts += "}";
+   lasts += "}";
 }
 
 /**
@@ -386,29 +754,46 @@ void DatabaseConnectionManager::post(Client *src, int cmd, uint8_t *data, int dl
  * @param lastUpdate the last update the client received 
  */
 void DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
-   static const int plens[2] = {8, 4};
-   static const int pformats[2] = {1, 1};
+   static const int plens[5] = {8, 4, 0, 0, 0};
+   static const int pformats[5] = {1, 1, 0, 0, 0};
+
+   //let the database skip the updates the client isn't subscribed to
+   string cmds = subscribedCommands(c->getSub());
+   if (cmds == "{}") {
+      return;
+   }
+
+   vector<AddressRange> ranges;
+   string firsts;
+   string lasts;
+   c->getAddressRanges(ranges);
+   rangeArrays(ranges, firsts, lasts);
 
    int pid = htonl(c->getPid());
    
    lastUpdate = ntohll(lastUpdate);
    //need to reverse lastUpdate here as well?   
-   const char * const parms[2] = {(char*)&lastUpdate, (char*)&pid};
+   const char * const parms[5] = {(char*)&lastUpdate, (char*)&pid, cmds.c_str(), firsts.c_str(), lasts.c_str()};
 
-   sem_wait(&glu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "getLatestUpdates",
-                       2, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&glu_sem);
+   struct timeval start, end;
+   gettimeofday(&start, NULL);
+
+   PGresult *rset;
+   if (ranges.empty()) {
+      rset = execPrepared(DB_GET_LATEST_UPDATES, &glu_sem, 3, parms, plens, pformats);
+   }
+   else {
+      rset = execPrepared(DB_GET_LATEST_UPDATES_RANGES, &glur_sem, 5, parms, plens, pformats);
+   }
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
       fprintf(stderr, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
    }
    else {
       int rows = PQntuples(rset);
+      Buffer update;  //reused to inflate compressed updates
+      int sent = 0;
+      uint64_t bytes = 0;
       for (int i = 0; i < rows; i++) {
          //need to reverse updateid here?? no, just copy it in network byte order into the data array
          uint64_t updateid = *(uint64_t*)PQgetvalue(rset, i, 0);
@@ -416,16 +801,46 @@ void DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate
          uint8_t *data = (uint8_t*)PQgetvalue(rset, i, 2);
          int dlen = PQgetlength(rset, i, 2);
 
+         if (!PQgetisnull(rset, i, 3)) {
+            update.reset();
+            if (!unpackUpdate(data, dlen, ntohl(*(int*)PQgetvalue(rset, i, 3)), update) || update.size() < 16) {
+               fprintf(stderr, "getLatestUpdates: unable to decompress update %llu\n", (unsigned long long)ntohll(updateid));
+               continue;
+            }
+            data = update.get_buf();
+            dlen = update.size();
+         }
+
 //         fprintf(stderr, "posting %lld (cmd %d)\n", ntohll(updateid), cmd);
 //         logln("posting " + updateid + " (cmd " + cmd + ")");
          memcpy(data + 8, &updateid, 8);
-         c->post(data, dlen);
+         c->postBulk(data, dlen);
+         sent++;
+         bytes += dlen;
       }
+      c->flushBulk();
+      //so the effect of compaction on join time can be measured
+      gettimeofday(&end, NULL);
+      char buf[128];
+      snprintf(buf, sizeof(buf), "catch up for project %d: %d updates, %llu bytes, %ld ms",
+               c->getPid(), sent, (unsigned long long)bytes,
+               (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+      logln(buf, LINFO1);
    }
    PQclear(rset);
 
 }
 
+/**
+ * archiveProjects moves idle projects out to archive files, they are
+ * restored the next time somebody joins them
+ * @param days the number of days a project must have been idle
+ * @return the number of projects archived, -1 on error
+ */
+int DatabaseConnectionManager::archiveProjects(int days) {
+   return archiver ? archiver->archiveIdle(days) : -1;
+}
+
 /**
  * getProjectInfo gets informatio related to a local project
  * @param pid the local pid of a project to get info on
@@ -440,14 +855,7 @@ ProjectInfo *DatabaseConnectionManager::getProjectInfo(int pid) {
    pid = htonl(pid);
    const char * const parms[1] = {(char*)&pid};
 
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECT_BY_PID, &fpbp_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
@@ -500,14 +908,7 @@ vector<ProjectInfo*> *DatabaseConnectionManager::getProjectList(const string &ph
 
    const char * const parms[1] = {phash.c_str()};
 
-   sem_wait(&fpbh_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectsByHash",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbh_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECTS_BY_HASH, &fpbh_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
@@ -573,14 +974,7 @@ int DatabaseConnectionManager::joinProject(Client *c, int lpid) {
 #ifdef DEBUG
    fprintf(stderr, "trying to join project %d\n", lpid);
 #endif
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECT_BY_PID, &fpbp_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
@@ -642,7 +1036,19 @@ int DatabaseConnectionManager::joinProject(Client *c, int lpid) {
    PQclear(rset);
 
    if (foundPid) {
+      //pick up any dictionary trained since the project was last used
+      sem_wait(&dict_sem);
+      projectDicts.erase(lpid);
+      sem_post(&dict_sem);
+      //the client is added first so the project can't be archived again
+      //between being restored and the client catching up
       projects.addClient(c);
+      if (archiver && !archiver->restore(lpid)) {
+         projects.removeClient(c);
+         c->send_error("unable to restore this project from its archive");
+         logln("unable to restore an archived project", LERROR);
+         return -1;
+      }
       rval = 0;
    }
    else {
@@ -685,14 +1091,7 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
       const char * const parms[6] = {c->getHash().c_str(), gpid.c_str(),
                                      desc.c_str(), (char*)&uid, (char*)&lastupdateid, (char*)&proto};
    
-      sem_wait(&aps_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProjectSnap",
-                          6, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&aps_sem);
+      PGresult *rset = execPrepared(DB_ADD_PROJECT_SNAP, &aps_sem, 6, parms, plens, pformats);
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -711,14 +1110,7 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
 
    const char * const parms[2] = {(char*)&spid, (char*)&oldpid};
 
-   sem_wait(&apf_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                       2, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&apf_sem);
+   PGresult *rset = execPrepared(DB_ADD_PROJECT_FORK, &apf_sem, 2, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -756,14 +1148,7 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
    int pid = htonl(c->getPid());
    const char * const parms[1] = {(char*)&pid};
 
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECT_BY_PID, &fpbp_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
@@ -809,14 +1194,7 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
       int tlpid = htonl(lpid);
       const char * const parms[2] = {(char*)&tlpid, (char*)&told};
    
-      sem_wait(&apf_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                          2, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&apf_sem);
+      PGresult *rset = execPrepared(DB_ADD_PROJECT_FORK, &apf_sem, 2, parms, plens, pformats);
    
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -835,14 +1213,7 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
       uint64_t last = ntohll(lastupdateid);
       const char * const parms2[3] = {(char*)&told, (char*)&last, (char*)&tlpid};
    
-      sem_wait(&cu_sem);
-      rset = PQexecPrepared(dbConn, "copyUpdates",
-                          3, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&cu_sem);
+      rset = execPrepared(DB_COPY_UPDATES, &cu_sem, 3, parms, plens, pformats);
    
       qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -929,14 +1300,7 @@ int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string
 
    const char * const parms[1] = {(char*)&oldlpid};
 
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECT_BY_PID, &fpbp_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
@@ -950,6 +1314,11 @@ int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string
    }
    PQclear(rset);
    
+   //the updates to copy may have been archived along with the parent
+   if (parentlpid >= 0 && archiver && !archiver->restore(parentlpid)) {
+      logln("unable to restore the parent of a snapshot", LERROR);
+      return -1;
+   }
    if (lastupdateid >= 0 && parentlpid >= 0 ) {
       int lpid = addProject(c, c->getHash(), desc, pub, sub);  
       if (lpid >= 0) {
@@ -962,14 +1331,7 @@ int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string
          int tlpid = htonl(lpid);
          const char * const parms[2] = {(char*)&tlpid, (char*)&oldlpid};
       
-         sem_wait(&apf_sem);
-         PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                             2, //int nParams,   size of arrays that follow
-                             parms, //parms,  //const char * const *paramValues, array of string values
-                             plens, //const int *paramLengths,
-                             pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         sem_post(&apf_sem);
+         PGresult *rset = execPrepared(DB_ADD_PROJECT_FORK, &apf_sem, 2, parms, plens, pformats);
       
          ExecStatusType qres = PQresultStatus(rset);
          if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -989,14 +1351,7 @@ int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string
          lastupdateid = ntohll(lastupdateid);
          const char * const parms2[3] = {(char*)&parentlpid, (char*)&lastupdateid, (char*)&tlpid};
       
-         sem_wait(&cu_sem);
-         rset = PQexecPrepared(dbConn, "copyUpdates",
-                             3, //int nParams,   size of arrays that follow
-                             parms, //parms,  //const char * const *paramValues, array of string values
-                             plens, //const int *paramLengths,
-                             pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         sem_post(&cu_sem);
+         rset = execPrepared(DB_COPY_UPDATES, &cu_sem, 3, parms, plens, pformats);
       
          qres = PQresultStatus(rset);
          if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -1045,14 +1400,7 @@ int DatabaseConnectionManager::migrateProject(int owner, const string &gpid, con
                                   desc.c_str(), (char*)&owner, (char*)&pub, (char*)&sub, (char*)&proto};
    pub = ntohll(pub);
    sub = ntohll(sub);
-   sem_wait(&ap_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "addProject",
-                       7, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&ap_sem);
+   PGresult *rset = execPrepared(DB_ADD_PROJECT, &ap_sem, 7, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -1105,14 +1453,7 @@ int DatabaseConnectionManager::addProject(Client *c, const string &hash, const s
       const char * const parms[7] = {hash.c_str(), gpid.c_str(),
                                      desc.c_str(), (char*)&uid, (char*)&pub, (char*)&sub, (char*)&proto};
    
-      sem_wait(&ap_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProject",
-                          7, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&ap_sem);
+      PGresult *rset = execPrepared(DB_ADD_PROJECT, &ap_sem, 7, parms, plens, pformats);
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -1180,14 +1521,7 @@ void DatabaseConnectionManager::updateProjectPerms(Client *c, uint64_t pub, uint
    const char * const parms[3] = {(char*)&tpub, (char*)&tsub, (char*)&pid};
 
 //   logln("Setting project " + pid + " permissions to p " + pub + " s " + sub, LINFO2);
-   sem_wait(&ppu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "projectPermsUpdate",
-                       3, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&ppu_sem);
+   PGresult *rset = execPrepared(DB_PROJECT_PERMS_UPDATE, &ppu_sem, 3, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_COMMAND_OK) {
@@ -1216,14 +1550,7 @@ int DatabaseConnectionManager::gpid2lpid(const string &gpid) {
 
    const char * const parms[1] = {gpid.c_str()};
 
-   sem_wait(&fpbg_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByGpid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbg_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECT_BY_GPID, &fpbg_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -1253,14 +1580,7 @@ string DatabaseConnectionManager::lpid2gpid(int lpid) {
    lpid = htonl(lpid);
    const char * const parms[1] = {(char*)&lpid};
 
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   PGresult *rset = execPrepared(DB_FIND_PROJECT_BY_PID, &fpbp_sem, 1, parms, plens, pformats);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
@@ -26,12 +26,24 @@
 #include <libpq-fe.h>
 #include <semaphore.h>
 
+#include "buffer.h"
 #include "cli_mgr.h"
 #include "client.h"
 #include "proj_info.h"
 
 using namespace std;
 
+class Maintenance;
+class Archiver;
+class BulkLoader;
+
+/**
+ * connectDatabase opens a connection to the database named in the config
+ * @param p the server configuration
+ * @return the connection, or NULL if the connection failed
+ */
+PGconn *connectDatabase(map<string,string> *p);
+
 class DatabaseConnectionManager : public ConnectionManagerBase {
 public:
    DatabaseConnectionManager(map<string,string> *p);
@@ -39,6 +51,8 @@ public:
    
    int authenticate(Client *c, const char *user, const uint8_t *challenge, uint32_t clen, const uint8_t *response, uint32_t rlen);
    void migrateUpdate(int newowner, int pid, int cmd, const uint8_t *data, int dlen);
+   int64_t migrateUpdates(int newowner, int pid, int64_t first, const uint8_t *block, int len, int count);
+   int64_t migratedUpdates(int pid);
    void post(Client *src, int cmd, uint8_t *data, int dlen);
    void sendLatestUpdates(Client *c, uint64_t lastUpdate);
    ProjectInfo *getProjectInfo(int pid);
@@ -55,9 +69,16 @@ public:
    void updateProjectPerms(Client *c, uint64_t pub, uint64_t sub);
    int gpid2lpid(const string &gpid);
    string lpid2gpid(int lpid);
+   int archiveProjects(int days);
+   bool unpackUpdate(const uint8_t *data, int dlen, int dictid, Buffer &out);
+   bool packUpdate(int pid, const uint8_t *data, int dlen, Buffer &out, int &dictid);
 
 private:
    void init_queries();
+   Buffer *getDictionary(int dictid);
+   int projectDictionary(int pid);
+   PGresult *execPrepared(int stmt, sem_t *sem, int nParams, const char * const *parms,
+                          const int *plens, const int *pformats);
    
    sem_t pu_sem;
    sem_t ap_sem;
@@ -68,8 +89,28 @@ private:
    sem_t fpbg_sem;
    sem_t gui_sem;
    sem_t glu_sem;
+   sem_t glur_sem;
    sem_t cu_sem;
    sem_t ppu_sem;
+   sem_t gd_sem;
+   sem_t fd_sem;
+
+   //compression of stored updates
+   int storeLevel;
+   int storeMinimum;
+
+   //statements slower than this, in nanoseconds, are logged, 0 logs none
+   uint64_t slowNs;
+
+   //background compaction of superseded updates
+   Maintenance *maint;
+   //idle projects moved out of the updates table
+   Archiver *archiver;
+   //imports stored with COPY
+   BulkLoader *loader;
+   map<int,Buffer*> dicts;     //dictid -> preset dictionary
+   map<int,int> projectDicts;  //pid -> dictid used for new updates
+   sem_t dict_sem;
 
    PGconn *dbConn;
 };
@@ -0,0 +1,472 @@
+/*
+   collabREate export_chunked.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "export_chunked.h"
+
+using namespace std;
+
+//sig, version, gpid, hash, sub and pub precede the description
+#define EXPORT_FIXED_HEADER (8 + 4 + GPID_SIZE + MD5_SIZE + 8 + 8)
+
+//TAG, updateid, uid, pid, cmd and datalen precede the data of an update
+#define EXPORT_RECORD_HEADER (4 + 8 + 4 + 4 + 4 + 4)
+
+static uint32_t getInt(const uint8_t *p) {
+   uint32_t val;
+   memcpy(&val, p, sizeof(val));
+   return ntohl(val);
+}
+
+static uint64_t getLong(const uint8_t *p) {
+   return ((uint64_t)getInt(p) << 32) | getInt(p + 4);
+}
+
+static bool preadFully(int fd, void *buf, uint32_t len, uint64_t offset) {
+   uint8_t *p = (uint8_t*)buf;
+   while (len > 0) {
+      ssize_t n = pread(fd, p, len, offset);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      p += n;
+      len -= n;
+      offset += n;
+   }
+   return true;
+}
+
+/**
+ * nextExportRecord steps through the records of an export
+ * @param p the next record, advanced past it on return
+ * @param end the end of the records
+ * @param r receives the record
+ * @return false once the records are exhausted or a record is malformed
+ */
+bool nextExportRecord(const uint8_t *&p, const uint8_t *end, ExportRecord &r) {
+   if (end - p < EXPORT_RECORD_HEADER || getInt(p) != TAG) {
+      return false;
+   }
+   r.stored = getLong(p + 4);
+   r.updateid = ntohll(r.stored);
+   r.uid = getInt(p + 12);
+   r.pid = getInt(p + 16);
+   r.cmd = getInt(p + 20);
+   r.dlen = getInt(p + 24);
+   if (r.dlen < 0 || end - p - EXPORT_RECORD_HEADER < r.dlen) {
+      return false;
+   }
+   r.data = p + EXPORT_RECORD_HEADER;
+   p = r.data + r.dlen;
+   return true;
+}
+
+ChunkedExportWriter::ChunkedExportWriter(int level) {
+   f = NULL;
+   this->level = level;
+   ok = false;
+   pos = 0;
+   total = 0;
+   memset(&cur, 0, sizeof(cur));
+}
+
+ChunkedExportWriter::~ChunkedExportWriter() {
+   if (f != NULL) {
+      fclose(f);
+   }
+}
+
+bool ChunkedExportWriter::put(const void *data, uint32_t len) {
+   if (ok && len > 0) {
+      ok = fwrite(data, len, 1, f) == 1;
+      pos += len;
+   }
+   return ok;
+}
+
+/**
+ * open creates the export and writes its header
+ * @param efile the name of the export
+ * @param header the export header, with FILE_VER_CHUNKED as the version
+ * @return false on failure
+ */
+bool ChunkedExportWriter::open(const char *efile, const Buffer &header) {
+   f = fopen(efile, "wb");
+   if (f == NULL) {
+      fprintf(stderr, "unable to create %s: %s\n", efile, strerror(errno));
+      return false;
+   }
+   ok = true;
+   return put(header.get_buf(), header.size());
+}
+
+/**
+ * add adds an update to the current chunk
+ * @param stored the updateid as it is stored in an export
+ * @return false on failure
+ */
+bool ChunkedExportWriter::add(uint64_t stored, int uid, int pid, int cmd, const uint8_t *data, int dlen) {
+   uint64_t updateid = ntohll(stored);
+   if (cur.count == 0) {
+      cur.first = updateid;
+   }
+   cur.last = updateid;
+   cur.count++;
+   raw.writeInt(TAG);
+   raw.writeLong(stored);
+   raw.writeInt(uid);
+   raw.writeInt(pid);
+   raw.writeInt(cmd);
+   raw.writeInt(dlen);
+   raw.write(data, dlen);
+   total++;
+   if (cur.count >= EXPORT_CHUNK_UPDATES || raw.size() >= EXPORT_CHUNK_BYTES) {
+      return flushChunk();
+   }
+   return ok;
+}
+
+bool ChunkedExportWriter::flushChunk() {
+   if (!ok || cur.count == 0) {
+      return ok;
+   }
+   uLongf clen = compressBound(raw.size());
+   if (comp.size() < clen) {
+      comp.resize(clen);
+   }
+   if (compress2(&comp[0], &clen, raw.get_buf(), raw.size(), level) != Z_OK) {
+      return ok = false;
+   }
+   cur.offset = pos;
+   cur.rawLen = raw.size();
+   cur.compLen = clen;
+   cur.crc = crc32(0, raw.get_buf(), raw.size());
+   raw.reset();
+   return copyChunk(cur, &comp[0]);
+}
+
+/**
+ * copyChunk copies a chunk of another export as it is
+ * @param c the index entry of the chunk
+ * @param comp the compressed records of the chunk
+ * @return false on failure
+ */
+bool ChunkedExportWriter::copyChunk(const ExportChunk &c, const uint8_t *comp) {
+   if (&c != &cur && cur.count > 0 && !flushChunk()) {
+      return false;
+   }
+   ExportChunk e = c;
+   e.offset = pos;
+   Buffer hdr;
+   hdr.writeInt(CHUNK_TAG);
+   hdr.writeInt(e.count);
+   hdr.writeInt(e.rawLen);
+   hdr.writeInt(e.compLen);
+   hdr.writeInt(e.crc);
+   put(hdr.get_buf(), hdr.size());
+   put(comp, e.compLen);
+   if (&c == &cur) {
+      memset(&cur, 0, sizeof(cur));
+   }
+   else {
+      total += e.count;
+   }
+   chunks.push_back(e);
+   return ok;
+}
+
+/**
+ * close writes the last chunk, the index and the trailer
+ * @return false if anything went wrong since open
+ */
+bool ChunkedExportWriter::close() {
+   if (f == NULL) {
+      return false;
+   }
+   flushChunk();
+   Buffer index;
+   index.writeInt(ENDTAG);
+   uint64_t indexOffset = pos + index.size();
+   for (size_t i = 0; i < chunks.size(); i++) {
+      ExportChunk &c = chunks[i];
+      index.writeLong(c.first);
+      index.writeLong(c.last);
+      index.writeLong(c.offset);
+      index.writeInt(c.count);
+      index.writeInt(c.rawLen);
+      index.writeInt(c.compLen);
+      index.writeInt(c.crc);
+   }
+   uint32_t crc = crc32(0, index.get_buf() + 4, index.size() - 4);
+   index.writeLong(indexOffset);
+   index.writeInt(chunks.size());
+   index.writeInt(crc);
+   index.write(EXPORT_TRAILER_MAGIC, 8);
+   put(index.get_buf(), index.size());
+   if (fclose(f) != 0) {
+      ok = false;
+   }
+   f = NULL;
+   return ok;
+}
+
+ChunkedExportReader::ChunkedExportReader() {
+   fd = -1;
+   total = 0;
+   subPerms = 0;
+   pubPerms = 0;
+}
+
+ChunkedExportReader::~ChunkedExportReader() {
+   close();
+}
+
+void ChunkedExportReader::close() {
+   if (fd >= 0) {
+      ::close(fd);
+   }
+   fd = -1;
+   total = 0;
+   chunks.clear();
+   hdr.reset();
+}
+
+/**
+ * open reads the header, trailer and index of an export
+ * @param efile the name of the export
+ * @return false if it isn't a usable version 2 export
+ */
+bool ChunkedExportReader::open(const char *efile) {
+   close();
+   fd = ::open(efile, O_RDONLY);
+   if (fd < 0) {
+      fprintf(stderr, "unable to open %s: %s\n", efile, strerror(errno));
+      return false;
+   }
+   struct stat st;
+   fstat(fd, &st);
+   uint64_t size = st.st_size;
+   uint8_t fixed[EXPORT_FIXED_HEADER + 2];
+   uint8_t trailer[EXPORT_TRAILER];
+   if (size < sizeof(fixed) + 4 + EXPORT_TRAILER || !preadFully(fd, fixed, sizeof(fixed), 0) ||
+       memcmp(fixed, FILE_SIG, 8) != 0 || getInt(fixed + 8) != FILE_VER_CHUNKED ||
+       !preadFully(fd, trailer, sizeof(trailer), size - EXPORT_TRAILER) ||
+       memcmp(trailer + 16, EXPORT_TRAILER_MAGIC, 8) != 0) {
+      fprintf(stderr, "%s is not a chunked collabREate export\n", efile);
+      close();
+      return false;
+   }
+   uint32_t dlen = (fixed[sizeof(fixed) - 2] << 8) | fixed[sizeof(fixed) - 1];
+   uint64_t headerLen = sizeof(fixed) + dlen;
+   uint64_t indexOffset = getLong(trailer);
+   uint32_t count = getInt(trailer + 8);
+   uint64_t indexLen = (uint64_t)count * EXPORT_CHUNK_ENTRY;
+   if (headerLen + 4 > indexOffset || indexOffset + indexLen + EXPORT_TRAILER != size) {
+      fprintf(stderr, "%s has a damaged trailer\n", efile);
+      close();
+      return false;
+   }
+   hdr.write(fixed, sizeof(fixed));
+   vector<uint8_t> buf(dlen + indexLen + 1);
+   if (!preadFully(fd, &buf[0], dlen, sizeof(fixed)) || !preadFully(fd, &buf[dlen], indexLen, indexOffset) ||
+       crc32(0, &buf[dlen], indexLen) != getInt(trailer + 12)) {
+      fprintf(stderr, "%s has a damaged index\n", efile);
+      close();
+      return false;
+   }
+   hdr.write(&buf[0], dlen);
+   description.assign((char*)&buf[0], dlen);
+   subPerms = getLong(fixed + 12 + GPID_SIZE + MD5_SIZE);
+   pubPerms = getLong(fixed + 20 + GPID_SIZE + MD5_SIZE);
+
+   uint64_t next = headerLen;
+   for (uint32_t i = 0; i < count; i++) {
+      const uint8_t *e = &buf[dlen + i * EXPORT_CHUNK_ENTRY];
+      ExportChunk c;
+      c.first = getLong(e);
+      c.last = getLong(e + 8);
+      c.offset = getLong(e + 16);
+      c.count = getInt(e + 24);
+      c.rawLen = getInt(e + 28);
+      c.compLen = getInt(e + 32);
+      c.crc = getInt(e + 36);
+      //chunks are laid out back to back in updateid order
+      if (c.offset != next || c.count == 0 || c.first > c.last ||
+          (i > 0 && c.first <= chunks.back().last)) {
+         fprintf(stderr, "%s has a damaged index entry for chunk %u\n", efile, i);
+         close();
+         return false;
+      }
+      next = c.offset + EXPORT_CHUNK_HEADER + c.compLen;
+      total += c.count;
+      chunks.push_back(c);
+   }
+   if (next + 4 != indexOffset) {
+      fprintf(stderr, "%s has a damaged index\n", efile);
+      close();
+      return false;
+   }
+   return true;
+}
+
+/**
+ * readCompressed reads a chunk without decompressing it
+ * @param i the chunk to read
+ * @param comp receives the compressed records of the chunk
+ * @return false if the chunk can't be read
+ */
+bool ChunkedExportReader::readCompressed(int i, Buffer &comp) {
+   const ExportChunk &c = chunks[i];
+   uint8_t h[EXPORT_CHUNK_HEADER];
+   if (!preadFully(fd, h, sizeof(h), c.offset) || getInt(h) != CHUNK_TAG || getInt(h + 4) != c.count ||
+       getInt(h + 8) != c.rawLen || getInt(h + 12) != c.compLen || getInt(h + 16) != c.crc) {
+      return false;
+   }
+   comp.reset();
+   vector<uint8_t> buf(c.compLen + 1);
+   if (!preadFully(fd, &buf[0], c.compLen, c.offset + EXPORT_CHUNK_HEADER)) {
+      return false;
+   }
+   return comp.write(&buf[0], c.compLen);
+}
+
+/**
+ * readChunk decompresses a chunk and checks it against its crc
+ * @param i the chunk to read
+ * @param raw receives the records of the chunk
+ * @return false if the chunk can't be read or is corrupt
+ */
+bool ChunkedExportReader::readChunk(int i, Buffer &raw) {
+   const ExportChunk &c = chunks[i];
+   Buffer comp;
+   if (!readCompressed(i, comp)) {
+      return false;
+   }
+   vector<uint8_t> buf(c.rawLen + 1);
+   uLongf rlen = c.rawLen;
+   if (uncompress(&buf[0], &rlen, comp.get_buf(), c.compLen) != Z_OK || rlen != c.rawLen ||
+       crc32(0, &buf[0], rlen) != c.crc) {
+      return false;
+   }
+   raw.reset();
+   return raw.write(&buf[0], rlen);
+}
+
+/**
+ * findChunk finds the first chunk holding updates after a given one
+ * @param after the updateid to look past
+ * @return the chunk, or numChunks() if no update comes after
+ */
+int ChunkedExportReader::findChunk(uint64_t after) {
+   int lo = 0;
+   int hi = chunks.size();
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (chunks[mid].last <= after) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+struct VerifyWork {
+   ChunkedExportReader *reader;
+   int start;
+   int step;
+   vector<int> bad;
+};
+
+static void *verifyChunks(void *arg) {
+   VerifyWork *w = (VerifyWork*)arg;
+   Buffer raw;
+   for (int i = w->start; i < w->reader->numChunks(); i += w->step) {
+      bool good = w->reader->readChunk(i, raw);
+      //the index has to agree with the records too
+      if (good) {
+         const uint8_t *p = raw.get_buf();
+         const uint8_t *end = p + raw.size();
+         ExportRecord r;
+         uint32_t n = 0;
+         uint64_t first = 0;
+         uint64_t last = 0;
+         while (nextExportRecord(p, end, r)) {
+            first = n++ ? first : r.updateid;
+            last = r.updateid;
+         }
+         const ExportChunk &c = w->reader->chunk(i);
+         good = p == end && n == c.count && first == c.first && last == c.last;
+      }
+      if (!good) {
+         w->bad.push_back(i);
+      }
+   }
+   return NULL;
+}
+
+/**
+ * verify reads and checks every chunk
+ * @param threads the number of threads to spread the work across
+ * @param bad receives the chunks that failed
+ * @return false if any chunk failed
+ */
+bool ChunkedExportReader::verify(int threads, vector<int> &bad) {
+   if (threads < 1) {
+      threads = 1;
+   }
+   vector<VerifyWork> work(threads);
+   vector<pthread_t> tids(threads);
+   for (int t = 0; t < threads; t++) {
+      work[t].reader = this;
+      work[t].start = t;
+      work[t].step = threads;
+      if (t > 0) {
+         pthread_create(&tids[t], NULL, verifyChunks, &work[t]);
+      }
+   }
+   verifyChunks(&work[0]);
+   for (int t = 0; t < threads; t++) {
+      if (t > 0) {
+         pthread_join(tids[t], NULL);
+      }
+      bad.insert(bad.end(), work[t].bad.begin(), work[t].bad.end());
+   }
+   sort(bad.begin(), bad.end());
+   return bad.empty();
+}
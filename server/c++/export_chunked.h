@@ -0,0 +1,227 @@
+/*
+   collabREate export_chunked.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __EXPORT_CHUNKED_H
+#define __EXPORT_CHUNKED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+#include "utils.h"
+
+using namespace std;
+
+/*
+ * A version 2 (FILE_VER_CHUNKED) export starts with the same header as a
+ * version 1 export.  The records that follow are the same too, but they
+ * are grouped into chunks that are compressed independently:
+ *
+ *    CHUNK_TAG, update count, raw length, compressed length, crc32 of
+ *    the raw records, then the compressed records
+ *
+ * The last chunk is followed by ENDTAG, then an index with one entry per
+ * chunk (first updateid, last updateid, offset, count, raw length,
+ * compressed length, crc32) and finally a fixed size trailer holding the
+ * offset of the index, the number of chunks, the crc32 of the index and
+ * EXPORT_TRAILER_MAGIC.  Everything is big endian.
+ */
+
+#define CHUNK_TAG 0xC0C4C0C4
+#define EXPORT_TRAILER_MAGIC "CRXCHUNK"
+
+//chunks are cut at whichever of these comes first
+#define EXPORT_CHUNK_UPDATES 4096
+#define EXPORT_CHUNK_BYTES 0x100000
+
+#define EXPORT_CHUNK_HEADER 20
+#define EXPORT_CHUNK_ENTRY 40
+#define EXPORT_TRAILER 24
+
+/**
+ * ExportChunk
+ * Where a chunk is and what it holds, as listed in the trailing index
+ */
+struct ExportChunk {
+   uint64_t first;
+   uint64_t last;
+   uint64_t offset;
+   uint32_t count;
+   uint32_t rawLen;
+   uint32_t compLen;
+   uint32_t crc;
+};
+
+/**
+ * ExportRecord
+ * A single update of an export, pointing into the buffer it was read from
+ */
+struct ExportRecord {
+   //the updateid, and the value it is stored as (see exportProject)
+   uint64_t updateid;
+   uint64_t stored;
+   int uid;
+   int pid;
+   int cmd;
+   const uint8_t *data;
+   int dlen;
+};
+
+/**
+ * nextExportRecord steps through the records of an export
+ * @param p the next record, advanced past it on return
+ * @param end the end of the records
+ * @param r receives the record
+ * @return false once the records are exhausted or a record is malformed
+ */
+bool nextExportRecord(const uint8_t *&p, const uint8_t *end, ExportRecord &r);
+
+/**
+ * ChunkedExportWriter
+ * Writes a version 2 export, one chunk at a time
+ */
+class ChunkedExportWriter {
+public:
+   ChunkedExportWriter(int level = 6);
+   ~ChunkedExportWriter();
+
+   /**
+    * open creates the export and writes its header
+    * @param efile the name of the export
+    * @param header the export header, with FILE_VER_CHUNKED as the version
+    * @return false on failure
+    */
+   bool open(const char *efile, const Buffer &header);
+
+   /**
+    * add adds an update to the current chunk
+    * @param stored the updateid as it is stored in an export
+    * @return false on failure
+    */
+   bool add(uint64_t stored, int uid, int pid, int cmd, const uint8_t *data, int dlen);
+
+   /**
+    * copyChunk copies a chunk of another export as it is
+    * @param c the index entry of the chunk
+    * @param comp the compressed records of the chunk
+    * @return false on failure
+    */
+   bool copyChunk(const ExportChunk &c, const uint8_t *comp);
+
+   /**
+    * close writes the last chunk, the index and the trailer
+    * @return false if anything went wrong since open
+    */
+   bool close();
+
+   /**
+    * updates inspector to get the number of updates written so far
+    */
+   uint64_t updates() {return total;};
+
+private:
+   bool flushChunk();
+   bool put(const void *data, uint32_t len);
+
+   FILE *f;
+   int level;
+   bool ok;
+   uint64_t pos;
+   uint64_t total;
+   Buffer raw;
+   vector<uint8_t> comp;
+   ExportChunk cur;
+   vector<ExportChunk> chunks;
+};
+
+/**
+ * ChunkedExportReader
+ * Random access to the chunks of a version 2 export.  Reading chunks is
+ * thread safe, so chunks can be decompressed and checked in parallel
+ */
+class ChunkedExportReader {
+public:
+   ChunkedExportReader();
+   ~ChunkedExportReader();
+
+   /**
+    * open reads the header, trailer and index of an export
+    * @param efile the name of the export
+    * @return false if it isn't a usable version 2 export
+    */
+   bool open(const char *efile);
+   void close();
+
+   /**
+    * readChunk decompresses a chunk and checks it against its crc
+    * @param i the chunk to read
+    * @param raw receives the records of the chunk
+    * @return false if the chunk can't be read or is corrupt
+    */
+   bool readChunk(int i, Buffer &raw);
+
+   /**
+    * readCompressed reads a chunk without decompressing it
+    * @param i the chunk to read
+    * @param comp receives the compressed records of the chunk
+    * @return false if the chunk can't be read
+    */
+   bool readCompressed(int i, Buffer &comp);
+
+   /**
+    * findChunk finds the first chunk holding updates after a given one
+    * @param after the updateid to look past
+    * @return the chunk, or numChunks() if no update comes after
+    */
+   int findChunk(uint64_t after);
+
+   /**
+    * verify reads and checks every chunk
+    * @param threads the number of threads to spread the work across
+    * @param bad receives the chunks that failed
+    * @return false if any chunk failed
+    */
+   bool verify(int threads, vector<int> &bad);
+
+   int numChunks() {return chunks.size();};
+   const ExportChunk &chunk(int i) {return chunks[i];};
+   uint64_t size() {return total;};
+
+   //the raw header, for writing an extract of the export
+   const Buffer &header() {return hdr;};
+   const uint8_t *gpid() {return hdr.get_buf() + 12;};
+   const uint8_t *hash() {return hdr.get_buf() + 12 + GPID_SIZE;};
+   uint64_t sub() {return subPerms;};
+   uint64_t pub() {return pubPerms;};
+   const string &desc() {return description;};
+
+private:
+   int fd;
+   uint64_t total;
+   uint64_t subPerms;
+   uint64_t pubPerms;
+   string description;
+   Buffer hdr;
+   vector<ExportChunk> chunks;
+};
+
+#endif
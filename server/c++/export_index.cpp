@@ -0,0 +1,325 @@
+/*
+   collabREate export_index.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "export_index.h"
+
+using namespace std;
+
+#define ENTRIES_PER_PAGE (EXPORT_INDEX_PAGE / sizeof(ExportIndexEntry))
+
+//sig, version, gpid, hash, sub and pub precede the description
+#define EXPORT_FIXED_HEADER (8 + 4 + GPID_SIZE + MD5_SIZE + 8 + 8)
+
+//TAG, updateid, uid, pid, cmd and datalen precede the data of an update
+#define EXPORT_RECORD_HEADER (4 + 8 + 4 + 4 + 4 + 4)
+
+static bool entryLess(const ExportIndexEntry &a, const ExportIndexEntry &b) {
+   return a.updateid < b.updateid;
+}
+
+static bool idLess(uint64_t id, const ExportIndexEntry &e) {
+   return id < e.updateid;
+}
+
+static bool entryBefore(const ExportIndexEntry &e, uint64_t id) {
+   return e.updateid < id;
+}
+
+static uint32_t getInt(const uint8_t *p) {
+   uint32_t val;
+   memcpy(&val, p, sizeof(val));
+   return ntohl(val);
+}
+
+static string indexName(const char *efile) {
+   return string(efile) + EXPORT_INDEX_SUFFIX;
+}
+
+/**
+ * add records the position of an update in the export
+ * @param updateid the id of the update
+ * @param offset the file offset of the update's TAG
+ */
+void ExportIndexWriter::add(uint64_t updateid, uint64_t offset) {
+   ExportIndexEntry e;
+   e.updateid = updateid;
+   e.offset = offset;
+   entries.push_back(e);
+}
+
+/**
+ * write writes the index for an export file
+ * @param efile the name of the export, the index is efile.idx
+ * @param end the file offset of the export's ENDTAG
+ * @param exportSize the size of the export
+ * @return false on failure
+ */
+bool ExportIndexWriter::write(const char *efile, uint64_t end, uint64_t exportSize) {
+   //exports come out of the database in updateid order, but nothing
+   //guarantees that of an archive somebody else wrote
+   stable_sort(entries.begin(), entries.end(), entryLess);
+
+   uint64_t count = entries.size();
+   uint64_t pages = (count + ENTRIES_PER_PAGE - 1) / ENTRIES_PER_PAGE;
+
+   uint8_t page[EXPORT_INDEX_PAGE];
+   memset(page, 0, sizeof(page));
+   ExportIndexHeader *hdr = (ExportIndexHeader*)page;
+   memcpy(hdr->magic, EXPORT_INDEX_MAGIC, sizeof(hdr->magic));
+   hdr->version = EXPORT_INDEX_VER;
+   hdr->perPage = ENTRIES_PER_PAGE;
+   hdr->count = count;
+   hdr->topCount = pages;
+   hdr->end = end;
+   hdr->exportSize = exportSize;
+
+   string name = indexName(efile);
+   string tmp = name + ".tmp";
+   FILE *f = fopen(tmp.c_str(), "wb");
+   if (f == NULL) {
+      fprintf(stderr, "ExportIndex: unable to create %s: %s\n", tmp.c_str(), strerror(errno));
+      return false;
+   }
+   bool ok = fwrite(page, sizeof(page), 1, f) == 1;
+   for (uint64_t p = 0; ok && p < pages; p++) {
+      uint64_t first = p * ENTRIES_PER_PAGE;
+      uint64_t n = min((uint64_t)ENTRIES_PER_PAGE, count - first);
+      memset(page, 0, sizeof(page));
+      memcpy(page, &entries[first], n * sizeof(ExportIndexEntry));
+      ok = fwrite(page, sizeof(page), 1, f) == 1;
+   }
+   //the top level, the first entry of each page
+   for (uint64_t p = 0; ok && p < pages; p++) {
+      ok = fwrite(&entries[p * ENTRIES_PER_PAGE], sizeof(ExportIndexEntry), 1, f) == 1;
+   }
+   if (fclose(f) != 0 || !ok || rename(tmp.c_str(), name.c_str()) == -1) {
+      fprintf(stderr, "ExportIndex: unable to write %s\n", name.c_str());
+      unlink(tmp.c_str());
+      return false;
+   }
+   return true;
+}
+
+ExportIndex::ExportIndex() {
+   fd = -1;
+   len = 0;
+   hdr = NULL;
+   entries = NULL;
+   top = NULL;
+}
+
+ExportIndex::~ExportIndex() {
+   close();
+}
+
+/**
+ * open maps the index of an export file
+ * @param efile the name of the export, not of its index
+ * @return false if there is no usable index for the export
+ */
+bool ExportIndex::open(const char *efile) {
+   close();
+   struct stat est;
+   if (stat(efile, &est) == -1) {
+      return false;
+   }
+   string name = indexName(efile);
+   fd = ::open(name.c_str(), O_RDONLY);
+   if (fd < 0) {
+      return false;
+   }
+   struct stat st;
+   fstat(fd, &st);
+   if ((uint64_t)st.st_size < EXPORT_INDEX_PAGE) {
+      close();
+      return false;
+   }
+   len = st.st_size;
+   void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "ExportIndex: unable to map %s: %s\n", name.c_str(), strerror(errno));
+      len = 0;
+      close();
+      return false;
+   }
+   //lookups jump around, don't let the kernel read ahead on our behalf
+   madvise(map, len, MADV_RANDOM);
+   hdr = (ExportIndexHeader*)map;
+   if (memcmp(hdr->magic, EXPORT_INDEX_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != EXPORT_INDEX_VER ||
+       hdr->perPage != ENTRIES_PER_PAGE ||
+       len != EXPORT_INDEX_PAGE * (1 + hdr->topCount) + hdr->topCount * sizeof(ExportIndexEntry) ||
+       hdr->count > hdr->topCount * ENTRIES_PER_PAGE) {
+      fprintf(stderr, "ExportIndex: %s is not a valid index\n", name.c_str());
+      close();
+      return false;
+   }
+   if (hdr->exportSize != (uint64_t)est.st_size) {
+      //the export has been rewritten since the index was built
+      close();
+      return false;
+   }
+   entries = (ExportIndexEntry*)((uint8_t*)map + EXPORT_INDEX_PAGE);
+   top = (ExportIndexEntry*)((uint8_t*)map + EXPORT_INDEX_PAGE * (1 + hdr->topCount));
+   return true;
+}
+
+void ExportIndex::close() {
+   if (hdr) {
+      munmap(hdr, len);
+   }
+   if (fd >= 0) {
+      ::close(fd);
+   }
+   fd = -1;
+   len = 0;
+   hdr = NULL;
+   entries = NULL;
+   top = NULL;
+}
+
+/**
+ * find locates the start of a range of updates
+ * @param first the first updateid of the range
+ * @return the file offset of the first update whose id is at least
+ * first, or the offset of the ENDTAG if there is no such update
+ */
+uint64_t ExportIndex::find(uint64_t first) {
+   if (hdr == NULL) {
+      return 0;
+   }
+   if (hdr->count == 0) {
+      return hdr->end;
+   }
+   //the last page that starts at or before first
+   ExportIndexEntry *t = upper_bound(top, top + hdr->topCount, first, idLess);
+   if (t == top) {
+      return top[0].offset;
+   }
+   uint64_t p = (t - top) - 1;
+   ExportIndexEntry *page = entries + p * ENTRIES_PER_PAGE;
+   uint64_t n = min((uint64_t)ENTRIES_PER_PAGE, hdr->count - p * ENTRIES_PER_PAGE);
+   ExportIndexEntry *e = lower_bound(page, page + n, first, entryBefore);
+   if (e != page + n) {
+      return e->offset;
+   }
+   //first falls after the end of this page, the answer starts the next one
+   return t != top + hdr->topCount ? t->offset : hdr->end;
+}
+
+/**
+ * firstUpdate inspector to get the smallest updateid in the export
+ * @return the updateid, 0 for an empty export
+ */
+uint64_t ExportIndex::firstUpdate() {
+   return hdr && hdr->count ? entries[0].updateid : 0;
+}
+
+/**
+ * lastUpdate inspector to get the largest updateid in the export
+ * @return the updateid, 0 for an empty export
+ */
+uint64_t ExportIndex::lastUpdate() {
+   return hdr && hdr->count ? entries[hdr->count - 1].updateid : 0;
+}
+
+/**
+ * build scans an existing export and writes its index, for exports
+ * made before indexes were written alongside them
+ * @param efile the name of the export
+ * @return false if the export could not be read
+ */
+bool ExportIndex::build(const char *efile) {
+   int efd = ::open(efile, O_RDONLY);
+   if (efd < 0) {
+      fprintf(stderr, "ExportIndex: unable to open %s: %s\n", efile, strerror(errno));
+      return false;
+   }
+   struct stat st;
+   fstat(efd, &st);
+   uint64_t size = st.st_size;
+   if (size < EXPORT_FIXED_HEADER + 2) {
+      fprintf(stderr, "ExportIndex: %s is too short to be an export\n", efile);
+      ::close(efd);
+      return false;
+   }
+   void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, efd, 0);
+   ::close(efd);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "ExportIndex: unable to map %s: %s\n", efile, strerror(errno));
+      return false;
+   }
+   madvise(map, size, MADV_SEQUENTIAL);
+   const uint8_t *data = (const uint8_t*)map;
+
+   if (data[0] == 0x1f && data[1] == 0x8b) {
+      //offsets into a gzip stream can't be seeked to
+      fprintf(stderr, "ExportIndex: %s is gzip compressed, only uncompressed exports can be indexed\n", efile);
+      munmap(map, size);
+      return false;
+   }
+   if (memcmp(data, FILE_SIG, 8) != 0 || getInt(data + 8) != FILE_VER) {
+      fprintf(stderr, "ExportIndex: %s doesn't appear to be a collabREate export\n", efile);
+      munmap(map, size);
+      return false;
+   }
+   uint64_t pos = EXPORT_FIXED_HEADER;
+   pos += 2 + ((data[pos] << 8) | data[pos + 1]);
+
+   ExportIndexWriter w;
+   bool ok = false;
+   while (pos + 4 <= size) {
+      uint32_t tag = getInt(data + pos);
+      if (tag == ENDTAG) {
+         ok = true;
+         break;
+      }
+      if (tag != TAG || pos + EXPORT_RECORD_HEADER > size) {
+         break;
+      }
+      //updateids are written exactly as they came out of the database
+      uint64_t updateid = ((uint64_t)getInt(data + pos + 4) << 32) | getInt(data + pos + 8);
+      uint32_t dlen = getInt(data + pos + 24);
+      if (pos + EXPORT_RECORD_HEADER + dlen > size) {
+         break;
+      }
+      w.add(ntohll(updateid), pos);
+      pos += EXPORT_RECORD_HEADER + dlen;
+   }
+   munmap(map, size);
+   if (!ok) {
+      fprintf(stderr, "ExportIndex: %s is truncated or corrupt at offset %llu\n", efile, (unsigned long long)pos);
+      return false;
+   }
+   return w.write(efile, pos, size);
+}
@@ -0,0 +1,164 @@
+/*
+   collabREate export_index.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __EXPORT_INDEX_H
+#define __EXPORT_INDEX_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#define EXPORT_INDEX_MAGIC "CRXPTIDX"
+#define EXPORT_INDEX_VER 1
+#define EXPORT_INDEX_SUFFIX ".idx"
+
+//the index is laid out in pages of this size so that a lookup touches
+//exactly one page of entries once the top level has been searched
+#define EXPORT_INDEX_PAGE 4096
+
+/**
+ * ExportIndexHeader
+ * The first page of an export index file
+ */
+struct ExportIndexHeader {
+   char magic[8];
+   uint32_t version;
+   //entries per page
+   uint32_t perPage;
+   //number of entries
+   uint64_t count;
+   //number of top level entries, one per page of entries
+   uint64_t topCount;
+   //file offset of the ENDTAG that follows the last update
+   uint64_t end;
+   //size of the export file the index was built from
+   uint64_t exportSize;
+};
+
+/**
+ * ExportIndexEntry
+ * Maps an updateid onto the file offset of its record in an export
+ */
+struct ExportIndexEntry {
+   uint64_t updateid;
+   uint64_t offset;
+};
+
+/**
+ * ExportIndexWriter
+ * Collects the records of an export as it is written, then writes the
+ * index next to it
+ */
+class ExportIndexWriter {
+public:
+   /**
+    * add records the position of an update in the export
+    * @param updateid the id of the update
+    * @param offset the file offset of the update's TAG
+    */
+   void add(uint64_t updateid, uint64_t offset);
+
+   /**
+    * write writes the index for an export file
+    * @param efile the name of the export, the index is efile.idx
+    * @param end the file offset of the export's ENDTAG
+    * @param exportSize the size of the export
+    * @return false on failure
+    */
+   bool write(const char *efile, uint64_t end, uint64_t exportSize);
+
+private:
+   vector<ExportIndexEntry> entries;
+};
+
+/**
+ * ExportIndex
+ * A read only view of the index of an exported or archived project.  The
+ * index is a sorted array of (updateid, offset) pairs, one page of them at a
+ * time, followed by a sparse top level holding the first entry of every
+ * page.  Everything is memory mapped, so finding where a range of updates
+ * begins costs a binary search over the top level plus one page of entries,
+ * no matter how large the export is, and nothing is read up front.
+ */
+class ExportIndex {
+public:
+   ExportIndex();
+   ~ExportIndex();
+
+   /**
+    * open maps the index of an export file
+    * @param efile the name of the export, not of its index
+    * @return false if there is no usable index for the export
+    */
+   bool open(const char *efile);
+
+   void close();
+
+   /**
+    * find locates the start of a range of updates
+    * @param first the first updateid of the range
+    * @return the file offset of the first update whose id is at least
+    * first, or the offset of the ENDTAG if there is no such update
+    */
+   uint64_t find(uint64_t first);
+
+   /**
+    * size inspector to get the number of updates in the export
+    * @return the number of updates
+    */
+   uint64_t size() {return hdr ? hdr->count : 0;};
+
+   /**
+    * firstUpdate inspector to get the smallest updateid in the export
+    * @return the updateid, 0 for an empty export
+    */
+   uint64_t firstUpdate();
+
+   /**
+    * lastUpdate inspector to get the largest updateid in the export
+    * @return the updateid, 0 for an empty export
+    */
+   uint64_t lastUpdate();
+
+   /**
+    * end inspector to get the file offset of the export's ENDTAG
+    * @return the offset, 0 if no index is open
+    */
+   uint64_t end() {return hdr ? hdr->end : 0;};
+
+   /**
+    * build scans an existing export and writes its index, for exports
+    * made before indexes were written alongside them
+    * @param efile the name of the export
+    * @return false if the export could not be read
+    */
+   static bool build(const char *efile);
+
+private:
+   int fd;
+   size_t len;
+   ExportIndexHeader *hdr;
+   ExportIndexEntry *entries;
+   ExportIndexEntry *top;
+};
+
+#endif
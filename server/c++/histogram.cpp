@@ -0,0 +1,194 @@
+/*
+   collabREate histogram.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+
+#include "buffer.h"
+#include "histogram.h"
+
+Histogram::Histogram() {
+   reset();
+}
+
+void Histogram::reset() {
+   memset(counts, 0, sizeof(counts));
+   count = 0;
+   sum = 0;
+   min = ~0ULL;
+   max = 0;
+}
+
+/*
+ * values below HISTOGRAM_SUB_COUNT get a bucket each, beyond that every
+ * power of two gets HISTOGRAM_SUB_COUNT equally wide buckets
+ */
+int Histogram::bucketOf(uint64_t v) {
+   if (v < HISTOGRAM_SUB_COUNT) {
+      return (int)v;
+   }
+   int msb = 63 - __builtin_clzll(v);
+   int shift = msb - HISTOGRAM_SUB_BITS;
+   return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((v >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+uint64_t Histogram::highestIn(int bucket) {
+   if (bucket < HISTOGRAM_SUB_COUNT) {
+      return bucket;
+   }
+   int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+   uint64_t lowest = (uint64_t)(HISTOGRAM_SUB_COUNT + (bucket & (HISTOGRAM_SUB_COUNT - 1))) << shift;
+   return lowest + ((1ULL << shift) - 1);
+}
+
+void Histogram::record(uint64_t v) {
+   counts[bucketOf(v)]++;
+   count++;
+   sum += v;
+   if (v < min) {
+      min = v;
+   }
+   if (v > max) {
+      max = v;
+   }
+}
+
+void Histogram::add(const Histogram &h) {
+   if (h.count == 0) {
+      return;
+   }
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      counts[i] += h.counts[i];
+   }
+   count += h.count;
+   sum += h.sum;
+   if (h.min < min) {
+      min = h.min;
+   }
+   if (h.max > max) {
+      max = h.max;
+   }
+}
+
+void Histogram::subtract(const Histogram &h) {
+   if (h.count == 0) {
+      return;
+   }
+   if (h.count >= count) {
+      reset();
+      return;
+   }
+   count -= h.count;
+   sum -= h.sum;
+   min = ~0ULL;
+   uint64_t highest = 0;
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      counts[i] = counts[i] > h.counts[i] ? counts[i] - h.counts[i] : 0;
+      if (counts[i]) {
+         if (min == ~0ULL) {
+            min = i ? highestIn(i - 1) + 1 : 0;
+         }
+         highest = highestIn(i);
+      }
+   }
+   if (highest < max) {
+      max = highest;
+   }
+}
+
+uint64_t Histogram::percentile(double pct) const {
+   if (count == 0) {
+      return 0;
+   }
+   uint64_t rank = (uint64_t)(pct / 100.0 * count + 0.5);
+   if (rank < 1) {
+      rank = 1;
+   }
+   uint64_t seen = 0;
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+         uint64_t v = highestIn(i);
+         return v < max ? v : max;
+      }
+   }
+   return max;
+}
+
+uint64_t Histogram::countAtMost(uint64_t v) const {
+   if (v >= max) {
+      return count;
+   }
+   uint64_t n = 0;
+   int last = bucketOf(v);
+   for (int i = 0; i <= last; i++) {
+      n += counts[i];
+   }
+   return n;
+}
+
+void Histogram::write(Buffer &b) const {
+   int used = 0;
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      used += counts[i] != 0;
+   }
+   b.writeLong(count);
+   b.writeLong(sum);
+   b.writeLong(getMin());
+   b.writeLong(max);
+   b.writeInt(used);
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      if (counts[i]) {
+         b.writeShort(i);
+         b.writeLong(counts[i]);
+      }
+   }
+}
+
+bool Histogram::read(Buffer &b) {
+   reset();
+   count = b.readLong();
+   sum = b.readLong();
+   min = b.readLong();
+   max = b.readLong();
+   int used = b.readInt();
+   if (used < 0 || used > HISTOGRAM_BUCKETS) {
+      reset();
+      return false;
+   }
+   uint64_t total = 0;
+   for (int i = 0; i < used; i++) {
+      int bucket = (uint16_t)b.readShort();
+      uint64_t n = b.readLong();
+      if (bucket >= HISTOGRAM_BUCKETS) {
+         reset();
+         return false;
+      }
+      counts[bucket] += n;
+      total += n;
+   }
+   if (b.has_error() || total != count) {
+      reset();
+      return false;
+   }
+   if (count == 0) {
+      min = ~0ULL;
+   }
+   return true;
+}
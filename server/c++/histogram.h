@@ -0,0 +1,116 @@
+/*
+   collabREate histogram.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <stdint.h>
+
+class Buffer;
+
+//each power of two is split into 1 << HISTOGRAM_SUB_BITS buckets, so any
+//recorded value is known to within about 6%
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+/**
+ * Histogram
+ * A log-linear (HDR style) histogram of 64 bit values.  Recording is a
+ * handful of instructions and never allocates, any value from 0 to 2^64 - 1
+ * can be recorded, and histograms can be merged and sent over the wire.
+ * A Histogram does no locking of its own.
+ */
+
+class Histogram {
+public:
+   Histogram();
+
+   /**
+    * record adds a value to the histogram
+    * @param v the value to add
+    */
+   void record(uint64_t v);
+
+   /**
+    * add merges the values of another histogram into this one
+    * @param h the histogram to merge
+    */
+   void add(const Histogram &h);
+
+   /**
+    * subtract removes the values of an earlier copy of this histogram,
+    * leaving only what was recorded since.  The smallest and largest
+    * values left are only known to within a bucket
+    * @param h the earlier copy
+    */
+   void subtract(const Histogram &h);
+
+   void reset();
+
+   uint64_t getCount() const {return count;};
+   uint64_t getMin() const {return count ? min : 0;};
+   uint64_t getMax() const {return max;};
+   uint64_t getMean() const {return count ? sum / count : 0;};
+   uint64_t getSum() const {return sum;};
+
+   /**
+    * percentile finds the value below which a given share of the recorded
+    * values fall
+    * @param pct the share, from 0 to 100
+    * @return the largest value that shares a bucket with the percentile,
+    * never more than the largest value recorded
+    */
+   uint64_t percentile(double pct) const;
+
+   /**
+    * countAtMost counts the recorded values that are no larger than a limit,
+    * values that share the limit's bucket count as being below it
+    * @param v the limit
+    * @return the number of values
+    */
+   uint64_t countAtMost(uint64_t v) const;
+
+   /**
+    * write appends the histogram to a Buffer, only buckets that hold
+    * values are written
+    * @param b the Buffer to write to
+    */
+   void write(Buffer &b) const;
+
+   /**
+    * read replaces the histogram with one written by write
+    * @param b the Buffer to read from
+    * @return false if b does not hold a valid histogram
+    */
+   bool read(Buffer &b);
+
+private:
+   static int bucketOf(uint64_t v);
+   static uint64_t highestIn(int bucket);
+
+   uint64_t counts[HISTOGRAM_BUCKETS];
+   uint64_t count;
+   uint64_t sum;
+   uint64_t min;
+   uint64_t max;
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+   collabREate latency.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <time.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "latency.h"
+
+const char *latencyStages[] = {"store", "queue", "send", "total"};
+
+uint64_t latencyNow() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//a stamp that was never set counts as no time spent in the stage
+static uint64_t elapsed(uint64_t from, uint64_t to) {
+   return from && to > from ? to - from : 0;
+}
+
+LatencyTracker::LatencyTracker(map<string,string> *p) {
+   pthread_mutex_init(&mutex, NULL);
+   traceNs = getIntOption(p, "LATENCY_TRACE_MS", 0) * 1000000ULL;
+}
+
+LatencyTracker::~LatencyTracker() {
+   for (map<int,ProjectLatency*>::iterator i = projects.begin(); i != projects.end(); i++) {
+      delete (*i).second;
+   }
+   pthread_mutex_destroy(&mutex);
+}
+
+//call this only if you already hold the lock
+ProjectLatency *LatencyTracker::getProject(int pid) {
+   map<int,ProjectLatency*>::iterator i = projects.find(pid);
+   if (i != projects.end()) {
+      return (*i).second;
+   }
+   ProjectLatency *pl = new ProjectLatency();
+   projects[pid] = pl;
+   return pl;
+}
+
+bool LatencyTracker::dispatched(int pid, const UpdateTimes &t, const uint64_t *written) {
+   pthread_mutex_lock(&mutex);
+   ProjectLatency *pl = getProject(pid);
+   pl->stages[LATENCY_STORE].record(elapsed(t.received, t.stored));
+   pl->stages[LATENCY_QUEUE].record(elapsed(t.stored, t.dequeued));
+   for (int i = 0; i < t.subscribers; i++) {
+      pl->stages[LATENCY_SEND].record(elapsed(t.dequeued, written[i]));
+      pl->stages[LATENCY_TOTAL].record(elapsed(t.received, written[i]));
+   }
+   pthread_mutex_unlock(&mutex);
+   return traceNs != 0 && t.subscribers > 0 && elapsed(t.received, t.written) >= traceNs;
+}
+
+void LatencyTracker::write(int pid, Buffer &b) {
+   pthread_mutex_lock(&mutex);
+   if (pid != -1) {
+      map<int,ProjectLatency*>::iterator i = projects.find(pid);
+      b.writeInt(i != projects.end() ? 1 : 0);
+      if (i != projects.end()) {
+         b.writeInt(pid);
+         for (int s = 0; s < LATENCY_STAGES; s++) {
+            (*i).second->stages[s].write(b);
+         }
+      }
+   }
+   else {
+      b.writeInt(projects.size());
+      for (map<int,ProjectLatency*>::iterator i = projects.begin(); i != projects.end(); i++) {
+         b.writeInt((*i).first);
+         for (int s = 0; s < LATENCY_STAGES; s++) {
+            (*i).second->stages[s].write(b);
+         }
+      }
+   }
+   pthread_mutex_unlock(&mutex);
+}
+
+void LatencyTracker::writeSummary(Buffer &b) {
+   pthread_mutex_lock(&mutex);
+   b.writeInt(projects.size());
+   for (map<int,ProjectLatency*>::iterator i = projects.begin(); i != projects.end(); i++) {
+      Histogram *stages = (*i).second->stages;
+      b.writeInt((*i).first);
+      b.writeLong(stages[LATENCY_STORE].getCount());
+      b.writeLong(stages[LATENCY_SEND].getCount());
+      stages[LATENCY_TOTAL].write(b);
+   }
+   pthread_mutex_unlock(&mutex);
+}
+
+void LatencyTracker::totals(Histogram *stages) {
+   pthread_mutex_lock(&mutex);
+   for (map<int,ProjectLatency*>::iterator i = projects.begin(); i != projects.end(); i++) {
+      for (int s = 0; s < LATENCY_STAGES; s++) {
+         stages[s].add((*i).second->stages[s]);
+      }
+   }
+   pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,129 @@
+/*
+   collabREate latency.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "histogram.h"
+
+using namespace std;
+
+class Buffer;
+
+//the stages an update passes through on its way from publisher to subscriber
+#define LATENCY_STORE   0   //read from the publisher until stored
+#define LATENCY_QUEUE   1   //stored until the dispatch thread picks it up
+#define LATENCY_SEND    2   //picked up until written to a subscriber
+#define LATENCY_TOTAL   3   //read from the publisher until written to a subscriber
+#define LATENCY_STAGES  4
+
+extern const char *latencyStages[];
+
+/**
+ * latencyNow reads the clock that updates are stamped with
+ * @return monotonic time in nanoseconds
+ */
+uint64_t latencyNow();
+
+/**
+ * UpdateTimes holds the stamps an update collects on its way through
+ * the server, all of them latencyNow() values
+ */
+struct UpdateTimes {
+   uint64_t received;   //the last byte of the update was read
+   uint64_t stored;     //the update was stored (or would have been in basic mode)
+   uint64_t dequeued;   //the dispatch thread picked the update up
+   uint64_t written;    //the update was last written to a subscriber
+   int subscribers;     //the number of subscribers it was written to
+};
+
+/**
+ * ProjectLatency holds one histogram per stage for a single project
+ */
+struct ProjectLatency {
+   Histogram stages[LATENCY_STAGES];
+};
+
+/**
+ * LatencyTracker
+ * This class keeps, per project, the time updates spend in each stage
+ * between being read from a publisher and being written to a subscriber.
+ * Updates that take longer than LATENCY_TRACE_MS from end to end are
+ * reported to the caller so it can log them.
+ */
+
+class LatencyTracker {
+public:
+   /**
+    * @param p the server configuration
+    */
+   LatencyTracker(map<string,string> *p);
+   ~LatencyTracker();
+
+   /**
+    * dispatched records an update once it has been written to every
+    * subscriber
+    * @param pid the project the update belongs to
+    * @param t the update's stamps
+    * @param written the time it was written to each subscriber, there are
+    * t.subscribers of them
+    * @return true if the update is slow enough to be traced
+    */
+   bool dispatched(int pid, const UpdateTimes &t, const uint64_t *written);
+
+   /**
+    * write appends the histograms of one or all projects to a Buffer as a
+    * project count followed by each pid and its LATENCY_STAGES histograms
+    * @param pid the project to write, -1 for every project
+    * @param b the Buffer to write to
+    */
+   void write(int pid, Buffer &b);
+
+   /**
+    * totals merges the histograms of every project
+    * @param stages receives LATENCY_STAGES histograms, added to what they
+    * already hold
+    */
+   void totals(Histogram *stages);
+
+   /**
+    * writeSummary appends a summary of every project to a Buffer as a
+    * project count followed by, for each project, its pid, the number of
+    * updates stored, the number of times they were written to a
+    * subscriber and its LATENCY_TOTAL histogram
+    * @param b the Buffer to write to
+    */
+   void writeSummary(Buffer &b);
+
+private:
+   ProjectLatency *getProject(int pid);
+
+   map<int,ProjectLatency*> projects;
+   pthread_mutex_t mutex;
+   //updates slower than this from end to end are traced, 0 traces none
+   uint64_t traceNs;
+};
+
+#endif
@@ -0,0 +1,488 @@
+/*
+   collabREate log_mgr.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <sys/time.h>
+#include "utils.h"
+#include "buffer.h"
+#include "proj_info.h"
+#include "client.h"
+#include "log_mgr.h"
+#include "projectmap.h"
+#include "clientset.h"
+
+using namespace std;
+
+/**
+ * LogConnectionManager
+ * This class is responsible for routing incoming packets to all
+ * interested clients, projects and updates are kept in a LogStore
+ */
+
+//clients are challenged, as in database mode, so that the challenge can
+//carry the protocol version and compression the plugin negotiates against
+LogConnectionManager::LogConnectionManager(map<string,string> *p) : ConnectionManagerBase(p, false) {
+   store = new LogStore(p);
+   if (!store->open()) {
+      logln("unable to open the log store, updates will not be saved", LERROR);
+   }
+}
+
+/**
+ * authenticate authenticates a user, there are no user accounts in log
+ * mode so any credentials are accepted and, as in basic mode, everyone is
+ * let in with full permissions
+ * @param user the user to authenticate
+ * @param challenge the randomly generated challenge send to the plugin
+ * @param response the calculated response from the plugin to check
+ * @return the user id of an authenticated user, or INVALID_USER
+ */
+int LogConnectionManager::authenticate(Client *c, const char * /*user*/, const uint8_t * /*challenge*/, uint32_t /*clen*/,
+                                       const uint8_t * /*response*/, uint32_t /*rlen*/) {
+   c->setUserPub(FULL_PERMISSIONS);
+   c->setUserSub(FULL_PERMISSIONS);
+   return BASIC_USER;
+}
+
+/**
+ * migrateUpdate is very similar to 'post', migrateUpdate only
+ * archives the udpate so that future clients can receive it
+ * @param newowner the new uid to attribute the update to
+ * @param pid the local project id for the migrated project
+ * @param cmd the 'command' that was performed (comment, rename, etc)
+ * @param data the 'data' portion of the command (the comment text, etc)
+ */
+void LogConnectionManager::migrateUpdate(int /*newowner*/, int pid, int /*cmd*/, const uint8_t *data, int dlen) {
+   //the store writes the new updateid into the frame
+   Buffer update(data, dlen);
+   if (store->append(pid, update.get_buf(), dlen) == 0) {
+      logln("migrateUpdate: unable to store update", LERROR);
+   }
+}
+
+/**
+ * post both queues a newly received update to be sent to other clients and
+ * appends the udpate to the project's log so that future clients can receive it
+ * @param src the client that made the update
+ * @param cmd the 'command' that was performed (comment, rename, etc)
+ * @param data the 'data' portion of the command (the comment text, etc)
+            note that this data array already has 8 bytes (8-15) reserved to receive the updateid
+ */
+void LogConnectionManager::post(Client *src, int /*cmd*/, uint8_t *data, int dlen) {
+   uint64_t updateid = store->append(src->getPid(), data, dlen);
+   if (updateid == 0) {
+      logln("post: unable to store update", LERROR);
+      return;
+   }
+   enqueue(new Packet(src, data, dlen, updateid));   //add a new packet with the binary data to the queue
+}
+
+static bool postUpdate(const uint8_t *frame, int len, void *user) {
+   Client *c = (Client*)user;
+   //frames are stored exactly as they are sent, updateid included
+   c->postBulk(frame, len);
+   return true;
+}
+
+static bool sendSegment(int fd, uint64_t offset, uint64_t len, void *user) {
+   Client *c = (Client*)user;
+   //frames are stored exactly as they are sent, so whole runs of them can
+   //go straight from the segment file to the socket
+   return c->postFile(fd, offset, len);
+}
+
+/**
+ * sendLatestUpdates sends updates from LastUpdate to current
+ * it is expected that the client has already joined a project before calling this function
+ * it is expected that the client has already received updates from 0 - lastUpdate
+ * this function is typically called when a user is re-joining a project that they had previously worked on
+ * @param c the client requesting updates
+ * @param lastUpdate the last update the client received
+ */
+void LogConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
+   struct timeval start, end;
+   gettimeofday(&start, NULL);
+   uint64_t frames = 0;
+   bool raw = c->receivesEverything();
+   if (raw) {
+      if (!store->send(c->getPid(), ntohll(lastUpdate), sendSegment, c, frames)) {
+         logln("sendLatestUpdates: unable to send the update log", LERROR);
+      }
+   }
+   else {
+      if (!store->scan(c->getPid(), ntohll(lastUpdate), postUpdate, c)) {
+         logln("sendLatestUpdates: unable to read the update log", LERROR);
+      }
+      c->flushBulk();
+   }
+   gettimeofday(&end, NULL);
+   char buf[128];
+   if (raw) {
+      snprintf(buf, sizeof(buf), "catch up for project %d: %llu updates sent from the log, %ld ms", c->getPid(),
+               (unsigned long long)frames, (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+   }
+   else {
+      snprintf(buf, sizeof(buf), "catch up for project %d: %ld ms", c->getPid(),
+               (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+   }
+   logln(buf, LINFO1);
+}
+
+/**
+ * getProjectInfo gets information related to a local project
+ * @param pid the local pid of a project to get info on
+ * @return a  project info object for the provided pid
+ */
+ProjectInfo *LogConnectionManager::getProjectInfo(int pid) {
+   ProjectInfo *pinfo = store->getProject(pid);
+   if (pinfo != NULL) {
+      ClientSet *cs = projects.get(pid);
+      if (cs != NULL) {
+         pinfo->connected = cs->size();
+      }
+   }
+   return pinfo;
+}
+
+/**
+ * getProjectList generates a list of projects on this server, each list (vector) item is
+ * actually a pinfo (project info) object, the list does NOT contain all projects, but
+ * only contains projects relevant to the binary that is currently loaded in IDA
+ * @param phash the IDA generated hash that is unique among the analysis files
+ * @return a vector of project info objects for the provided phash
+ */
+vector<ProjectInfo*> *LogConnectionManager::getProjectList(const string &phash) {
+   vector<ProjectInfo*> *plist = new vector<ProjectInfo*>;
+   store->getProjects(phash, *plist);
+   for (vector<ProjectInfo*>::iterator it = plist->begin(); it != plist->end(); it++) {
+      ClientSet *cs = projects.get((*it)->lpid);
+      if (cs != NULL) {
+         (*it)->connected = cs->size();
+      }
+   }
+   return plist;
+}
+
+/**
+ * joinProject joings a particular client to a project so that it can participate in collabREation
+ * @param c the client attempting to join
+ * @param lpid the local project id of the project on this server
+ * @return 0 on success, negative value on failure
+ */
+int LogConnectionManager::joinProject(Client *c, int lpid) {
+   ProjectInfo *pinfo = store->getProject(lpid);
+   if (pinfo == NULL) {
+      return -1;
+   }
+   if (pinfo->snapupdateid > 0) {  //pid is a snapshot pid
+      c->send_error("can't join a snapshot, you MUST fork a snapshot");
+      logln("attempted to join a snapshop instead of forking", LERROR);
+      delete pinfo;
+      return -1;
+   }
+   c->setPid(lpid);
+   c->setHash(pinfo->hash);
+   c->setGpid(pinfo->gpid);
+   if (pinfo->owner == (uint32_t)c->getUid()) { //project owner gets full perms, regardless of user, project, or requested perms
+      c->setPub(FULL_PERMISSIONS);
+      c->setSub(FULL_PERMISSIONS);
+   }
+   else { //effective permissions are user perms ANDed with project perms ANDed with the perms requested by the user
+      c->setPub(pinfo->pub & c->getUserPub() & c->getReqPub());
+      c->setSub(pinfo->sub & c->getUserSub() & c->getReqSub());
+   }
+   delete pinfo;
+   projects.addClient(c);
+   return 0;
+}
+
+/**
+ * snapProject adds a snapshop for a project, this does not change the client's
+ * current project, nor copy any updates, it simply marks a point-in-time (updateid wise)
+ * this point-in-time can later be used as a project fork point if desired
+ * @param c the client invoking the snapshot
+ * @param lastupdateid the point-in-time the client wishes to save in the snapshot
+ * @param desc a user provided description of the snapshot
+ * @return the snapshotid on success, -1 on failure
+ */
+int LogConnectionManager::snapProject(Client *c, uint64_t lastupdateid, const string &desc) {
+   ProjectInfo snap(0, desc);
+   snap.hash = c->getHash();
+   snap.gpid = newGpid();
+   snap.owner = c->getUid();
+   snap.parent = c->getPid();
+   snap.snapupdateid = lastupdateid;
+   snap.proto = PROTOCOL_VERSION;
+   int spid = store->createProject(snap);
+   if (spid < 0) {
+      logln("project snap failed", LERROR);
+   }
+   return spid;
+}
+
+/**
+ * forkProject  forks a project - creats new project and copies all updates to point to the new project,
+ * publish and subscribe values are inherited
+ * @param c client object invoking the fork
+ * @param lastupdateid the updateid value the fork is to occur at
+ * @param desc user provided description of the fork
+ * @return the new projectid on success, -1 on failure
+ */
+int LogConnectionManager::forkProject(Client *c, uint64_t lastupdateid, const string &desc) {
+   int rval = -1;
+   ProjectInfo *pinfo = store->getProject(c->getPid());
+   if (pinfo != NULL) {
+      rval = forkProject(c, lastupdateid, desc, pinfo->pub, pinfo->sub);
+      delete pinfo;
+   }
+   return rval;
+}
+
+/**
+ * forkProject  forks a project - creats new project and copies all updates to point to the new project
+ * @param c client object invoking the fork
+ * @param lastupdateid the updateid value the fork is to occur at
+ * @param desc user provided description of the fork
+ * @param pub specified publish permissions
+ * @param sub specified subscribe permissions
+ * @return the new projectid on success, -1 on failure
+ */
+int LogConnectionManager::forkProject(Client *c, uint64_t lastupdateid, const string &desc, uint64_t pub, uint64_t sub) {
+   int rval = -1;
+   int oldlpid = c->getPid();
+   remove(c);
+   int lpid = newProject(c, c->getHash(), desc, pub, sub, oldlpid);
+   if (lpid >= 0) {
+      if (store->copy(oldlpid, lpid, lastupdateid)) {
+         rval = lpid;
+      }
+      else {
+         logln("forkProject: unable to copy updates", LERROR);
+      }
+      //allow anyone else on the project (w/ exactly the same updates) to follow the fork
+      logln("sending fork follows", LINFO);
+      sendForkFollows(c, oldlpid, lastupdateid, desc);
+   }
+   else {
+      //rejoin original project
+      joinProject(c, oldlpid);
+      //send fork error
+      c->send_error("Fork Failed, could not create forked project");
+   }
+   return rval;
+}
+
+struct ForkArgs {
+   Client *org;
+   uint64_t lastupdate;
+   const string &desc;
+};
+
+static bool offerFork(Client *c, void *user) {
+   ForkArgs *fa = (ForkArgs*)user;
+   if (c != fa->org) {  //sanity check, originator shouldn't be in vector anymore
+      c->sendForkFollow(fa->org->getUser(), fa->org->getGpid(), fa->lastupdate, fa->desc);
+   }
+   return true;
+}
+
+/**
+ * sendForkFollows sends a special "follow fork" message to all clients working on
+ * a project that has been forked, this allows the user to decide if they would like
+ * to continue to work on the existing project, or change to the newly created project
+ * @param originator the client that instigated the fork
+ * @param oldlpid the local pid of the original project
+ * @param lastupdateid the last update processed prior to fork (if your database is different you can't change to the new project)
+ * @param desc the description of the new project, so the user can make a more educated descision
+ */
+void LogConnectionManager::sendForkFollows(Client *originator, int oldlpid, uint64_t lastupdateid, const string &desc) {
+   ForkArgs fa = {originator, lastupdateid, desc};
+   projects.loopProject(oldlpid, offerFork, &fa);
+}
+
+/**
+ * snapforkProject -  this is a special version of forkProject that is designed to work
+ * on snapshots (instead of existing projects) this works exactly like forkProject, execpt
+ * updates are copied from the 'parent' of the snapshot instead of the client's currently
+ * associated project, also updates are copied until the lastupdateid from the snapshot,
+ * not from the plugin (last received update is stored in the idb)
+ * @param c client invoking the snapforkProject
+ * @param spid the pid of the project that is being snapshotted
+ * @param desc the user provided description for the snapshot
+ * @return the new project id on success, -1 on failure
+ */
+int LogConnectionManager::snapforkProject(Client *c, int spid, const string &desc, uint64_t pub, uint64_t sub) {
+   int rval = -1;
+   ProjectInfo *snap = store->getProject(spid);
+   if (snap == NULL || snap->snapupdateid == 0 || snap->parent < 0) {
+      c->send_error("attempt to snapfork a project (not a snapshot)");
+   }
+   else {
+      int lpid = newProject(c, c->getHash(), desc, pub, sub, spid);
+      if (lpid >= 0 && store->copy(snap->parent, lpid, snap->snapupdateid)) {
+         rval = lpid;
+      }
+   }
+   delete snap;
+   return rval;
+}
+
+/**
+ * migrateProject adds a project to the store
+ * fairly similar to addProject
+ * @param owner the uid to be the owner of the new project
+ * @param gpid unique global id for the incoming project
+ * @param hash unique hash for the binary file originally generated by IDA
+ * @param desc user provided description of the project
+ * @param pub the publish permissions for the project
+ * @param sub the subscribe permissions for the project
+ * @return the new project id on success, -1 on failure
+ */
+int LogConnectionManager::migrateProject(int owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub) {
+   ProjectInfo pinfo(0, desc);
+   pinfo.hash = hash;
+   pinfo.gpid = gpid;
+   pinfo.owner = owner;
+   pinfo.parent = -1;
+   pinfo.pub = pub;
+   pinfo.sub = sub;
+   pinfo.proto = PROTOCOL_VERSION;
+   return store->createProject(pinfo);
+}
+
+/**
+ * newGpid generates a gpid that no project in the store is using yet
+ * @return the new gpid
+ */
+string LogConnectionManager::newGpid() {
+   string gpid;
+   do {
+      uint8_t gpid_bytes[32];
+      fill_random(gpid_bytes, sizeof(gpid_bytes));
+      gpid = toHexString(gpid_bytes, sizeof(gpid_bytes));
+   } while (store->findProject(gpid) != -1);
+   return gpid;
+}
+
+int LogConnectionManager::newProject(Client *c, const string &hash, const string &desc, uint64_t pub, uint64_t sub, int parent) {
+   ProjectInfo pinfo(0, desc);
+   pinfo.hash = hash;
+   pinfo.gpid = newGpid();
+   pinfo.owner = c->getUid();
+   pinfo.parent = parent;
+   pinfo.pub = pub;
+   pinfo.sub = sub;
+   pinfo.proto = PROTOCOL_VERSION;
+   int lpid = store->createProject(pinfo);
+   if (lpid != -1) {
+      c->setPid(lpid);
+      c->setGpid(pinfo.gpid);
+      //this is a newly created project, user of c must be the owner
+      c->setPub(FULL_PERMISSIONS);
+      c->setSub(FULL_PERMISSIONS);
+      projects.addClient(c);
+   }
+   return lpid;
+}
+
+/**
+ * addProject adds a project to the store and reflector
+ * @param c cliend invoking the addProject
+ * @param hash unique hash for the binary file originally generated by IDA
+ * @param desc user provided description of the project
+ * @param pub the publish permissions for the project
+ * @param sub the subscribe permissions for the project
+ * @return the new project id on success, -1 on failure
+ */
+int LogConnectionManager::addProject(Client *c, const string &hash, const string &desc, uint64_t pub, uint64_t sub) {
+   return newProject(c, hash, desc, pub, sub, -1);
+}
+
+struct UpdateArgs {
+   Client *owner;
+   uint64_t pub;
+   uint64_t sub;
+};
+
+static bool updatePerms(Client *c, void *user) {
+   UpdateArgs *args = (UpdateArgs*)user;
+   if (c != args->owner) {
+      uint64_t newpperm = (c->getUserPub() & c->getReqPub() & args->pub);
+      uint64_t newsperm = (c->getUserSub() & c->getReqSub() & args->sub);
+      if (c->getPub() != newpperm) {
+         c->setPub(newpperm);
+         c->setSub(newsperm);
+         c->send_error("You permissions have changed as a result of the project owner changing project permissions");
+      }
+   }
+   return true;
+}
+
+/**
+ * updateProjectPerms updates the publish and subscribe values in the store, it also iterates
+ * across all clients connected the project and updates the effective permissions accordingly
+ * @param pub the publish permissions to set
+ * @param sub the subscribe permissions to set
+ */
+void LogConnectionManager::updateProjectPerms(Client *c, uint64_t pub, uint64_t sub) {
+   ProjectInfo *pinfo = store->getProject(c->getPid());
+   if (pinfo == NULL) {
+      return;
+   }
+   pinfo->pub = pub;
+   pinfo->sub = sub;
+   if (!store->saveProject(*pinfo)) {
+      logln("updateProjectPerms: unable to save project", LERROR);
+   }
+   delete pinfo;
+
+   logln("recalculating effective permissions for connected clients", LINFO3);
+   UpdateArgs args = {c, pub, sub};
+   projects.loopProject(c->getPid(), updatePerms, &args);
+}
+
+/**
+ * gpid2lpid converts a gpid (which is unique across all projects on all servers)
+ * to an lpid (pid local to a particular server instance)
+ * @param gpid global pid
+ * @return the local pid
+ */
+int LogConnectionManager::gpid2lpid(const string &gpid) {
+   return store->findProject(gpid);
+}
+
+/**
+ * lpid2gpid converts an lpid (pid local to a particular server instance)
+ * to a gpid (which is unique across all projects on all servers)
+ * @param lpid the local pid for this particular server
+ * @return the glocabl pid
+ */
+string LogConnectionManager::lpid2gpid(int lpid) {
+   string gpid;
+   ProjectInfo *pinfo = store->getProject(lpid);
+   if (pinfo != NULL) {
+      gpid = pinfo->gpid;
+      delete pinfo;
+   }
+   return gpid;
+}
@@ -0,0 +1,324 @@
+/*
+   collabREate logger.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "utils.h"
+#include "logger.h"
+
+using namespace std;
+
+/*
+ * each message sits in a ring behind one of these, its text padded out
+ * to a multiple of 8 bytes
+ */
+struct LogRecord {
+   uint32_t len;
+   uint32_t usec;
+   int64_t sec;
+};
+
+/*
+ * LogRing holds the messages of one thread until the flusher gets to
+ * them.  Only the owning thread moves head and only the flusher moves
+ * tail, so neither side ever waits on the other.
+ */
+struct LogRing {
+   uint8_t buf[LOG_RING_SIZE];
+   uint32_t head;
+   uint32_t tail;
+   //messages the owning thread had no room for, and how many of those
+   //the flusher has reported
+   uint32_t dropped;
+   uint32_t reported;
+   //the owning thread has exited, the ring goes once it is empty
+   bool retired;
+   LogRing *next;
+};
+
+//a message waiting to be written, rings are merged in time order
+struct LogLine {
+   int64_t sec;
+   uint32_t usec;
+   uint32_t seq;
+   string msg;
+};
+
+int logVerbosity = DEFAULT_VERBOSITY;
+
+static bool started = false;
+
+//the flusher sleeps on this between flushes, a thread whose ring is
+//filling up wakes it early
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+//guards the list of rings
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *rings = NULL;
+
+//guards the log file, one flush at a time
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *logFile = stderr;
+static string logName;
+static uint64_t logSize;
+static uint64_t rotateSize;
+static int keep;
+
+static void retireRing(void *arg) {
+   LogRing *r = (LogRing*)arg;
+   pthread_mutex_lock(&ringLock);
+   r->retired = true;
+   pthread_mutex_unlock(&ringLock);
+}
+
+static void createRingKey() {
+   pthread_key_create(&ringKey, retireRing);
+}
+
+static LogRing *myRing() {
+   pthread_once(&ringOnce, createRingKey);
+   LogRing *r = (LogRing*)pthread_getspecific(ringKey);
+   if (r == NULL) {
+      r = new LogRing;
+      r->head = r->tail = 0;
+      r->dropped = r->reported = 0;
+      r->retired = false;
+      pthread_setspecific(ringKey, r);
+      pthread_mutex_lock(&ringLock);
+      r->next = rings;
+      rings = r;
+      pthread_mutex_unlock(&ringLock);
+   }
+   return r;
+}
+
+static void ringWrite(LogRing *r, uint32_t pos, const void *data, uint32_t len) {
+   uint32_t off = pos & (LOG_RING_SIZE - 1);
+   uint32_t first = min(len, (uint32_t)LOG_RING_SIZE - off);
+   memcpy(r->buf + off, data, first);
+   memcpy(r->buf, (const uint8_t*)data + first, len - first);
+}
+
+static void ringRead(LogRing *r, uint32_t pos, void *data, uint32_t len) {
+   uint32_t off = pos & (LOG_RING_SIZE - 1);
+   uint32_t first = min(len, (uint32_t)LOG_RING_SIZE - off);
+   memcpy(data, r->buf + off, first);
+   memcpy((uint8_t*)data + first, r->buf, len - first);
+}
+
+static uint32_t recordSize(uint32_t len) {
+   return sizeof(LogRecord) + ((len + 7) & ~7);
+}
+
+void logWrite(const char *msg, unsigned int len) {
+   if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+      //nobody to hand it to yet
+      fwrite(msg, 1, len, stderr);
+      if (len == 0 || msg[len - 1] != '\n') {
+         fputc('\n', stderr);
+      }
+      return;
+   }
+   LogRing *r = myRing();
+   if (len > LOG_MAX_MESSAGE) {
+      len = LOG_MAX_MESSAGE;
+   }
+   uint32_t need = recordSize(len);
+   uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   if (LOG_RING_SIZE - (r->head - tail) < need) {
+      __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+      return;
+   }
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   LogRecord rec;
+   rec.len = len;
+   rec.usec = tv.tv_usec;
+   rec.sec = tv.tv_sec;
+   ringWrite(r, r->head, &rec, sizeof(rec));
+   ringWrite(r, r->head + sizeof(rec), msg, len);
+   uint32_t used = r->head - tail;
+   __atomic_store_n(&r->head, r->head + need, __ATOMIC_RELEASE);
+   if (used < LOG_RING_SIZE / 2 && used + need >= LOG_RING_SIZE / 2) {
+      //only the message that takes the ring past half full pays for this
+      pthread_cond_signal(&wake);
+   }
+}
+
+static bool lineBefore(const LogLine &a, const LogLine &b) {
+   if (a.sec != b.sec) {
+      return a.sec < b.sec;
+   }
+   if (a.usec != b.usec) {
+      return a.usec < b.usec;
+   }
+   return a.seq < b.seq;
+}
+
+/*
+ * rotate moves LogFile to LogFile.1, LogFile.1 to LogFile.2 and so on,
+ * dropping the oldest of LOGFILE_KEEP, and starts a new LogFile
+ */
+static void rotate() {
+   fclose(logFile);
+   char from[1024];
+   char to[1024];
+   for (int i = keep - 1; i >= 1; i--) {
+      snprintf(from, sizeof(from), "%s.%d", logName.c_str(), i);
+      snprintf(to, sizeof(to), "%s.%d", logName.c_str(), i + 1);
+      rename(from, to);
+   }
+   if (keep > 0) {
+      snprintf(to, sizeof(to), "%s.1", logName.c_str());
+      rename(logName.c_str(), to);
+   }
+   logFile = fopen(logName.c_str(), keep > 0 ? "a" : "w");
+   if (logFile == NULL) {
+      fprintf(stderr, "Logger: unable to open %s: %s\n", logName.c_str(), strerror(errno));
+      logFile = stderr;
+      rotateSize = 0;
+   }
+   logSize = 0;
+}
+
+void logFlush() {
+   vector<LogLine> lines;
+   uint64_t dropped = 0;
+
+   pthread_mutex_lock(&flushLock);
+   pthread_mutex_lock(&ringLock);
+   for (LogRing **p = &rings; *p;) {
+      LogRing *r = *p;
+      uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      uint32_t tail = r->tail;
+      while (tail != head) {
+         LogRecord rec;
+         ringRead(r, tail, &rec, sizeof(rec));
+         LogLine line;
+         line.sec = rec.sec;
+         line.usec = rec.usec;
+         line.seq = lines.size();
+         line.msg.resize(rec.len);
+         ringRead(r, tail + sizeof(rec), &line.msg[0], rec.len);
+         lines.push_back(line);
+         tail += recordSize(rec.len);
+      }
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+      uint32_t d = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+      dropped += d - r->reported;
+      r->reported = d;
+      if (r->retired) {
+         *p = r->next;
+         delete r;
+      }
+      else {
+         p = &r->next;
+      }
+   }
+   pthread_mutex_unlock(&ringLock);
+
+   stable_sort(lines.begin(), lines.end(), lineBefore);
+   for (vector<LogLine>::iterator i = lines.begin(); i != lines.end(); i++) {
+      time_t sec = (*i).sec;
+      struct tm tm;
+      localtime_r(&sec, &tm);
+      char stamp[64];
+      int n = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+      n += snprintf(stamp + n, sizeof(stamp) - n, ".%06u ", (*i).usec);
+      fwrite(stamp, 1, n, logFile);
+      const string &msg = (*i).msg;
+      fwrite(msg.data(), 1, msg.size(), logFile);
+      logSize += n + msg.size();
+      if (msg.empty() || msg[msg.size() - 1] != '\n') {
+         fputc('\n', logFile);
+         logSize++;
+      }
+   }
+   if (dropped) {
+      logSize += fprintf(logFile, "%llu log messages dropped, the threads logging them were too far ahead\n",
+                         (unsigned long long)dropped);
+   }
+   fflush(logFile);
+   if (rotateSize != 0 && logSize >= rotateSize) {
+      rotate();
+   }
+   pthread_mutex_unlock(&flushLock);
+}
+
+static void *flusher(void *arg) {
+   while (true) {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      uint64_t ns = (tv.tv_usec * 1000ULL) + LOG_FLUSH_MS * 1000000ULL;
+      struct timespec until;
+      until.tv_sec = tv.tv_sec + ns / 1000000000;
+      until.tv_nsec = ns % 1000000000;
+      pthread_mutex_lock(&wakeLock);
+      pthread_cond_timedwait(&wake, &wakeLock, &until);
+      pthread_mutex_unlock(&wakeLock);
+      logFlush();
+   }
+   return NULL;
+}
+
+void logStart(map<string,string> *p) {
+   logVerbosity = getIntOption(p, "LogVerbosity", DEFAULT_VERBOSITY);
+   logName = getStringOption(p, "LogFile", "");
+   rotateSize = (uint64_t)getIntOption(p, "LOGFILE_ROTATE_MB", 64) << 20;
+   keep = getIntOption(p, "LOGFILE_KEEP", 5);
+   if (logName.length() > 0) {
+      FILE *f = fopen(logName.c_str(), "a");
+      if (f == NULL) {
+         fprintf(stderr, "Logger: unable to open %s: %s\n", logName.c_str(), strerror(errno));
+      }
+      else {
+         logFile = f;
+         fseek(logFile, 0, SEEK_END);
+         logSize = ftell(logFile);
+      }
+   }
+   if (logFile == stderr) {
+      //there is nothing to rotate
+      rotateSize = 0;
+   }
+
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   if (pthread_create(&tid, &attr, flusher, NULL) != 0) {
+      fprintf(stderr, "Logger: unable to start the log flusher, logging synchronously\n");
+      return;
+   }
+   __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+}
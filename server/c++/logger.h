@@ -0,0 +1,72 @@
+/*
+   collabREate logger.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __LOGGER_H
+#define __LOGGER_H
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+//bytes of log records each thread can have waiting for the flusher, a power of 2
+#define LOG_RING_SIZE     0x10000
+//longer messages are cut short
+#define LOG_MAX_MESSAGE   4096
+//how often the flusher empties the rings, sooner if one is half full
+#define LOG_FLUSH_MS      100
+
+//messages logged at this verbosity or higher are discarded
+extern int logVerbosity;
+
+/**
+ * logEnabled tells whether a message would be logged, so a caller can skip
+ * building a message that would only be thrown away
+ * @param verbosity the verbosity level of the message
+ * @return true if the message would be logged
+ */
+inline bool logEnabled(int verbosity) {
+   return verbosity < logVerbosity;
+}
+
+/**
+ * logStart switches logging from writing straight to stderr to writing
+ * into a ring per thread that a background thread flushes to LogFile,
+ * rotating it once it reaches LOGFILE_ROTATE_MB.  Call it once, after any
+ * fork, before the threads that log are started.
+ * @param p the server configuration
+ */
+void logStart(map<string,string> *p);
+
+/**
+ * logWrite logs a message that has passed logEnabled, it never blocks on
+ * the log file.  A message that does not fit in the thread's ring is
+ * dropped and counted.
+ * @param msg the message, a newline is added if it doesn't end with one
+ * @param len the length of the message
+ */
+void logWrite(const char *msg, unsigned int len);
+
+/**
+ * logFlush writes out everything that has been logged so far
+ */
+void logFlush();
+
+#endif
@@ -0,0 +1,988 @@
+/*
+   collabREate logstore.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "logstore.h"
+
+using namespace std;
+
+#define INITIAL_INDEX_ENTRIES 4096
+#define DEFAULT_SEGMENT_SIZE 64   //MB
+
+static bool syncDir(const string &dir) {
+   int fd = ::open(dir.c_str(), O_RDONLY);
+   if (fd < 0) {
+      return false;
+   }
+   fsync(fd);
+   close(fd);
+   return true;
+}
+
+static bool writeFully(int fd, const uint8_t *data, int len) {
+   while (len > 0) {
+      ssize_t n = ::write(fd, data, len);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+ProjectLog::ProjectLog(LogStore *owner, const string &dir, uint64_t segmentSize) {
+   store = owner;
+   this->dir = dir;
+   this->segmentSize = segmentSize;
+   pthread_mutex_init(&lock, NULL);
+   appendFd = -1;
+   end = 0;
+   indexFd = -1;
+   index = NULL;
+   entries = NULL;
+   capacity = 0;
+   count = 0;
+   durable = 0;
+}
+
+ProjectLog::~ProjectLog() {
+   if (appendFd >= 0) {
+      close(appendFd);
+   }
+   if (index) {
+      munmap(index, sizeof(LogIndexHeader) + capacity * sizeof(LogIndexEntry));
+   }
+   if (indexFd >= 0) {
+      close(indexFd);
+   }
+}
+
+string ProjectLog::segmentName(uint64_t start) {
+   char name[32];
+   snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)start);
+   return dir + name;
+}
+
+/**
+ * open opens the log, creating it if necessary, and recovers
+ * anything written after the last sync
+ * @return false if the log could not be opened
+ */
+bool ProjectLog::open() {
+   if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "ProjectLog: unable to create %s: %s\n", dir.c_str(), strerror(errno));
+      return false;
+   }
+   DIR *d = opendir(dir.c_str());
+   if (d == NULL) {
+      return false;
+   }
+   struct dirent *de;
+   while ((de = readdir(d)) != NULL) {
+      unsigned long long start;
+      char tail[8];
+      if (strlen(de->d_name) == 20 && sscanf(de->d_name, "%16llx%4s", &start, tail) == 2 && strcmp(tail, ".seg") == 0) {
+         segments.push_back(start);
+      }
+   }
+   closedir(d);
+   sort(segments.begin(), segments.end());
+
+   if (!openIndex() || !recover()) {
+      return false;
+   }
+   if (segments.empty()) {
+      segments.push_back(0);
+   }
+   appendFd = ::open(segmentName(segments.back()).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+   if (appendFd < 0) {
+      fprintf(stderr, "ProjectLog: unable to open %s: %s\n", segmentName(segments.back()).c_str(), strerror(errno));
+      return false;
+   }
+   durable = count;
+   return true;
+}
+
+bool ProjectLog::openIndex() {
+   string name = dir + "/index";
+   indexFd = ::open(name.c_str(), O_RDWR | O_CREAT, 0600);
+   if (indexFd < 0) {
+      fprintf(stderr, "ProjectLog: unable to open %s: %s\n", name.c_str(), strerror(errno));
+      return false;
+   }
+   struct stat st;
+   fstat(indexFd, &st);
+   bool fresh = (uint64_t)st.st_size < sizeof(LogIndexHeader);
+   capacity = fresh ? 0 : (st.st_size - sizeof(LogIndexHeader)) / sizeof(LogIndexEntry);
+   if (capacity < INITIAL_INDEX_ENTRIES) {
+      capacity = INITIAL_INDEX_ENTRIES;
+   }
+   size_t len = sizeof(LogIndexHeader) + capacity * sizeof(LogIndexEntry);
+   if ((uint64_t)st.st_size < len && ftruncate(indexFd, len) == -1) {
+      return false;
+   }
+   void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "ProjectLog: unable to map %s: %s\n", name.c_str(), strerror(errno));
+      return false;
+   }
+   index = (LogIndexHeader*)map;
+   entries = (LogIndexEntry*)(index + 1);
+   if (fresh || memcmp(index->magic, LOG_INDEX_MAGIC, sizeof(index->magic)) != 0) {
+      memcpy(index->magic, LOG_INDEX_MAGIC, sizeof(index->magic));
+      index->synced = 0;
+   }
+   return true;
+}
+
+bool ProjectLog::growIndex() {
+   size_t oldLen = sizeof(LogIndexHeader) + capacity * sizeof(LogIndexEntry);
+   size_t len = sizeof(LogIndexHeader) + 2 * capacity * sizeof(LogIndexEntry);
+   if (ftruncate(indexFd, len) == -1) {
+      return false;
+   }
+   void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+   if (map == MAP_FAILED) {
+      return false;
+   }
+   munmap(index, oldLen);
+   index = (LogIndexHeader*)map;
+   entries = (LogIndexEntry*)(index + 1);
+   capacity *= 2;
+   return true;
+}
+
+bool ProjectLog::addEntry(uint64_t updateid, uint64_t offset) {
+   if (count == capacity && !growIndex()) {
+      return false;
+   }
+   entries[count].updateid = updateid;
+   entries[count].offset = offset;
+   count++;
+   return true;
+}
+
+/**
+ * recover trusts the index up to its last sync and rebuilds the rest of it
+ * from the segments.  A frame that is incomplete or not a valid update is
+ * the tail of an interrupted write, the log is truncated in front of it.
+ */
+bool ProjectLog::recover() {
+   uint64_t total = 0;
+   if (!segments.empty()) {
+      struct stat st;
+      if (stat(segmentName(segments.back()).c_str(), &st) == 0) {
+         total = segments.back() + st.st_size;
+      }
+   }
+   uint64_t trusted = index->synced;
+   if (trusted > capacity || (trusted > 0 && entries[trusted - 1].offset >= total)) {
+      //the index is ahead of the data, rebuild all of it
+      trusted = 0;
+   }
+   //the last trusted frame is checked again, the scan resumes from it
+   count = trusted > 0 ? trusted - 1 : 0;
+   uint64_t pos = trusted > 0 ? entries[trusted - 1].offset : 0;
+   uint64_t lastId = count > 0 ? entries[count - 1].updateid : 0;
+   end = pos;
+
+   size_t si = 0;
+   while (si + 1 < segments.size() && segments[si + 1] <= pos) {
+      si++;
+   }
+   for (; si < segments.size(); si++) {
+      if (segments[si] != end && segments[si] > pos) {
+         //a gap between segments, nothing from here on can be trusted
+         break;
+      }
+      string name = segmentName(segments[si]);
+      int fd = ::open(name.c_str(), O_RDWR);
+      if (fd < 0) {
+         break;
+      }
+      struct stat st;
+      fstat(fd, &st);
+      uint64_t size = st.st_size;
+      uint64_t local = pos > segments[si] ? pos - segments[si] : 0;
+      if (size > 0) {
+         uint8_t *p = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+         if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+         }
+         while (local + 16 <= size) {
+            uint32_t len = ntohl(*(uint32_t*)(p + local));
+            uint32_t cmd = ntohl(*(uint32_t*)(p + local + 4));
+            uint64_t updateid = ntohll(*(uint64_t*)(p + local + 8));
+            if (len < 16 || len > LOG_MAX_FRAME || local + len > size || cmd >= MSG_CONTROL_FIRST || updateid <= lastId) {
+               break;
+            }
+            if (!addEntry(updateid, segments[si] + local)) {
+               munmap(p, size);
+               close(fd);
+               return false;
+            }
+            lastId = updateid;
+            local += len;
+         }
+         munmap(p, size);
+      }
+      end = segments[si] + local;
+      if (local < size) {
+         char buf[128];
+         snprintf(buf, sizeof(buf), "discarding %llu bytes from the tail of ", (unsigned long long)(size - local));
+         logln(buf + name, LERROR);
+         if (ftruncate(fd, local) == -1) {
+            close(fd);
+            return false;
+         }
+         fsync(fd);
+         close(fd);
+         si++;
+         break;
+      }
+      close(fd);
+      pos = end;
+   }
+   //anything left over follows a damaged segment
+   while (si < segments.size()) {
+      logln("discarding " + segmentName(segments.back()), LERROR);
+      unlink(segmentName(segments.back()).c_str());
+      segments.pop_back();
+   }
+   index->synced = count;
+   fdatasync(indexFd);
+   return true;
+}
+
+/**
+ * roll starts a new segment once the current one is full.  The old segment
+ * is synced first, so only the newest segment ever needs syncing.
+ */
+bool ProjectLog::roll() {
+   fdatasync(appendFd);
+   int fd = ::open(segmentName(end).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+   if (fd < 0) {
+      fprintf(stderr, "ProjectLog: unable to open %s: %s\n", segmentName(end).c_str(), strerror(errno));
+      return false;
+   }
+   syncDir(dir);
+   close(appendFd);
+   appendFd = fd;
+   segments.push_back(end);
+   return true;
+}
+
+/**
+ * append adds a frame to the end of the log
+ * @param frame the frame to append, the updateid at offset 8 is filled
+ * in when assign is true
+ * @param len the length of the frame
+ * @param assign true to give the frame a new updateid, false to keep
+ * the one it has (copying from another log)
+ * @param seq receives the sequence number to wait on for durability
+ * @return the updateid of the frame, 0 on failure
+ */
+uint64_t ProjectLog::append(uint8_t *frame, int len, bool assign, uint64_t &seq) {
+   uint64_t updateid = 0;
+   if (len < 16) {
+      return 0;
+   }
+   pthread_mutex_lock(&lock);
+   if (end > segments.back() && end - segments.back() + len > segmentSize && !roll()) {
+      pthread_mutex_unlock(&lock);
+      return 0;
+   }
+   if (assign) {
+      //allocated under the lock so that ids increase through the log
+      updateid = store->nextUpdateId();
+      *(uint64_t*)(frame + 8) = htonll(updateid);
+   }
+   else {
+      updateid = ntohll(*(uint64_t*)(frame + 8));
+      if (count > 0 && updateid <= entries[count - 1].updateid) {
+         pthread_mutex_unlock(&lock);
+         return 0;
+      }
+   }
+   if (!writeFully(appendFd, frame, len) || !addEntry(updateid, end)) {
+      //don't leave a partial frame behind for the next append to follow
+      if (ftruncate(appendFd, end - segments.back()) == -1) {
+         fprintf(stderr, "ProjectLog: unable to truncate %s\n", segmentName(segments.back()).c_str());
+      }
+      pthread_mutex_unlock(&lock);
+      return 0;
+   }
+   end += len;
+   seq = count;
+   pthread_mutex_unlock(&lock);
+   return updateid;
+}
+
+/**
+ * sync flushes everything appended so far to disk
+ * @return the sequence number that is now durable
+ */
+uint64_t ProjectLog::sync() {
+   pthread_mutex_lock(&lock);
+   uint64_t n = count;
+   //a roll may close appendFd while we are syncing
+   int fd = dup(appendFd);
+   pthread_mutex_unlock(&lock);
+
+   if (fd >= 0) {
+      fdatasync(fd);
+      close(fd);
+   }
+   //the index may only claim frames that are already on disk
+   pthread_mutex_lock(&lock);
+   if (n > index->synced) {
+      index->synced = n;
+   }
+   pthread_mutex_unlock(&lock);
+   fdatasync(indexFd);
+   return n;
+}
+
+/**
+ * findEntry finds the first index entry after an updateid,
+ * the caller holds the lock
+ * @return the position of the entry, -1 if there is none
+ */
+int ProjectLog::findEntry(uint64_t after) {
+   uint64_t lo = 0;
+   uint64_t hi = count;
+   while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (entries[mid].updateid <= after) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   return lo < count ? (int)lo : -1;
+}
+
+/**
+ * findOffset finds the first index entry, at or after a given one, whose
+ * frame starts at or after an offset, the caller holds the lock
+ * @return the position of the entry, -1 if there is none
+ */
+int ProjectLog::findOffset(uint64_t from, uint64_t offset) {
+   uint64_t lo = from;
+   uint64_t hi = count;
+   while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (entries[mid].offset < offset) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   return lo < count ? (int)lo : -1;
+}
+
+/**
+ * lastUpdate inspector to get the updateid of the newest frame
+ * @return the updateid, 0 for an empty log
+ */
+uint64_t ProjectLog::lastUpdate() {
+   pthread_mutex_lock(&lock);
+   uint64_t updateid = count > 0 ? entries[count - 1].updateid : 0;
+   pthread_mutex_unlock(&lock);
+   return updateid;
+}
+
+/**
+ * scan hands frames from the log to a visitor, in updateid order
+ * @param after only frames after this updateid are visited
+ * @param upto no frames after this updateid are visited
+ * @param v the visitor
+ * @param user passed through to the visitor
+ * @return false on error
+ */
+bool ProjectLog::scan(uint64_t after, uint64_t upto, FrameVisitor v, void *user) {
+   pthread_mutex_lock(&lock);
+   int first = findEntry(after);
+   if (first < 0) {
+      pthread_mutex_unlock(&lock);
+      return true;
+   }
+   //frames before end are complete and never change, so the rest of the
+   //scan can run without the lock while new frames are appended
+   uint64_t start = entries[first].offset;
+   uint64_t stop = end;
+   vector<uint64_t> segs = segments;
+   pthread_mutex_unlock(&lock);
+
+   for (size_t si = 0; si < segs.size(); si++) {
+      uint64_t segEnd = si + 1 < segs.size() ? segs[si + 1] : stop;
+      if (segEnd > stop) {
+         segEnd = stop;
+      }
+      if (segEnd <= start || segEnd <= segs[si]) {
+         continue;
+      }
+      string name = segmentName(segs[si]);
+      int fd = ::open(name.c_str(), O_RDONLY);
+      if (fd < 0) {
+         fprintf(stderr, "ProjectLog: unable to open %s: %s\n", name.c_str(), strerror(errno));
+         return false;
+      }
+      uint64_t size = segEnd - segs[si];
+      uint8_t *p = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (p == MAP_FAILED) {
+         return false;
+      }
+      madvise(p, size, MADV_SEQUENTIAL);
+      bool done = false;
+      uint64_t local = start > segs[si] ? start - segs[si] : 0;
+      while (local + 16 <= size) {
+         uint32_t len = ntohl(*(uint32_t*)(p + local));
+         if (len < 16 || local + len > size) {
+            break;
+         }
+         if (ntohll(*(uint64_t*)(p + local + 8)) > upto || !(*v)(p + local, len, user)) {
+            done = true;
+            break;
+         }
+         local += len;
+      }
+      munmap(p, size);
+      if (done) {
+         break;
+      }
+   }
+   return true;
+}
+
+/**
+ * send hands every frame after an updateid to a visitor as runs of
+ * segment file, frames are not parsed or copied.  Runs are cut on frame
+ * boundaries into pieces of about LOG_SEND_PIECE bytes
+ * @param after only frames after this updateid are included
+ * @param v the visitor
+ * @param user passed through to the visitor
+ * @param frames receives the number of frames handed over
+ * @return false on error
+ */
+bool ProjectLog::send(uint64_t after, SegmentVisitor v, void *user, uint64_t &frames) {
+   frames = 0;
+   pthread_mutex_lock(&lock);
+   int first = findEntry(after);
+   if (first < 0) {
+      pthread_mutex_unlock(&lock);
+      return true;
+   }
+   //segments only ever end on a frame boundary, so every run handed out
+   //below holds whole frames
+   uint64_t start = entries[first].offset;
+   uint64_t stop = end;
+   uint64_t total = count - first;
+   vector<uint64_t> segs = segments;
+   //the offsets the runs are cut at, taken from the index while it can't move
+   vector<uint64_t> cuts;
+   for (int e = first; (e = findOffset(e, entries[e].offset + LOG_SEND_PIECE)) >= 0; ) {
+      cuts.push_back(entries[e].offset);
+   }
+   pthread_mutex_unlock(&lock);
+
+   size_t ci = 0;
+
+   for (size_t si = 0; si < segs.size(); si++) {
+      uint64_t segEnd = si + 1 < segs.size() ? segs[si + 1] : stop;
+      if (segEnd > stop) {
+         segEnd = stop;
+      }
+      if (segEnd <= start || segEnd <= segs[si]) {
+         continue;
+      }
+      string name = segmentName(segs[si]);
+      int fd = ::open(name.c_str(), O_RDONLY);
+      if (fd < 0) {
+         fprintf(stderr, "ProjectLog: unable to open %s: %s\n", name.c_str(), strerror(errno));
+         return false;
+      }
+      uint64_t from = start > segs[si] ? start : segs[si];
+      bool ok = true;
+      while (ok && from < segEnd) {
+         while (ci < cuts.size() && cuts[ci] <= from) {
+            ci++;
+         }
+         uint64_t to = ci < cuts.size() && cuts[ci] < segEnd ? cuts[ci] : segEnd;
+         ok = (*v)(fd, from - segs[si], to - from, user);
+         from = to;
+      }
+      close(fd);
+      if (!ok) {
+         return false;
+      }
+   }
+   frames = total;
+   return true;
+}
+
+LogStore::LogStore(map<string,string> *p) {
+   dir = getStringOption(p, "LOG_DIR", "logstore");
+   segmentSize = (uint64_t)getIntOption(p, "LOG_SEGMENT_SIZE", DEFAULT_SEGMENT_SIZE) << 20;
+   syncWrites = getIntOption(p, "LOG_SYNC", 1) != 0;
+   lastPid = 0;
+   lastId = 0;
+   pthread_mutex_init(&catalogLock, NULL);
+   pthread_mutex_init(&idLock, NULL);
+   pthread_mutex_init(&syncLock, NULL);
+   pthread_cond_init(&syncWork, NULL);
+   pthread_cond_init(&syncDone, NULL);
+}
+
+string LogStore::projectDir(int pid) {
+   char name[16];
+   snprintf(name, sizeof(name), "/%d", pid);
+   return dir + name;
+}
+
+/**
+ * open loads every project under the store's directory and starts the
+ * sync thread
+ * @return false if the store directory is unusable
+ */
+bool LogStore::open() {
+   if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "LogStore: unable to create %s: %s\n", dir.c_str(), strerror(errno));
+      return false;
+   }
+   DIR *d = opendir(dir.c_str());
+   if (d == NULL) {
+      fprintf(stderr, "LogStore: unable to read %s: %s\n", dir.c_str(), strerror(errno));
+      return false;
+   }
+   struct dirent *de;
+   while ((de = readdir(d)) != NULL) {
+      if (!isNumeric(de->d_name)) {
+         continue;
+      }
+      int pid = atoi(de->d_name);
+      ProjectInfo *pi = readProject(projectDir(pid));
+      if (pi == NULL) {
+         continue;
+      }
+      pi->lpid = pid;
+      catalog[pid] = pi;
+      if (pid > lastPid) {
+         lastPid = pid;
+      }
+      ProjectLog *log = new ProjectLog(this, projectDir(pid), segmentSize);
+      if (!log->open()) {
+         logln("unable to open the update log for " + projectDir(pid), LERROR);
+         delete log;
+         continue;
+      }
+      logs[pid] = log;
+      if (log->lastUpdate() > lastId) {
+         lastId = log->lastUpdate();
+      }
+   }
+   closedir(d);
+
+   char buf[128];
+   snprintf(buf, sizeof(buf), "LogStore: %d projects, last update %llu", (int)catalog.size(), (unsigned long long)lastId);
+   logln(buf, LINFO);
+
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   pthread_create(&tid, &attr, run, (void*)this);
+   return true;
+}
+
+/**
+ * nextUpdateId allocates an updateid, ids increase across the whole store
+ * @return the new updateid
+ */
+uint64_t LogStore::nextUpdateId() {
+   pthread_mutex_lock(&idLock);
+   uint64_t updateid = ++lastId;
+   pthread_mutex_unlock(&idLock);
+   return updateid;
+}
+
+ProjectLog *LogStore::getLog(int pid) {
+   ProjectLog *log = NULL;
+   pthread_mutex_lock(&catalogLock);
+   map<int,ProjectLog*>::iterator li = logs.find(pid);
+   if (li != logs.end()) {
+      log = (*li).second;
+   }
+   else if (catalog.find(pid) != catalog.end()) {
+      //snapshots and new projects get a log the first time one is needed
+      log = new ProjectLog(this, projectDir(pid), segmentSize);
+      if (log->open()) {
+         logs[pid] = log;
+      }
+      else {
+         delete log;
+         log = NULL;
+      }
+   }
+   pthread_mutex_unlock(&catalogLock);
+   return log;
+}
+
+/**
+ * waitDurable hands a log to the sync thread and, if writes are synchronous,
+ * waits for it to sync at least up to seq
+ */
+void LogStore::waitDurable(ProjectLog *log, uint64_t seq) {
+   pthread_mutex_lock(&syncLock);
+   pending.insert(log);
+   pthread_cond_signal(&syncWork);
+   while (syncWrites && log->durable < seq) {
+      pthread_cond_wait(&syncDone, &syncLock);
+   }
+   pthread_mutex_unlock(&syncLock);
+}
+
+/**
+ * run is the sync thread.  Every log that was appended to while the previous
+ * round of syncs was running is synced once in the next round, no matter how
+ * many updates it received in the meantime.
+ */
+void *LogStore::run(void *arg) {
+   LogStore *ls = (LogStore*)arg;
+   set<ProjectLog*> work;
+   while (true) {
+      pthread_mutex_lock(&ls->syncLock);
+      while (ls->pending.empty()) {
+         pthread_cond_wait(&ls->syncWork, &ls->syncLock);
+      }
+      work.swap(ls->pending);
+      pthread_mutex_unlock(&ls->syncLock);
+
+      map<ProjectLog*,uint64_t> synced;
+      for (set<ProjectLog*>::iterator wi = work.begin(); wi != work.end(); wi++) {
+         synced[*wi] = (*wi)->sync();
+      }
+      work.clear();
+
+      pthread_mutex_lock(&ls->syncLock);
+      for (map<ProjectLog*,uint64_t>::iterator si = synced.begin(); si != synced.end(); si++) {
+         if ((*si).second > (*si).first->durable) {
+            (*si).first->durable = (*si).second;
+         }
+      }
+      pthread_cond_broadcast(&ls->syncDone);
+      pthread_mutex_unlock(&ls->syncLock);
+   }
+   return NULL;
+}
+
+/**
+ * append stores a new update
+ * @param pid the local pid of the project
+ * @param frame the update, its updateid is filled in
+ * @param len the length of the update
+ * @return the new updateid, 0 on failure
+ */
+uint64_t LogStore::append(int pid, uint8_t *frame, int len) {
+   ProjectLog *log = getLog(pid);
+   if (log == NULL) {
+      return 0;
+   }
+   uint64_t seq;
+   uint64_t updateid = log->append(frame, len, true, seq);
+   if (updateid != 0) {
+      waitDurable(log, seq);
+   }
+   return updateid;
+}
+
+struct CopyArgs {
+   ProjectLog *to;
+   uint64_t seq;
+   bool ok;
+};
+
+static bool copyFrame(const uint8_t *frame, int len, void *user) {
+   CopyArgs *args = (CopyArgs*)user;
+   //frames keep their updateid, so append leaves them untouched
+   args->ok = args->to->append((uint8_t*)frame, len, false, args->seq) != 0;
+   return args->ok;
+}
+
+/**
+ * copy copies the updates of one project into another, keeping their
+ * updateids, used when forking
+ * @param from the local pid to copy from
+ * @param to the local pid to copy to
+ * @param upto the last updateid to copy
+ * @return false on error
+ */
+bool LogStore::copy(int from, int to, uint64_t upto) {
+   ProjectLog *src = getLog(from);
+   ProjectLog *dst = getLog(to);
+   if (src == NULL || dst == NULL) {
+      return false;
+   }
+   CopyArgs args = {dst, 0, true};
+   if (!src->scan(0, upto, copyFrame, &args)) {
+      return false;
+   }
+   if (args.seq > 0) {
+      waitDurable(dst, args.seq);
+   }
+   return args.ok;
+}
+
+/**
+ * scan hands the updates of a project to a visitor, in updateid order
+ * @param pid the local pid of the project
+ * @param after only updates after this updateid are visited
+ * @param v the visitor
+ * @param user passed through to the visitor
+ * @return false on error
+ */
+bool LogStore::scan(int pid, uint64_t after, FrameVisitor v, void *user) {
+   ProjectLog *log = getLog(pid);
+   if (log == NULL) {
+      return false;
+   }
+   return log->scan(after, ~0ULL, v, user);
+}
+
+/**
+ * send hands the updates of a project to a visitor as runs of segment
+ * file, for clients that receive every update exactly as it is stored
+ * @param pid the local pid of the project
+ * @param after only updates after this updateid are included
+ * @param v the visitor
+ * @param user passed through to the visitor
+ * @param frames receives the number of updates handed over
+ * @return false on error
+ */
+bool LogStore::send(int pid, uint64_t after, SegmentVisitor v, void *user, uint64_t &frames) {
+   frames = 0;
+   ProjectLog *log = getLog(pid);
+   if (log == NULL) {
+      return false;
+   }
+   return log->send(after, v, user, frames);
+}
+
+/**
+ * writeProject saves a project's description, replacing the old one only
+ * once the new one is safely on disk
+ */
+bool LogStore::writeProject(const ProjectInfo &info) {
+   string pdir = projectDir(info.lpid);
+   if (mkdir(pdir.c_str(), 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "LogStore: unable to create %s: %s\n", pdir.c_str(), strerror(errno));
+      return false;
+   }
+   Buffer b;
+   b.writeUTF(info.hash);
+   b.writeUTF(info.gpid);
+   b.writeUTF(info.desc);
+   b.writeLong(info.pub);
+   b.writeLong(info.sub);
+   b.writeInt(info.parent);
+   b.writeLong(info.snapupdateid);
+   b.writeInt(info.owner);
+   b.writeInt(info.proto);
+
+   string tmp = pdir + "/project.tmp";
+   int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd < 0) {
+      fprintf(stderr, "LogStore: unable to create %s: %s\n", tmp.c_str(), strerror(errno));
+      return false;
+   }
+   bool ok = writeFully(fd, b.get_buf(), b.size()) && fsync(fd) == 0;
+   close(fd);
+   if (!ok || rename(tmp.c_str(), (pdir + "/project").c_str()) == -1) {
+      fprintf(stderr, "LogStore: unable to save %s\n", pdir.c_str());
+      return false;
+   }
+   syncDir(pdir);
+   return true;
+}
+
+ProjectInfo *LogStore::readProject(const string &pdir) {
+   string name = pdir + "/project";
+   FILE *f = fopen(name.c_str(), "rb");
+   if (f == NULL) {
+      return NULL;
+   }
+   Buffer b;
+   uint8_t buf[1024];
+   size_t n;
+   while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      b.write(buf, n);
+   }
+   fclose(f);
+
+   char *hash = b.readUTF();
+   char *gpid = b.readUTF();
+   char *desc = b.readUTF();
+   ProjectInfo *pi = NULL;
+   if (hash && gpid && desc) {
+      pi = new ProjectInfo(0, desc);
+      pi->hash = hash;
+      pi->gpid = gpid;
+      pi->pub = b.readLong();
+      pi->sub = b.readLong();
+      pi->parent = b.readInt();
+      pi->snapupdateid = b.readLong();
+      pi->owner = b.readInt();
+      pi->proto = b.readInt();
+      if (b.has_error()) {
+         delete pi;
+         pi = NULL;
+      }
+   }
+   if (pi == NULL) {
+      logln("unreadable project description " + name, LERROR);
+   }
+   delete [] hash;
+   delete [] gpid;
+   delete [] desc;
+   return pi;
+}
+
+/**
+ * createProject adds a project to the store
+ * @param info the project to add, lpid is ignored
+ * @return the local pid of the new project, -1 on failure
+ */
+int LogStore::createProject(const ProjectInfo &info) {
+   pthread_mutex_lock(&catalogLock);
+   ProjectInfo *pi = new ProjectInfo(info);
+   pi->lpid = ++lastPid;
+   pi->connected = 0;
+   int pid = pi->lpid;
+   if (writeProject(*pi)) {
+      catalog[pid] = pi;
+   }
+   else {
+      delete pi;
+      pid = -1;
+   }
+   pthread_mutex_unlock(&catalogLock);
+   return pid;
+}
+
+/**
+ * saveProject rewrites the description of an existing project
+ * @param info the project to save
+ * @return false on failure
+ */
+bool LogStore::saveProject(const ProjectInfo &info) {
+   bool ok = false;
+   pthread_mutex_lock(&catalogLock);
+   map<int,ProjectInfo*>::iterator ci = catalog.find(info.lpid);
+   if (ci != catalog.end() && writeProject(info)) {
+      *(*ci).second = info;
+      ok = true;
+   }
+   pthread_mutex_unlock(&catalogLock);
+   return ok;
+}
+
+/**
+ * getProject gets a copy of a project's description
+ * @param pid the local pid of the project
+ * @return the project, which the caller must delete, or NULL
+ */
+ProjectInfo *LogStore::getProject(int pid) {
+   ProjectInfo *pi = NULL;
+   pthread_mutex_lock(&catalogLock);
+   map<int,ProjectInfo*>::iterator ci = catalog.find(pid);
+   if (ci != catalog.end()) {
+      pi = new ProjectInfo(*(*ci).second);
+      map<int,ProjectInfo*>::iterator parent = catalog.find(pi->parent);
+      if (parent != catalog.end()) {
+         pi->pdesc = (*parent).second->desc;
+      }
+   }
+   pthread_mutex_unlock(&catalogLock);
+   return pi;
+}
+
+/**
+ * getProjects gets copies of the descriptions of every project for a binary
+ * @param hash the hash of the binary
+ * @param plist receives the projects, which the caller must delete
+ */
+void LogStore::getProjects(const string &hash, vector<ProjectInfo*> &plist) {
+   pthread_mutex_lock(&catalogLock);
+   for (map<int,ProjectInfo*>::iterator ci = catalog.begin(); ci != catalog.end(); ci++) {
+      if ((*ci).second->hash == hash) {
+         ProjectInfo *pi = new ProjectInfo(*(*ci).second);
+         map<int,ProjectInfo*>::iterator parent = catalog.find(pi->parent);
+         if (parent != catalog.end()) {
+            pi->pdesc = (*parent).second->desc;
+         }
+         plist.push_back(pi);
+      }
+   }
+   pthread_mutex_unlock(&catalogLock);
+}
+
+/**
+ * findProject maps a gpid onto a local pid
+ * @param gpid the global pid of the project
+ * @return the local pid, -1 if there is no such project
+ */
+int LogStore::findProject(const string &gpid) {
+   int pid = -1;
+   pthread_mutex_lock(&catalogLock);
+   for (map<int,ProjectInfo*>::iterator ci = catalog.begin(); ci != catalog.end(); ci++) {
+      if ((*ci).second->gpid == gpid) {
+         pid = (*ci).first;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&catalogLock);
+   return pid;
+}
@@ -0,0 +1,313 @@
+/*
+   collabREate logstore.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __LOGSTORE_H
+#define __LOGSTORE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "proj_info.h"
+
+using namespace std;
+
+#define LOG_INDEX_MAGIC "CRLOGIDX"
+
+//largest frame recovery will accept
+#define LOG_MAX_FRAME 0x1000000
+
+//catch up hands segment runs over in pieces of about this size, so that a
+//client's send lock is never held for a whole segment
+#define LOG_SEND_PIECE 0x80000
+
+/**
+ * LogIndexHeader
+ * The first bytes of a project's index file
+ */
+struct LogIndexHeader {
+   char magic[8];
+   //number of entries whose updates are known to be on disk, anything
+   //after this is rebuilt from the segments when the log is opened
+   uint64_t synced;
+};
+
+/**
+ * LogIndexEntry
+ * Maps an updateid onto the position of its frame in the project's log.
+ * The offset is logical, segments are named for the logical offset of
+ * their first byte
+ */
+struct LogIndexEntry {
+   uint64_t updateid;
+   uint64_t offset;
+};
+
+/**
+ * FrameVisitor receives each frame read back from a log
+ * @param frame a complete update frame, updateid included
+ * @param len the length of the frame
+ * @param user the value handed to scan
+ * @return false to stop the scan
+ */
+typedef bool (*FrameVisitor)(const uint8_t *frame, int len, void *user);
+
+/**
+ * SegmentVisitor receives runs of whole frames still sitting in a segment
+ * file, so that they can be handed to the kernel without being read
+ * @param fd the open segment file, closed once the visitor returns
+ * @param offset the file offset of the first frame in the run
+ * @param len the length of the run
+ * @param user the value handed to send
+ * @return false to stop
+ */
+typedef bool (*SegmentVisitor)(int fd, uint64_t offset, uint64_t len, void *user);
+
+class LogStore;
+
+/**
+ * ProjectLog
+ * The update log of a single project.  Updates are appended exactly as they
+ * are sent to plugins, so catching up is a matter of finding the first frame
+ * in the index and reading sequentially from there.  The log is split into
+ * segment files so no single file grows without bound.
+ */
+class ProjectLog {
+public:
+   ProjectLog(LogStore *owner, const string &dir, uint64_t segmentSize);
+   ~ProjectLog();
+
+   /**
+    * open opens the log, creating it if necessary, and recovers
+    * anything written after the last sync
+    * @return false if the log could not be opened
+    */
+   bool open();
+
+   /**
+    * append adds a frame to the end of the log
+    * @param frame the frame to append, the updateid at offset 8 is filled
+    * in when assign is true
+    * @param len the length of the frame
+    * @param assign true to give the frame a new updateid, false to keep
+    * the one it has (copying from another log)
+    * @param seq receives the sequence number to wait on for durability
+    * @return the updateid of the frame, 0 on failure
+    */
+   uint64_t append(uint8_t *frame, int len, bool assign, uint64_t &seq);
+
+   /**
+    * scan hands frames from the log to a visitor, in updateid order
+    * @param after only frames after this updateid are visited
+    * @param upto no frames after this updateid are visited
+    * @param v the visitor
+    * @param user passed through to the visitor
+    * @return false on error
+    */
+   bool scan(uint64_t after, uint64_t upto, FrameVisitor v, void *user);
+
+   /**
+    * send hands every frame after an updateid to a visitor as runs of
+    * segment file, frames are not parsed or copied
+    * @param after only frames after this updateid are included
+    * @param v the visitor
+    * @param user passed through to the visitor
+    * @param frames receives the number of frames handed over
+    * @return false on error
+    */
+   bool send(uint64_t after, SegmentVisitor v, void *user, uint64_t &frames);
+
+   /**
+    * sync flushes everything appended so far to disk
+    * @return the sequence number that is now durable
+    */
+   uint64_t sync();
+
+   /**
+    * lastUpdate inspector to get the updateid of the newest frame
+    * @return the updateid, 0 for an empty log
+    */
+   uint64_t lastUpdate();
+
+   //updated by the LogStore sync thread
+   uint64_t durable;
+
+private:
+   bool openIndex();
+   bool growIndex();
+   bool recover();
+   bool addEntry(uint64_t updateid, uint64_t offset);
+   bool roll();
+   string segmentName(uint64_t start);
+   int findEntry(uint64_t after);
+   int findOffset(uint64_t from, uint64_t offset);
+
+   LogStore *store;
+   string dir;
+   uint64_t segmentSize;
+   pthread_mutex_t lock;
+
+   //logical start of each segment, the last one is open for appending
+   vector<uint64_t> segments;
+   int appendFd;
+   //logical end of the last complete frame
+   uint64_t end;
+
+   int indexFd;
+   LogIndexHeader *index;
+   LogIndexEntry *entries;
+   uint64_t capacity;
+   uint64_t count;
+};
+
+/**
+ * LogStore
+ * An embedded, append only store for the server's projects and updates
+ * that needs nothing more than a directory.  Each project lives in its own
+ * subdirectory holding its description, its log segments and the index over
+ * them.  Updates are durable before they are acknowledged: writers that
+ * arrive while a sync is in progress are all covered by the next one, so
+ * busy projects pay for far fewer syncs than they post updates.
+ */
+class LogStore {
+public:
+   LogStore(map<string,string> *p);
+
+   /**
+    * open loads every project under the store's directory and starts the
+    * sync thread
+    * @return false if the store directory is unusable
+    */
+   bool open();
+
+   /**
+    * append stores a new update
+    * @param pid the local pid of the project
+    * @param frame the update, its updateid is filled in
+    * @param len the length of the update
+    * @return the new updateid, 0 on failure
+    */
+   uint64_t append(int pid, uint8_t *frame, int len);
+
+   /**
+    * copy copies the updates of one project into another, keeping their
+    * updateids, used when forking
+    * @param from the local pid to copy from
+    * @param to the local pid to copy to
+    * @param upto the last updateid to copy
+    * @return false on error
+    */
+   bool copy(int from, int to, uint64_t upto);
+
+   /**
+    * scan hands the updates of a project to a visitor, in updateid order
+    * @param pid the local pid of the project
+    * @param after only updates after this updateid are visited
+    * @param v the visitor
+    * @param user passed through to the visitor
+    * @return false on error
+    */
+   bool scan(int pid, uint64_t after, FrameVisitor v, void *user);
+
+   /**
+    * send hands the updates of a project to a visitor as runs of segment
+    * file, for clients that receive every update exactly as it is stored
+    * @param pid the local pid of the project
+    * @param after only updates after this updateid are included
+    * @param v the visitor
+    * @param user passed through to the visitor
+    * @param frames receives the number of updates handed over
+    * @return false on error
+    */
+   bool send(int pid, uint64_t after, SegmentVisitor v, void *user, uint64_t &frames);
+
+   /**
+    * createProject adds a project to the store
+    * @param info the project to add, lpid is ignored
+    * @return the local pid of the new project, -1 on failure
+    */
+   int createProject(const ProjectInfo &info);
+
+   /**
+    * saveProject rewrites the description of an existing project
+    * @param info the project to save
+    * @return false on failure
+    */
+   bool saveProject(const ProjectInfo &info);
+
+   /**
+    * getProject gets a copy of a project's description
+    * @param pid the local pid of the project
+    * @return the project, which the caller must delete, or NULL
+    */
+   ProjectInfo *getProject(int pid);
+
+   /**
+    * getProjects gets copies of the descriptions of every project for a binary
+    * @param hash the hash of the binary
+    * @param plist receives the projects, which the caller must delete
+    */
+   void getProjects(const string &hash, vector<ProjectInfo*> &plist);
+
+   /**
+    * findProject maps a gpid onto a local pid
+    * @param gpid the global pid of the project
+    * @return the local pid, -1 if there is no such project
+    */
+   int findProject(const string &gpid);
+
+   /**
+    * nextUpdateId allocates an updateid, ids increase across the whole store
+    * @return the new updateid
+    */
+   uint64_t nextUpdateId();
+
+   static void *run(void *arg);
+
+private:
+   ProjectLog *getLog(int pid);
+   bool writeProject(const ProjectInfo &info);
+   ProjectInfo *readProject(const string &dir);
+   string projectDir(int pid);
+   void waitDurable(ProjectLog *log, uint64_t seq);
+
+   string dir;
+   uint64_t segmentSize;
+   bool syncWrites;
+
+   pthread_mutex_t catalogLock;
+   map<int,ProjectInfo*> catalog;
+   map<int,ProjectLog*> logs;
+   int lastPid;
+
+   pthread_mutex_t idLock;
+   uint64_t lastId;
+
+   //group commit
+   pthread_mutex_t syncLock;
+   pthread_cond_t syncWork;
+   pthread_cond_t syncDone;
+   set<ProjectLog*> pending;
+};
+
+#endif
@@ -0,0 +1,536 @@
+/*
+   collabREate maintenance.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "db_support.h"
+#include "maintenance.h"
+
+using namespace std;
+
+#define DEFAULT_COMPACT_INTERVAL 300
+#define DEFAULT_COMPACT_MIN_UPDATES 1000
+//how often idle projects are looked for, in seconds
+#define ARCHIVE_CHECK_INTERVAL 3600
+//how often deleted projects are looked for, in seconds
+#define PURGE_CHECK_INTERVAL 10
+#define DEFAULT_PURGE_BATCH 5000
+#define DEFAULT_PURGE_DELAY 100   //ms
+
+/**
+ * @param dbm the connection manager that owns this Maintenance
+ * @param p the server configuration
+ */
+Maintenance::Maintenance(DatabaseConnectionManager *dbm, map<string,string> *p) {
+   cm = dbm;
+   props = p;
+   dbConn = NULL;
+   sem_init(&dirty_sem, 0, 1);
+   interval = getIntOption(p, "COMPACT_INTERVAL", DEFAULT_COMPACT_INTERVAL);
+   minUpdates = getIntOption(p, "COMPACT_MIN_UPDATES", DEFAULT_COMPACT_MIN_UPDATES);
+   archiveDays = getIntOption(p, "ARCHIVE_DAYS", 0);
+   purgeBatch = getIntOption(p, "PURGE_BATCH", DEFAULT_PURGE_BATCH);
+   purgeDelay = getIntOption(p, "PURGE_DELAY", DEFAULT_PURGE_DELAY);
+   if (purgeBatch <= 0) {
+      purgeBatch = DEFAULT_PURGE_BATCH;
+   }
+
+   keyedCommands = "{";
+   for (uint32_t cmd = 0; cmd < MSG_CONTROL_FIRST; cmd++) {
+      if (updateKeyLength(cmd) >= 0) {
+         char buf[16];
+         snprintf(buf, sizeof(buf), keyedCommands.length() > 1 ? ",%u" : "%u", cmd);
+         keyedCommands += buf;
+      }
+   }
+   keyedCommands += "}";
+}
+
+void Maintenance::init_queries() {
+   //only the maintenance thread uses this connection, so unlike the
+   //connection manager's statements these need no semaphores
+   PGresult *res = PQprepare(dbConn, "lastCheckpoint",
+                   "select coalesce(max(updateid),0) from checkpoints where pid = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "lastCheckpoint: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "countUpdates",
+                   "select count(*) from updates where pid = $1 and updateid > $2 and updateid <= $3;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "countUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //updates stored before supersession keys existed
+   res = PQprepare(dbConn, "unkeyedUpdates",
+                   "select updateid,data,dictid from updates where pid = $1 and updateid > $2 and updateid <= $3 "
+                   "and supkey is null and cmd = any($4::int4[]);",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "unkeyedUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "setUpdateKey",
+                   "update updates set supkey = $3 where updateid = $1 and pid = $2;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "setUpdateKey: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //only keys that received an update since the last checkpoint can have
+   //anything new to supersede
+   res = PQprepare(dbConn, "compactUpdates",
+                   "with s as (update updates u set superseded = true "
+                   "where u.pid = $1 and u.updateid <= $3 and not u.superseded and u.supkey is not null "
+                   "and exists (select 1 from updates v where v.pid = $1 and v.supkey = u.supkey "
+                   "and v.updateid > u.updateid and v.updateid > $2 and v.updateid <= $3) "
+                   "returning octet_length(u.data) as n) "
+                   "insert into checkpoints (pid,updateid,superseded,bytes) "
+                   "select $1, $3, count(*), coalesce(sum(n),0) from s returning superseded,bytes;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "compactUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "deletedProjects",
+                   "select pid from projects where deleted order by pid;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "deletedProjects: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //each batch is its own short transaction, so the locks it takes and the
+   //WAL it generates stay small
+   res = PQprepare(dbConn, "purgeUpdates",
+                   "delete from updates where pid = $1 and updateid in "
+                   "(select updateid from updates where pid = $1 limit $2);",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "purgeUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "purgeForks",
+                   "delete from forklist where child = $1 or parent = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "purgeForks: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "purgeProject",
+                   "delete from projects where pid = $1 and deleted;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "purgeProject: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+}
+
+/**
+ * start kicks off the maintenance thread
+ */
+void Maintenance::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   pthread_create(&tid, &attr, run, (void*)this);
+}
+
+/**
+ * touch records that a project has received a new update
+ * @param pid the local pid of the project
+ * @param updateid the id of the new update
+ */
+void Maintenance::touch(int pid, uint64_t updateid) {
+   sem_wait(&dirty_sem);
+   uint64_t &last = dirty[pid];
+   if (updateid > last) {
+      last = updateid;
+   }
+   sem_post(&dirty_sem);
+}
+
+/**
+ * forget drops what is known about a project's checkpoints, used when
+ * its updates have been archived or restored
+ * @param pid the local pid of the project
+ */
+void Maintenance::forget(int pid) {
+   sem_wait(&dirty_sem);
+   dirty.erase(pid);
+   forgotten.insert(pid);
+   sem_post(&dirty_sem);
+}
+
+/**
+ * seed marks every project that has updates as dirty, so that history
+ * stored before the server started gets compacted too
+ */
+void Maintenance::seed() {
+   PGresult *rset = PQexecParams(dbConn,
+                       "select p.pid, (select max(u.updateid) from updates u where u.pid = p.pid) from projects p;",
+                       0, NULL, NULL, NULL, NULL, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "seed: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      int rows = PQntuples(rset);
+      for (int i = 0; i < rows; i++) {
+         if (!PQgetisnull(rset, i, 1)) {
+            touch(ntohl(*(int*)PQgetvalue(rset, i, 0)), ntohll(*(uint64_t*)PQgetvalue(rset, i, 1)));
+         }
+      }
+   }
+   PQclear(rset);
+}
+
+/**
+ * lastCheckpoint finds the updateid a project was last compacted up to
+ * @param pid the local pid of the project
+ * @return the updateid of the last checkpoint, 0 if there is none
+ */
+uint64_t Maintenance::lastCheckpoint(int pid) {
+   map<int,uint64_t>::iterator ci = checkpoints.find(pid);
+   if (ci != checkpoints.end()) {
+      return (*ci).second;
+   }
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int npid = htonl(pid);
+   const char * const parms[1] = {(char*)&npid};
+   uint64_t updateid = 0;
+   PGresult *rset = PQexecPrepared(dbConn, "lastCheckpoint", 1, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "lastCheckpoint: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+      checkpoints[pid] = updateid;
+   }
+   PQclear(rset);
+   return updateid;
+}
+
+/**
+ * countUpdates counts the updates a project received in an interval
+ * @param pid the local pid of the project
+ * @param from the interval starts after this updateid
+ * @param to the last updateid in the interval
+ * @return the number of updates, -1 on error
+ */
+int64_t Maintenance::countUpdates(int pid, uint64_t from, uint64_t to) {
+   static const int plens[3] = {4, 8, 8};
+   static const int pformats[3] = {1, 1, 1};
+   pid = htonl(pid);
+   from = htonll(from);
+   to = htonll(to);
+   const char * const parms[3] = {(char*)&pid, (char*)&from, (char*)&to};
+   int64_t count = -1;
+   PGresult *rset = PQexecPrepared(dbConn, "countUpdates", 3, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "countUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      count = (int64_t)ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+   return count;
+}
+
+/**
+ * keyUpdates fills in the supersession key of updates that were stored
+ * before keys were computed on insert
+ * @param pid the local pid of the project
+ * @param from the interval starts after this updateid
+ * @param to the last updateid in the interval
+ * @return false on error
+ */
+bool Maintenance::keyUpdates(int pid, uint64_t from, uint64_t to) {
+   static const int plens[4] = {4, 8, 8, 0};
+   static const int pformats[4] = {1, 1, 1, 0};
+   int npid = htonl(pid);
+   from = htonll(from);
+   to = htonll(to);
+   const char * const parms[4] = {(char*)&npid, (char*)&from, (char*)&to, keyedCommands.c_str()};
+   PGresult *rset = PQexecPrepared(dbConn, "unkeyedUpdates", 4, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "unkeyedUpdates: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+      return false;
+   }
+   bool ok = true;
+   int rows = PQntuples(rset);
+   Buffer update;
+   for (int i = 0; i < rows && ok; i++) {
+      const uint8_t *data = (const uint8_t*)PQgetvalue(rset, i, 1);
+      int dlen = PQgetlength(rset, i, 1);
+      if (!PQgetisnull(rset, i, 2)) {
+         update.reset();
+         if (!cm->unpackUpdate(data, dlen, ntohl(*(int*)PQgetvalue(rset, i, 2)), update)) {
+            continue;
+         }
+         data = update.get_buf();
+         dlen = update.size();
+      }
+      Buffer key;
+      if (!updateKey(data, dlen, key)) {
+         continue;
+      }
+      const int klens[3] = {8, 4, key.size()};
+      static const int kformats[3] = {1, 1, 1};
+      const char * const kparms[3] = {PQgetvalue(rset, i, 0), (char*)&npid, (char*)key.get_buf()};
+      PGresult *res = PQexecPrepared(dbConn, "setUpdateKey", 3, kparms, klens, kformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "setUpdateKey: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(res);
+   }
+   PQclear(rset);
+   return ok;
+}
+
+/**
+ * compact marks the superseded updates of a project and records a checkpoint,
+ * the whole thing is a single transaction so a failure leaves no trace
+ * @param pid the local pid of the project
+ * @param from the updateid of the previous checkpoint
+ * @param to the updateid of the new checkpoint
+ * @return false on error
+ */
+bool Maintenance::compact(int pid, uint64_t from, uint64_t to) {
+   PGresult *res = PQexec(dbConn, "BEGIN;");
+   PQclear(res);
+
+   bool ok = keyUpdates(pid, from, to);
+   if (ok) {
+      static const int plens[3] = {4, 8, 8};
+      static const int pformats[3] = {1, 1, 1};
+      int npid = htonl(pid);
+      uint64_t nfrom = htonll(from);
+      uint64_t nto = htonll(to);
+      const char * const parms[3] = {(char*)&npid, (char*)&nfrom, (char*)&nto};
+      PGresult *rset = PQexecPrepared(dbConn, "compactUpdates", 3, parms, plens, pformats, 1);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+         fprintf(stderr, "compactUpdates: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      else {
+         char buf[128];
+         snprintf(buf, sizeof(buf), "compacted project %d through update %llu: %llu updates, %llu bytes superseded",
+                  pid, (unsigned long long)to,
+                  (unsigned long long)ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0)),
+                  (unsigned long long)ntohll(*(uint64_t*)PQgetvalue(rset, 0, 1)));
+         logln(buf, LINFO);
+      }
+      PQclear(rset);
+   }
+
+   res = PQexec(dbConn, ok ? "COMMIT;" : "ROLLBACK;");
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "compact: %s\n", PQerrorMessage(dbConn));
+      ok = false;
+   }
+   PQclear(res);
+   if (ok) {
+      checkpoints[pid] = to;
+   }
+   return ok;
+}
+
+/**
+ * compactAll compacts every dirty project that has received enough updates
+ * since its last checkpoint
+ */
+void Maintenance::compactAll() {
+   map<int,uint64_t> work;
+   set<int> stale;
+   sem_wait(&dirty_sem);
+   work.swap(dirty);
+   stale.swap(forgotten);
+   sem_post(&dirty_sem);
+   for (set<int>::iterator si = stale.begin(); si != stale.end(); si++) {
+      checkpoints.erase(*si);
+   }
+
+   for (map<int,uint64_t>::iterator wi = work.begin(); wi != work.end(); wi++) {
+      int pid = (*wi).first;
+      uint64_t to = (*wi).second;
+      uint64_t from = lastCheckpoint(pid);
+      if (to <= from) {
+         continue;
+      }
+      int64_t count = countUpdates(pid, from, to);
+      if (count < minUpdates || !compact(pid, from, to)) {
+         //try again once more updates have arrived
+         touch(pid, to);
+      }
+   }
+}
+
+/**
+ * purge removes a deleted project a batch of updates at a time, pausing
+ * PURGE_DELAY ms between batches, then removes the project itself
+ * @param pid the local pid of the project
+ * @return false on error
+ */
+bool Maintenance::purge(int pid) {
+   static const int plens[2] = {4, 4};
+   static const int pformats[2] = {1, 1};
+   int npid = htonl(pid);
+   int nbatch = htonl(purgeBatch);
+   const char * const parms[2] = {(char*)&npid, (char*)&nbatch};
+   struct timeval start, end;
+   gettimeofday(&start, NULL);
+   long long total = 0;
+   int batches = 0;
+   while (true) {
+      PGresult *res = PQexecPrepared(dbConn, "purgeUpdates", 2, parms, plens, pformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "purgeUpdates: %s\n", PQerrorMessage(dbConn));
+         PQclear(res);
+         return false;
+      }
+      int n = atoi(PQcmdTuples(res));
+      PQclear(res);
+      if (n == 0) {
+         break;
+      }
+      total += n;
+      if (++batches % 100 == 0) {
+         char buf[128];
+         snprintf(buf, sizeof(buf), "purging project %d: %lld updates removed so far", pid, total);
+         logln(buf, LINFO);
+      }
+      if (purgeDelay > 0) {
+         usleep(purgeDelay * 1000);
+      }
+   }
+
+   //the project row goes last, cascading to its checkpoints and to any
+   //update that was posted while the purge was running
+   bool ok = true;
+   PGresult *res = PQexec(dbConn, "BEGIN;");
+   PQclear(res);
+   res = PQexecPrepared(dbConn, "purgeForks", 1, parms, plens, pformats, 1);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "purgeForks: %s\n", PQerrorMessage(dbConn));
+      ok = false;
+   }
+   PQclear(res);
+   if (ok) {
+      res = PQexecPrepared(dbConn, "purgeProject", 1, parms, plens, pformats, 1);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "purgeProject: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(res);
+   }
+   res = PQexec(dbConn, ok ? "COMMIT;" : "ROLLBACK;");
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "purge: %s\n", PQerrorMessage(dbConn));
+      ok = false;
+   }
+   PQclear(res);
+   if (ok) {
+      forget(pid);
+      gettimeofday(&end, NULL);
+      char buf[128];
+      snprintf(buf, sizeof(buf), "purged project %d: %lld updates in %d batches, %ld s", pid, total, batches,
+               (long)(end.tv_sec - start.tv_sec));
+      logln(buf, LINFO);
+   }
+   return ok;
+}
+
+/**
+ * purgeAll purges every project that has been marked as deleted
+ */
+void Maintenance::purgeAll() {
+   PGresult *rset = PQexecPrepared(dbConn, "deletedProjects", 0, NULL, NULL, NULL, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "deletedProjects: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+      return;
+   }
+   vector<int> pids;
+   int rows = PQntuples(rset);
+   for (int i = 0; i < rows; i++) {
+      pids.push_back(ntohl(*(int*)PQgetvalue(rset, i, 0)));
+   }
+   PQclear(rset);
+   for (size_t i = 0; i < pids.size(); i++) {
+      purge(pids[i]);
+   }
+}
+
+/**
+ * run is the maintenance thread.  It purges deleted projects as soon as it
+ * notices them, compacts every COMPACT_INTERVAL seconds and looks for idle
+ * projects to archive every ARCHIVE_CHECK_INTERVAL seconds
+ */
+void *Maintenance::run(void *arg) {
+   Maintenance *m = (Maintenance*)arg;
+   m->dbConn = connectDatabase(m->props);
+   if (m->dbConn == NULL) {
+      logln("Maintenance unable to connect to the database, compaction and purging disabled", LERROR);
+      return NULL;
+   }
+   m->init_queries();
+   if (m->interval > 0) {
+      m->seed();
+   }
+   logln("Maintenance running...", LINFO);
+   time_t lastCompact = time(NULL);
+   time_t lastArchive = 0;
+   while (true) {
+      sleep(PURGE_CHECK_INTERVAL);
+      m->purgeAll();
+      if (m->interval > 0 && time(NULL) - lastCompact >= m->interval) {
+         m->compactAll();
+         lastCompact = time(NULL);
+      }
+      if (m->archiveDays > 0 && time(NULL) - lastArchive >= ARCHIVE_CHECK_INTERVAL) {
+         lastArchive = time(NULL);
+         int count = m->cm->archiveProjects(m->archiveDays);
+         if (count > 0) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "archived %d idle projects", count);
+            logln(buf, LINFO);
+         }
+      }
+   }
+   return NULL;
+}
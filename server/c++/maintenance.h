@@ -0,0 +1,115 @@
+/*
+   collabREate maintenance.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __MAINTENANCE_H
+#define __MAINTENANCE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <stdint.h>
+#include <libpq-fe.h>
+#include <semaphore.h>
+
+using namespace std;
+
+class DatabaseConnectionManager;
+
+/**
+ * Maintenance
+ * This class runs housekeeping against the update log in the background,
+ * on its own database connection so that clients are never held up by it.
+ * Compaction marks every update that has been overwritten by a later update
+ * to the same target (a name, a comment, an xref, ...) as superseded and
+ * records a checkpoint.  Catch up skips superseded updates, so a new joiner
+ * receives the latest state of each target plus everything that can't be
+ * superseded instead of the complete history of the project.  It also
+ * archives projects that have sat idle for ARCHIVE_DAYS, and purges the
+ * updates of deleted projects a batch at a time so that deleting a large
+ * project never holds up anyone else.
+ */
+
+class Maintenance {
+public:
+   /**
+    * @param dbm the connection manager that owns this Maintenance
+    * @param p the server configuration
+    */
+   Maintenance(DatabaseConnectionManager *dbm, map<string,string> *p);
+
+   /**
+    * start kicks off the maintenance thread
+    */
+   void start();
+
+   static void *run(void *arg);
+
+   /**
+    * touch records that a project has received a new update
+    * @param pid the local pid of the project
+    * @param updateid the id of the new update
+    */
+   void touch(int pid, uint64_t updateid);
+
+   /**
+    * forget drops what is known about a project's checkpoints, used when
+    * its updates have been archived or restored
+    * @param pid the local pid of the project
+    */
+   void forget(int pid);
+
+private:
+   void init_queries();
+   void seed();
+   void compactAll();
+   void purgeAll();
+   bool purge(int pid);
+   uint64_t lastCheckpoint(int pid);
+   int64_t countUpdates(int pid, uint64_t from, uint64_t to);
+   bool keyUpdates(int pid, uint64_t from, uint64_t to);
+   bool compact(int pid, uint64_t from, uint64_t to);
+
+   DatabaseConnectionManager *cm;
+   map<string,string> *props;
+   PGconn *dbConn;
+
+   //latest update seen for each project that has changed since its last checkpoint
+   map<int,uint64_t> dirty;
+   sem_t dirty_sem;
+   //projects whose cached checkpoint is no longer valid, guarded by dirty_sem
+   set<int> forgotten;
+   //updateid of the last checkpoint of each project
+   map<int,uint64_t> checkpoints;
+
+   //commands that can be superseded, as an int4[] literal
+   string keyedCommands;
+
+   int interval;
+   int minUpdates;
+
+   //days a project sits idle before it is archived, 0 to never archive
+   int archiveDays;
+
+   //updates removed per statement when purging, and the pause between statements
+   int purgeBatch;
+   int purgeDelay;
+};
+
+#endif
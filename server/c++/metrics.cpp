@@ -0,0 +1,502 @@
+/*
+   collabREate metrics.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "utils.h"
+#include "cli_mgr.h"
+#include "latency.h"
+#include "metrics.h"
+
+using namespace std;
+
+//how long a scraper gets to send its request
+#define METRICS_TIMEOUT 5
+
+static pthread_once_t shardOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t shardKey;
+//guards the list of live shards and the retired totals
+static pthread_mutex_t shardLock = PTHREAD_MUTEX_INITIALIZER;
+static MetricShard *shards = NULL;
+//what threads that have exited counted
+static MetricTotals *retired = NULL;
+static TrafficTotals *retiredTraffic = NULL;
+
+static void addShard(MetricTotals &t, const MetricShard *s) {
+   for (int i = 0; i < METRIC_COMMANDS; i++) {
+      t.updatesIn[i] += s->updatesIn[i];
+      t.updatesOut[i] += s->updatesOut[i];
+   }
+   for (int i = 0; i < METRIC_COUNTERS; i++) {
+      t.counters[i] += s->counters[i];
+   }
+   for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+      if (s->histograms[i]) {
+         t.histograms[i].add(*s->histograms[i]);
+      }
+   }
+}
+
+static void addTraffic(CommandTraffic &t, const CommandTraffic &c) {
+   t.received += c.received;
+   t.receivedBytes += c.receivedBytes;
+   t.sent += c.sent;
+   t.sentBytes += c.sentBytes;
+   for (int i = 0; i < TRAFFIC_SIZE_BUCKETS; i++) {
+      t.sizes[i] += c.sizes[i];
+   }
+}
+
+static void addShardTraffic(TrafficTotals &t, const MetricShard *s) {
+   if (s->traffic == NULL) {
+      return;
+   }
+   for (map<int,ProjectTraffic*>::const_iterator i = s->traffic->begin(); i != s->traffic->end(); i++) {
+      for (int c = 0; c < METRIC_COMMANDS; c++) {
+         if ((*i).second->commands[c]) {
+            addTraffic(t[make_pair((*i).first, c)], *(*i).second->commands[c]);
+         }
+      }
+   }
+}
+
+static MetricTotals *newTotals() {
+   MetricTotals *t = new MetricTotals();
+   memset(t->updatesIn, 0, sizeof(t->updatesIn));
+   memset(t->updatesOut, 0, sizeof(t->updatesOut));
+   memset(t->counters, 0, sizeof(t->counters));
+   return t;
+}
+
+/*
+ * a thread's shard outlives it, its counts are folded into the retired
+ * totals when the thread exits
+ */
+static void retireShard(void *arg) {
+   MetricShard *s = (MetricShard*)arg;
+   pthread_mutex_lock(&shardLock);
+   for (MetricShard **p = &shards; *p; p = &(*p)->next) {
+      if (*p == s) {
+         *p = s->next;
+         break;
+      }
+   }
+   addShard(*retired, s);
+   addShardTraffic(*retiredTraffic, s);
+   pthread_mutex_unlock(&shardLock);
+   for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+      delete s->histograms[i];
+   }
+   if (s->traffic) {
+      for (map<int,ProjectTraffic*>::iterator i = s->traffic->begin(); i != s->traffic->end(); i++) {
+         for (int c = 0; c < METRIC_COMMANDS; c++) {
+            delete (*i).second->commands[c];
+         }
+         delete (*i).second;
+      }
+      delete s->traffic;
+   }
+   delete s;
+}
+
+static void createShardKey() {
+   retired = newTotals();
+   retiredTraffic = new TrafficTotals;
+   pthread_key_create(&shardKey, retireShard);
+}
+
+static MetricShard *myShard() {
+   pthread_once(&shardOnce, createShardKey);
+   MetricShard *s = (MetricShard*)pthread_getspecific(shardKey);
+   if (s == NULL) {
+      s = new MetricShard;
+      memset(s, 0, sizeof(MetricShard));
+      pthread_setspecific(shardKey, s);
+      pthread_mutex_lock(&shardLock);
+      s->next = shards;
+      shards = s;
+      pthread_mutex_unlock(&shardLock);
+   }
+   return s;
+}
+
+/*
+ * only the owning thread changes its shard's traffic, and only under the
+ * lock, so it can look things up without taking the lock
+ */
+static CommandTraffic *myTraffic(MetricShard *s, int pid, uint32_t command) {
+   ProjectTraffic *p = s->lastTraffic;
+   if (p == NULL || s->lastPid != pid) {
+      p = NULL;
+      if (s->traffic) {
+         map<int,ProjectTraffic*>::iterator i = s->traffic->find(pid);
+         if (i != s->traffic->end()) {
+            p = (*i).second;
+         }
+      }
+      if (p == NULL) {
+         p = new ProjectTraffic;
+         memset(p, 0, sizeof(ProjectTraffic));
+         pthread_mutex_lock(&shardLock);
+         if (s->traffic == NULL) {
+            s->traffic = new map<int,ProjectTraffic*>;
+         }
+         (*s->traffic)[pid] = p;
+         pthread_mutex_unlock(&shardLock);
+      }
+      s->lastPid = pid;
+      s->lastTraffic = p;
+   }
+   CommandTraffic *c = p->commands[command];
+   if (c == NULL) {
+      c = new CommandTraffic;
+      memset(c, 0, sizeof(CommandTraffic));
+      pthread_mutex_lock(&shardLock);
+      p->commands[command] = c;
+      pthread_mutex_unlock(&shardLock);
+   }
+   return c;
+}
+
+static int sizeBucket(uint32_t payload) {
+   if (payload <= 1) {
+      return 0;
+   }
+   int b = 32 - __builtin_clz(payload - 1);
+   return b < TRAFFIC_SIZE_BUCKETS ? b : TRAFFIC_SIZE_BUCKETS - 1;
+}
+
+void metricUpdateIn(int pid, uint32_t command, uint32_t payload) {
+   if (command < METRIC_COMMANDS) {
+      MetricShard *s = myShard();
+      s->updatesIn[command]++;
+      //updates from a plugin that hasn't joined a project go nowhere
+      if (pid >= 0) {
+         CommandTraffic *c = myTraffic(s, pid, command);
+         c->received++;
+         c->receivedBytes += payload;
+         c->sizes[sizeBucket(payload)]++;
+      }
+   }
+}
+
+void metricUpdateOut(int pid, uint32_t command, uint32_t payload) {
+   if (command < METRIC_COMMANDS) {
+      MetricShard *s = myShard();
+      s->updatesOut[command]++;
+      if (pid >= 0) {
+         CommandTraffic *c = myTraffic(s, pid, command);
+         c->sent++;
+         c->sentBytes += payload;
+      }
+   }
+}
+
+void metricAdd(int counter, uint64_t n) {
+   myShard()->counters[counter] += n;
+}
+
+void metricRecord(int histogram, uint64_t ns) {
+   MetricShard *s = myShard();
+   if (s->histograms[histogram] == NULL) {
+      Histogram *h = new Histogram();
+      //published under the lock so a collector never sees it half built
+      pthread_mutex_lock(&shardLock);
+      s->histograms[histogram] = h;
+      pthread_mutex_unlock(&shardLock);
+   }
+   s->histograms[histogram]->record(ns);
+}
+
+/*
+ * shards are read while their threads go on counting, so a collection
+ * can be a few counts behind, but it never stops anybody
+ */
+void metricTotals(MetricTotals &t) {
+   pthread_once(&shardOnce, createShardKey);
+   memset(t.updatesIn, 0, sizeof(t.updatesIn));
+   memset(t.updatesOut, 0, sizeof(t.updatesOut));
+   memset(t.counters, 0, sizeof(t.counters));
+   for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+      t.histograms[i].reset();
+   }
+   pthread_mutex_lock(&shardLock);
+   for (int i = 0; i < METRIC_COMMANDS; i++) {
+      t.updatesIn[i] = retired->updatesIn[i];
+      t.updatesOut[i] = retired->updatesOut[i];
+   }
+   memcpy(t.counters, retired->counters, sizeof(t.counters));
+   for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+      t.histograms[i].add(retired->histograms[i]);
+   }
+   for (MetricShard *s = shards; s; s = s->next) {
+      addShard(t, s);
+   }
+   pthread_mutex_unlock(&shardLock);
+}
+
+void metricTraffic(TrafficTotals &t) {
+   pthread_once(&shardOnce, createShardKey);
+   pthread_mutex_lock(&shardLock);
+   t = *retiredTraffic;
+   for (MetricShard *s = shards; s; s = s->next) {
+      addShardTraffic(t, s);
+   }
+   pthread_mutex_unlock(&shardLock);
+}
+
+//histogram bucket bounds, in seconds
+static const double bounds[] = {
+   0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+   0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static void describe(string &out, const char *name, const char *type, const char *help) {
+   out += "# HELP ";
+   out += name;
+   out += " ";
+   out += help;
+   out += "\n# TYPE ";
+   out += name;
+   out += " ";
+   out += type;
+   out += "\n";
+}
+
+static void sample(string &out, const char *name, const char *labels, uint64_t v) {
+   char buf[256];
+   snprintf(buf, sizeof(buf), "%s%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+            (unsigned long long)v);
+   out += buf;
+}
+
+/*
+ * a Histogram becomes cumulative _bucket samples at the fixed bounds, plus
+ * _sum and _count, its values are nanoseconds and the output is seconds
+ */
+static void histogram(string &out, const char *name, const char *labels, const Histogram &h) {
+   char buf[256];
+   const char *sep = *labels ? "," : "";
+   for (unsigned int i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+      snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, bounds[i],
+               (unsigned long long)h.countAtMost((uint64_t)(bounds[i] * 1e9)));
+      out += buf;
+   }
+   snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)h.getCount());
+   out += buf;
+   snprintf(buf, sizeof(buf), "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+            h.getSum() / 1e9);
+   out += buf;
+   snprintf(buf, sizeof(buf), "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+            (unsigned long long)h.getCount());
+   out += buf;
+}
+
+static void commands(string &out, const char *name, const uint64_t *counts) {
+   char labels[32];
+   for (int i = 0; i < METRIC_COMMANDS; i++) {
+      if (counts[i]) {
+         snprintf(labels, sizeof(labels), "command=\"%d\"", i);
+         sample(out, name, labels, counts[i]);
+      }
+   }
+}
+
+/*
+ * payload sizes go out as a histogram in bytes, with the power of two
+ * bounds they were counted in
+ */
+static void sizes(string &out, const char *name, const char *labels, const CommandTraffic &c) {
+   char buf[256];
+   uint64_t n = 0;
+   for (int i = 0; i < TRAFFIC_SIZE_BUCKETS - 1; i++) {
+      n += c.sizes[i];
+      snprintf(buf, sizeof(buf), "%s_bucket{%s,le=\"%u\"} %llu\n", name, labels, 1U << i, (unsigned long long)n);
+      out += buf;
+   }
+   snprintf(buf, sizeof(buf), "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)c.received);
+   out += buf;
+   snprintf(buf, sizeof(buf), "%s_sum{%s} %llu\n", name, labels, (unsigned long long)c.receivedBytes);
+   out += buf;
+   snprintf(buf, sizeof(buf), "%s_count{%s} %llu\n", name, labels, (unsigned long long)c.received);
+   out += buf;
+}
+
+static void traffic(string &out, const TrafficTotals &t) {
+   char labels[96];
+   describe(out, "collab_project_updates_total", "counter", "Updates received from and sent to plugins, by project and command.");
+   for (TrafficTotals::const_iterator i = t.begin(); i != t.end(); i++) {
+      const CommandTraffic &c = (*i).second;
+      snprintf(labels, sizeof(labels), "project=\"%d\",command=\"%d\",direction=\"received\"", (*i).first.first, (*i).first.second);
+      sample(out, "collab_project_updates_total", labels, c.received);
+      snprintf(labels, sizeof(labels), "project=\"%d\",command=\"%d\",direction=\"sent\"", (*i).first.first, (*i).first.second);
+      sample(out, "collab_project_updates_total", labels, c.sent);
+   }
+   describe(out, "collab_project_payload_bytes_total", "counter",
+            "Update payload bytes received from and sent to plugins, by project and command.");
+   for (TrafficTotals::const_iterator i = t.begin(); i != t.end(); i++) {
+      const CommandTraffic &c = (*i).second;
+      snprintf(labels, sizeof(labels), "project=\"%d\",command=\"%d\",direction=\"received\"", (*i).first.first, (*i).first.second);
+      sample(out, "collab_project_payload_bytes_total", labels, c.receivedBytes);
+      snprintf(labels, sizeof(labels), "project=\"%d\",command=\"%d\",direction=\"sent\"", (*i).first.first, (*i).first.second);
+      sample(out, "collab_project_payload_bytes_total", labels, c.sentBytes);
+   }
+   describe(out, "collab_project_payload_size_bytes", "histogram",
+            "Payload sizes of the updates received from plugins, by project and command.");
+   for (TrafficTotals::const_iterator i = t.begin(); i != t.end(); i++) {
+      if ((*i).second.received) {
+         snprintf(labels, sizeof(labels), "project=\"%d\",command=\"%d\"", (*i).first.first, (*i).first.second);
+         sizes(out, "collab_project_payload_size_bytes", labels, (*i).second);
+      }
+   }
+}
+
+MetricsServer::MetricsServer(ConnectionManagerBase *connm, map<string,string> *p) {
+   cm = connm;
+   props = p;
+   ss = NULL;
+}
+
+void MetricsServer::render(string &out) {
+   MetricTotals *t = newTotals();
+   metricTotals(*t);
+
+   describe(out, "collab_updates_received_total", "counter", "Updates received from plugins, by command.");
+   commands(out, "collab_updates_received_total", t->updatesIn);
+   describe(out, "collab_updates_sent_total", "counter", "Updates sent to plugins, live and catching up, by command.");
+   commands(out, "collab_updates_sent_total", t->updatesOut);
+   describe(out, "collab_received_bytes_total", "counter", "Frame bytes received from plugins.");
+   sample(out, "collab_received_bytes_total", "", t->counters[METRIC_BYTES_IN]);
+   describe(out, "collab_sent_bytes_total", "counter", "Frame bytes sent to plugins, before compression.");
+   sample(out, "collab_sent_bytes_total", "", t->counters[METRIC_BYTES_OUT]);
+   describe(out, "collab_connections_total", "counter", "Plugin connections accepted.");
+   sample(out, "collab_connections_total", "", t->counters[METRIC_CONNECTIONS]);
+   describe(out, "collab_dictionary_cache_hits_total", "counter", "Compression dictionaries found in the cache.");
+   sample(out, "collab_dictionary_cache_hits_total", "", t->counters[METRIC_DICT_HITS]);
+   describe(out, "collab_dictionary_cache_misses_total", "counter", "Compression dictionaries read from the database.");
+   sample(out, "collab_dictionary_cache_misses_total", "", t->counters[METRIC_DICT_MISSES]);
+
+   describe(out, "collab_db_errors_total", "counter", "Database statements that failed.");
+   sample(out, "collab_db_errors_total", "", t->counters[METRIC_DB_ERRORS]);
+
+   describe(out, "collab_db_statement_seconds", "histogram", "Time spent executing database statements.");
+   for (int s = 0; s < DB_STATEMENTS; s++) {
+      char labels[64];
+      snprintf(labels, sizeof(labels), "statement=\"%s\"", dbStatements[s]);
+      histogram(out, "collab_db_statement_seconds", labels, t->histograms[METRIC_DB_EXEC + s]);
+   }
+   describe(out, "collab_db_wait_seconds", "histogram", "Time spent waiting for a database connection.");
+   for (int s = 0; s < DB_STATEMENTS; s++) {
+      char labels[64];
+      snprintf(labels, sizeof(labels), "statement=\"%s\"", dbStatements[s]);
+      histogram(out, "collab_db_wait_seconds", labels, t->histograms[METRIC_DB_WAIT + s]);
+   }
+   delete t;
+
+   TrafficTotals tt;
+   metricTraffic(tt);
+   traffic(out, tt);
+
+   Histogram stages[LATENCY_STAGES];
+   cm->getLatencyTotals(stages);
+   describe(out, "collab_update_stage_seconds", "histogram",
+            "Time updates spend in each stage between publisher and subscriber.");
+   for (int s = 0; s < LATENCY_STAGES; s++) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "stage=\"%s\"", latencyStages[s]);
+      histogram(out, "collab_update_stage_seconds", labels, stages[s]);
+   }
+
+   describe(out, "collab_dispatch_queue_depth", "gauge", "Updates waiting for the dispatch thread.");
+   sample(out, "collab_dispatch_queue_depth", "", cm->getQueueDepth());
+   map<int,int> counts;
+   cm->projects.clientCounts(counts);
+   describe(out, "collab_clients", "gauge", "Clients connected, by project.");
+   for (map<int,int>::iterator i = counts.begin(); i != counts.end(); i++) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "project=\"%d\"", (*i).first);
+      sample(out, "collab_clients", labels, (*i).second);
+   }
+}
+
+void MetricsServer::start() {
+   int port = getIntOption(props, "METRICS_PORT", 0);
+   if (port == 0) {
+      return;
+   }
+   try {
+      if (getIntOption(props, "METRICS_LOCAL", 1) == 1) {
+         ss = new Tcp6Service("localhost", port);
+      }
+      else {
+         ss = new Tcp6Service(port);
+      }
+   } catch (IOException e) {
+      fprintf(stderr, "MetricsServer: unable to listen on port %d\n", port);
+      return;
+   }
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   pthread_create(&tid, &attr, run, (void*)this);
+}
+
+void *MetricsServer::run(void *arg) {
+   MetricsServer *ms = (MetricsServer*)arg;
+   while (true) {
+      NetworkIO *nio = ms->ss->accept();
+      if (nio == NULL) {
+         continue;
+      }
+      struct timeval tv;
+      tv.tv_sec = METRICS_TIMEOUT;
+      tv.tv_usec = 0;
+      setsockopt(nio->getFileDescriptor(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      string request = nio->readLine();
+      //the headers don't matter, but the scraper expects them to be read
+      string header = request;
+      while (header.length() > 2) {
+         header = nio->readLine();
+      }
+      string body;
+      const char *status = "200 OK";
+      if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+         ms->render(body);
+      }
+      else {
+         status = "404 Not Found";
+         body = "try /metrics\n";
+      }
+      nio->sendFormat("HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %u\r\nConnection: close\r\n\r\n", status, (unsigned int)body.length());
+      nio->sendAll(body.data(), body.length());
+      nio->close();
+      delete nio;
+   }
+   return NULL;
+}
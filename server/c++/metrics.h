@@ -0,0 +1,207 @@
+/*
+   collabREate metrics.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#include "histogram.h"
+
+using namespace std;
+
+class ConnectionManagerBase;
+class Tcp6Service;
+
+//update commands are counted individually up to this one
+#define METRIC_COMMANDS 256
+
+//counters
+#define METRIC_BYTES_IN         0   //frame bytes read from plugins
+#define METRIC_BYTES_OUT        1   //frame bytes written to plugins
+#define METRIC_CONNECTIONS      2   //plugin connections accepted
+#define METRIC_DICT_HITS        3   //compression dictionaries found in the cache
+#define METRIC_DICT_MISSES      4   //compression dictionaries read from the database
+#define METRIC_DB_ERRORS        5   //database statements that failed
+#define METRIC_COUNTERS         6
+
+//the prepared statements DatabaseConnectionManager times, named in dbStatements
+#define DB_POST_UPDATE                0
+#define DB_ADD_PROJECT                1
+#define DB_ADD_PROJECT_SNAP           2
+#define DB_ADD_PROJECT_FORK           3
+#define DB_FIND_PROJECTS_BY_HASH      4
+#define DB_FIND_PROJECT_BY_PID        5
+#define DB_FIND_PROJECT_BY_GPID       6
+#define DB_GET_USER_INFO              7
+#define DB_GET_LATEST_UPDATES         8
+#define DB_GET_LATEST_UPDATES_RANGES  9
+#define DB_COPY_UPDATES               10
+#define DB_PROJECT_PERMS_UPDATE       11
+#define DB_GET_DICTIONARY             12
+#define DB_FIND_DICTIONARY            13
+#define DB_STATEMENTS                 14
+
+extern const char *dbStatements[];
+
+//histograms, all in nanoseconds, one of each per DB_ statement
+#define METRIC_DB_EXEC          0                                //executing the statement
+#define METRIC_DB_WAIT          (METRIC_DB_EXEC + DB_STATEMENTS)  //waiting for the connection to run it on
+#define METRIC_HISTOGRAMS       (METRIC_DB_WAIT + DB_STATEMENTS)
+
+//payload sizes are counted in power of two buckets, the last one also
+//holds everything larger
+#define TRAFFIC_SIZE_BUCKETS    26
+
+/**
+ * CommandTraffic is what one project sent and received of one update
+ * command.  Bytes are payload bytes, not counting the frame header or
+ * the updateid.
+ */
+struct CommandTraffic {
+   uint64_t received;
+   uint64_t receivedBytes;
+   uint64_t sent;
+   uint64_t sentBytes;
+   //received payloads of more than 1 << (i - 1) and at most 1 << i bytes
+   uint64_t sizes[TRAFFIC_SIZE_BUCKETS];
+};
+
+/**
+ * ProjectTraffic holds a project's CommandTraffic, each allocated the
+ * first time its command is counted
+ */
+struct ProjectTraffic {
+   CommandTraffic *commands[METRIC_COMMANDS];
+};
+
+//the traffic of every thread added up, keyed by local pid and command
+typedef map<pair<int,int>, CommandTraffic> TrafficTotals;
+
+/**
+ * MetricShard holds one thread's share of the server's counters.  Only
+ * the owning thread writes to it, so counting never takes a lock or
+ * contends for a cache line, collection adds up every thread's shard.
+ */
+struct MetricShard {
+   uint64_t updatesIn[METRIC_COMMANDS];
+   uint64_t updatesOut[METRIC_COMMANDS];
+   uint64_t counters[METRIC_COUNTERS];
+   //allocated the first time the thread records into them
+   Histogram *histograms[METRIC_HISTOGRAMS];
+   //by local pid, allocated the first time the thread counts an update
+   map<int,ProjectTraffic*> *traffic;
+   //the project counted last, a thread mostly counts for one at a time
+   int lastPid;
+   ProjectTraffic *lastTraffic;
+   MetricShard *next;
+};
+
+/**
+ * MetricTotals is the sum of every thread's shard
+ */
+struct MetricTotals {
+   uint64_t updatesIn[METRIC_COMMANDS];
+   uint64_t updatesOut[METRIC_COMMANDS];
+   uint64_t counters[METRIC_COUNTERS];
+   Histogram histograms[METRIC_HISTOGRAMS];
+};
+
+/**
+ * metricUpdateIn counts an update read from a plugin
+ * @param pid the local pid of the plugin's project
+ * @param command the update command
+ * @param payload the size of the update's payload
+ */
+void metricUpdateIn(int pid, uint32_t command, uint32_t payload);
+
+/**
+ * metricUpdateOut counts an update written to a plugin
+ * @param pid the local pid of the plugin's project
+ * @param command the update command
+ * @param payload the size of the update's payload
+ */
+void metricUpdateOut(int pid, uint32_t command, uint32_t payload);
+
+/**
+ * metricAdd adds to one of the METRIC_ counters
+ * @param counter the counter
+ * @param n the amount to add
+ */
+void metricAdd(int counter, uint64_t n = 1);
+
+/**
+ * metricRecord records a value in one of the METRIC_ histograms
+ * @param histogram the histogram
+ * @param ns the value, in nanoseconds
+ */
+void metricRecord(int histogram, uint64_t ns);
+
+/**
+ * metricTotals adds up the shards of every thread, including threads that
+ * have since exited
+ * @param t receives the totals
+ */
+void metricTotals(MetricTotals &t);
+
+/**
+ * metricTraffic adds up the per project traffic of every thread,
+ * including threads that have since exited
+ * @param t receives the traffic
+ */
+void metricTraffic(TrafficTotals &t);
+
+/**
+ * MetricsServer
+ * This class serves the server's counters, histograms and gauges over
+ * HTTP in the Prometheus text exposition format, on METRICS_PORT.  Each
+ * scrape is answered in turn on the server's own thread.
+ */
+
+class MetricsServer {
+public:
+   /**
+    * @param connm the connection manager whose state is exported
+    * @param p the server configuration
+    */
+   MetricsServer(ConnectionManagerBase *connm, map<string,string> *p);
+
+   /**
+    * start starts serving, unless METRICS_PORT is 0 or can't be bound
+    */
+   void start();
+
+   /**
+    * render builds the exposition text
+    * @param out receives the text
+    */
+   void render(string &out);
+
+private:
+   static void *run(void *arg);
+
+   ConnectionManagerBase *cm;
+   map<string,string> *props;
+   Tcp6Service *ss;
+};
+
+#endif
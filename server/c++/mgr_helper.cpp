@@ -20,6 +20,7 @@
 
 #include <map>
 #include <string>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "utils.h"
@@ -27,6 +28,7 @@
 #include "client.h"
 #include "buffer.h"
 #include "mgr_helper.h"
+#include "logger.h"
 
 using namespace std;
 
@@ -93,116 +95,206 @@ void ManagerHelper::initCommon() {
  * @param command the server command to send
  * @param data the data relevant to be sent with command
  */
-void ManagerHelper::send_data(int command, uint8_t *data, int dlen) {
+bool ManagerHelper::send_data(int command, uint8_t *data, int dlen) {
    if (command >= MNG_CONTROL_FIRST) {
-      nio->writeInt(8 + dlen);
-      nio->writeInt(command);
-      nio->write(data, dlen);
+      return nio->writeInt(8 + dlen) && nio->writeInt(command) && nio->write(data, dlen);
 //         logln("send_data- cmd: " + command + " datasize: " + data.length, LDEBUG);
    }
    else {
 //         logln("post should be used for command " + command + ", not send_data.  Data not sent.", LERROR);
    }
+   return false;
 }
 
 /**
- * run kicks off a thread that perpetually waits for a single connection, if the connection is dropped
- * it waits again, once connected, the ManagerHelper processes commands similar to the server.
+ * run kicks off a thread that perpetually waits for connections.  Each
+ * connection is handed to a session of its own, so a whole server restore
+ * can import several projects at once
  */
 void *ManagerHelper::run(void *arg) {
    ManagerHelper *mh = (ManagerHelper*)arg;
    mh->logln("ManagerHelper running...", LINFO);
-   //just accept a single connection, loop back if the connection drops
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
    while (true) {
-      mh->nio = mh->ss->accept();
+      NetworkIO *nio = mh->ss->accept();
 //         logln("New Management connection: " + s.getInetAddress().getHostAddress() + ":" + s.getPort(), LINFO);
-      try {
-         while (true) {
-            Buffer os;
-            int len = mh->nio->readInt();
-            int cmd = mh->nio->readInt();
-
-            switch(cmd) {
-               case MNG_GET_CONNECTIONS: {
-                  mh->logln("sending connections", LINFO3);
-                  string c = mh->cm->listConnections();
-                  os.writeUTF(c.c_str());
-                  mh->send_data(MNG_CONNECTIONS, os.get_buf(), os.size());
-                  break;
+      //a session shares everything but the connection and the project it imports to
+      ManagerHelper *session = new ManagerHelper(*mh);
+      session->nio = nio;
+      session->pidForUpdates = 0;
+      pthread_t tid;
+      if (pthread_create(&tid, &attr, serve, (void*)session) != 0) {
+         mh->logln("unable to start a management session", LERROR);
+         nio->close();
+         delete nio;
+         delete session;
+      }
+   }
+}
+
+/**
+ * serve processes the commands of a single management connection, similar
+ * to the server, until the connection drops
+ */
+void *ManagerHelper::serve(void *arg) {
+   ManagerHelper *mh = (ManagerHelper*)arg;
+   try {
+      while (true) {
+         Buffer os;
+         int len = mh->nio->readInt();
+         int cmd = mh->nio->readInt();
+
+         switch(cmd) {
+            case MNG_GET_CONNECTIONS: {
+               mh->logln("sending connections", LINFO3);
+               string c = mh->cm->listConnections();
+               os.writeUTF(c.c_str());
+               mh->send_data(MNG_CONNECTIONS, os.get_buf(), os.size());
+               break;
+            }
+            case MNG_GET_STATS: {
+               mh->logln("sending stats", LINFO3);
+               string c = mh->cm->dumpStats();
+               os.writeUTF(c.c_str());
+               mh->send_data(MNG_STATS, os.get_buf(), os.size());
+               break;
+            }
+            case MNG_GET_LATENCY: {
+               int pid = mh->nio->readInt();
+               mh->logln("sending update latency", LINFO3);
+               mh->cm->getLatency(pid, os);
+               mh->send_data(MNG_LATENCY, os.get_buf(), os.size());
+               break;
+            }
+            case MNG_SUBSCRIBE_STATS: {
+               //the session streams snapshots from here on, until the
+               //manager hangs up
+               int interval = mh->nio->readInt();
+               if (interval < MNG_STATS_MIN_INTERVAL) {
+                  interval = MNG_STATS_MIN_INTERVAL;
                }
-               case MNG_GET_STATS: {
-                  mh->logln("sending stats", LINFO3);
-                  string c = mh->cm->dumpStats();
-                  os.writeUTF(c.c_str());
-                  mh->send_data(MNG_STATS, os.get_buf(), os.size());
-                  break;
+               else if (interval > MNG_STATS_MAX_INTERVAL) {
+                  interval = MNG_STATS_MAX_INTERVAL;
                }
-               case MNG_SHUTDOWN: {
-                  mh->logln("client requested server shutdown", LINFO);
-                  mh->cm->Shutdown();
-                  break;
+               mh->logln("streaming stats", LINFO3);
+               while (true) {
+                  Buffer snap;
+                  mh->cm->writeSnapshot(snap);
+                  if (!mh->send_data(MNG_STATS_UPDATE, snap.get_buf(), snap.size())) {
+                     break;
+                  }
+                  //usleep may refuse a second or more
+                  sleep(interval / 1000);
+                  usleep((interval % 1000) * 1000);
                }
-               case MNG_PROJECT_MIGRATE: {
-                  mh->logln("client requested a project migrate", LINFO);
-                  //Client c = new Client(cm,new Socket());
-                  uint8_t md5_bytes[MD5_SIZE];
-                  uint8_t gpid_bytes[GPID_SIZE];
-                  int status = MNG_MIGRATE_REPLY_FAIL;
-                  int uid = mh->nio->readInt();
-                  mh->nio->readFully(gpid_bytes, GPID_SIZE);
-                  string gpid = toHexString(gpid_bytes, GPID_SIZE);
-                  mh->nio->readFully(md5_bytes, MD5_SIZE);
-                  string hash = toHexString(md5_bytes, MD5_SIZE);
-                  string desc = mh->nio->readUTF();
-                  uint64_t pub = mh->nio->readLong() & 0x7FFFFFFF;
-                  uint64_t sub = mh->nio->readLong() & 0x7FFFFFFF;
-
-                  int newpid = mh->cm->migrateProject(uid, gpid, hash, desc, pub, sub);
-                  if (newpid > 0) {
+               throw IOException();
+            }
+            case MNG_SHUTDOWN: {
+               mh->logln("client requested server shutdown", LINFO);
+               mh->cm->Shutdown();
+               break;
+            }
+            case MNG_PROJECT_MIGRATE: {
+               mh->logln("client requested a project migrate", LINFO);
+               //Client c = new Client(cm,new Socket());
+               uint8_t md5_bytes[MD5_SIZE];
+               uint8_t gpid_bytes[GPID_SIZE];
+               int status = MNG_MIGRATE_REPLY_FAIL;
+               int uid = mh->nio->readInt();
+               mh->nio->readFully(gpid_bytes, GPID_SIZE);
+               string gpid = toHexString(gpid_bytes, GPID_SIZE);
+               mh->nio->readFully(md5_bytes, MD5_SIZE);
+               string hash = toHexString(md5_bytes, MD5_SIZE);
+               string desc = mh->nio->readUTF();
+               uint64_t pub = mh->nio->readLong() & 0x7FFFFFFF;
+               uint64_t sub = mh->nio->readLong() & 0x7FFFFFFF;
+
+               int newpid = mh->cm->migrateProject(uid, gpid, hash, desc, pub, sub);
+               if (newpid > 0) {
 //                        logln("Added new project " + newpid + " via project migration from another server");
-                     status = MNG_MIGRATE_REPLY_SUCCESS;
-                     mh->pidForUpdates = newpid;  //store globally for any updates that may come in
-                  }
-                  else {
+                  status = MNG_MIGRATE_REPLY_SUCCESS;
+                  mh->pidForUpdates = newpid;  //store globally for any updates that may come in
+               }
+               else {
 //                        logln("migrate project failed for gpid " + gpid + " hash " + hash);
-                     status = MNG_MIGRATE_REPLY_FAIL;
-                  }
-                  os.writeInt(status);
-                  mh->send_data(MNG_PROJECT_MIGRATE_REPLY, os.get_buf(), os.size());
-                  break;
+                  status = MNG_MIGRATE_REPLY_FAIL;
                }
-               case MNG_MIGRATE_UPDATE: {
-                  mh->logln("in MNG_MIGRATE_UPDATE", LERROR);
-                  int uid = mh->nio->readInt();
+               os.writeInt(status);
+               //the pid lets the manager resume an interrupted import
+               os.writeInt(newpid);
+               mh->send_data(MNG_PROJECT_MIGRATE_REPLY, os.get_buf(), os.size());
+               break;
+            }
+            case MNG_MIGRATE_UPDATE: {
+               mh->logln("in MNG_MIGRATE_UPDATE", LERROR);
+               int uid = mh->nio->readInt();
 //                     logln("... got uid" + uid, LERROR);
-                  int pid = mh->nio->readInt();
+               int pid = mh->nio->readInt();
 //                     logln("... got pid" + pid, LERROR);
-                  int ucmd = mh->nio->readInt();
+               int ucmd = mh->nio->readInt();
 //                     logln("... got cmd" + ucmd, LERROR);
-                  int datalen = mh->nio->readInt();
+               int datalen = mh->nio->readInt();
 //                     logln("... got datalen" + datalen, LERROR);
-                  uint8_t *data = new uint8_t[datalen];
-                  mh->nio->readFully(data, datalen);
-                  mh->logln("... got data", LERROR);
-                  mh->cm->migrateUpdate(uid, mh->pidForUpdates, ucmd, data, datalen);
-                  delete [] data;
-                  break;
+               uint8_t *data = new uint8_t[datalen];
+               mh->nio->readFully(data, datalen);
+               mh->logln("... got data", LERROR);
+               mh->cm->migrateUpdate(uid, mh->pidForUpdates, ucmd, data, datalen);
+               delete [] data;
+               break;
+            }
+            case MNG_MIGRATE_BLOCK: {
+               int uid = mh->nio->readInt();
+               int64_t first = mh->nio->readLong();
+               int count = mh->nio->readInt();
+               int blen = len - 24;
+               if (blen < 0 || blen > MAX_MIGRATE_BLOCK) {
+                  mh->logln("bad MNG_MIGRATE_BLOCK length", LERROR);
+                  throw IOException();
+               }
+               uint8_t *block = new uint8_t[blen];
+               mh->nio->readFully(block, blen);
+               os.writeLong(mh->cm->migrateUpdates(uid, mh->pidForUpdates, first, block, blen, count));
+               delete [] block;
+               mh->send_data(MNG_MIGRATE_BLOCK_REPLY, os.get_buf(), os.size());
+               break;
+            }
+            case MNG_MIGRATE_RESUME: {
+               int pid = mh->nio->readInt();
+               mh->logln("client requested to resume an import", LINFO);
+               int64_t done = mh->cm->migratedUpdates(pid);
+               if (done >= 0) {
+                  mh->pidForUpdates = pid;
                }
-               default: {
-                  mh->logln("unkown command", LERROR);
+               os.writeLong(done);
+               mh->send_data(MNG_MIGRATE_RESUME_REPLY, os.get_buf(), os.size());
+               break;
+            }
+            case MNG_ARCHIVE_PROJECTS: {
+               int days = mh->nio->readInt();
+               mh->logln("client requested idle projects be archived", LINFO);
+               os.writeInt(mh->cm->archiveProjects(days));
+               mh->send_data(MNG_ARCHIVE_REPLY, os.get_buf(), os.size());
+               break;
+            }
+            default: {
+               mh->logln("unkown command", LERROR);
 //The ServerManager has no means of processing this message as it is very much
 //a synchronous protocol: Send Command -> Process Reply.  If we don't recognize
 //their command we can easily drop it, but they are not likely to be looking
 //for our reply
 //                        os.writeUTF("bad command received:" + cmd);
 //                        mh->send_data(MNG_CONNECTIONS, os.get_buf(), os.size());
-               }
             }
          }
-      } catch (IOException ex) {
-         mh->nio->close();
       }
+   } catch (IOException ex) {
+      mh->nio->close();
    }
+   delete mh->nio;
+   delete mh;
+   return NULL;
 }
 
 /**
@@ -218,7 +310,9 @@ void ManagerHelper::terminate() {
  * @param v apply a verbosity level to the msg
  */
 void ManagerHelper::log(const string &msg, int v) {
-   cm->log("[MNG]" +  msg, v);
+   if (logEnabled(v)) {
+      cm->log("[MNG]" +  msg, v);
+   }
 }
 
 /**
@@ -227,7 +321,7 @@ void ManagerHelper::log(const string &msg, int v) {
  * @param v apply a verbosity level to the msg
  */
 void ManagerHelper::logln(const string &msg, int v) {
-   log(msg + "\n", v);
+   log(msg, v);
 }
 
 void ManagerHelper::start() {
@@ -73,15 +73,23 @@ private:
     * send_data constructs the packet and sends it to the ServerManager
     * @param command the server command to send
     * @param data the data relevant to be sent with command
+    * @return false if the ServerManager has gone away
     */
-   void send_data(int command, uint8_t *data, int dlen);
+   bool send_data(int command, uint8_t *data, int dlen);
 
    /**
-    * run kicks off a thread that perpetually waits for a single connection, if the connection is dropped
-    * it waits again, once connected, the ManagerHelper processes commands similar to the server.
+    * run kicks off a thread that perpetually waits for connections.  Each
+    * connection is handed to a session of its own, so a whole server restore
+    * can import several projects at once
     */
    static void *run(void *arg);
 
+   /**
+    * serve processes the commands of a single management connection, similar
+    * to the server, until the connection drops
+    */
+   static void *serve(void *arg);
+
    /**
     * closes the socket
     */
@@ -0,0 +1,491 @@
+/*
+   collabREate microbench.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * collab_microbench times the server's hot paths in isolation: building and
+ * parsing Buffers, Packet construction, permission checks, posting to a
+ * client, dispatching to a whole project and framing over a socketpair.
+ * It links the server's own objects, clients talk to in-memory sinks unless
+ * a benchmark is about the socket itself, and every benchmark reports the
+ * median ns/op of several runs alongside the allocations it made per op.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#if defined __linux__
+#include <sched.h>
+#endif
+
+#include "utils.h"
+#include "buffer.h"
+#include "client.h"
+#include "cli_mgr.h"
+#include "basic_mgr.h"
+
+using namespace std;
+
+static bool counting = false;
+static uint64_t allocs = 0;
+static uint64_t allocBytes = 0;
+
+static uint64_t now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void countAlloc(size_t n) {
+   if (counting) {
+      allocs++;
+      allocBytes += n;
+   }
+}
+
+#if defined __GLIBC__
+
+//glibc lets the executable replace malloc, which catches Buffer's mallocs
+//as well as operator new, the real allocator stays reachable underneath
+extern "C" void *__libc_malloc(size_t n);
+extern "C" void *__libc_calloc(size_t n, size_t sz);
+extern "C" void *__libc_realloc(void *p, size_t n);
+
+extern "C" void *malloc(size_t n) {
+   countAlloc(n);
+   return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t sz) {
+   countAlloc(n * sz);
+   return __libc_calloc(n, sz);
+}
+
+extern "C" void *realloc(void *p, size_t n) {
+   countAlloc(n);
+   return __libc_realloc(p, n);
+}
+
+#else
+
+//elsewhere only operator new can be counted portably
+void *operator new(size_t n) {
+   countAlloc(n);
+   void *p = malloc(n ? n : 1);
+   if (p == NULL) {
+      throw bad_alloc();
+   }
+   return p;
+}
+
+void *operator new[](size_t n) {
+   return operator new(n);
+}
+
+void operator delete(void *p) throw() {
+   free(p);
+}
+
+void operator delete[](void *p) throw() {
+   free(p);
+}
+
+#endif
+
+/**
+ * MemoryIO is a connection whose bytes go nowhere, it keeps clients'
+ * sends off the kernel so that only the server's own work is timed
+ */
+class MemoryIO : public NetworkIO {
+public:
+   MemoryIO() {
+      setFileDescriptor(-1);
+      sent = 0;
+   }
+   int sendAll(const void *buf, uint32_t len) {
+      sent += len;
+      return (int)len;
+   }
+   uint64_t sent;
+};
+
+struct MicroOptions {
+   uint64_t targetNs;
+   int reps;
+   int members;
+   int payload;
+};
+
+/**
+ * Fixture holds everything the benchmarks share, one project of clients
+ * in a basic mode connection manager and a few prebuilt frames
+ */
+struct Fixture {
+   map<string,string> props;
+   BasicConnectionManager *mgr;
+   vector<Client*> clients;
+   Client *deflated;
+   Buffer update;
+   Buffer large;
+   Packet *packet;
+   Packet *largePacket;
+   NetworkIO *pairOut;
+   FileIO *pairIn;
+   uint8_t *readBuf;
+};
+
+static Fixture fx;
+static MicroOptions opts;
+//results are written here so the compiler can't discard the work
+static volatile uint64_t sink;
+
+static const uint32_t commandMix[] = {
+   COMMAND_RENAMED, COMMAND_CMT_CHANGED, COMMAND_BYTE_PATCHED, COMMAND_TI_CHANGED,
+   COMMAND_MAKE_CODE, COMMAND_ADD_FUNC, COMMAND_ADD_CREF, COMMAND_ADD_DREF,
+   COMMAND_RENAMED, COMMAND_CMT_CHANGED, COMMAND_UNDEFINE, COMMAND_MAKE_DATA,
+   COMMAND_RENAMED, COMMAND_SEGM_ADDED, COMMAND_ENUM_CREATED, COMMAND_STRUC_CREATED
+};
+#define COMMAND_MIX_SIZE (sizeof(commandMix) / sizeof(commandMix[0]))
+
+/**
+ * buildUpdate builds a complete update frame the way the plugin sends it
+ * @param b receives the frame
+ * @param command the update command
+ * @param payload the total size of the frame
+ */
+static void buildUpdate(Buffer &b, int command, int payload) {
+   b.reset();
+   b.writeInt(0);
+   b.writeInt(command);
+   b.writeLong(0);
+   b.writeLong(0x401000);
+   while (b.size() < payload) {
+      b.write((int)('a' + b.size() % 26));
+   }
+   *(uint32_t*)b.get_buf() = htonl(b.size());
+}
+
+static Client *newClient(NetworkIO *conn) {
+   Client *c = new Client(fx.mgr, conn, true);
+   c->setHash(getMD5(string("collab_microbench")));
+   return c;
+}
+
+static bool setup() {
+   //the basic manager narrates every join, none of which is of interest here
+   fflush(stderr);
+   int saved = dup(2);
+   int devnull = open("/dev/null", O_WRONLY);
+   dup2(devnull, 2);
+   close(devnull);
+
+   //compression is turned on per connection below, never by the manager
+   fx.props["COMPRESSION_THRESHOLD"] = "0";
+   fx.mgr = new BasicConnectionManager(&fx.props);
+   bool ok = true;
+   for (int i = 0; ok && i < opts.members; i++) {
+      Client *c = newClient(new MemoryIO());
+      if (i == 0) {
+         ok = fx.mgr->addProject(c, c->getHash(), "microbench", FULL_PERMISSIONS, FULL_PERMISSIONS) != -1;
+      }
+      else {
+         ok = fx.mgr->joinProject(c, fx.clients[0]->getPid()) == 0;
+      }
+      fx.clients.push_back(c);
+   }
+   MemoryIO *dio = new MemoryIO();
+   dio->enableCompression(1, 512);
+   fx.deflated = newClient(dio);
+   fx.deflated->setSub(FULL_PERMISSIONS);
+
+   fflush(stderr);
+   dup2(saved, 2);
+   close(saved);
+   if (!ok) {
+      fprintf(stderr, "Microbench: unable to build a project of %d clients\n", opts.members);
+      return false;
+   }
+
+   buildUpdate(fx.update, COMMAND_RENAMED, opts.payload);
+   buildUpdate(fx.large, COMMAND_CMT_CHANGED, 4096);
+   fx.packet = new Packet(fx.clients[0], fx.update.get_buf(), fx.update.size(), 1);
+   fx.largePacket = new Packet(fx.clients[0], fx.large.get_buf(), fx.large.size(), 2);
+
+   int sv[2];
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+      perror("Microbench: socketpair");
+      return false;
+   }
+   fx.pairOut = new NetworkIO();
+   fx.pairOut->setFileDescriptor(sv[0]);
+   fx.pairIn = new FileIO();
+   fx.pairIn->setFileDescriptor(sv[1]);
+   fx.readBuf = new uint8_t[fx.large.size()];
+   return true;
+}
+
+static void benchBufferWrite(uint64_t i) {
+   Buffer b;
+   b.writeInt(0);
+   b.writeInt(COMMAND_RENAMED);
+   b.writeLong(i);
+   b.writeLong(0x401000 + i);
+   b.writeUTF("sub_401000_renamed");
+   b.write(fx.update.get_buf(), 32);
+   sink += b.size();
+}
+
+static void benchBufferRead(uint64_t i) {
+   Buffer b(fx.update.get_buf(), fx.update.size());
+   uint32_t len = b.readInt();
+   uint32_t cmd = b.readInt();
+   uint64_t id = b.readLong();
+   uint64_t ea = b.readLong();
+   sink += len + cmd + id + ea;
+}
+
+static void benchBufferUTF(uint64_t i) {
+   Buffer b;
+   b.writeUTF("sub_401000_renamed");
+   char *s = b.readUTF();
+   sink += s[0];
+   free(s);
+}
+
+static void benchPacket(uint64_t i) {
+   Packet *p = new Packet(fx.clients[0], fx.update.get_buf(), fx.update.size(), i);
+   sink += p->dataLen;
+   delete p;
+}
+
+static void benchPermissions(uint64_t i) {
+   Client *c = fx.clients[0];
+   sink += c->checkPermissions(commandMix[i % COMMAND_MIX_SIZE], c->getSub());
+}
+
+static bool countMember(Client *c, void *user) {
+   (*(uint64_t*)user)++;
+   return true;
+}
+
+static void benchLoopProject(uint64_t i) {
+   uint64_t n = 0;
+   fx.mgr->projects.loopProject(fx.clients[0]->getPid(), countMember, &n);
+   sink += n;
+}
+
+static void benchPost(uint64_t i) {
+   fx.clients[1 % fx.clients.size()]->post(fx.update.get_buf(), fx.update.size());
+}
+
+static void benchPostDeflate(uint64_t i) {
+   fx.deflated->post(fx.large.get_buf(), fx.large.size());
+}
+
+static void benchDispatch(uint64_t i) {
+   fx.mgr->dispatch(fx.packet);
+}
+
+static void benchDispatchLarge(uint64_t i) {
+   fx.mgr->dispatch(fx.largePacket);
+}
+
+static void benchFrameSocket(uint64_t i) {
+   fx.pairOut->sendFrame(fx.update.get_buf(), fx.update.size());
+   uint32_t len = fx.pairIn->readInt();
+   fx.pairIn->readFully(fx.readBuf, len - 4);
+   sink += len;
+}
+
+static void benchLogFiltered(uint64_t i) {
+   fx.clients[0]->logln("posting command 13", LDEBUG);
+}
+
+struct MicroBench {
+   const char *name;
+   const char *desc;
+   void (*op)(uint64_t i);
+};
+
+static MicroBench benches[] = {
+   {"buffer_write", "Buffer::write* of an update header and name", benchBufferWrite},
+   {"buffer_read", "Buffer copy of an update and read* of its header", benchBufferRead},
+   {"buffer_utf", "Buffer::writeUTF then readUTF", benchBufferUTF},
+   {"packet", "Packet construction and destruction", benchPacket},
+   {"check_permissions", "Client::checkPermissions over a mix of commands", benchPermissions},
+   {"loop_project", "ProjectMap::loopProject over every member", benchLoopProject},
+   {"post", "Client::post of an update to a memory sink", benchPost},
+   {"post_deflate", "Client::post of a 4KB update to a compressing sink", benchPostDeflate},
+   {"dispatch", "ConnectionManagerBase::dispatch of an update to the project", benchDispatch},
+   {"dispatch_4k", "ConnectionManagerBase::dispatch of a 4KB update to the project", benchDispatchLarge},
+   {"frame_socketpair", "NetworkIO::sendFrame and FileIO read back over a socketpair", benchFrameSocket},
+   {"log_filtered", "Client::logln of a message above the verbosity level", benchLogFiltered},
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+struct MicroResult {
+   double ns;
+   double allocs;
+   double bytes;
+};
+
+static MicroResult runOnce(MicroBench &b, uint64_t n) {
+   MicroResult r;
+   allocs = 0;
+   allocBytes = 0;
+   counting = true;
+   uint64_t start = now();
+   for (uint64_t i = 0; i < n; i++) {
+      b.op(i);
+   }
+   uint64_t elapsed = now() - start;
+   counting = false;
+   r.ns = (double)elapsed / n;
+   r.allocs = (double)allocs / n;
+   r.bytes = (double)allocBytes / n;
+   return r;
+}
+
+static bool nsLess(const MicroResult &a, const MicroResult &b) {
+   return a.ns < b.ns;
+}
+
+/**
+ * measure times a benchmark, the iteration count is doubled until a run
+ * lasts the target time, then the median of several such runs is taken
+ * @param b the benchmark to run
+ */
+static void measure(MicroBench &b) {
+   uint64_t n = 1;
+   while (true) {
+      MicroResult r = runOnce(b, n);
+      if (r.ns * n >= opts.targetNs || n >= (1ULL << 40)) {
+         break;
+      }
+      n *= 2;
+   }
+   vector<MicroResult> runs;
+   for (int i = 0; i < opts.reps; i++) {
+      runs.push_back(runOnce(b, n));
+   }
+   sort(runs.begin(), runs.end(), nsLess);
+   MicroResult &med = runs[runs.size() / 2];
+   double spread = med.ns > 0 ? 100.0 * (runs.back().ns - runs.front().ns) / med.ns : 0;
+   printf("%-18s %10.1f %10.1f %7.1f%% %10.2f %10.1f %12llu\n", b.name, med.ns, runs.front().ns,
+          spread, med.allocs, med.bytes, (unsigned long long)n);
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options] [benchmark ...]\n", prog);
+   fprintf(stderr, "   -t ms        minimum length of each timed run (50)\n");
+   fprintf(stderr, "   -r runs      number of timed runs, the median is reported (9)\n");
+   fprintf(stderr, "   -n members   clients in the dispatch project (8)\n");
+   fprintf(stderr, "   -b bytes     size of the update that is posted and dispatched (64)\n");
+   fprintf(stderr, "   -c cpu       pin the benchmark to a cpu (Linux only)\n");
+   fprintf(stderr, "   -l           list the benchmarks and exit\n");
+   fprintf(stderr, "benchmarks are selected by name or name prefix, all are run by default\n");
+   exit(1);
+}
+
+static bool selected(MicroBench &b, int argc, char **argv) {
+   if (optind >= argc) {
+      return true;
+   }
+   for (int i = optind; i < argc; i++) {
+      if (strncmp(b.name, argv[i], strlen(argv[i])) == 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+int main(int argc, char **argv) {
+   int opt;
+   int cpu = -1;
+   opts.targetNs = 50 * 1000000ULL;
+   opts.reps = 9;
+   opts.members = 8;
+   opts.payload = 64;
+   while ((opt = getopt(argc, argv, "t:r:n:b:c:l")) != -1) {
+      switch (opt) {
+         case 't':
+            opts.targetNs = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+         case 'r':
+            opts.reps = atoi(optarg);
+            break;
+         case 'n':
+            opts.members = atoi(optarg);
+            break;
+         case 'b':
+            opts.payload = atoi(optarg);
+            break;
+         case 'c':
+            cpu = atoi(optarg);
+            break;
+         case 'l':
+            for (unsigned int i = 0; i < NUM_BENCHES; i++) {
+               printf("%-18s %s\n", benches[i].name, benches[i].desc);
+            }
+            return 0;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (opts.targetNs == 0 || opts.reps < 1 || opts.members < 2 || opts.payload < 24) {
+      usage(argv[0]);
+   }
+   if (cpu >= 0) {
+#if defined __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+         perror("Microbench: sched_setaffinity");
+      }
+#else
+      fprintf(stderr, "Microbench: -c is not supported on this platform\n");
+#endif
+   }
+   signal(SIGPIPE, SIG_IGN);
+   if (!setup()) {
+      return 1;
+   }
+
+   printf("%d member project, %d byte updates, median of %d runs\n", opts.members, opts.payload, opts.reps);
+   printf("%-18s %10s %10s %8s %10s %10s %12s\n", "benchmark", "ns/op", "min ns/op", "spread",
+          "allocs/op", "bytes/op", "iterations");
+   for (unsigned int i = 0; i < NUM_BENCHES; i++) {
+      if (selected(benches[i], argc, argv)) {
+         fflush(stdout);
+         measure(benches[i]);
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,102 @@
+/*
+   collabREate probes.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/*
+ * Static tracepoints for bpftrace, perf and systemtap, all under the
+ * provider "collab".  Where <sys/sdt.h> is available (the systemtap sdt
+ * headers on Linux) each one compiles to a nop plus a note in the binary,
+ * behind a test of the probe's semaphore.  Tracers raise the semaphore
+ * while they are attached, so until then a probe costs one load and a
+ * branch and its arguments are not evaluated.  Elsewhere, or when built
+ * with -DNO_PROBES, they compile to nothing at all.  Either way arguments
+ * must not have side effects.
+ *
+ *    frame_received(int pid, int uid, int command, int len)
+ *       a frame has been read from a plugin, all of an update but only the
+ *       header of a control message, len includes the header
+ *    update_enqueue(void *packet, int pid, uint64_t updateid, int command)
+ *       an update has been stored and handed to the dispatch thread
+ *    update_dequeue(void *packet, int depth)
+ *       the dispatch thread picked an update up, depth are still waiting
+ *    update_send(void *packet, int uid, int sent, uint64_t ns)
+ *       the update went to one subscriber, sent is 0 if the subscriber
+ *       filtered it out, ns is the time spent on the subscriber
+ *    update_dispatched(void *packet, int subscribers)
+ *       the update has been through every member of its project
+ *    catchup_start(int pid, int uid, uint64_t lastupdate)
+ *    catchup_done(int pid, int uid)
+ *       a plugin's request for the updates after lastupdate
+ *    db_start(const char *statement)
+ *    db_done(const char *statement, uint64_t waitns, uint64_t execns, int rows)
+ *       a prepared statement, waitns is the wait for its connection
+ *    conn_accept(const char *addr, int port)
+ *    conn_close(const char *addr, int port, int uid, int pid)
+ *       a plugin connection
+ *
+ * The scripts in bpftrace/ put these together into latency breakdowns.
+ */
+
+#if !defined NO_PROBES && defined __linux__ && defined __has_include
+#if __has_include(<sys/sdt.h>)
+//each probe's note records the address of its semaphore
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define COLLAB_PROBES 1
+#endif
+#endif
+
+//every probe above, a new one has to be added here for its semaphore
+#define PROBE_LIST(X) \
+   X(frame_received) X(update_enqueue) X(update_dequeue) X(update_send) \
+   X(update_dispatched) X(catchup_start) X(catchup_done) X(db_start) \
+   X(db_done) X(conn_accept) X(conn_close)
+
+#ifdef COLLAB_PROBES
+//the semaphores live in .probes where tracers expect them, the same way
+//the headers dtrace -h generates declare them
+#define PROBE_DECLARE(name) \
+   extern unsigned short collab_##name##_semaphore __attribute__((unused, section(".probes")));
+#define PROBE_DEFINE(name) \
+   unsigned short collab_##name##_semaphore __attribute__((section(".probes"))) = 0;
+PROBE_LIST(PROBE_DECLARE)
+
+//defines the semaphores, once in the server
+#define PROBE_SEMAPHORES PROBE_LIST(PROBE_DEFINE)
+
+//true while a tracer is attached to the probe
+#define PROBE_ENABLED(name) __builtin_expect(collab_##name##_semaphore, 0)
+
+#define PROBE1(name, a) do { if (PROBE_ENABLED(name)) DTRACE_PROBE1(collab, name, a); } while (0)
+#define PROBE2(name, a, b) do { if (PROBE_ENABLED(name)) DTRACE_PROBE2(collab, name, a, b); } while (0)
+#define PROBE3(name, a, b, c) do { if (PROBE_ENABLED(name)) DTRACE_PROBE3(collab, name, a, b, c); } while (0)
+#define PROBE4(name, a, b, c, d) do { if (PROBE_ENABLED(name)) DTRACE_PROBE4(collab, name, a, b, c, d); } while (0)
+#else
+#define PROBE_SEMAPHORES
+#define PROBE_ENABLED(name) 0
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
@@ -142,3 +142,11 @@ ClientSet *ProjectMap::get(int key) {
    return res;
 }
 
+//number of clients connected to each project, by project
+void ProjectMap::clientCounts(map<int,int> &counts) {
+   pthread_mutex_lock(&mutex);
+   for (Projects_it i = projects.begin(); i != projects.end(); i++) {
+      counts[(*i).first] = (*i).second->size();
+   }
+   pthread_mutex_unlock(&mutex);
+}
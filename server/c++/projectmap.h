@@ -56,6 +56,8 @@ public:
    void removeClient(Client *c);
    ClientSet *get(int key);
    int numClients(int key);
+   //number of clients connected to each project, by project
+   void clientCounts(map<int,int> &counts);
    //loop across all projects
    void loop(pcb func, void *user);
    //loop across all clients in a single project
@@ -0,0 +1,461 @@
+/*
+   collabREate replay.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * collab_replay drives a server with traffic recorded by a server running
+ * with CAPTURE_DIR set.  Every capture becomes a simulated plugin that sends
+ * the recorded frames on the recorded schedule, scaled by a speed factor,
+ * so idle stretches and analysis storms arrive just as they did for real.
+ * Captures are replayed together, lined up by the time their connections
+ * were accepted, and can be replayed several times over to multiply the
+ * number of clients.  Each copy of a recorded project becomes a new
+ * project of its own.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "buffer.h"
+#include "capture.h"
+#include "bench.h"
+
+using namespace std;
+
+//how long to wait for acks and relayed updates once the captures run out
+#define DRAIN_SECONDS 10
+
+/**
+ * a recorded project, one per copy of the replay
+ */
+struct ReplayProject {
+   BenchProject bp;
+   bool created;
+};
+
+/**
+ * one capture being replayed by one simulated client
+ */
+struct ReplaySession {
+   int id;
+   string file;
+   int copy;
+   BenchClient *client;
+   pthread_t tid;
+   bool ok;
+   uint64_t frames;
+   uint64_t skipped;
+   //the last frame's time relative to the start of the replay, before scaling
+   uint64_t span;
+   //how far behind schedule each frame went out, in nanoseconds
+   vector<uint64_t> lateness;
+};
+
+static BenchOptions opts;
+static double speed = 1.0;
+static string runTag;
+static uint64_t firstStart;
+static uint64_t replayStart;
+static map<string, ReplayProject*> projects;
+//held while a client looks up, creates or joins a project
+static pthread_mutex_t projectLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * mapProject finds the project that stands in for a recorded one
+ * @param key identifies the recorded project
+ * @param copy which copy of the replay is asking
+ * @return the stand in project, created on first use
+ */
+static ReplayProject *mapProject(const string &key, int copy) {
+   char buf[32];
+   snprintf(buf, sizeof(buf), "/%d", copy);
+   string name = key + buf;
+   map<string, ReplayProject*>::iterator i = projects.find(name);
+   if (i != projects.end()) {
+      return i->second;
+   }
+   ReplayProject *rp = new ReplayProject;
+   //a hash nobody else will ever open keeps each run in projects of its own
+   uint8_t *h = toByteArray(getMD5(runTag + name));
+   memcpy(rp->bp.hash, h, MD5_SIZE);
+   delete [] h;
+   rp->bp.index = projects.size();
+   rp->bp.lpid = -1;
+   rp->bp.lastAcked = 0;
+   pthread_mutex_init(&rp->bp.lock, NULL);
+   rp->created = false;
+   projects[name] = rp;
+   return rp;
+}
+
+/**
+ * joinRecorded joins the stand in for the project a recorded
+ * MSG_PROJECT_NEW_REQUEST, MSG_PROJECT_JOIN_REQUEST or
+ * MSG_PROJECT_REJOIN_REQUEST asked for
+ * @param s the session making the request
+ * @param r the recorded request
+ * @param lastHash the hash of the last recorded MSG_PROJECT_LIST
+ * @return false if the project could not be joined
+ */
+static bool joinRecorded(ReplaySession *s, CaptureRecord &r, const string &lastHash) {
+   string key;
+   if (r.cmd == MSG_PROJECT_NEW_REQUEST) {
+      uint8_t md5[MD5_SIZE];
+      r.payload.read(md5, sizeof(md5));
+      key = toHexString(md5, MD5_SIZE);
+      free(r.payload.readUTF());
+   }
+   else if (r.cmd == MSG_PROJECT_JOIN_REQUEST) {
+      int lpid = r.payload.readInt();
+      char buf[32];
+      snprintf(buf, sizeof(buf), "lpid %d", lpid);
+      //plugins always list a hash before joining one of its projects
+      key = lastHash.length() ? lastHash : buf;
+   }
+   else {
+      uint8_t gpid[GPID_SIZE];
+      r.payload.read(gpid, sizeof(gpid));
+      //a rejoin names the project rather than the binary, so it can't be
+      //tied to clients of the same project that created or listed it
+      key = "gpid " + toHexString(gpid, GPID_SIZE);
+   }
+   uint64_t pub = r.payload.readLong();
+   uint64_t sub = r.payload.readLong();
+   if (r.payload.has_error()) {
+      fprintf(stderr, "collab_replay: %s: malformed project request\n", s->file.c_str());
+      return false;
+   }
+   pthread_mutex_lock(&projectLock);
+   ReplayProject *rp = mapProject(key, s->copy);
+   s->client->setProject(&rp->bp);
+   //the first client in creates the project, everyone else joins it
+   bool ok = s->client->join(!rp->created, pub, sub, "collab_replay " + key.substr(0, 16));
+   if (ok) {
+      rp->created = true;
+   }
+   pthread_mutex_unlock(&projectLock);
+   return ok;
+}
+
+/**
+ * replay sends one capture's frames on schedule
+ */
+static void *replay(void *arg) {
+   ReplaySession *s = (ReplaySession*)arg;
+   CaptureReader cr;
+   CaptureRecord r;
+   if (!cr.open(s->file.c_str())) {
+      s->ok = false;
+      return NULL;
+   }
+   if (!cr.next(r)) {
+      //the plugin never said anything
+      return NULL;
+   }
+   uint64_t base = cr.getStart() - firstStart;
+   bool more = true;
+   if (r.cmd == MSG_AUTH_REQUEST) {
+      //speak the version the recorded plugin spoke
+      s->client->limitProto(r.payload.readInt());
+      more = cr.next(r);
+   }
+   if (speed > 0) {
+      benchSleepUntil(replayStart + (uint64_t)(base / speed));
+   }
+   if (!s->client->open()) {
+      s->ok = false;
+      return NULL;
+   }
+   bool joined = false;
+   string lastHash;
+   for (; more && s->ok; more = cr.next(r)) {
+      uint64_t due = benchNow();
+      s->span = base + r.offset;
+      if (speed > 0) {
+         due = replayStart + (uint64_t)(s->span / speed);
+         benchSleepUntil(due);
+         s->lateness.push_back(benchNow() - due);
+      }
+      s->frames++;
+      switch (r.cmd) {
+         case MSG_AUTH_REQUEST:
+            //open already authenticated with our own credentials
+            break;
+         case MSG_PROJECT_LIST: {
+            uint8_t md5[MD5_SIZE];
+            if (r.payload.read(md5, sizeof(md5))) {
+               lastHash = toHexString(md5, MD5_SIZE);
+            }
+            break;
+         }
+         case MSG_PROJECT_NEW_REQUEST:
+         case MSG_PROJECT_JOIN_REQUEST:
+         case MSG_PROJECT_REJOIN_REQUEST:
+            if (joined) {
+               //join reads the reply itself, which the reader thread now owns
+               s->skipped++;
+               break;
+            }
+            s->ok = joinRecorded(s, r, lastHash);
+            if (s->ok) {
+               joined = true;
+               s->client->start();
+            }
+            break;
+         case MSG_PROJECT_SNAPSHOT_REQUEST:
+         case MSG_PROJECT_FORK_REQUEST:
+         case MSG_PROJECT_SNAPFORK_REQUEST:
+         case MSG_PROJECT_LEAVE:
+            //these move the plugin to another project, which a replay can't follow
+            s->skipped++;
+            break;
+         case MSG_SEND_UPDATES: {
+            if (!joined) {
+               s->skipped++;
+               break;
+            }
+            //recorded updateids mean nothing in a stand in project
+            Buffer b;
+            b.writeLong(0);
+            s->ok = s->client->sendFrame(MSG_SEND_UPDATES, b);
+            break;
+         }
+         default:
+            if (!joined) {
+               s->skipped++;
+            }
+            else if (r.cmd < MSG_CONTROL_FIRST) {
+               s->ok = s->client->sendUpdate(r.cmd, r.payload, due);
+            }
+            else {
+               s->ok = s->client->sendFrame(r.cmd, r.payload);
+            }
+            break;
+      }
+   }
+   return NULL;
+}
+
+/**
+ * addCaptures adds a capture file, or every capture in a directory
+ * @param path a capture or a directory of them
+ * @param files receives the names of the captures
+ */
+static void addCaptures(const char *path, vector<string> &files) {
+   struct stat st;
+   if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      DIR *d = opendir(path);
+      if (d == NULL) {
+         return;
+      }
+      vector<string> found;
+      size_t slen = strlen(CAPTURE_SUFFIX);
+      for (struct dirent *de = readdir(d); de != NULL; de = readdir(d)) {
+         size_t len = strlen(de->d_name);
+         if (len > slen && strcmp(de->d_name + len - slen, CAPTURE_SUFFIX) == 0) {
+            found.push_back(string(path) + "/" + de->d_name);
+         }
+      }
+      closedir(d);
+      sort(found.begin(), found.end());
+      files.insert(files.end(), found.begin(), found.end());
+   }
+   else {
+      files.push_back(path);
+   }
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options] capture|directory ...\n", prog);
+   fprintf(stderr, "   -s host      server to connect to (127.0.0.1)\n");
+   fprintf(stderr, "   -p port      server port (5042)\n");
+   fprintf(stderr, "   -u user      user every client authenticates as, ignored by basic mode servers\n");
+   fprintf(stderr, "   -P password  password for user\n");
+   fprintf(stderr, "   -S speed     1 for real time, 10 for ten times as fast, max for no waiting (1)\n");
+   fprintf(stderr, "   -x copies    replay every capture this many times at once (1)\n");
+   fprintf(stderr, "   -v version   highest protocol version to negotiate (%d)\n", PROTOCOL_VERSION_MAX);
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   opts.host = "127.0.0.1";
+   opts.port = 5042;
+   opts.proto = PROTOCOL_VERSION_MAX;
+   opts.payload = 0;
+   opts.totalWeight = 0;
+   int copies = 1;
+
+   int opt;
+   while ((opt = getopt(argc, argv, "s:p:u:P:S:x:v:")) != -1) {
+      switch (opt) {
+         case 's':
+            opts.host = optarg;
+            break;
+         case 'p':
+            opts.port = atoi(optarg);
+            break;
+         case 'u':
+            opts.user = optarg;
+            break;
+         case 'P':
+            opts.password = optarg;
+            break;
+         case 'S':
+            speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+            break;
+         case 'x':
+            copies = atoi(optarg);
+            break;
+         case 'v':
+            opts.proto = atoi(optarg);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   vector<string> files;
+   for (int i = optind; i < argc; i++) {
+      addCaptures(argv[i], files);
+   }
+   if (files.empty() || copies < 1 || speed < 0 ||
+       opts.proto < PROTOCOL_VERSION || opts.proto > PROTOCOL_VERSION_MAX) {
+      usage(argv[0]);
+   }
+   signal(SIGPIPE, SIG_IGN);
+   setvbuf(stdout, NULL, _IOLBF, 0);
+
+   //line the captures up by the time their connections were accepted
+   firstStart = 0;
+   vector<string> usable;
+   for (vector<string>::iterator i = files.begin(); i != files.end(); i++) {
+      CaptureReader cr;
+      if (cr.open(i->c_str())) {
+         if (usable.empty() || cr.getStart() < firstStart) {
+            firstStart = cr.getStart();
+         }
+         usable.push_back(*i);
+      }
+   }
+   if (usable.empty()) {
+      return 1;
+   }
+   char tag[64];
+   snprintf(tag, sizeof(tag), "collab_replay %d %ld ", getpid(), (long)time(NULL));
+   runTag = tag;
+
+   vector<ReplaySession*> sessions;
+   for (int c = 0; c < copies; c++) {
+      for (vector<string>::iterator i = usable.begin(); i != usable.end(); i++) {
+         ReplaySession *s = new ReplaySession;
+         s->id = sessions.size();
+         s->file = *i;
+         s->copy = c;
+         s->client = new BenchClient(s->id, NULL, &opts);
+         s->ok = true;
+         s->frames = 0;
+         s->skipped = 0;
+         s->span = 0;
+         sessions.push_back(s);
+      }
+   }
+   if (speed > 0) {
+      printf("replaying %d capture(s) %d time(s) over at %gx\n", (int)usable.size(), copies, speed);
+   }
+   else {
+      printf("replaying %d capture(s) %d time(s) over as fast as possible\n", (int)usable.size(), copies);
+   }
+
+   replayStart = benchNow();
+   for (vector<ReplaySession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
+      pthread_create(&(*i)->tid, NULL, replay, *i);
+   }
+   for (vector<ReplaySession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
+      pthread_join((*i)->tid, NULL);
+   }
+   double elapsed = (benchNow() - replayStart) / 1e9;
+
+   //let the acks and relayed updates still in flight arrive
+   uint64_t deadline = benchNow() + DRAIN_SECONDS * 1000000000ULL;
+   uint64_t pub = 0, ack = 0, del = 0, lastDel = (uint64_t)-1;
+   int quiet = 0;
+   while (true) {
+      pub = ack = del = 0;
+      for (vector<ReplaySession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
+         uint64_t p, a, d;
+         (*i)->client->getCounts(p, a, d);
+         pub += p;
+         ack += a;
+         del += d;
+      }
+      quiet = (del == lastDel) ? quiet + 1 : 0;
+      if ((ack >= pub && quiet >= 3) || benchNow() >= deadline) {
+         break;
+      }
+      lastDel = del;
+      usleep(100000);
+   }
+
+   int failed = 0;
+   uint64_t frames = 0, skipped = 0, span = 0;
+   vector<uint64_t> lateness;
+   vector<uint64_t> ackLatencies;
+   for (vector<ReplaySession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
+      ReplaySession *s = *i;
+      s->client->close();
+      if (!s->ok) {
+         failed++;
+      }
+      frames += s->frames;
+      skipped += s->skipped;
+      span = max(span, s->span);
+      lateness.insert(lateness.end(), s->lateness.begin(), s->lateness.end());
+      ackLatencies.insert(ackLatencies.end(), s->client->ackLatencies.begin(), s->client->ackLatencies.end());
+   }
+   printf("clients     %d, %d failed\n", (int)sessions.size(), failed);
+   printf("recorded    %.1f s replayed in %.1f s, %.1fx\n", span / 1e9, elapsed, elapsed > 0 ? span / 1e9 / elapsed : 0.0);
+   printf("frames      %llu replayed, %llu skipped\n", (unsigned long long)frames, (unsigned long long)skipped);
+   printf("published   %llu updates, %.0f/s\n", (unsigned long long)pub, pub / elapsed);
+   printf("acked       %llu updates, %.0f/s\n", (unsigned long long)ack, ack / elapsed);
+   printf("delivered   %llu updates, %.0f/s\n", (unsigned long long)del, del / elapsed);
+   if (speed > 0) {
+      //a replay that falls behind is measuring the replay, not the server
+      printLatency("behind", lateness);
+   }
+   printLatency("ack", ackLatencies);
+
+   for (vector<ReplaySession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
+      delete (*i)->client;
+      delete *i;
+   }
+   for (map<string, ReplayProject*>::iterator i = projects.begin(); i != projects.end(); i++) {
+      pthread_mutex_destroy(&i->second->bp.lock);
+      delete i->second;
+   }
+   return failed ? 1 : 0;
+}
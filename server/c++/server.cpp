@@ -39,7 +39,11 @@
 
 #include "utils.h"
 #include "db_support.h"
+#include "basic_mgr.h"
+#include "log_mgr.h"
 #include "mgr_helper.h"
+#include "metrics.h"
+#include "logger.h"
 #include "client.h"
 
 #define ERROR_NO_USER "Failed to find user %s"
@@ -73,16 +77,28 @@ void sigchld(int sig) {
  * the client thread crashes, the entire server crashes.
  */
 void loop(NetworkService *svc) {
-   //should choose between Basic and Database connection managers here
-   DatabaseConnectionManager mgr(conf);
-   mgr.start();
+   ConnectionManagerBase *mgr;
+   string mode = getStringOption(conf, "SERVER_MODE", "database");
+   if (mode == "log") {
+      //projects and updates kept in local files, no database required
+      mgr = new LogConnectionManager(conf);
+   }
+   else if (mode == "basic") {
+      mgr = new BasicConnectionManager(conf);
+   }
+   else {
+      mgr = new DatabaseConnectionManager(conf);
+   }
+   mgr->start();
    //need to instantiate a ManagerHelper here as well
-   ManagerHelper helper(&mgr, conf);
+   ManagerHelper helper(mgr, conf);
    helper.start();
+   MetricsServer metrics(mgr, conf);
+   metrics.start();
    while (true) {
       NetworkIO *nio = svc->accept();
       if (nio) {
-         mgr.add(nio);
+         mgr->add(nio);
       }   
    }
 }
@@ -187,6 +203,9 @@ int main(int argc, char **argv, char **envp) {
       exit(-1);
 #endif
    }
+   //a peer that hangs up mid send is an error on that connection, not a
+   //reason to exit
+   signal(SIGPIPE, SIG_IGN);
    int opt;
    while ((opt = getopt(argc, argv, "c:")) != -1) {
       switch (opt) {
@@ -211,6 +230,8 @@ int main(int argc, char **argv, char **envp) {
    }
    drop_privs_user(svc_user);
    daemon(1, 0);
+   //the flusher thread has to be started after daemon forks
+   logStart(conf);
    writePidFile();
    loop(svc);
    return 0;
@@ -0,0 +1,675 @@
+/*
+   collabREate server_backup.cpp
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "export_chunked.h"
+#include "server_mgr.h"
+#include "server_backup.h"
+
+using namespace std;
+
+//the longest snapshot description a manifest keeps, its lines are read whole
+#define BACKUP_DESC_MAX 0x10000
+
+//what a worker thread needs, the manager it works through is its own
+struct BackupWorker {
+   ServerBackup *backup;
+   ServerManager *sm;
+};
+
+static double elapsed(const struct timeval &start) {
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+static bool gzReadFully(gzFile gz, void *buf, uint32_t len) {
+   return len == 0 || gzread(gz, buf, len) == (int)len;
+}
+
+//how many of the updates in an archive come at or before updateid, -1 on error
+static int64_t countArchived(const char *name, uint64_t updateid) {
+   gzFile gz = gzopen(name, "rb");
+   if (gz == NULL) {
+      fprintf(stderr, "unable to read %s\n", name);
+      return -1;
+   }
+   //skip over the project description
+   uint8_t head[8 + 4 + GPID_SIZE + MD5_SIZE + 8 + 8 + 2];
+   bool ok = gzReadFully(gz, head, sizeof(head)) && memcmp(head, FILE_SIG, 8) == 0 &&
+             gzseek(gz, (head[sizeof(head) - 2] << 8) | head[sizeof(head) - 1], SEEK_CUR) != -1;
+   int64_t count = 0;
+   bool ended = false;
+   while (ok) {
+      uint8_t rec[4 + 8 + 4 + 4 + 4 + 4];
+      if (!gzReadFully(gz, rec, 4) || (ntohl(*(uint32_t*)rec) != TAG && ntohl(*(uint32_t*)rec) != ENDTAG)) {
+         break;
+      }
+      if (ntohl(*(uint32_t*)rec) == ENDTAG || !gzReadFully(gz, rec + 4, sizeof(rec) - 4)) {
+         ended = ntohl(*(uint32_t*)rec) == ENDTAG;
+         break;
+      }
+      uint64_t id = ((uint64_t)ntohl(*(uint32_t*)(rec + 4)) << 32) | ntohl(*(uint32_t*)(rec + 8));
+      //archives are written in updateid order
+      if (ntohll(id) > updateid) {
+         ended = true;
+         break;
+      }
+      count++;
+      ok = gzseek(gz, ntohl(*(uint32_t*)(rec + 24)), SEEK_CUR) != -1;
+   }
+   gzclose(gz);
+   if (!ended) {
+      fprintf(stderr, "%s is truncated or corrupt\n", name);
+      return -1;
+   }
+   return count;
+}
+
+static bool copyFile(const char *src, const char *dst) {
+   int in = open(src, O_RDONLY);
+   if (in < 0) {
+      fprintf(stderr, "unable to read %s: %s\n", src, strerror(errno));
+      return false;
+   }
+   int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (out < 0) {
+      fprintf(stderr, "unable to create %s: %s\n", dst, strerror(errno));
+      close(in);
+      return false;
+   }
+   char buf[0x10000];
+   ssize_t len;
+   bool ok = true;
+   while (ok && (len = read(in, buf, sizeof(buf))) > 0) {
+      ok = write(out, buf, len) == len;
+   }
+   ok = ok && len == 0;
+   close(in);
+   if (close(out) != 0 || !ok) {
+      fprintf(stderr, "unable to copy %s to %s\n", src, dst);
+      unlink(dst);
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @param m the manager doing the backup or restore, it reads and
+ * writes users and forks
+ * @param p the configuration
+ */
+ServerBackup::ServerBackup(ServerManager *m, map<string,string> *p) {
+   sm = m;
+   props = p;
+   restoring = false;
+   workers = getIntOption(props, "BACKUP_WORKERS", 4);
+   if (workers < 1) {
+      workers = 1;
+   }
+   next = 0;
+   done = 0;
+   restored = NULL;
+   updates = 0;
+   bytes = 0;
+   sem_init(&lock, 0, 1);
+}
+
+ServerBackup::~ServerBackup() {
+   if (restored) {
+      fclose(restored);
+   }
+   sem_destroy(&lock);
+}
+
+string ServerBackup::path(const string &name) {
+   return dir + "/" + name;
+}
+
+/**
+ * backup exports every project to a directory and writes its manifest
+ * @param d the directory to back up to, created if it doesn't exist
+ * @return 0 if everything was backed up
+ */
+int ServerBackup::backup(const char *d) {
+   dir = d;
+   restoring = false;
+   if (sm->getMode() != MODE_DB) {
+      fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
+      return -1;
+   }
+   if (mkdir(d, 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "unable to create %s: %s\n", d, strerror(errno));
+      return -1;
+   }
+   vector<BackupUser> users;
+   if (sm->getBackupUsers(users) != 0 || sm->getBackupProjects(projects) != 0) {
+      return -1;
+   }
+   map<int,BackupProject*> byPid;
+   for (size_t i = 0; i < projects.size(); i++) {
+      byPid[projects[i].pid] = &projects[i];
+   }
+   jobs.clear();
+   for (size_t i = 0; i < projects.size(); i++) {
+      BackupProject &p = projects[i];
+      if (p.snapupdateid != 0) {
+         //a snapshot is a point in its parent's updates, there is nothing to export
+         p.file = "-";
+         continue;
+      }
+      //an archive is already an export, just gzip compressed
+      p.file = p.gpid + (p.archive.empty() ? ".crx" : ".gz");
+      jobs.push_back(&p);
+   }
+   printf("backing up %u users, %u projects and %u snapshots to %s\n", (unsigned)users.size(),
+          (unsigned)jobs.size(), (unsigned)(projects.size() - jobs.size()), d);
+   bool ok = runWorkers();
+   report("backed up");
+
+   //snapshots once their parents are backed up, one that can't be is left out
+   int snaps = 0;
+   int skipped = 0;
+   for (size_t i = 0; i < projects.size(); i++) {
+      BackupProject &p = projects[i];
+      if (p.snapupdateid != 0) {
+         map<int,BackupProject*>::iterator parent = byPid.find(p.parent);
+         p.ok = locateSnapshot(p, parent == byPid.end() ? NULL : parent->second);
+         snaps += p.ok ? 1 : 0;
+         skipped += p.ok ? 0 : 1;
+      }
+   }
+   printf("%d snapshots backed up, %d skipped\n", snaps, skipped);
+   if (!writeManifest(users)) {
+      return -1;
+   }
+   if (!ok) {
+      fprintf(stderr, "projects that failed are left out of the manifest\n");
+   }
+   return ok ? 0 : -1;
+}
+
+/**
+ * restore recreates the users, projects and forks of a backup, projects
+ * restored by an earlier run are skipped
+ * @param d the directory holding the backup
+ * @return 0 if everything was restored
+ */
+int ServerBackup::restore(const char *d) {
+   dir = d;
+   restoring = true;
+   if (sm->getMode() != MODE_DB) {
+      fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
+      return -1;
+   }
+   vector<BackupUser> users;
+   if (!readManifest(users)) {
+      return -1;
+   }
+   //users first, the projects belong to them
+   int added = 0;
+   for (size_t i = 0; i < users.size(); i++) {
+      BackupUser &u = users[i];
+      int uid = sm->findUser(u.username);
+      if (uid == 0) {
+         uid = sm->addUser(u.username, u.pwhash, u.pub, u.sub);
+         added++;
+      }
+      if (uid < 0) {
+         return -1;
+      }
+      uids[u.uid] = uid;
+   }
+   printf("%d users added, %d already present\n", added, (int)users.size() - added);
+
+   map<string,int> earlier;
+   string rname = path(BACKUP_RESTORED);
+   FILE *f = fopen(rname.c_str(), "r");
+   if (f != NULL) {
+      char gpid[GPID_SIZE * 2 + 1];
+      int pid;
+      while (fscanf(f, "%64s %d", gpid, &pid) == 2) {
+         earlier[gpid] = pid;
+      }
+      fclose(f);
+   }
+   jobs.clear();
+   unsigned before = 0;
+   for (size_t i = 0; i < projects.size(); i++) {
+      BackupProject &p = projects[i];
+      map<string,int>::iterator e = earlier.find(p.gpid);
+      if (e != earlier.end()) {
+         p.newpid = e->second;
+         p.ok = true;
+         before++;
+      }
+      else if (p.snapupdateid == 0) {
+         jobs.push_back(&p);
+      }
+   }
+   restored = fopen(rname.c_str(), "a");
+   if (restored == NULL) {
+      fprintf(stderr, "unable to write %s: %s\n", rname.c_str(), strerror(errno));
+      return -1;
+   }
+   printf("restoring %u projects from %s, %u were restored earlier\n", (unsigned)jobs.size(), d, before);
+   bool ok = runWorkers();
+   report("restored");
+
+   map<int,BackupProject*> byPid;
+   for (size_t i = 0; i < projects.size(); i++) {
+      byPid[projects[i].pid] = &projects[i];
+   }
+   //snapshots need their parents' restored updateids
+   int snaps = 0;
+   for (size_t i = 0; i < projects.size(); i++) {
+      BackupProject &p = projects[i];
+      if (p.snapupdateid == 0 || p.ok) {
+         continue;
+      }
+      map<int,BackupProject*>::iterator parent = byPid.find(p.parent);
+      if (restoreSnapshot(p, parent == byPid.end() ? NULL : parent->second)) {
+         snaps++;
+      }
+      else {
+         ok = false;
+      }
+   }
+   printf("%d snapshots restored\n", snaps);
+
+   //forks last, both ends need their new pids, a snapshot is recorded as a fork of its parent
+   int forks = 0;
+   for (size_t i = 0; i < projects.size(); i++) {
+      BackupProject &p = projects[i];
+      if (p.parent == 0 || !p.ok) {
+         continue;
+      }
+      map<int,BackupProject*>::iterator parent = byPid.find(p.parent);
+      if (parent == byPid.end() || !parent->second->ok) {
+         fprintf(stderr, "project %s was forked from project %d, which was not restored\n", p.gpid.c_str(), p.parent);
+      }
+      else if (sm->addFork(p.newpid, parent->second->newpid) != 0) {
+         ok = false;
+      }
+      else {
+         forks++;
+      }
+   }
+   printf("%d forks restored\n", forks);
+   return ok ? 0 : -1;
+}
+
+/**
+ * runWorkers works through the jobs with a pool of workers, each one a
+ * ServerManager with its own database connection and, for a restore, its
+ * own connection to the server
+ * @return false if any job failed
+ */
+bool ServerBackup::runWorkers() {
+   next = 0;
+   done = 0;
+   updates = 0;
+   bytes = 0;
+   gettimeofday(&start, NULL);
+   //workers are set up one at a time, reading the configuration isn't thread safe
+   vector<BackupWorker> pool;
+   for (int i = 0; i < workers && i < (int)jobs.size(); i++) {
+      BackupWorker bw;
+      bw.backup = this;
+      bw.sm = new ServerManager(props, true);
+      if (bw.sm->getMode() != MODE_DB || (restoring && !bw.sm->connectToHelper())) {
+         bw.sm->terminate();
+         delete bw.sm;
+         break;
+      }
+      pool.push_back(bw);
+   }
+   if (pool.empty() && !jobs.empty()) {
+      fprintf(stderr, "unable to start any workers\n");
+      return false;
+   }
+   if (!jobs.empty()) {
+      printf("using %u workers\n", (unsigned)pool.size());
+   }
+   vector<pthread_t> tids(pool.size());
+   for (size_t i = 1; i < pool.size(); i++) {
+      pthread_create(&tids[i], NULL, worker, &pool[i]);
+   }
+   if (!pool.empty()) {
+      worker(&pool[0]);
+   }
+   for (size_t i = 0; i < pool.size(); i++) {
+      if (i > 0) {
+         pthread_join(tids[i], NULL);
+      }
+      pool[i].sm->terminate();
+      delete pool[i].sm;
+   }
+   bool ok = true;
+   for (size_t i = 0; i < jobs.size(); i++) {
+      ok = ok && jobs[i]->ok;
+   }
+   return ok;
+}
+
+void *ServerBackup::worker(void *arg) {
+   BackupWorker *bw = (BackupWorker*)arg;
+   ServerBackup *b = bw->backup;
+   if (!b->restoring) {
+      bw->sm->loadProjects(false);
+   }
+   BackupProject *job;
+   while ((job = b->take()) != NULL) {
+      job->ok = b->restoring ? b->importOne(bw->sm, *job) : b->exportOne(bw->sm, *job);
+      b->finished(job);
+   }
+   return NULL;
+}
+
+BackupProject *ServerBackup::take() {
+   BackupProject *job = NULL;
+   sem_wait(&lock);
+   if (next < jobs.size()) {
+      job = jobs[next++];
+   }
+   sem_post(&lock);
+   return job;
+}
+
+void ServerBackup::finished(BackupProject *job) {
+   sem_wait(&lock);
+   done++;
+   if (job->ok) {
+      updates += job->updates > 0 ? job->updates : 0;
+      bytes += job->bytes;
+      if (restored) {
+         fprintf(restored, "%s %d\n", job->gpid.c_str(), job->newpid);
+         fflush(restored);
+      }
+   }
+   printf("[%u/%u] project %d %s", (unsigned)done, (unsigned)jobs.size(), job->pid, job->ok ? "done" : "FAILED");
+   if (job->ok && job->updates >= 0) {
+      printf(", %lld updates", (long long)job->updates);
+   }
+   printf("\n");
+   fflush(stdout);
+   sem_post(&lock);
+}
+
+bool ServerBackup::exportOne(ServerManager *w, BackupProject &job) {
+   string file = path(job.file);
+   if (!job.archive.empty()) {
+      //the updates of an archived project are only in its archive
+      if (!copyFile(job.archive.c_str(), file.c_str())) {
+         return false;
+      }
+      job.updates = -1;
+   }
+   else {
+      if (w->exportProject(job.pid, file.c_str(), EXPORT_CHUNKED) != 0) {
+         return false;
+      }
+      ChunkedExportReader reader;
+      if (!reader.open(file.c_str())) {
+         return false;
+      }
+      job.updates = reader.size();
+   }
+   struct stat st;
+   job.bytes = stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+   return true;
+}
+
+bool ServerBackup::importOne(ServerManager *w, BackupProject &job) {
+   map<int,int>::iterator owner = uids.find(job.owner);
+   if (owner == uids.end()) {
+      fprintf(stderr, "the owner of project %d is not in the backup\n", job.pid);
+      return false;
+   }
+   return w->importProject(path(job.file).c_str(), owner->second, &job.newpid) == 0;
+}
+
+/**
+ * locateSnapshot finds how many of its parent's updates a snapshot covers
+ * @param snap the snapshot
+ * @param parent the project it was taken of, NULL if that isn't being backed up
+ * @return false if the snapshot can't be backed up
+ */
+bool ServerBackup::locateSnapshot(BackupProject &snap, const BackupProject *parent) {
+   if (parent == NULL || !parent->ok) {
+      fprintf(stderr, "snapshot %d was taken of project %d, which was not backed up\n", snap.pid, snap.parent);
+      return false;
+   }
+   //the updates of an archived project are only in its archive
+   snap.position = parent->archive.empty() ? sm->countUpdatesTo(parent->pid, snap.snapupdateid) :
+                   countArchived(parent->archive.c_str(), snap.snapupdateid);
+   if (snap.position <= 0) {
+      fprintf(stderr, "unable to find update %llu of project %d for snapshot %d\n",
+              (unsigned long long)snap.snapupdateid, parent->pid, snap.pid);
+      return false;
+   }
+   return true;
+}
+
+/**
+ * restoreSnapshot recreates a snapshot at the same place in its restored parent
+ * @param snap the snapshot
+ * @param parent the project it was taken of, NULL if that isn't in the backup
+ * @return false if the snapshot could not be restored
+ */
+bool ServerBackup::restoreSnapshot(BackupProject &snap, const BackupProject *parent) {
+   if (parent == NULL || !parent->ok) {
+      fprintf(stderr, "snapshot %s was taken of project %d, which was not restored\n", snap.gpid.c_str(), snap.parent);
+      return false;
+   }
+   map<int,int>::iterator owner = uids.find(snap.owner);
+   if (owner == uids.end()) {
+      fprintf(stderr, "the owner of snapshot %d is not in the backup\n", snap.pid);
+      return false;
+   }
+   //the parent's updates were given new updateids, in the same order
+   uint64_t updateid = sm->updateAt(parent->newpid, snap.position - 1);
+   if (updateid == 0) {
+      fprintf(stderr, "project %s has fewer than %lld updates, unable to restore snapshot %s\n",
+              parent->gpid.c_str(), (long long)snap.position, snap.gpid.c_str());
+      return false;
+   }
+   snap.newpid = sm->addSnapshot(snap, owner->second, updateid);
+   if (snap.newpid < 0) {
+      return false;
+   }
+   snap.ok = true;
+   fprintf(restored, "%s %d\n", snap.gpid.c_str(), snap.newpid);
+   fflush(restored);
+   return true;
+}
+
+void ServerBackup::report(const char *what) {
+   unsigned ok = 0;
+   for (size_t i = 0; i < jobs.size(); i++) {
+      ok += jobs[i]->ok ? 1 : 0;
+   }
+   double secs = elapsed(start);
+   double mb = bytes / 1048576.0;
+   printf("%s %u of %u projects, %lld updates, %.1f MB in %.1f s", what, ok, (unsigned)jobs.size(),
+          (long long)updates, mb, secs);
+   if (secs > 0) {
+      printf(" (%.0f updates/s, %.1f MB/s)", updates / secs, mb / secs);
+   }
+   printf("\n");
+}
+
+/**
+ * writeManifest lists the users and every project that was backed up,
+ * along with the project each was forked from, and the snapshots with
+ * their place in the project they were taken of
+ */
+bool ServerBackup::writeManifest(const vector<BackupUser> &users) {
+   string name = path(BACKUP_MANIFEST);
+   string tmp = name + ".tmp";
+   FILE *f = fopen(tmp.c_str(), "w");
+   if (f == NULL) {
+      fprintf(stderr, "unable to create %s: %s\n", tmp.c_str(), strerror(errno));
+      return false;
+   }
+   fprintf(f, "%s\n", BACKUP_MANIFEST_SIG);
+   fprintf(f, "# user uid pub sub pwhash username\n");
+   for (size_t i = 0; i < users.size(); i++) {
+      const BackupUser &u = users[i];
+      fprintf(f, "user %d %llx %llx %s %s\n", u.uid, (unsigned long long)u.pub, (unsigned long long)u.sub,
+              u.pwhash.empty() ? "-" : u.pwhash.c_str(), u.username.c_str());
+   }
+   fprintf(f, "# project pid owner parent updates bytes gpid file\n");
+   for (size_t i = 0; i < projects.size(); i++) {
+      const BackupProject &p = projects[i];
+      if (p.ok && p.snapupdateid == 0) {
+         fprintf(f, "project %d %d %d %lld %lld %s %s\n", p.pid, p.owner, p.parent,
+                 (long long)p.updates, (long long)p.bytes, p.gpid.c_str(), p.file.c_str());
+      }
+   }
+   fprintf(f, "# snapshot pid owner parent snapupdateid position protocol gpid hash description\n");
+   for (size_t i = 0; i < projects.size(); i++) {
+      const BackupProject &p = projects[i];
+      if (p.snapupdateid == 0) {
+         continue;
+      }
+      if (!p.ok) {
+         fprintf(f, "# skipped snapshot %d of project %d\n", p.pid, p.parent);
+         continue;
+      }
+      //the description ends the line, so it must be a single one
+      string desc = p.desc.substr(0, BACKUP_DESC_MAX);
+      for (size_t c = 0; c < desc.length(); c++) {
+         if (desc[c] == '\r' || desc[c] == '\n') {
+            desc[c] = ' ';
+         }
+      }
+      fprintf(f, "snapshot %d %d %d %llu %lld %d %s %s %s\n", p.pid, p.owner, p.parent,
+              (unsigned long long)p.snapupdateid, (long long)p.position, p.protocol, p.gpid.c_str(),
+              p.hash.empty() ? "-" : p.hash.c_str(), desc.c_str());
+   }
+   if (fclose(f) != 0 || rename(tmp.c_str(), name.c_str()) == -1) {
+      fprintf(stderr, "unable to write %s\n", name.c_str());
+      unlink(tmp.c_str());
+      return false;
+   }
+   return true;
+}
+
+bool ServerBackup::readManifest(vector<BackupUser> &users) {
+   string name = path(BACKUP_MANIFEST);
+   FILE *f = fopen(name.c_str(), "r");
+   if (f == NULL) {
+      fprintf(stderr, "unable to read %s: %s\n", name.c_str(), strerror(errno));
+      return false;
+   }
+   char line[BACKUP_DESC_MAX + 1024];
+   bool ok = fgets(line, sizeof(line), f) != NULL && strncmp(line, BACKUP_MANIFEST_SIG, strlen(BACKUP_MANIFEST_SIG)) == 0;
+   if (!ok) {
+      fprintf(stderr, "%s is not a collabREate backup manifest\n", name.c_str());
+   }
+   int lineno = 1;
+   projects.clear();
+   while (ok && fgets(line, sizeof(line), f) != NULL) {
+      lineno++;
+      line[strcspn(line, "\r\n")] = 0;
+      unsigned long long pub, sub;
+      long long upd, len;
+      int id, owner, parent, proto;
+      char hash[128];
+      char gpid[128];
+      char file[256];
+      int n = -1;
+      if (*line == 0 || *line == '#') {
+         continue;
+      }
+      if (sscanf(line, "user %d %llx %llx %127s %n", &id, &pub, &sub, hash, &n) == 4 && n > 0 && line[n] != 0) {
+         BackupUser u;
+         u.uid = id;
+         u.pub = pub;
+         u.sub = sub;
+         u.pwhash = strcmp(hash, "-") ? hash : "";
+         u.username = line + n;
+         users.push_back(u);
+      }
+      else if (sscanf(line, "project %d %d %d %lld %lld %127s %255s", &id, &owner, &parent, &upd, &len, gpid, file) == 7) {
+         BackupProject p;
+         p.pid = id;
+         p.owner = owner;
+         p.parent = parent;
+         p.gpid = gpid;
+         p.file = file;
+         p.snapupdateid = 0;
+         p.position = 0;
+         p.protocol = 0;
+         p.updates = upd;
+         p.bytes = len;
+         p.newpid = 0;
+         p.ok = false;
+         //never let a manifest send us outside the backup
+         ok = strchr(file, '/') == NULL;
+         projects.push_back(p);
+      }
+      else if (sscanf(line, "snapshot %d %d %d %llu %lld %d %127s %127s %n", &id, &owner, &parent, &pub, &upd,
+                      &proto, gpid, hash, &n) == 8 && n > 0 && parent != 0 && pub != 0 && upd > 0) {
+         BackupProject p;
+         p.pid = id;
+         p.owner = owner;
+         p.parent = parent;
+         p.gpid = gpid;
+         p.file = "-";
+         p.snapupdateid = pub;
+         p.position = upd;
+         p.hash = strcmp(hash, "-") ? hash : "";
+         p.desc = line + n;
+         p.protocol = proto;
+         p.updates = -1;
+         p.bytes = 0;
+         p.newpid = 0;
+         p.ok = false;
+         projects.push_back(p);
+      }
+      else {
+         ok = false;
+      }
+      if (!ok) {
+         fprintf(stderr, "%s: unrecognized line %d\n", name.c_str(), lineno);
+      }
+   }
+   fclose(f);
+   return ok;
+}
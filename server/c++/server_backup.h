@@ -0,0 +1,152 @@
+/*
+   collabREate server_backup.h
+   Copyright (C) 2012 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2012 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SERVER_BACKUP_H
+#define __SERVER_BACKUP_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/time.h>
+
+using namespace std;
+
+class ServerManager;
+
+//the name of the file listing the contents of a backup directory
+#define BACKUP_MANIFEST "manifest"
+//the first line of a manifest
+#define BACKUP_MANIFEST_SIG "collabREate backup 1"
+//the projects a restore has finished, so it can be run again after an interruption
+#define BACKUP_RESTORED "restored"
+
+/**
+ * a user account as it is backed up, the password stays hashed
+ */
+struct BackupUser {
+   int uid;
+   string username;
+   string pwhash;
+   uint64_t pub;
+   uint64_t sub;
+};
+
+/**
+ * a project as it is backed up or restored
+ */
+struct BackupProject {
+   int pid;
+   string gpid;
+   int owner;
+   //0 if the project isn't a fork
+   int parent;
+   //the project's archive file, empty if its updates are in the database
+   string archive;
+   //the export file, relative to the backup directory
+   string file;
+   //the update a snapshot was taken at, 0 if the project isn't a snapshot
+   uint64_t snapupdateid;
+   //how many of its parent's updates a snapshot covers, unlike the
+   //updateid this survives the parent being restored
+   int64_t position;
+   //a snapshot has no updates of its own, its row is recreated from these
+   string hash;
+   string desc;
+   int protocol;
+   //-1 if not known
+   int64_t updates;
+   int64_t bytes;
+   //the project's pid on the restored server
+   int newpid;
+   bool ok;
+};
+
+/**
+ * ServerBackup
+ * Backs up or restores every user, project and fork of a server to or from
+ * a directory.  Each project goes to its own chunked export, written or
+ * read by a pool of BACKUP_WORKERS workers, each with its own database
+ * connection and connection to the server.  The directory's manifest
+ * lists the users, the projects, their forks and the snapshots taken of
+ * them, which have no updates of their own to export.
+ */
+
+class ServerBackup {
+public:
+   /**
+    * @param m the manager doing the backup or restore, it reads and
+    * writes users and forks
+    * @param p the configuration
+    */
+   ServerBackup(ServerManager *m, map<string,string> *p);
+   ~ServerBackup();
+
+   /**
+    * backup exports every project to a directory and writes its manifest
+    * @param dir the directory to back up to, created if it doesn't exist
+    * @return 0 if everything was backed up
+    */
+   int backup(const char *dir);
+
+   /**
+    * restore recreates the users, projects and forks of a backup, projects
+    * restored by an earlier run are skipped
+    * @param dir the directory holding the backup
+    * @return 0 if everything was restored
+    */
+   int restore(const char *dir);
+
+private:
+   bool runWorkers();
+   static void *worker(void *arg);
+   BackupProject *take();
+   void finished(BackupProject *job);
+   bool exportOne(ServerManager *w, BackupProject &job);
+   bool importOne(ServerManager *w, BackupProject &job);
+   bool locateSnapshot(BackupProject &snap, const BackupProject *parent);
+   bool restoreSnapshot(BackupProject &snap, const BackupProject *parent);
+   bool writeManifest(const vector<BackupUser> &users);
+   bool readManifest(vector<BackupUser> &users);
+   void report(const char *what);
+   string path(const string &name);
+
+   ServerManager *sm;
+   map<string,string> *props;
+   string dir;
+   bool restoring;
+   int workers;
+   vector<BackupProject> projects;
+   //the jobs for this run, pointers into projects
+   vector<BackupProject*> jobs;
+   size_t next;
+   size_t done;
+   //backed up uid to restored uid
+   map<int,int> uids;
+   FILE *restored;
+   sem_t lock;
+   struct timeval start;
+   int64_t updates;
+   int64_t bytes;
+};
+
+#endif
@@ -21,14 +21,24 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <sys/stat.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/time.h>
 #include "client.h"
 #include "utils.h"
+#include "compress.h"
 #include "proj_info.h"
+#include "export_index.h"
+#include "export_chunked.h"
+#include "latency.h"
 #include "server_mgr.h"
 
 using namespace std;
@@ -44,6 +54,21 @@ using namespace std;
 #define DEFAULT_PORT 5043
 #define DEFAULT_HOST "::1"
 
+//number of recent updates sampled when training a dictionary
+#define TRAINING_SAMPLES 20000
+//updates read and recompressed in each transaction
+#define RECOMPRESS_BATCH 1000
+
+static bool execOk(PGconn *conn, const char *sql) {
+   PGresult *res = PQexec(conn, sql);
+   bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+   if (!ok) {
+      fprintf(stderr, "%s %s\n", sql, PQerrorMessage(conn));
+   }
+   PQclear(res);
+   return ok;
+}
+
 char *readLine(char *buf, int sz) {
    if (fgets(buf, sz, stdin) == NULL) {
       return NULL;
@@ -75,12 +100,17 @@ bool askyn() {
    return strcmp(resp, "yes") == 0;
 }
 
-ServerManager::ServerManager(map<string,string> *p) {
+ServerManager::ServerManager(map<string,string> *p, bool batch) {
    done = false;
+   this->batch = batch;
    props = p;
+   s = NULL;
+   dbConn = NULL;
    port = getShortOption(props, "MANAGE_PORT", 5043);
    host = (*props)["MANAGE_HOST"];
    mode = (*props)["SERVER_MODE"] == "database" ? MODE_DB : MODE_BASIC;
+   storeLevel = getIntOption(props, "STORE_COMPRESSION_LEVEL", 6);
+   storeMinimum = getIntOption(props, "STORE_COMPRESSION_MIN", 64);
    if (mode == MODE_DB) {
 
       vector<string> dbparms;
@@ -119,28 +149,45 @@ ServerManager::ServerManager(map<string,string> *p) {
          mode = MODE_BASIC;
       }
       else {
-         printf("Database connected.\n");
+         note("Database connected.\n");
          initQueries();
       }
    }
    else {
       fprintf(stderr, "Starting in BASIC mode\n");
    }
-   connectToHelper();
+   if (!batch) {
+      connectToHelper();
+   }
 }
 
 /**
- * deleteProject deletes a local project
+ * note prints a progress message, unless this is a batch worker
+ * @param format the printf format of the message
+ */
+void ServerManager::note(const char *format, ...) {
+   if (!batch) {
+      va_list va;
+      va_start(va, format);
+      vprintf(format, va);
+      va_end(va);
+   }
+}
+
+/**
+ * deleteProject deletes a local project.  The project is only marked as
+ * deleted here, and its gpid released so the project can be imported again
+ * straight away, the server's maintenance thread purges its updates in the
+ * background a batch at a time
  * @param pid the local project id to delete
  */
 void ServerManager::deleteProject(int pid) {
    if (mode == MODE_DB) {
       static const int plens[1] = {4};
       static const int pformats[1] = {1};
-      //insert into files values(stream_id, fname);
       const char * const parms[1] = {(char*)&pid};
       pid = htonl(pid);
-      PGresult *rset = PQexecPrepared(dbConn, "deleteUpdatesByPID",
+      PGresult *rset = PQexecPrepared(dbConn, "markProjectDeleted",
                           1, //int nParams,   size of arrays that follow
                           parms, //parms,  //const char * const *paramValues, array of string values
                           plens, //const int *paramLengths,
@@ -148,20 +195,18 @@ void ServerManager::deleteProject(int pid) {
                           1); //int resultFormat); 0 == text, 1 == binary
    
       ExecStatusType qres = PQresultStatus(rset);
-      if (qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "deleteUpdatesByPID: %s\n", PQerrorMessage(dbConn));
+      if (qres != PGRES_TUPLES_OK) {
+         fprintf(stderr, "markProjectDeleted: %s\n", PQerrorMessage(dbConn));
       }
-      PQclear(rset);
-      rset = PQexecPrepared(dbConn, "deleteProjectByPID",
-                          1, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-   
-      qres = PQresultStatus(rset);
-      if (qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "deleteProjectByPID: %s\n", PQerrorMessage(dbConn));
+      else if (PQntuples(rset) == 0) {
+         printf("no such project, or it is already being deleted\n");
+      }
+      else {
+         if (!PQgetisnull(rset, 0, 0)) {
+            //the project's updates were archived, they go too
+            unlink(PQgetvalue(rset, 0, 0));
+         }
+         printf("project marked as deleted, the server will purge its updates in the background\n");
       }
       PQclear(rset);
    }
@@ -272,17 +317,20 @@ uint64_t parsePerms(const char *perms, uint64_t def) {
  * terminate terminates the server manager
  */
 void ServerManager::terminate() {
-   printf("ServerManager terminating\n");
+   note("ServerManager terminating\n");
    done = true;
    closeDB();
-   s->close();
+   if (s != NULL) {
+      s->close();
+   }
 }
 
 /**
  * connectToHelper connects to the managerHelper on the server on MANAGE_PORT,
  * by default this must be a local connection.
+ * @return false if the server could not be reached
  */
-void ServerManager::connectToHelper() {
+bool ServerManager::connectToHelper() {
    if (s != NULL) {
       s->close();
    }
@@ -290,11 +338,14 @@ void ServerManager::connectToHelper() {
       //s = new Socket("127.0.0.1",port);
       //s = new Socket("localhost",port);
       s = new NetworkIO(host.c_str(), port);
-      printf("Connection to ManagerHelper established. Ready to process commands\n");
+      note("Connection to ManagerHelper established. Ready to process commands\n");
    //} catch (UnknownHostException e) {
    } catch (IOException e) {
       fprintf(stderr, "Couldn't connect to ManagerHelper on %s:%d, is the server running?", host.c_str(), port);
+      s = NULL;
+      return false;
    }
+   return true;
 }
 
 void ServerManager::initQueries() {
@@ -307,7 +358,7 @@ void ServerManager::initQueries() {
       }
       PQclear(res);
       res = PQprepare(dbConn, "listProjects", 
-                      "select p.pid,p.gpid,p.hash,p.pub,p.sub,f.parent,p.description,q.description,p.snapupdateid from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child order by p.pid asc;",
+                      "select p.pid,p.gpid,p.hash,p.pub,p.sub,f.parent,p.description,q.description,p.snapupdateid,p.deleted from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child order by p.pid asc;",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
          fprintf(stderr, "listProjects: %s\n", PQerrorMessage(dbConn));
@@ -320,25 +371,27 @@ void ServerManager::initQueries() {
          fprintf(stderr, "findUserByUID: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
-      res = PQprepare(dbConn, "getAllUpdates", 
-                      "select updateid,userid,pid,cmd,data,created from updates where pid=$1 order by updateid asc",
+      res = PQprepare(dbConn, "countUpdates", 
+                      "select count(*) from updates where pid=$1",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-         fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
+         fprintf(stderr, "countUpdates: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
-      res = PQprepare(dbConn, "deleteUpdatesByPID", 
-                      "delete from updates where pid=$1",
+      res = PQprepare(dbConn, "getAllUpdates", 
+                      "select updateid,userid,pid,cmd,data,created,dictid from updates where pid=$1 and updateid>$2 order by updateid asc",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-         fprintf(stderr, "deleteUpdatesByPID: %s\n", PQerrorMessage(dbConn));
+         fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
-      res = PQprepare(dbConn, "deleteProjectByPID", 
-                      "delete from projects where pid=$1",
+      //gpid is unique, renaming it frees the gpid for a re-import while the
+      //old updates are still being purged
+      res = PQprepare(dbConn, "markProjectDeleted", 
+                      "update projects set deleted=true,gpid=gpid||':deleted:'||pid where pid=$1 and not deleted returning archive",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-         fprintf(stderr, "deleteProjectByPID: %s\n", PQerrorMessage(dbConn));
+         fprintf(stderr, "markProjectDeleted: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
       res = PQprepare(dbConn, "addUser", 
@@ -355,9 +408,329 @@ void ServerManager::initQueries() {
          fprintf(stderr, "updateUser: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
+      res = PQprepare(dbConn, "getDictionary", 
+                      "select data from dictionaries where dictid=$1",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "getDictionary: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "addDictionary", 
+                      "insert into dictionaries (pid,data) values ($1,$2) returning dictid;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "addDictionary: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "sampleUpdates", 
+                      "select data,dictid from updates where $1 = 0 or pid = $1 order by updateid desc limit $2;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "sampleUpdates: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      //the updates that a new dictionary applies to, a global dictionary does not
+      //replace the dictionaries of projects that have their own.  Read a batch
+      //at a time, in primary key order after the last update of the previous batch
+      res = PQprepare(dbConn, "getPackableUpdates", 
+                      "select updateid,pid,data,dictid from updates where (updateid,pid) > ($2,$3) and "
+                      "(pid = $1 or ($1 = 0 and pid not in (select pid from dictionaries where pid is not null))) "
+                      "order by updateid,pid limit $4;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "getPackableUpdates: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "storeUpdate", 
+                      "update updates set data=$1,dictid=$2 where updateid=$3 and pid=$4;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "storeUpdate: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "backupUsers", 
+                      "select userid,username,coalesce(pwhash,''),coalesce(pub,0),coalesce(sub,0) from users order by userid;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "backupUsers: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "backupProjects", 
+                      "select p.pid,p.gpid,coalesce(p.owner,0),coalesce(p.archive,''),coalesce(f.parent,0),coalesce(p.snapupdateid,0),p.hash,p.description,p.protocol from projects p left join forklist f on p.pid = f.child where not p.deleted order by p.pid;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "backupProjects: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "findUserByName", 
+                      "select userid from users where username=$1;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "findUserByName: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      //a restore that is run again must not record a fork twice
+      res = PQprepare(dbConn, "addFork", 
+                      "insert into forklist (child,parent) select $1::integer,$2::integer where not exists (select 1 from forklist where child=$1::integer);",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "addFork: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "countUpdatesTo", 
+                      "select count(*) from updates where pid=$1 and updateid<=$2;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "countUpdatesTo: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      res = PQprepare(dbConn, "updateAt", 
+                      "select updateid from updates where pid=$1 order by updateid offset $2 limit 1;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "updateAt: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+      //a snapshot's gpid is kept, so a restore that is run again can't add it twice
+      res = PQprepare(dbConn, "addSnapshot", 
+                      "insert into projects (hash,gpid,description,owner,snapupdateid,protocol) values ($1,$2,$3,$4,$5,$6) returning pid;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "addSnapshot: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
+   }
+}
+
+/**
+ * getDictionary loads a compression dictionary from the database
+ * @param dictid the id of the dictionary to load
+ * @return the dictionary, or NULL if it could not be loaded
+ */
+Buffer *ServerManager::getDictionary(int dictid) {
+   map<int,Buffer*>::iterator it = dicts.find(dictid);
+   if (it != dicts.end()) {
+      return (*it).second;
+   }
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   int tdictid = htonl(dictid);
+   const char * const parms[1] = {(char*)&tdictid};
+   Buffer *dict = NULL;
+   PGresult *rset = PQexecPrepared(dbConn, "getDictionary",
+                       1, //int nParams,   size of arrays that follow
+                       parms, //parms,  //const char * const *paramValues, array of string values
+                       plens, //const int *paramLengths,
+                       pformats, //const int *paramFormats,
+                       1); //int resultFormat); 0 == text, 1 == binary
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+      fprintf(stderr, "getDictionary: %s\n", PQerrorMessage(dbConn));
    }
+   else {
+      dict = new Buffer(PQgetvalue(rset, 0, 0), PQgetlength(rset, 0, 0));
+      dicts[dictid] = dict;
+   }
+   PQclear(rset);
+   return dict;
 }
 
+/**
+ * unpackUpdate restores an update that the server stored compressed
+ * @param rset the result set holding the update
+ * @param row the row of the update
+ * @param dcol the column of the update data, the dictid must follow it
+ * @param out the buffer that receives the update
+ * @return false if the update can't be restored
+ */
+bool ServerManager::unpackUpdate(PGresult *rset, int row, int dcol, Buffer &out) {
+   const uint8_t *data = (const uint8_t*)PQgetvalue(rset, row, dcol);
+   int dlen = PQgetlength(rset, row, dcol);
+   out.reset();
+   if (PQgetisnull(rset, row, dcol + 1)) {
+      return out.write(data, dlen);
+   }
+   int dictid = ntohl(*(int*)PQgetvalue(rset, row, dcol + 1));
+   Buffer *dict = NULL;
+   if (dictid != 0 && (dict = getDictionary(dictid)) == NULL) {
+      return false;
+   }
+   return decompressPayload(data, dlen, dict, out);
+}
+
+/**
+ * trainProjectDictionary trains a new compression dictionary from the most
+ * recent updates of a project, or of the whole server.  The server uses the
+ * new dictionary for updates posted after the next time the project is joined
+ * @param lpid the local PID of the project to train on, 0 for a global dictionary
+ * @param recompress true to recompress the existing updates with the new dictionary
+ * @return the new dictionary id, -1 on error
+ */
+int ServerManager::trainProjectDictionary(int lpid, bool recompress) {
+   int dictid = -1;
+   if (mode != MODE_DB) {
+      fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
+      return -1;
+   }
+   int tpid = htonl(lpid);
+   int limit = htonl(TRAINING_SAMPLES);
+   static const int plens[2] = {4, 4};
+   static const int pformats[2] = {1, 1};
+   const char * const parms[2] = {(char*)&tpid, (char*)&limit};
+   PGresult *rset = PQexecPrepared(dbConn, "sampleUpdates",
+                       2, //int nParams,   size of arrays that follow
+                       parms, //parms,  //const char * const *paramValues, array of string values
+                       plens, //const int *paramLengths,
+                       pformats, //const int *paramFormats,
+                       1); //int resultFormat); 0 == text, 1 == binary
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "sampleUpdates: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+      return -1;
+   }
+   vector<string> samples;
+   Buffer update;
+   int rows = PQntuples(rset);
+   for (int i = 0; i < rows; i++) {
+      if (unpackUpdate(rset, i, 0, update)) {
+         samples.push_back(string((char*)update.get_buf(), update.size()));
+      }
+   }
+   PQclear(rset);
+
+   Buffer dict;
+   trainDictionary(samples, MAX_DICTIONARY_SIZE, dict);
+   if (dict.size() == 0) {
+      printf("Not enough updates to train a dictionary\n");
+      return -1;
+   }
+
+   const int aplens[2] = {4, dict.size()};
+   const char * const aparms[2] = {lpid ? (char*)&tpid : NULL, (char*)dict.get_buf()};
+   rset = PQexecPrepared(dbConn, "addDictionary",
+                       2, //int nParams,   size of arrays that follow
+                       aparms, //parms,  //const char * const *paramValues, array of string values
+                       aplens, //const int *paramLengths,
+                       pformats, //const int *paramFormats,
+                       1); //int resultFormat); 0 == text, 1 == binary
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "addDictionary: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+      return -1;
+   }
+   dictid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
+   PQclear(rset);
+   printf("Trained dictionary %d (%d bytes) from %d updates\n", dictid, dict.size(), (int)samples.size());
+
+   if (recompress && recompressUpdates(lpid, dictid, dict) != 0) {
+      return -1;
+   }
+   return dictid;
+}
+
+/**
+ * recompressUpdates rewrites the updates a new dictionary applies to, a
+ * batch per transaction so that neither the result nor the transaction
+ * grows with the size of the server
+ * @param lpid the local PID of the project the dictionary was trained on, 0 for a global dictionary
+ * @param dictid the id of the new dictionary
+ * @param dict the new dictionary
+ * @return 0 on success, -1 if a batch failed, the batches before it are kept
+ */
+int ServerManager::recompressUpdates(int lpid, int dictid, Buffer &dict) {
+   int tpid = htonl(lpid);
+   int limit = htonl(RECOMPRESS_BATCH);
+   uint64_t lastid = 0;
+   int lastpid = 0;
+   static const int plens[4] = {4, 8, 4, 4};
+   static const int pformats[4] = {1, 1, 1, 1};
+   const char * const parms[4] = {(char*)&tpid, (char*)&lastid, (char*)&lastpid, (char*)&limit};
+   int tdictid = htonl(dictid);
+   static const int sformats[4] = {1, 1, 1, 1};
+   int splens[4] = {0, 4, 8, 4};
+   uint64_t before = 0;
+   uint64_t after = 0;
+   int changed = 0;
+   int total = 0;
+   int rval = 0;
+   Buffer update;
+   Buffer packed;
+   while (true) {
+      PGresult *rset = PQexecPrepared(dbConn, "getPackableUpdates",
+                          4, //int nParams,   size of arrays that follow
+                          parms, //parms,  //const char * const *paramValues, array of string values
+                          plens, //const int *paramLengths,
+                          pformats, //const int *paramFormats,
+                          1); //int resultFormat); 0 == text, 1 == binary
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+         fprintf(stderr, "getPackableUpdates: %s\n", PQerrorMessage(dbConn));
+         PQclear(rset);
+         rval = -1;
+         break;
+      }
+      int rows = PQntuples(rset);
+      if (rows == 0) {
+         PQclear(rset);
+         break;
+      }
+      uint64_t bbefore = 0;
+      uint64_t bafter = 0;
+      int bchanged = 0;
+      bool ok = execOk(dbConn, "begin;");
+      for (int i = 0; ok && i < rows; i++) {
+         int dlen = PQgetlength(rset, i, 2);
+         bbefore += dlen;
+         packed.reset();
+         if (!unpackUpdate(rset, i, 2, update) || update.size() < storeMinimum ||
+             !compressPayload(update.get_buf(), update.size(), &dict, storeLevel, packed) ||
+             packed.size() >= dlen) {
+            bafter += dlen;
+            continue;
+         }
+         splens[0] = packed.size();
+         const char * const sparms[4] = {(char*)packed.get_buf(), (char*)&tdictid,
+                                         PQgetvalue(rset, i, 0), PQgetvalue(rset, i, 1)};
+         PGresult *res = PQexecPrepared(dbConn, "storeUpdate",
+                             4, //int nParams,   size of arrays that follow
+                             sparms, //parms,  //const char * const *paramValues, array of string values
+                             splens, //const int *paramLengths,
+                             sformats, //const int *paramFormats,
+                             1); //int resultFormat); 0 == text, 1 == binary
+         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            //the transaction is aborted, nothing more in this batch can be stored
+            fprintf(stderr, "storeUpdate: %s\n", PQerrorMessage(dbConn));
+            ok = false;
+         }
+         else {
+            bafter += packed.size();
+            bchanged++;
+         }
+         PQclear(res);
+      }
+      //the next batch starts after the last update of this one, both still in network order
+      lastid = *(uint64_t*)PQgetvalue(rset, rows - 1, 0);
+      lastpid = *(int*)PQgetvalue(rset, rows - 1, 1);
+      PQclear(rset);
+      if (!execOk(dbConn, ok ? "commit;" : "rollback;") || !ok) {
+         if (ok) {
+            execOk(dbConn, "rollback;");
+         }
+         rval = -1;
+         break;
+      }
+      before += bbefore;
+      after += bafter;
+      changed += bchanged;
+      total += rows;
+      printf(".");
+      fflush(stdout);
+   }
+   printf("\nRecompressed %d of %d updates, %llu bytes -> %llu bytes\n", changed, total,
+          (unsigned long long)before, (unsigned long long)after);
+   if (rval != 0) {
+      fprintf(stderr, "Recompression stopped early, the remaining updates keep their old compression\n");
+   }
+   return rval;
+}
 
 /**
  * similar to post in Client, but does not check subscription status, and takes command as a arg
@@ -407,6 +780,352 @@ void ServerManager::dumpStats() {
    }
 }
 
+static void printLatency(const char *project, const char *stage, const Histogram &h) {
+   printf("%-10s %-6s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", project, stage,
+          (unsigned long long)h.getCount(), h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+          h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0, h.getMax() / 1000.0);
+}
+
+/**
+ * showLatency prints the time updates spend in each stage between
+ * publisher and subscriber
+ * this requires ServerHelper to be running
+ * @param pid the project to show, -1 for every project
+ */
+void ServerManager::showLatency(int pid) {
+   int tries = 2;
+   while (tries > 0) {
+      try {
+         tries--;
+         Buffer os;
+         os.writeInt(pid);
+         send_data(MNG_GET_LATENCY, os.get_buf(), os.size());
+
+         //This requires that the server immediately replies !!!
+         //otherwise we might get stuck here and have to kill the app
+         int len = s->readInt();
+         int cmd = s->readInt();
+         if (len < 12 || cmd != MNG_LATENCY) {
+            fprintf(stderr, "protocol dictates MNG_LATENCY, but recieved: %d %d\n", len, cmd);
+            return;
+         }
+         uint8_t *data = new uint8_t[len - 8];
+         s->readFully(data, len - 8);
+         Buffer b(data, len - 8);
+         delete [] data;
+
+         int count = b.readInt();
+         Histogram all[LATENCY_STAGES];
+         printf("\nCollabREate update latency (microseconds)\n");
+         printf("%-10s %-6s %10s %10s %10s %10s %10s %10s\n", "project", "stage", "updates",
+                "p50", "p90", "p99", "p99.9", "max");
+         for (int i = 0; i < count; i++) {
+            char project[16];
+            snprintf(project, sizeof(project), "%d", b.readInt());
+            for (int st = 0; st < LATENCY_STAGES; st++) {
+               Histogram h;
+               if (!h.read(b)) {
+                  fprintf(stderr, "malformed MNG_LATENCY reply\n");
+                  return;
+               }
+               printLatency(project, latencyStages[st], h);
+               all[st].add(h);
+            }
+         }
+         if (count == 0) {
+            printf(" - none - \n");
+         }
+         else if (count > 1) {
+            for (int st = 0; st < LATENCY_STAGES; st++) {
+               printLatency("all", latencyStages[st], all[st]);
+            }
+         }
+         break;
+      } catch (IOException e) {
+         connectToHelper();
+      }
+   }
+}
+
+//how many rows each of top's client lists shows
+#define TOP_ROWS 10
+
+struct TopProject {
+   int clients;
+   uint64_t updates;
+   uint64_t deliveries;
+   Histogram total;
+};
+
+struct TopClient {
+   string user;
+   string addr;
+   int pid;
+   uint64_t rx;
+   uint64_t tx;
+   uint64_t sendNs;
+   uint64_t sends;
+   int queued;
+};
+
+struct TopSnapshot {
+   uint64_t time;
+   uint64_t updatesIn;
+   uint64_t updatesOut;
+   uint64_t bytesIn;
+   uint64_t bytesOut;
+   int queueDepth;
+   Histogram dbPost;
+   Histogram dbWait;
+   map<int,TopProject> projects;
+   map<string,TopClient> clients;
+};
+
+//a client's activity over one interval
+struct TopRow {
+   const TopClient *c;
+   double rate;
+   double avgUs;
+};
+
+static bool busier(const TopRow &a, const TopRow &b) {
+   return a.rate > b.rate;
+}
+
+static bool slower(const TopRow &a, const TopRow &b) {
+   return a.avgUs > b.avgUs;
+}
+
+static string readString(Buffer &b) {
+   char *s = b.readUTF();
+   string res = s ? s : "";
+   delete [] s;
+   return res;
+}
+
+/*
+ * readSnapshot unpacks an MNG_STATS_UPDATE, see
+ * ConnectionManagerBase::writeSnapshot
+ */
+static bool readSnapshot(Buffer &b, TopSnapshot &s) {
+   s.time = b.readLong();
+   s.updatesIn = b.readLong();
+   s.updatesOut = b.readLong();
+   s.bytesIn = b.readLong();
+   s.bytesOut = b.readLong();
+   s.queueDepth = b.readInt();
+   if (!s.dbPost.read(b) || !s.dbWait.read(b)) {
+      return false;
+   }
+   s.projects.clear();
+   int count = b.readInt();
+   for (int i = 0; i < count && !b.has_error(); i++) {
+      TopProject &p = s.projects[b.readInt()];
+      p.clients = 0;
+      p.updates = b.readLong();
+      p.deliveries = b.readLong();
+      if (!p.total.read(b)) {
+         return false;
+      }
+   }
+   count = b.readInt();
+   for (int i = 0; i < count && !b.has_error(); i++) {
+      int pid = b.readInt();
+      int clients = b.readInt();
+      map<int,TopProject>::iterator p = s.projects.find(pid);
+      if (p == s.projects.end()) {
+         //nothing has been published to it yet
+         p = s.projects.insert(make_pair(pid, TopProject())).first;
+         (*p).second.updates = 0;
+         (*p).second.deliveries = 0;
+      }
+      (*p).second.clients = clients;
+   }
+   s.clients.clear();
+   count = b.readInt();
+   for (int i = 0; i < count && !b.has_error(); i++) {
+      TopClient c;
+      c.user = readString(b);
+      c.addr = readString(b);
+      char port[16];
+      snprintf(port, sizeof(port), ":%d", b.readInt());
+      c.addr += port;
+      c.pid = b.readInt();
+      c.rx = b.readLong();
+      c.tx = b.readLong();
+      c.sendNs = b.readLong();
+      c.sends = b.readLong();
+      c.queued = b.readInt();
+      s.clients[c.addr] = c;
+   }
+   return !b.has_error();
+}
+
+static void printMs(const Histogram &h, double pct) {
+   if (h.getCount()) {
+      printf(" %8.2f", h.percentile(pct) / 1e6);
+   }
+   else {
+      printf(" %8s", "-");
+   }
+}
+
+/*
+ * showTop prints the difference between two snapshots taken secs apart
+ */
+static void showTop(const TopSnapshot &prev, const TopSnapshot &cur, double secs) {
+   time_t now = time(NULL);
+   char when[32];
+   strftime(when, sizeof(when), "%H:%M:%S", localtime(&now));
+
+   Histogram dbPost = cur.dbPost;
+   dbPost.subtract(prev.dbPost);
+   Histogram dbWait = cur.dbWait;
+   dbWait.subtract(prev.dbWait);
+
+   //clear the screen and start at the top left
+   printf("\033[H\033[2J");
+   printf("collabREate top - %s, every %.1f s\n", when, secs);
+   printf("updates in %.1f/s out %.1f/s, KB in %.1f/s out %.1f/s, dispatch queue %d\n",
+          (cur.updatesIn - prev.updatesIn) / secs, (cur.updatesOut - prev.updatesOut) / secs,
+          (cur.bytesIn - prev.bytesIn) / secs / 1024, (cur.bytesOut - prev.bytesOut) / secs / 1024,
+          cur.queueDepth);
+   printf("db post ms    ");
+   printMs(dbPost, 50);
+   printMs(dbPost, 99);
+   printf("  (p50 p99), waiting");
+   printMs(dbWait, 50);
+   printMs(dbWait, 99);
+   printf("\n\n");
+
+   printf("%8s %8s %10s %10s %8s %8s\n", "project", "clients", "in/s", "out/s", "p50 ms", "p99 ms");
+   for (map<int,TopProject>::const_iterator i = cur.projects.begin(); i != cur.projects.end(); i++) {
+      const TopProject &p = (*i).second;
+      uint64_t updates = p.updates;
+      uint64_t deliveries = p.deliveries;
+      Histogram total = p.total;
+      map<int,TopProject>::const_iterator old = prev.projects.find((*i).first);
+      if (old != prev.projects.end()) {
+         updates -= (*old).second.updates;
+         deliveries -= (*old).second.deliveries;
+         total.subtract((*old).second.total);
+      }
+      printf("%8d %8d %10.1f %10.1f", (*i).first, p.clients, updates / secs, deliveries / secs);
+      printMs(total, 50);
+      printMs(total, 99);
+      printf("\n");
+   }
+   if (cur.projects.empty()) {
+      printf(" - none - \n");
+   }
+
+   vector<TopRow> rows;
+   for (map<string,TopClient>::const_iterator i = cur.clients.begin(); i != cur.clients.end(); i++) {
+      const TopClient &c = (*i).second;
+      TopRow r;
+      r.c = &c;
+      uint64_t rx = c.rx;
+      uint64_t sendNs = c.sendNs;
+      uint64_t sends = c.sends;
+      map<string,TopClient>::const_iterator old = prev.clients.find((*i).first);
+      if (old != prev.clients.end()) {
+         rx -= (*old).second.rx;
+         sendNs -= (*old).second.sendNs;
+         sends -= (*old).second.sends;
+      }
+      r.rate = rx / secs;
+      r.avgUs = sends ? sendNs / 1000.0 / sends : 0;
+      rows.push_back(r);
+   }
+
+   printf("\nbusiest publishers\n");
+   printf("%10s %8s %-16s %s\n", "updates/s", "project", "user", "address");
+   sort(rows.begin(), rows.end(), busier);
+   for (size_t i = 0; i < rows.size() && i < TOP_ROWS && rows[i].rate > 0; i++) {
+      printf("%10.1f %8d %-16s %s\n", rows[i].rate, rows[i].c->pid, rows[i].c->user.c_str(), rows[i].c->addr.c_str());
+   }
+
+   printf("\nslowest subscribers\n");
+   printf("%10s %10s %8s %-16s %s\n", "avg send us", "queued", "project", "user", "address");
+   sort(rows.begin(), rows.end(), slower);
+   for (size_t i = 0; i < rows.size() && i < TOP_ROWS && (rows[i].avgUs > 0 || rows[i].c->queued > 0); i++) {
+      printf("%10.1f %10d %8d %-16s %s\n", rows[i].avgUs, rows[i].c->queued, rows[i].c->pid,
+             rows[i].c->user.c_str(), rows[i].c->addr.c_str());
+   }
+   fflush(stdout);
+}
+
+/**
+ * top subscribes to the server's stats and shows per project update rates,
+ * the busiest publishers and the slowest subscribers until interrupted
+ * this requires ServerHelper to be running
+ * @param interval the number of milliseconds between refreshes
+ */
+void ServerManager::top(int interval) {
+   TopSnapshot *prev = new TopSnapshot();
+   TopSnapshot *cur = new TopSnapshot();
+   try {
+      Buffer os;
+      os.writeInt(interval);
+      send_data(MNG_SUBSCRIBE_STATS, os.get_buf(), os.size());
+      printf("waiting for the server...\n");
+      fflush(stdout);
+      bool first = true;
+      while (true) {
+         int len = readReply(MNG_STATS_UPDATE);
+         uint8_t *data = new uint8_t[len];
+         s->readFully(data, len);
+         Buffer b(data, len);
+         delete [] data;
+         if (!readSnapshot(b, *cur)) {
+            fprintf(stderr, "malformed MNG_STATS_UPDATE\n");
+            break;
+         }
+         if (!first && cur->time > prev->time) {
+            showTop(*prev, *cur, (cur->time - prev->time) / 1e9);
+         }
+         first = false;
+         swap(prev, cur);
+      }
+   } catch (IOException e) {
+      fprintf(stderr, "lost the connection to the server\n");
+   }
+   delete prev;
+   delete cur;
+}
+
+/**
+ * archiveProjects asks the server to archive projects that have been idle
+ * for a number of days
+ * this requires ServerHelper to be running
+ * @param days the number of days a project must have been idle
+ * @return the number of projects archived, -1 on error
+ */
+int ServerManager::archiveProjects(int days) {
+   int tries = 2;
+   while (tries > 0) {
+      try {
+         tries--;
+         Buffer os;
+         os.writeInt(days);
+         send_data(MNG_ARCHIVE_PROJECTS, os.get_buf(), os.size());
+
+         //This requires that the server immediately replies !!!
+         //otherwise we might get stuck here and have to kill the app
+         int len = s->readInt();
+         int cmd = s->readInt();
+         if (len != 12 || cmd != MNG_ARCHIVE_REPLY) {
+            fprintf(stderr, "protocol dictates 12 byte ARCHIVE_REPLY, but recieved: %d %d\n", len, cmd);
+            return -1;
+         }
+         return (int)s->readInt();
+      } catch (IOException e) {
+         connectToHelper();
+      }
+   }
+   return -1;
+}
+
 /**
  * shutdownServer sends a request to the server to shutdown the server nicely
  * this requires ServerHelper to be running
@@ -453,30 +1172,107 @@ int ServerManager::getProjectInfo(int lpid, ProjectInfo *pinfo) {
    return rval;
 }
 
-//C API value for 2000-01-01
-#define MILLENIUM 946713600
-static u_int32_t millenium = MILLENIUM;
+//exports are written out in pieces of roughly this size
+#define EXPORT_CHUNK 0x100000
 
-/* swap the order of the eight bytes at the given location */
-static void double_swap(double *d) {
-   u_int32_t *p = (u_int32_t*)d;
-   u_int32_t temp = ntohl(p[1]);
-   p[1] = ntohl(p[0]);
-   p[0] = temp;
-}
+//how often the progress of an export is redrawn
+#define EXPORT_PROGRESS_ROWS 1000
 
-static time_t PQ_to_time_t(double pqtime) {
-   double_swap(&pqtime);              //convert to host order
-   return millenium + (time_t)pqtime; //normalize to C API reference time
+/**
+ * ExportWriter
+ * Buffers an export on its way to disk, through zlib if the export is to
+ * be compressed, so only one chunk of the export is ever held in memory
+ */
+class ExportWriter {
+public:
+   ExportWriter() : f(NULL), gz(NULL), pos(0), ok(true) {};
+   ~ExportWriter() {close();};
+
+   bool open(const char *efile, bool compress) {
+      f = fopen(efile, "wb");
+      if (f != NULL && compress) {
+         gz = gzdopen(dup(fileno(f)), "wb");
+         if (gz == NULL) {
+            fclose(f);
+            f = NULL;
+         }
+      }
+      return ok = f != NULL;
+   };
+
+   //write out whatever has been buffered once there is enough of it
+   bool flush(bool force = false) {
+      if (ok && os.size() > 0 && (force || os.size() >= EXPORT_CHUNK)) {
+         if (gz != NULL) {
+            ok = gzwrite(gz, os.get_buf(), os.size()) == os.size();
+         }
+         else {
+            ok = fwrite(os.get_buf(), os.size(), 1, f) == 1;
+         }
+         pos += os.size();
+         os.reset();
+      }
+      return ok;
+   };
+
+   bool close() {
+      flush(true);
+      if (gz != NULL && gzclose(gz) != Z_OK) {
+         ok = false;
+      }
+      if (f != NULL && fclose(f) != 0) {
+         ok = false;
+      }
+      gz = NULL;
+      f = NULL;
+      return ok;
+   };
+
+   //the uncompressed offset of the next byte written
+   uint64_t offset() {return pos + os.size();};
+   Buffer &buffer() {return os;};
+
+private:
+   FILE *f;
+   gzFile gz;
+   Buffer os;
+   uint64_t pos;
+   bool ok;
+};
+
+/**
+ * countUpdates counts the updates of a project
+ * @param lpid the local PID of the project
+ * @return the number of updates, -1 on error
+ */
+int64_t ServerManager::countUpdates(int lpid) {
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   lpid = htonl(lpid);
+   const char * const parms[1] = {(char*)&lpid};
+   PGresult *rset = PQexecPrepared(dbConn, "countUpdates", 1, parms, plens, pformats, 1);
+   int64_t count = -1;
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "countUpdates: %s\n", PQerrorMessage(dbConn));
+   }
+   else if (PQntuples(rset) == 1) {
+      count = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+   return count;
 }
 
 /**
- * exportProject exports a project to a binary final
+ * exportProject exports a project to a binary final.  Updates are
+ * streamed out of the database one row at a time, so exporting a project
+ * takes the same amount of memory no matter how large it is
  * @param lpid the local PID for the project to export
  * @param efile the filename to export to
+ * @param format EXPORT_PLAIN, EXPORT_GZIP or EXPORT_CHUNKED
+ * @param after only export the updates after this updateid
  * @return 0 on success
  */
-int ServerManager::exportProject(int lpid, const char *efile) {
+int ServerManager::exportProject(int lpid, const char *efile, int format, uint64_t after) {
    int rval = -1;
    if (mode == MODE_DB) {
       ProjectInfo pi(1, "none");
@@ -485,195 +1281,522 @@ int ServerManager::exportProject(int lpid, const char *efile) {
             fprintf(stderr, "snapshot exporting is currently not implimented\n");
             return -1;
          }
-         printf("exporting %d (%s)\n", lpid, pi.gpid.c_str());
-         if (pi.parent > 0 ) {
+         note("exporting %d (%s)\n", lpid, pi.gpid.c_str());
+         //a whole server backup keeps track of forks itself
+         if (pi.parent > 0 && !batch) {
             fprintf(stderr, "This project was forked.  Note: lineage is not preserved with export.\n");
          }
-         FILE *f = fopen(efile, "wb");
-         Buffer os;
-
-         os.write(FILE_SIG, strlen(FILE_SIG));
-         os.writeInt(FILE_VER);
-         os.write(toByteArray(pi.gpid), pi.gpid.length() / 2); //should probably garuntee GPID_SIZE write
-         os.write(toByteArray(pi.hash), pi.hash.length() / 2); //should probably garuntee MD5_SIZE write
-         os.writeLong(pi.sub);
-         os.writeLong(pi.pub);
-         os.writeUTF(pi.desc);  // at this point data is no longer at pre-known offsetsS
+         //a partial export has no way of telling how much is left
+         int64_t total = after ? -1 : countUpdates(lpid);
+         bool compress = format == EXPORT_GZIP;
+         bool chunked = format == EXPORT_CHUNKED;
+
+         Buffer header;
+         header.write(FILE_SIG, strlen(FILE_SIG));
+         header.writeInt(chunked ? FILE_VER_CHUNKED : FILE_VER);
+         header.write(toByteArray(pi.gpid), pi.gpid.length() / 2); //should probably garuntee GPID_SIZE write
+         header.write(toByteArray(pi.hash), pi.hash.length() / 2); //should probably garuntee MD5_SIZE write
+         header.writeLong(pi.sub);
+         header.writeLong(pi.pub);
+         header.writeUTF(pi.desc);  // at this point data is no longer at pre-known offsetsS
+
+         ExportWriter w;
+         ChunkedExportWriter cw;
+         if (chunked ? !cw.open(efile, header) : !w.open(efile, compress)) {
+            fprintf(stderr, "unable to create %s: %s\n", efile, strerror(errno));
+            return -1;
+         }
+         Buffer &os = w.buffer();
+         if (!chunked) {
+            os.append(header);
+         }
 
-         static const int plens[1] = {4};
-         static const int pformats[1] = {1};
+         static const int plens[2] = {4, 8};
+         static const int pformats[2] = {1, 1};
          //insert into files values(stream_id, fname);
-         const char * const parms[1] = {(char*)&lpid};
+         const char * const parms[2] = {(char*)&lpid, (char*)&after};
          lpid = htonl(lpid);
-         PGresult *rset = PQexecPrepared(dbConn, "getAllUpdates",
-                             1, //int nParams,   size of arrays that follow
+         after = htonll(after);
+         if (!PQsendQueryPrepared(dbConn, "getAllUpdates",
+                             2, //int nParams,   size of arrays that follow
                              parms, //parms,  //const char * const *paramValues, array of string values
                              plens, //const int *paramLengths,
                              pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-      
-         ExecStatusType qres = PQresultStatus(rset);
-         if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
+                             1) || //int resultFormat); 0 == text, 1 == binary
+             !PQsetSingleRowMode(dbConn)) {
             fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
+            w.close();
+            unlink(efile);
+            return -1;
          }
-         else {
-            printf("processing updates\n");
-            int rows = PQntuples(rset);
-            for (int i = 0; i < rows; i++) {
-               //printf("processing update %d...", (i + 1));
-               printf(".");
-               uint64_t updateid = *((uint64_t*)PQgetvalue(rset, i, 0));
-               int uid = ntohl(*(int*)PQgetvalue(rset, i, 1));
-               int pid = ntohl(*(int*)PQgetvalue(rset, i, 2));
-               int cmd = ntohl(*(int*)PQgetvalue(rset, i, 3));
-               uint8_t *data = (uint8_t*)PQgetvalue(rset, i, 4);
-               int dlen = PQgetlength(rset, i, 4);
-
-               double created_d = *(double*)PQgetvalue(rset, i, 5);
-               time_t created = PQ_to_time_t(created_d);
-
-               os.writeInt(TAG);
-               os.writeLong(updateid);
-               os.writeInt(uid);
-               os.writeInt(pid);
-               os.writeInt(cmd);
-               os.writeInt(dlen);
-               os.write(data, dlen);
-               //write timestamp?
+         note("processing updates\n");
+         int64_t rows = 0;
+         bool ok = true;
+         Buffer update;
+         //an index is only any use when updates can be found by file offset
+         ExportIndexWriter index;
+         PGresult *rset;
+         //every result has to be collected, even after a failure, before
+         //the connection can be used again
+         while ((rset = PQgetResult(dbConn)) != NULL) {
+            ExecStatusType qres = PQresultStatus(rset);
+            if (qres == PGRES_SINGLE_TUPLE && ok) {
+               uint64_t updateid = *((uint64_t*)PQgetvalue(rset, 0, 0));
+               int uid = ntohl(*(int*)PQgetvalue(rset, 0, 1));
+               int pid = ntohl(*(int*)PQgetvalue(rset, 0, 2));
+               int cmd = ntohl(*(int*)PQgetvalue(rset, 0, 3));
+               //exports always hold uncompressed updates
+               if (!unpackUpdate(rset, 0, 4, update)) {
+                  fprintf(stderr, "\nunable to decompress update %llu, skipping\n", (unsigned long long)ntohll(updateid));
+               }
+               else {
+                  uint8_t *data = update.get_buf();
+                  int dlen = update.size();
+
+                  bool written;
+                  if (chunked) {
+                     written = cw.add(updateid, uid, pid, cmd, data, dlen);
+                  }
+                  else {
+                     if (!compress) {
+                        index.add(ntohll(updateid), w.offset());
+                     }
+                     os.writeInt(TAG);
+                     os.writeLong(updateid);
+                     os.writeInt(uid);
+                     os.writeInt(pid);
+                     os.writeInt(cmd);
+                     os.writeInt(dlen);
+                     os.write(data, dlen);
+                     //write timestamp?
+                     written = w.flush();
+                  }
+                  rows++;
+                  if (!written) {
+                     fprintf(stderr, "\nunable to write %s: %s\n", efile, strerror(errno));
+                     ok = false;
+                  }
+                  if (rows % EXPORT_PROGRESS_ROWS == 0) {
+                     if (total > 0) {
+                        note("\r%lld of %lld updates (%d%%)", (long long)rows, (long long)total, (int)(rows * 100 / total));
+                     }
+                     else {
+                        note("\r%lld updates", (long long)rows);
+                     }
+                     fflush(stdout);
+                  }
+               }
+            }
+            else if (qres != PGRES_TUPLES_OK && qres != PGRES_SINGLE_TUPLE) {
+               fprintf(stderr, "\ngetAllUpdates: %s\n", PQerrorMessage(dbConn));
+               ok = false;
             }
+            PQclear(rset);
+         }
+         uint64_t end = w.offset();
+         if (!chunked) {
             os.writeInt(ENDTAG);
-            fwrite(os.get_buf(), os.size(), 1, f);
-            fclose(f);
+         }
+         uint64_t size = w.offset();
+         if (!(chunked ? cw.close() : w.close()) || !ok) {
+            fprintf(stderr, "\nexport of project %d failed, removing %s\n", ntohl(lpid), efile);
+            unlink(efile);
+         }
+         else {
+            //chunked exports carry their own index
+            if (format == EXPORT_PLAIN && !index.write(efile, end, size)) {
+               fprintf(stderr, "unable to write an index for %s\n", efile);
+            }
             if (rows == 0 ) {
-               printf("NO UPDATES FOUND FOR EXPORTING\n");
+               note("NO UPDATES FOUND FOR EXPORTING\n");
             }
             else {
-               printf("Processed %d updates\n", rows);
+               note("\rProcessed %lld updates\n", (long long)rows);
+            }
+            rval = 0;
+         }
+      }
+      else {
+         printf("Project %d not found.\n", lpid);
+      }
+      note("\n");
+   }
+   else {
+      fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
+   }
+   return rval;
+}
+
+static void gzReadFully(gzFile gz, void *buf, uint32_t len) {
+   if (len != 0 && gzread(gz, buf, len) != (int)len) {
+      throw IOException();
+   }
+}
+
+static uint32_t gzReadInt(gzFile gz) {
+   uint32_t val;
+   gzReadFully(gz, &val, sizeof(val));
+   return ntohl(val);
+}
+
+//reads a long the same way FileIO::readLong does
+static uint64_t gzReadLong(gzFile gz) {
+   uint64_t hi = gzReadInt(gz);
+   return (hi << 32) | gzReadInt(gz);
+}
+
+static string gzReadUTF(gzFile gz) {
+   uint8_t len[2];
+   gzReadFully(gz, len, sizeof(len));
+   string res((len[0] << 8) | len[1], '\0');
+   gzReadFully(gz, &res[0], res.length());
+   return res;
+}
+
+//imports are sent to the server in blocks of at most this many updates
+#define MIGRATE_BLOCK_UPDATES 5000
+//or of roughly this many bytes
+#define MIGRATE_BLOCK_BYTES 0x100000
+
+//the progress of an import is kept next to the export as it goes
+#define IMPORT_PROGRESS_SUFFIX ".progress"
+
+/**
+ * saveProgress records how far an import has got, so that it can be
+ * resumed if it is interrupted
+ */
+static void saveProgress(const string &name, const string &gpid, int pid, int64_t done, int64_t offset) {
+   string tmp = name + ".tmp";
+   FILE *f = fopen(tmp.c_str(), "w");
+   if (f == NULL) {
+      return;
+   }
+   fprintf(f, "%s %d %lld %lld\n", gpid.c_str(), pid, (long long)done, (long long)offset);
+   if (fclose(f) != 0 || rename(tmp.c_str(), name.c_str()) == -1) {
+      unlink(tmp.c_str());
+   }
+}
+
+/**
+ * loadProgress reads the progress of an earlier import of the same export
+ * @return false if there was no earlier import of gpid
+ */
+static bool loadProgress(const string &name, const string &gpid, int *pid, int64_t *done, int64_t *offset) {
+   FILE *f = fopen(name.c_str(), "r");
+   if (f == NULL) {
+      return false;
+   }
+   char g[GPID_SIZE * 2 + 1];
+   long long d, o;
+   bool ok = fscanf(f, "%64s %d %lld %lld", g, pid, &d, &o) == 4 && gpid == g;
+   fclose(f);
+   *done = d;
+   *offset = o;
+   return ok;
+}
+
+/**
+ * ImportSource
+ * Hands out the updates of an export one at a time, whichever version of
+ * the export format it is in.  The chunks of a version 2 export are
+ * checked against their crc as they are read
+ */
+class ImportSource {
+public:
+   ImportSource(gzFile f, ChunkedExportReader *chunked) : gz(f), reader(chunked), chunk(0), p(NULL), end(NULL), ended(false) {
+      pos = gztell(gz);
+   };
+
+   //the next update, false at the end of the export
+   bool next(int &cmd, const uint8_t *&data, int &dlen) {
+      if (reader) {
+         while (p == end) {
+            if (chunk == reader->numChunks()) {
+               ended = true;
+               return false;
+            }
+            if (!reader->readChunk(chunk, raw)) {
+               fprintf(stderr, "\nchunk %d of the export is corrupt\n", chunk);
+               throw IOException();
             }
-            rval = 0;
+            chunk++;
+            p = raw.get_buf();
+            end = p + raw.size();
          }
-         PQclear(rset);
+         ExportRecord r;
+         if (!nextExportRecord(p, end, r)) {
+            throw IOException();
+         }
+         cmd = r.cmd;
+         data = r.data;
+         dlen = r.dlen;
+         return true;
       }
-      else {
-         printf("Project %d not found.\n", ntohl(lpid));
+      int tag = gzReadInt(gz);
+      if (tag != TAG) {
+         ended = tag == ENDTAG;
+         return false;
       }
-      printf("\n");
-   }
-   else {
-      fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
+      //updateid, uid and pid aren't needed, the server assigns its own
+      uint8_t rec[16];
+      gzReadFully(gz, rec, sizeof(rec));
+      cmd = gzReadInt(gz);
+      dlen = gzReadInt(gz);
+      if (dlen < 0 || dlen > MAX_MIGRATE_BLOCK - MIGRATE_BLOCK_BYTES) {
+         fprintf(stderr, "Error: update of %d bytes\n", dlen);
+         throw IOException();
+      }
+      buf.resize(dlen + 1);
+      gzReadFully(gz, &buf[0], dlen);
+      data = &buf[0];
+      pos = gztell(gz);
+      return true;
+   };
+
+   //skips n updates, whole chunks at a time where possible
+   void skip(int64_t n) {
+      while (reader && p == end && chunk < reader->numChunks() && n >= reader->chunk(chunk).count) {
+         n -= reader->chunk(chunk++).count;
+      }
+      int cmd;
+      const uint8_t *data;
+      int dlen;
+      while (n-- > 0 && next(cmd, data, dlen)) {
+      }
+   };
+
+   //moves to a position that was saved while importing a version 1 export
+   bool seek(int64_t offset) {
+      if (reader == NULL && gzseek(gz, offset, SEEK_SET) == offset) {
+         pos = offset;
+         return true;
+      }
+      return false;
+   };
+
+   //how far through the export we are
+   int percent(uint64_t size) {
+      if (reader) {
+         return reader->numChunks() ? chunk * 100 / reader->numChunks() : 100;
+      }
+      return size ? (int)(gzoffset(gz) * 100 / size) : 100;
+   };
+
+   //where the update after the one returned last starts, version 1 only
+   int64_t position() {return pos;};
+
+   //true once the end of the export has been reached
+   bool complete() {return ended;};
+
+private:
+   gzFile gz;
+   ChunkedExportReader *reader;
+   int chunk;
+   Buffer raw;
+   const uint8_t *p;
+   const uint8_t *end;
+   vector<uint8_t> buf;
+   int64_t pos;
+   bool ended;
+};
+
+/**
+ * readReply reads the reply to a management command
+ * @param cmd the reply that is expected
+ * @return the length of the reply's payload
+ */
+int ServerManager::readReply(int cmd) {
+   int messagesize = s->readInt();
+   int testcmd = s->readInt();
+   if (testcmd != cmd || messagesize < 8) {
+      fprintf(stderr, "protocol dictates a %d reply, but recieved: %d\n", cmd, testcmd);
+      throw IOException();
    }
-   return rval;
+   return messagesize - 8;
 }
 
 /**
- * importProject imports a project from a binary final
+ * importProject imports a project from a binary final.  Updates go to the
+ * server in large blocks, and each block that the server has stored is
+ * recorded in ifile.progress, so an interrupted import can be resumed
  * @param ifile the filename to import from
  * @param newowner the local uid to be the owner of the new project
  */
-int ServerManager::importProject(FILE *ifile, int newowner) {
+int ServerManager::importProject(const char *ifile, int newowner, int *newpid) {
    int rval = -1;
    if (mode == MODE_DB) {
+      //zlib reads plain exports just as well as compressed ones
+      gzFile fdis = gzopen(ifile, "rb");
+      if (fdis == NULL) {
+         fprintf(stderr, "unable to read %s\n", ifile);
+         return -1;
+      }
+      struct stat sbuf;
+      stat(ifile, &sbuf);
+      string progress = string(ifile) + IMPORT_PROGRESS_SUFFIX;
       try {
-         ProjectInfo pi(1, "none");
-
-         FileIO fdis;
-         fdis.setFileDescriptor(fileno(ifile));
-
          uint8_t sig[8];
-         fdis.readFully(sig, sizeof(sig));
+         gzReadFully(fdis, sig, sizeof(sig));
          if (memcmp(FILE_SIG, sig, sizeof(sig)) == 0) {
-            printf("Magic matched\n");
+            note("Magic matched\n");
          }
          else {
             printf("This doesn't appear to be a collabREate binary file\n");
+            gzclose(fdis);
             return -1;
          }
-         int ver = fdis.readInt();
-         printf("File format version %d\n", ver);
+         int ver = gzReadInt(fdis);
+         note("File format version %d\n", ver);
          uint8_t gpid[GPID_SIZE];
-         fdis.readFully(gpid, sizeof(gpid));
-         printf("importing %s\n", toHexString(gpid, sizeof(gpid)).c_str());
+         gzReadFully(fdis, gpid, sizeof(gpid));
+         string gpidStr = toHexString(gpid, sizeof(gpid));
+         note("importing %s\n", gpidStr.c_str());
          uint8_t hash[MD5_SIZE];
-         fdis.readFully(hash, sizeof(hash));
-         printf("(%s)\n", toHexString(hash, sizeof(hash)).c_str());
-         uint64_t sub = ntohll(fdis.readLong());
-         uint64_t pub = ntohll(fdis.readLong());
-         printf("s 0x%llx, p 0x%llx\n", sub, pub);
-         string desc = fdis.readUTF();
-         printf("desc: %s\n", desc.c_str());
-
-         //addproject
-         Buffer os;
-         os.writeInt(newowner);
-         os.write(gpid, sizeof(gpid));
-         os.write(hash, sizeof(hash));
-         os.writeUTF(desc);
-         os.writeLong(pub);
-         os.writeLong(sub);
-         send_data(MNG_PROJECT_MIGRATE, os.get_buf(), os.size());
-
-         //slightly dangerous to assume the next message, but hey, it's the managment app...
-         //(this could wait for this message forever)
-
-         // this is really a throwaway, since we are expecting a specific message here
-         int messagesize = s->readInt();
-         if (messagesize != 12) {
-            fprintf(stderr, "protocol dictates 12 byte PROJECT_MIGRATE_REPLY, but recieved: %d\n", messagesize);
-            return rval;
-         }
-
-         int testcmd = s->readInt();
-         if (testcmd != MNG_PROJECT_MIGRATE_REPLY) {
-            fprintf(stderr, "protocol dictates PROJECT_MIGRATE_REPLY, but recieved: %d\n", testcmd);
-            return rval;
-         }
-         int status = s->readInt();
-         if (status != MNG_MIGRATE_REPLY_SUCCESS) {
-            fprintf(stderr, "Project migrate did not succeed on server, check server logs for more info\n");
-            return rval;
+         gzReadFully(fdis, hash, sizeof(hash));
+         note("(%s)\n", toHexString(hash, sizeof(hash)).c_str());
+         uint64_t sub = ntohll(gzReadLong(fdis));
+         uint64_t pub = ntohll(gzReadLong(fdis));
+         note("s 0x%llx, p 0x%llx\n", sub, pub);
+         string desc = gzReadUTF(fdis);
+         note("desc: %s\n", desc.c_str());
+
+         ChunkedExportReader chunked;
+         if (ver == FILE_VER_CHUNKED) {
+            if (!chunked.open(ifile)) {
+               gzclose(fdis);
+               return -1;
+            }
+            note("%d chunks, %llu updates\n", chunked.numChunks(), (unsigned long long)chunked.size());
+         }
+         else if (ver != FILE_VER) {
+            printf("Unsupported file format version\n");
+            gzclose(fdis);
+            return -1;
+         }
+         ImportSource src(fdis, ver == FILE_VER_CHUNKED ? &chunked : NULL);
+
+         int pid = 0;
+         int64_t done = -1;
+         int64_t saved;
+         int64_t offset;
+         if (loadProgress(progress, gpidStr, &pid, &saved, &offset)) {
+            bool resume = true;
+            //batch workers always resume, a whole server restore is simply run again
+            if (!batch) {
+               printf("An earlier import of this file into project %d was interrupted, resume it? (yes/no) ? ", pid);
+               resume = askyn();
+            }
+            if (resume) {
+               Buffer os;
+               os.writeInt(pid);
+               send_data(MNG_MIGRATE_RESUME, os.get_buf(), os.size());
+               readReply(MNG_MIGRATE_RESUME_REPLY);
+               done = s->readLong();
+               if (done < 0) {
+                  printf("The server is unable to resume the import, starting over\n");
+               }
+            }
+         }
+         if (done < 0) {
+            //addproject
+            Buffer os;
+            os.writeInt(newowner);
+            os.write(gpid, sizeof(gpid));
+            os.write(hash, sizeof(hash));
+            os.writeUTF(desc);
+            os.writeLong(pub);
+            os.writeLong(sub);
+            send_data(MNG_PROJECT_MIGRATE, os.get_buf(), os.size());
+
+            //slightly dangerous to assume the next message, but hey, it's the managment app...
+            //(this could wait for this message forever)
+            int replysize = readReply(MNG_PROJECT_MIGRATE_REPLY);
+            int status = s->readInt();
+            //older servers don't say which project they created
+            pid = replysize >= 8 ? s->readInt() : 0;
+            if (status != MNG_MIGRATE_REPLY_SUCCESS) {
+               fprintf(stderr, "Project migrate did not succeed on server, check server logs for more info\n");
+               gzclose(fdis);
+               return rval;
+            }
+            else {
+               note("Project creation succeeded on server\n");
+            }
+            done = 0;
          }
          else {
-            printf("Project creation succeeded on server\n");
+            note("resuming after %lld updates\n", (long long)done);
+            //if our record and the server's disagree, the server knows best
+            if (done != saved || !src.seek(offset)) {
+               src.skip(done);
+            }
          }
 
-         int tag = fdis.readInt();
-         while (tag == TAG) {
-            uint64_t updateid = fdis.readLong();
-            int uid = fdis.readInt();
-            int pid = fdis.readInt();
-            int cmd = fdis.readInt();
-            int datalen = fdis.readInt();
-            uint8_t *data = new uint8_t[datalen];
-            fdis.readFully(data, datalen);
-            //read timestamp?
-
-            //printf("update:" + updateid + " orig uid " + uid + " oldpid " + pid + " cmd " + cmd + " datalen " + datalen );
-            printf(".");
-
-            //insertUpdate
-            Buffer cos;
-            cos.writeInt(newowner);  //this is required becuase the original uid may
-            //os.writeInt(uid);      //not be present on the new server (users aren't migrated yet)
-            //cos.writeInt(newpid);  //similary, we could specify the newly created project
-            cos.writeInt(pid);       //instead the Helper ignores pid and uses the last successfully migrated project from this session
-            cos.writeInt(cmd);
-            cos.writeInt(datalen);
-            cos.write(data, datalen);
-            send_data(MNG_MIGRATE_UPDATE, cos.get_buf(), cos.size());
-            delete [] data;
-            tag = fdis.readInt();
-         }
-         if (tag != ENDTAG ) {
-            fprintf(stderr, "Error: didn't end update processing loop with ENDTAG\n");
+         struct timeval start, now;
+         gettimeofday(&start, NULL);
+         int64_t imported = 0;
+         bool failed = false;
+         while (!src.complete()) {
+            //uid, first and count, then the updates
+            Buffer block;
+            block.writeInt(newowner);
+            block.writeLong(done);
+            block.writeInt(0);
+            int count = 0;
+            int cmd;
+            const uint8_t *data;
+            int datalen;
+            while (count < MIGRATE_BLOCK_UPDATES && block.size() < MIGRATE_BLOCK_BYTES &&
+                   src.next(cmd, data, datalen)) {
+               block.writeInt(cmd);
+               block.writeInt(datalen);
+               block.write(data, datalen);
+               count++;
+            }
+            if (count == 0) {
+               break;
+            }
+            uint32_t ncount = htonl(count);
+            memcpy(block.get_buf() + 12, &ncount, sizeof(ncount));
+            send_data(MNG_MIGRATE_BLOCK, block.get_buf(), block.size());
+            readReply(MNG_MIGRATE_BLOCK_REPLY);
+            int64_t stored = s->readLong();
+            if (stored != done + count) {
+               fprintf(stderr, "\nthe server failed to store updates %lld - %lld, check server logs for more info\n",
+                       (long long)done, (long long)(done + count - 1));
+               failed = true;
+               break;
+            }
+            done = stored;
+            imported += count;
+            if (pid > 0) {
+               saveProgress(progress, gpidStr, pid, done, src.position());
+            }
+            gettimeofday(&now, NULL);
+            double secs = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+            note("\r%lld updates imported (%d%%), %.0f updates/s", (long long)done,
+                   src.percent(sbuf.st_size), secs > 0 ? imported / secs : 0.0);
+            fflush(stdout);
+         }
+         if (failed) {
+            fprintf(stderr, "the import can be resumed once the problem has been fixed\n");
+         }
+         else if (!src.complete()) {
+            fprintf(stderr, "\nError: didn't end update processing loop with ENDTAG\n");
          }
          else {
+            note("\nProcessed %lld updates\n", (long long)done);
+            unlink(progress.c_str());
+            if (newpid) {
+               *newpid = pid;
+            }
             rval = 0;
          }
-         fdis.close();
       } catch (IOException ex) {
-         fprintf(stderr, "Error importing project\n");
+         fprintf(stderr, "\nError importing project\n");
       }
-      printf("\n");
+      gzclose(fdis);
+      note("\n");
    }
    else {
       fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
@@ -681,6 +1804,199 @@ int ServerManager::importProject(FILE *ifile, int newowner) {
    return rval;
 }
 
+/**
+ * exportVersion peeks at the format version of an export file
+ * @param efile the export file
+ * @return the version, -1 if it isn't an export
+ */
+int ServerManager::exportVersion(const char *efile) {
+   int ver = -1;
+   gzFile gz = gzopen(efile, "rb");
+   if (gz != NULL) {
+      try {
+         uint8_t sig[8];
+         gzReadFully(gz, sig, sizeof(sig));
+         if (memcmp(FILE_SIG, sig, sizeof(sig)) == 0) {
+            ver = gzReadInt(gz);
+         }
+      } catch (IOException ex) {
+      }
+      gzclose(gz);
+   }
+   return ver;
+}
+
+/**
+ * extractIndexed writes the updates of an uncompressed version 1 export
+ * that follow a given updateid to a new export.  Exports are written in
+ * updateid order, so those updates are one run of the file, the index
+ * says where it starts and nothing before it is read
+ * @param src the export to extract from
+ * @param dst the export to create
+ * @param after the updateid to extract the updates after
+ * @return 0 on success
+ */
+static int extractIndexed(const char *src, const char *dst, uint64_t after) {
+   ExportIndex index;
+   if (!index.open(src)) {
+      printf("building index for %s\n", src);
+      if (!ExportIndex::build(src) || !index.open(src)) {
+         return -1;
+      }
+   }
+   //the header runs up to the first update
+   uint64_t hlen = index.find(0);
+   uint64_t start = after < index.lastUpdate() ? index.find(after + 1) : index.end();
+   uint64_t end = index.end();
+   FILE *in = fopen(src, "rb");
+   if (in == NULL) {
+      fprintf(stderr, "unable to read %s: %s\n", src, strerror(errno));
+      return -1;
+   }
+   FILE *out = fopen(dst, "wb");
+   if (out == NULL) {
+      fprintf(stderr, "unable to create %s: %s\n", dst, strerror(errno));
+      fclose(in);
+      return -1;
+   }
+   vector<uint8_t> buf(0x100000);
+   bool ok = true;
+   for (uint64_t pos = 0; ok && pos < end; ) {
+      if (pos == hlen && start > hlen) {
+         pos = start;
+         ok = fseeko(in, pos, SEEK_SET) == 0;
+         continue;
+      }
+      size_t n = min((uint64_t)buf.size(), (pos < hlen ? hlen : end) - pos);
+      ok = fread(&buf[0], n, 1, in) == 1 && fwrite(&buf[0], n, 1, out) == 1;
+      pos += n;
+   }
+   uint32_t tag = htonl(ENDTAG);
+   ok = ok && fwrite(&tag, sizeof(tag), 1, out) == 1;
+   fclose(in);
+   if (fclose(out) != 0 || !ok) {
+      fprintf(stderr, "unable to write %s\n", dst);
+      unlink(dst);
+      return -1;
+   }
+   if (!ExportIndex::build(dst) || !index.open(dst)) {
+      return -1;
+   }
+   printf("%llu updates after %llu written to %s\n", (unsigned long long)index.size(), (unsigned long long)after, dst);
+   return 0;
+}
+
+/**
+ * extractExport writes the updates of an export that follow a given
+ * updateid to a new export of the same kind.  Only the chunk of a chunked
+ * export holding the first of them is decompressed, the rest are copied
+ * as they are.  Uncompressed exports are located through their index
+ * @param src the export to extract from
+ * @param dst the export to create
+ * @param after the updateid to extract the updates after
+ * @return 0 on success
+ */
+int ServerManager::extractExport(const char *src, const char *dst, uint64_t after) {
+   if (exportVersion(src) == FILE_VER) {
+      return extractIndexed(src, dst, after);
+   }
+   ChunkedExportReader reader;
+   if (!reader.open(src)) {
+      return -1;
+   }
+   ChunkedExportWriter w;
+   if (!w.open(dst, reader.header())) {
+      return -1;
+   }
+   bool ok = true;
+   Buffer buf;
+   int i = reader.findChunk(after);
+   if (i < reader.numChunks() && reader.chunk(i).first <= after) {
+      ok = reader.readChunk(i, buf);
+      const uint8_t *p = buf.get_buf();
+      const uint8_t *end = p + buf.size();
+      ExportRecord r;
+      while (ok && nextExportRecord(p, end, r)) {
+         if (r.updateid > after) {
+            ok = w.add(r.stored, r.uid, r.pid, r.cmd, r.data, r.dlen);
+         }
+      }
+      if (!ok) {
+         fprintf(stderr, "chunk %d of %s is corrupt\n", i, src);
+      }
+      i++;
+   }
+   for (; ok && i < reader.numChunks(); i++) {
+      ok = reader.readCompressed(i, buf) && w.copyChunk(reader.chunk(i), buf.get_buf());
+   }
+   if (!w.close() || !ok) {
+      fprintf(stderr, "unable to write %s\n", dst);
+      unlink(dst);
+      return -1;
+   }
+   printf("%llu updates after %llu written to %s\n", (unsigned long long)w.updates(), (unsigned long long)after, dst);
+   return 0;
+}
+
+/**
+ * indexExport makes sure an export file has an up to date index, then
+ * times a number of lookups against it
+ * @param efile the export file to index
+ * @param lookups the number of random lookups to time, 0 for none
+ * @return 0 on success
+ */
+int ServerManager::indexExport(const char *efile, int lookups) {
+   if (exportVersion(efile) == FILE_VER_CHUNKED) {
+      //chunked exports carry their own index, check everything else
+      ChunkedExportReader reader;
+      if (!reader.open(efile)) {
+         return -1;
+      }
+      int n = reader.numChunks();
+      printf("%llu updates (%llu - %llu) in %d chunks\n", (unsigned long long)reader.size(),
+             (unsigned long long)(n ? reader.chunk(0).first : 0), (unsigned long long)(n ? reader.chunk(n - 1).last : 0), n);
+      int threads = sysconf(_SC_NPROCESSORS_ONLN);
+      vector<int> bad;
+      struct timeval start, end;
+      gettimeofday(&start, NULL);
+      bool ok = reader.verify(threads, bad);
+      gettimeofday(&end, NULL);
+      double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+      for (size_t i = 0; i < bad.size(); i++) {
+         const ExportChunk &c = reader.chunk(bad[i]);
+         fprintf(stderr, "chunk %d (updates %llu - %llu) is corrupt\n", bad[i],
+                 (unsigned long long)c.first, (unsigned long long)c.last);
+      }
+      printf("%d chunks verified by %d threads in %.3f s\n", n, threads > 0 ? threads : 1, secs);
+      return ok ? 0 : -1;
+   }
+   ExportIndex index;
+   if (!index.open(efile)) {
+      printf("building index for %s\n", efile);
+      if (!ExportIndex::build(efile) || !index.open(efile)) {
+         return -1;
+      }
+   }
+   printf("%llu updates (%llu - %llu)\n", (unsigned long long)index.size(),
+          (unsigned long long)index.firstUpdate(), (unsigned long long)index.lastUpdate());
+   if (lookups > 0 && index.size() > 0) {
+      uint64_t first = index.firstUpdate();
+      uint64_t span = index.lastUpdate() - first + 1;
+      uint64_t check = 0;
+      struct timeval start, end;
+      srandom(time(NULL));
+      gettimeofday(&start, NULL);
+      for (int i = 0; i < lookups; i++) {
+         uint64_t id = first + ((((uint64_t)random() << 31) | random()) % span);
+         check += index.find(id);
+      }
+      gettimeofday(&end, NULL);
+      double us = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+      printf("%d lookups in %.0f us, %.3f us per lookup (%llx)\n", lookups, us, us / lookups, (unsigned long long)check);
+   }
+   return 0;
+}
+
 /**
  * getProps is an inspector that gets the current operation mode of the connection manager
  * @return a Properites object
@@ -759,10 +2075,24 @@ void ServerManager::listUsers() {
  * listProjects lists the projects on this server
  */
 void ServerManager::listProjects() {
+   loadProjects(true);
+}
+
+/**
+ * loadProjects reads the projects on this server for getProjectInfo
+ * @param show true to list them as well
+ */
+void ServerManager::loadProjects(bool show) {
    if (mode == MODE_DB) {
       string lastHash = "";
-      printf("\nCollabREate projects\n");
-      printf("%-4s %-4s %-4s %-10s %-10s %s %s\n", "PID", "PPID", "snap", "Pub", "Sub", getPermHeaderString(6).c_str(), "Description");
+      for (vector<ProjectInfo*>::iterator it = plist.begin(); it != plist.end(); it++) {
+         delete *it;
+      }
+      plist.clear();
+      if (show) {
+         printf("\nCollabREate projects\n");
+         printf("%-4s %-4s %-4s %-10s %-10s %s %s\n", "PID", "PPID", "snap", "Pub", "Sub", getPermHeaderString(6).c_str(), "Description");
+      }
 
       //         listProjectsQuery = con.prepareStatement("select p.pid,p.gpid,p.hash,p.pub,p.sub,f.parent,p.description,q.description from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child order by p.pid asc;");
       //                                                            1      2      3     4     5      6          7             8
@@ -784,7 +2114,9 @@ void ServerManager::listProjects() {
          int rows = PQntuples(rset);
          for (int i = 0; i < rows; i++) {
             //printf("processing update %d...", (i + 1));
-            printf(".");
+            if (show) {
+               printf(".");
+            }
             int pid = ntohl(*(int*)PQgetvalue(rset, i, 0));
             uint64_t pub = ntohll(*((uint64_t*)PQgetvalue(rset, i, 3)));
             uint64_t sub = ntohll(*((uint64_t*)PQgetvalue(rset, i, 4)));
@@ -799,7 +2131,11 @@ void ServerManager::listProjects() {
             }
             ProjectInfo *temppi = new ProjectInfo(pid, desc);
             const char *isSnap = (snapupdateid > 0) ? " X " : "   ";
-            printf("%-4d %-4d %-4s %-10llx %-10llx %s %s\n", pid, ppid, isSnap, pub, sub, getPermRowString(pub, sub, 6).c_str(), desc);
+            //deleted projects stick around until their updates are purged
+            const char *deleted = *PQgetvalue(rset, i, 9) ? " (being deleted)" : "";
+            if (show) {
+               printf("%-4d %-4d %-4s %-10llx %-10llx %s %s%s\n", pid, ppid, isSnap, pub, sub, getPermRowString(pub, sub, 6).c_str(), desc, deleted);
+            }
             temppi->parent = ppid;
             temppi->pdesc = PQgetvalue(rset, i, 7);
             temppi->snapupdateid = snapupdateid;
@@ -818,12 +2154,189 @@ void ServerManager::listProjects() {
    }
 }
 
+/**
+ * getBackupUsers reads every user account for a backup
+ * @param users receives the accounts
+ * @return 0 on success
+ */
+int ServerManager::getBackupUsers(vector<BackupUser> &users) {
+   PGresult *rset = PQexecPrepared(dbConn, "backupUsers", 0, NULL, NULL, NULL, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "backupUsers: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+      return -1;
+   }
+   int rows = PQntuples(rset);
+   for (int i = 0; i < rows; i++) {
+      BackupUser u;
+      u.uid = ntohl(*(int*)PQgetvalue(rset, i, 0));
+      u.username = PQgetvalue(rset, i, 1);
+      u.pwhash = PQgetvalue(rset, i, 2);
+      u.pub = ntohll(*(uint64_t*)PQgetvalue(rset, i, 3));
+      u.sub = ntohll(*(uint64_t*)PQgetvalue(rset, i, 4));
+      users.push_back(u);
+   }
+   PQclear(rset);
+   return 0;
+}
+
+/**
+ * getBackupProjects reads every project that isn't being deleted for a backup
+ * @param projects receives the projects
+ * @return 0 on success
+ */
+int ServerManager::getBackupProjects(vector<BackupProject> &projects) {
+   PGresult *rset = PQexecPrepared(dbConn, "backupProjects", 0, NULL, NULL, NULL, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "backupProjects: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+      return -1;
+   }
+   int rows = PQntuples(rset);
+   for (int i = 0; i < rows; i++) {
+      BackupProject p;
+      p.pid = ntohl(*(int*)PQgetvalue(rset, i, 0));
+      p.gpid = PQgetvalue(rset, i, 1);
+      p.owner = ntohl(*(int*)PQgetvalue(rset, i, 2));
+      p.archive = PQgetvalue(rset, i, 3);
+      p.parent = ntohl(*(int*)PQgetvalue(rset, i, 4));
+      p.snapupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, i, 5));
+      p.position = 0;
+      p.hash = PQgetvalue(rset, i, 6);
+      p.desc = PQgetvalue(rset, i, 7);
+      p.protocol = ntohl(*(int*)PQgetvalue(rset, i, 8));
+      p.updates = -1;
+      p.bytes = 0;
+      p.newpid = 0;
+      p.ok = false;
+      projects.push_back(p);
+   }
+   PQclear(rset);
+   return 0;
+}
+
+/**
+ * findUser looks up a user by name
+ * @param username the name to look for
+ * @return the userid, 0 if there is no such user, -1 on error
+ */
+int ServerManager::findUser(const string &username) {
+   const char * const parms[1] = {username.c_str()};
+   PGresult *rset = PQexecPrepared(dbConn, "findUserByName", 1, parms, NULL, NULL, 1);
+   int uid = -1;
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "findUserByName: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      uid = PQntuples(rset) == 1 ? ntohl(*(int*)PQgetvalue(rset, 0, 0)) : 0;
+   }
+   PQclear(rset);
+   return uid;
+}
+
+/**
+ * addFork records that a project was forked from another
+ * @param child the local pid of the fork
+ * @param parent the local pid of the project it was forked from
+ * @return 0 on success
+ */
+int ServerManager::addFork(int child, int parent) {
+   static const int plens[2] = {4, 4};
+   static const int pformats[2] = {1, 1};
+   child = htonl(child);
+   parent = htonl(parent);
+   const char * const parms[2] = {(char*)&child, (char*)&parent};
+   PGresult *rset = PQexecPrepared(dbConn, "addFork", 2, parms, plens, pformats, 1);
+   int rval = 0;
+   if (PQresultStatus(rset) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "addFork: %s\n", PQerrorMessage(dbConn));
+      rval = -1;
+   }
+   PQclear(rset);
+   return rval;
+}
+
+/**
+ * countUpdatesTo counts the updates of a project up to and including one
+ * @param pid the local pid of the project
+ * @param updateid the last update to count
+ * @return the number of updates, -1 on error
+ */
+int64_t ServerManager::countUpdatesTo(int pid, uint64_t updateid) {
+   static const int plens[2] = {4, 8};
+   static const int pformats[2] = {1, 1};
+   pid = htonl(pid);
+   updateid = htonll(updateid);
+   const char * const parms[2] = {(char*)&pid, (char*)&updateid};
+   PGresult *rset = PQexecPrepared(dbConn, "countUpdatesTo", 2, parms, plens, pformats, 1);
+   int64_t count = -1;
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "countUpdatesTo: %s\n", PQerrorMessage(dbConn));
+   }
+   else if (PQntuples(rset) == 1) {
+      count = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+   return count;
+}
+
+/**
+ * updateAt finds the nth update of a project, counting from 0
+ * @param pid the local pid of the project
+ * @param n the position of the update
+ * @return the updateid, 0 if there is no such update or on error
+ */
+uint64_t ServerManager::updateAt(int pid, int64_t n) {
+   static const int plens[2] = {4, 8};
+   static const int pformats[2] = {1, 1};
+   pid = htonl(pid);
+   uint64_t offset = htonll(n);
+   const char * const parms[2] = {(char*)&pid, (char*)&offset};
+   PGresult *rset = PQexecPrepared(dbConn, "updateAt", 2, parms, plens, pformats, 1);
+   uint64_t updateid = 0;
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "updateAt: %s\n", PQerrorMessage(dbConn));
+   }
+   else if (PQntuples(rset) == 1) {
+      updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+   return updateid;
+}
+
+/**
+ * addSnapshot recreates the row of a backed up snapshot
+ * @param p the snapshot as it was backed up
+ * @param owner the restored uid of the snapshot's owner
+ * @param snapupdateid the restored updateid the snapshot was taken at
+ * @return the new local pid, -1 on error
+ */
+int ServerManager::addSnapshot(const BackupProject &p, int owner, uint64_t snapupdateid) {
+   static const int plens[6] = {0, 0, 0, 4, 8, 4};
+   static const int pformats[6] = {0, 0, 0, 1, 1, 1};
+   owner = htonl(owner);
+   snapupdateid = htonll(snapupdateid);
+   int proto = htonl(p.protocol);
+   const char * const parms[6] = {p.hash.c_str(), p.gpid.c_str(), p.desc.c_str(), (char*)&owner,
+                                  (char*)&snapupdateid, (char*)&proto};
+   PGresult *rset = PQexecPrepared(dbConn, "addSnapshot", 6, parms, plens, pformats, 1);
+   int pid = -1;
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "addSnapshot: %s\n", PQerrorMessage(dbConn));
+   }
+   else if (PQntuples(rset) == 1) {
+      pid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+   return pid;
+}
+
 /**
  * closeDB closes all the database queries and the database connection
  */
 void ServerManager::closeDB() {
    if (mode == MODE_DB) {
-      printf("Closing database connection\n");
+      note("Closing database connection\n");
       PGresult *res = PQexec(dbConn, "DEALLOCATE listUsers;");
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE listProjects;");
@@ -834,11 +2347,35 @@ void ServerManager::closeDB() {
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE findUserByUID;");
       PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE countUpdates;");
+      PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE getAllUpdates;");
       PQclear(res);
-      res = PQexec(dbConn, "DEALLOCATE deleteUpdatesByPID;");
+      res = PQexec(dbConn, "DEALLOCATE markProjectDeleted;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE getDictionary;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE addDictionary;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE sampleUpdates;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE getPackableUpdates;");
       PQclear(res);
-      res = PQexec(dbConn, "DEALLOCATE deleteProjectByPID;");
+      res = PQexec(dbConn, "DEALLOCATE storeUpdate;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE backupUsers;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE backupProjects;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE findUserByName;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE addFork;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE countUpdatesTo;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE updateAt;");
+      PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE addSnapshot;");
       PQclear(res);
       PQfinish(dbConn);
       dbConn = NULL;
@@ -922,6 +2459,28 @@ void ServerManager::exec(int argc, char **argv) {
          exit(0);
       }
    }
+   //latency is usually wanted while something is going on, not from the menu
+   if (argc >= 3 && sm != NULL && !strcmp("latency", argv[2])) {
+      sm->showLatency(argc >= 4 ? atoi(argv[3]) : -1);
+      sm->terminate();
+      delete p;
+      exit(0);
+   }
+   //top runs until it is interrupted
+   if (argc >= 3 && sm != NULL && !strcmp("top", argv[2])) {
+      sm->top(argc >= 4 ? atoi(argv[3]) : 1000);
+      sm->terminate();
+      delete p;
+      exit(0);
+   }
+   //whole server backups and restores are usually run from a script
+   if (argc >= 4 && sm != NULL && (!strcmp("backup", argv[2]) || !strcmp("restore", argv[2]))) {
+      ServerBackup backup(sm, p);
+      int res = !strcmp("backup", argv[2]) ? backup.backup(argv[3]) : backup.restore(argv[3]);
+      sm->terminate();
+      delete p;
+      exit(res == 0 ? 0 : 1);
+   }
    char resp[128];
    while (true) {
       printf("\n");
@@ -935,6 +2494,13 @@ void ServerManager::exec(int argc, char **argv) {
       printf("7)  Export a Project to file *\n");
       printf("8)  Import a Project from file *\n");
       printf("9)  Delete a Project\n");
+      printf("12) Train a compression dictionary\n");
+      printf("13) Index or verify an export file\n");
+      printf("14) Archive idle projects *\n");
+      printf("15) Extract updates from an export file\n");
+      printf("16) Back up all users and projects\n");
+      printf("17) Restore a backup of all users and projects *\n");
+      printf("18) Show update latency *\n");
       printf("10) Quit\n");
       printf("\n");
       printf(" * requires CollabREate Server to be running\n");
@@ -1191,7 +2757,19 @@ void ServerManager::exec(int argc, char **argv) {
                  continue;
                }
             }
-            if (sm->exportProject(lpid, resp) != 0) {
+            string efile = resp;
+            //version 2 can't be imported by the Java server, so it has to be asked for
+            printf("Export format, 1) version 1  2) version 1, gzip compressed  3) version 2, chunked (default: 1): ");
+            if (readLine(resp, sizeof(resp)) == NULL) {
+               break;
+            }
+            int format = !strcmp(resp, "3") ? EXPORT_CHUNKED : !strcmp(resp, "2") ? EXPORT_GZIP : EXPORT_PLAIN;
+            printf("Only export the updates after updateid (default: 0): ");
+            if (readLine(resp, sizeof(resp)) == NULL) {
+               break;
+            }
+            uint64_t after = isNumeric(resp) ? strtoull(resp, NULL, 0) : 0;
+            if (sm->exportProject(lpid, efile.c_str(), format, after) != 0) {
                fprintf(stderr, "export did not fully comply successfully\n");
             }
          }
@@ -1205,8 +2783,8 @@ void ServerManager::exec(int argc, char **argv) {
          if (readLine(resp, sizeof(resp)) == NULL) {
             break;
          }
-         FILE *f = fopen(resp, "r");
-         if (f != NULL) {
+         struct stat sbuf;
+         if (stat(resp, &sbuf) == 0) {
             char userid[64];
             sm->listUsers();
             int uid;
@@ -1215,10 +2793,9 @@ void ServerManager::exec(int argc, char **argv) {
                break;
             }
             uid = strtoul(userid, NULL, 0);  //obviously doesn't check for valid uid
-            if (sm->importProject(f, uid) != 0) {
+            if (sm->importProject(resp, uid) != 0) {
                fprintf(stderr, "import from %s did not complete successfully\n", resp);
             }
-            fclose(f);
          }
          else {
             printf("file %s not found.\n", resp);
@@ -1256,6 +2833,133 @@ void ServerManager::exec(int argc, char **argv) {
             sm->shutdownServer();
          }
       }
+      else if (!strcmp(resp, "12")) {
+         if (sm->getMode() != MODE_DB ) {
+            printf("this only makes sense in DB MODE !\n");
+            continue;
+         }
+         sm->listProjects();
+         printf("Which project would you like to train a dictionary for (enter PID, 0 for all projects)? : ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         if (isNumeric(resp)) {
+            int lpid = strtoul(resp, NULL, 0);
+            printf("Recompress existing updates with the new dictionary? ");
+            bool recompress = askyn();
+            if (sm->trainProjectDictionary(lpid, recompress) < 0) {
+               fprintf(stderr, "dictionary training did not complete successfully\n");
+            }
+         }
+      }
+      else if (!strcmp(resp, "13")) {
+         printf("Enter the export file to index or verify: ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         string efile = resp;
+         printf("Number of lookups to time (default: 0): ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         int lookups = isNumeric(resp) ? strtoul(resp, NULL, 0) : 0;
+         if (sm->indexExport(efile.c_str(), lookups) != 0) {
+            fprintf(stderr, "unable to index %s\n", efile.c_str());
+            continue;
+         }
+         if (sm->exportVersion(efile.c_str()) == FILE_VER_CHUNKED) {
+            ChunkedExportReader reader;
+            reader.open(efile.c_str());
+            while (true) {
+               printf("Locate updateid (blank to return): ");
+               if (readLine(resp, sizeof(resp)) == NULL || !isNumeric(resp)) {
+                  break;
+               }
+               uint64_t id = strtoull(resp, NULL, 0);
+               int c = reader.findChunk(id ? id - 1 : 0);
+               if (c == reader.numChunks()) {
+                  printf("no update >= %s\n", resp);
+               }
+               else {
+                  printf("first update >= %s is in chunk %d at offset %llu\n", resp, c,
+                         (unsigned long long)reader.chunk(c).offset);
+               }
+            }
+            continue;
+         }
+         ExportIndex index;
+         index.open(efile.c_str());
+         while (true) {
+            printf("Locate updateid (blank to return): ");
+            if (readLine(resp, sizeof(resp)) == NULL || !isNumeric(resp)) {
+               break;
+            }
+            printf("first update >= %s is at offset %llu\n", resp,
+                   (unsigned long long)index.find(strtoull(resp, NULL, 0)));
+         }
+      }
+      else if (!strcmp(resp, "14")) {
+         if (sm->getMode() != MODE_DB ) {
+            printf("this only makes sense in DB MODE !\n");
+            continue;
+         }
+         printf("Archive projects nobody has touched for how many days? ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         if (isNumeric(resp)) {
+            int count = sm->archiveProjects(strtoul(resp, NULL, 0));
+            if (count < 0) {
+               fprintf(stderr, "archiving did not complete successfully, check server logs for more info\n");
+            }
+            else {
+               printf("%d projects archived\n", count);
+            }
+         }
+      }
+      else if (!strcmp(resp, "15")) {
+         printf("Enter the export file to extract from: ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         string src = resp;
+         printf("Enter the filename to extract to: ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         string dst = resp;
+         printf("Extract the updates after updateid: ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         if (!isNumeric(resp) || src == dst) {
+            continue;
+         }
+         if (sm->extractExport(src.c_str(), dst.c_str(), strtoull(resp, NULL, 0)) != 0) {
+            fprintf(stderr, "extract from %s did not complete successfully\n", src.c_str());
+         }
+      }
+      else if (!strcmp(resp, "16") || !strcmp(resp, "17")) {
+         bool backingUp = !strcmp(resp, "16");
+         if (sm->getMode() != MODE_DB ) {
+            printf("this only makes sense in DB MODE !\n");
+            continue;
+         }
+         printf(backingUp ? "Enter the directory to back up to: " : "Enter the directory to restore from: ");
+         if (readLine(resp, sizeof(resp)) == NULL) {
+            break;
+         }
+         if (*resp == 0) {
+            continue;
+         }
+         ServerBackup backup(sm, p);
+         if ((backingUp ? backup.backup(resp) : backup.restore(resp)) != 0) {
+            fprintf(stderr, "%s did not complete successfully, it can be run again\n", backingUp ? "backup" : "restore");
+         }
+      }
+      else if (!strcmp(resp, "18")) {
+         sm->showLatency(-1);
+      }
    }
    delete p;
 }
@@ -27,11 +27,18 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <libpq-fe.h>
+#include "buffer.h"
 #include "client.h"
 #include "utils.h"
+#include "server_backup.h"
 
 using namespace std;
 
+//export file formats
+#define EXPORT_PLAIN 0
+#define EXPORT_GZIP 1
+#define EXPORT_CHUNKED 2
+
 class ProjectInfo;
 
 /**
@@ -43,8 +50,13 @@ class ProjectInfo;
  */
 
 class ServerManager {
+   //backup and restore workers are ServerManagers of their own
+   friend class ServerBackup;
+
 private:
    bool done;
+   //a backup or restore worker, says nothing of its progress and never asks
+   bool batch;
    map<string,string> *props;
    PGconn *dbConn;
    int port;
@@ -55,11 +67,36 @@ private:
 
    vector<ProjectInfo*> plist;
 
+   //compression of stored updates
+   int storeLevel;
+   int storeMinimum;
+   map<int,Buffer*> dicts;
+
 public:
-   ServerManager(map<string,string> *p);
+   /**
+    * @param p the configuration
+    * @param batch true for a backup or restore worker, which stays quiet and
+    * leaves connecting to the server to its caller
+    */
+   ServerManager(map<string,string> *p, bool batch = false);
 
 private:
 
+   /**
+    * note prints a progress message, unless this is a batch worker
+    * @param format the printf format of the message
+    */
+   void note(const char *format, ...);
+
+   /**
+    * recompressUpdates rewrites the updates a new dictionary applies to
+    * @param lpid the local PID of the project the dictionary was trained on, 0 for a global dictionary
+    * @param dictid the id of the new dictionary
+    * @param dict the new dictionary
+    * @return 0 on success, -1 if a batch failed
+    */
+   int recompressUpdates(int lpid, int dictid, Buffer &dict);
+
    /**
     * deleteProject deletes a local project
     * @param pid the local project id to delete
@@ -95,10 +132,18 @@ private:
    /**
     * connectToHelper connects to the managerHelper on the server on MANAGE_PORT,
     * by default this must be a local connection.
+    * @return false if the server could not be reached
     */
-   void connectToHelper();
+   bool connectToHelper();
    
    void initQueries();
+
+   /**
+    * readReply reads the reply to a management command
+    * @param cmd the reply that is expected
+    * @return the length of the reply's payload
+    */
+   int readReply(int cmd);
    
    /**
     * similar to post in Client, but does not check subscription status, and takes command as a arg
@@ -116,6 +161,25 @@ private:
 
    void dumpStats();
 
+   /**
+    * showLatency prints the time updates spend in each stage between
+    * publisher and subscriber
+    * this requires ServerHelper to be running
+    * @param pid the project to show, -1 for every project
+    */
+
+   void showLatency(int pid);
+
+   /**
+    * top subscribes to the server's stats and shows per project update
+    * rates, the busiest publishers and the slowest subscribers until
+    * interrupted
+    * this requires ServerHelper to be running
+    * @param interval the number of milliseconds between refreshes
+    */
+
+   void top(int interval);
+
    /**
     * shutdownServer sends a request to the server to shutdown the server nicely
     * this requires ServerHelper to be running
@@ -123,6 +187,15 @@ private:
 
    void shutdownServer();
 
+   /**
+    * archiveProjects asks the server to archive projects that have been idle
+    * for a number of days
+    * this requires ServerHelper to be running
+    * @param days the number of days a project must have been idle
+    * @return the number of projects archived, -1 on error
+    */
+   int archiveProjects(int days);
+
    /**
     * getProjectInfo gets project information for a previously listed project
     * @param lpid the local PID for the project to get info on
@@ -132,19 +205,88 @@ private:
    int getProjectInfo(int lpid, ProjectInfo *pinfo);
 
    /**
-    * exportProject exports a project to a binary final
+    * countUpdates counts the updates of a project
+    * @param lpid the local PID of the project
+    * @return the number of updates, -1 on error
+    */
+   int64_t countUpdates(int lpid);
+
+   /**
+    * exportProject exports a project to a binary final.  Updates are
+    * streamed out of the database one row at a time, so exporting a project
+    * takes the same amount of memory no matter how large it is
     * @param lpid the local PID for the project to export
     * @param efile the filename to export to
+    * @param format EXPORT_PLAIN, EXPORT_GZIP or EXPORT_CHUNKED
+    * @param after only export the updates after this updateid
     * @return 0 on success
     */
-   int exportProject(int lpid, const char *efile);
+   int exportProject(int lpid, const char *efile, int format = EXPORT_CHUNKED, uint64_t after = 0);
 
    /**
-    * importProject imports a project from a binary final
+    * importProject imports a project from a binary final.  Updates go to the
+    * server in large blocks, and each block that the server has stored is
+    * recorded in ifile.progress, so an interrupted import can be resumed
     * @param ifile the filename to import from
     * @param newowner the local uid to be the owner of the new project
+    * @param newpid if not NULL receives the local pid of the new project
+    * @return 0 on success
+    */
+   int importProject(const char *ifile, int newowner, int *newpid = NULL);
+
+   /**
+    * exportVersion peeks at the format version of an export file
+    * @param efile the export file
+    * @return the version, -1 if it isn't an export
     */
-   int importProject(FILE *ifile, int newowner);
+   int exportVersion(const char *efile);
+
+   /**
+    * extractExport writes the updates of an export that follow a given
+    * updateid to a new export of the same kind.  Only the chunk of a chunked
+    * export holding the first of them is decompressed, the rest are copied
+    * as they are.  Uncompressed exports are located through their index
+    * @param src the export to extract from
+    * @param dst the export to create
+    * @param after the updateid to extract the updates after
+    * @return 0 on success
+    */
+   int extractExport(const char *src, const char *dst, uint64_t after);
+
+   /**
+    * indexExport makes sure an export file has an up to date index, then
+    * times a number of lookups against it
+    * @param efile the export file to index
+    * @param lookups the number of random lookups to time, 0 for none
+    * @return 0 on success
+    */
+   int indexExport(const char *efile, int lookups);
+
+   /**
+    * getDictionary loads a compression dictionary from the database
+    * @param dictid the id of the dictionary to load
+    * @return the dictionary, or NULL if it could not be loaded
+    */
+   Buffer *getDictionary(int dictid);
+
+   /**
+    * unpackUpdate restores an update that the server stored compressed
+    * @param rset the result set holding the update
+    * @param row the row of the update
+    * @param dcol the column of the update data, the dictid must follow it
+    * @param out the buffer that receives the update
+    * @return false if the update can't be restored
+    */
+   bool unpackUpdate(PGresult *rset, int row, int dcol, Buffer &out);
+
+   /**
+    * trainProjectDictionary trains a new compression dictionary from the most
+    * recent updates of a project, or of the whole server
+    * @param lpid the local PID of the project to train on, 0 for a global dictionary
+    * @param recompress true to recompress the existing updates with the new dictionary
+    * @return the new dictionary id, -1 on error
+    */
+   int trainProjectDictionary(int lpid, bool recompress);
 
    /**
     * getProps is an inspector that gets the current operation mode of the connection manager
@@ -174,6 +316,66 @@ private:
     */
    void listProjects();
 
+   /**
+    * loadProjects reads the projects on this server for getProjectInfo
+    * @param show true to list them as well
+    */
+   void loadProjects(bool show);
+
+   /**
+    * getBackupUsers reads every user account for a backup
+    * @param users receives the accounts
+    * @return 0 on success
+    */
+   int getBackupUsers(vector<BackupUser> &users);
+
+   /**
+    * getBackupProjects reads every project that isn't being deleted for a backup
+    * @param projects receives the projects
+    * @return 0 on success
+    */
+   int getBackupProjects(vector<BackupProject> &projects);
+
+   /**
+    * findUser looks up a user by name
+    * @param username the name to look for
+    * @return the userid, 0 if there is no such user, -1 on error
+    */
+   int findUser(const string &username);
+
+   /**
+    * addFork records that a project was forked from another
+    * @param child the local pid of the fork
+    * @param parent the local pid of the project it was forked from
+    * @return 0 on success
+    */
+   int addFork(int child, int parent);
+
+   /**
+    * countUpdatesTo counts the updates of a project up to and including one
+    * @param pid the local pid of the project
+    * @param updateid the last update to count
+    * @return the number of updates, -1 on error
+    */
+   int64_t countUpdatesTo(int pid, uint64_t updateid);
+
+   /**
+    * updateAt finds the nth update of a project, counting from 0
+    * @param pid the local pid of the project
+    * @param n the position of the update
+    * @return the updateid, 0 if there is no such update or on error
+    */
+   uint64_t updateAt(int pid, int64_t n);
+
+   /**
+    * addSnapshot recreates the row of a backed up snapshot
+    * @param p the snapshot as it was backed up
+    * @param owner the restored uid of the snapshot's owner
+    * @param snapupdateid the restored updateid the snapshot was taken at
+    * @return the new local pid, -1 on error
+    */
+   int addSnapshot(const BackupProject &p, int owner, uint64_t snapupdateid);
+
    /**
     * closeDB closes all the database queries and the database connection
     */
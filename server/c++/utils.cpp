@@ -32,12 +32,23 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <err.h>
+#include <errno.h>
 #include <stdint.h>
 #include <string>
 #include <openssl/md5.h>
+#include <sys/ioctl.h>
+#if defined __linux__
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
+#elif defined __FreeBSD__
+#include <sys/uio.h>
+#include <sys/filio.h>
+#endif
 
 #include "buffer.h"
 #include "utils.h"
+#include "compress.h"
+#include "logger.h"
 
 #define ERROR_CREATE_SOCK "Unable to create socket"
 #define ERROR_REUSE_SOCK "Unable to set reuse"
@@ -179,11 +190,14 @@ string getMD5(const string &s) {
 }
 
 void log(const string &msg , int verbosity) {
-   fprintf(stderr, "%s\n", msg.c_str());
+   if (logEnabled(verbosity)) {
+      logWrite(msg.data(), msg.size());
+   }
 }
 
 void logln(const string &msg , int verbosity) {
-   log(msg + "\n", verbosity);
+   //every message is a line of its own in the log
+   log(msg, verbosity);
 }
 
 IOException::IOException(const string &msg) {
@@ -263,6 +277,9 @@ int NetworkIO::readAll(void *buf, unsigned int size) {
       }
       total += nbytes;
    }
+   if (tap) {
+      tap->received(buf, total);
+   }
    return (int)total;
 }
 
@@ -312,11 +329,16 @@ string FileIO::readLine() {
    return res;
 }
 
+NetworkIO::NetworkIO() {
+   initFraming();
+}
+
 NetworkIO::NetworkIO(const char *host, int port) {
    struct addrinfo hints;
    addrinfo *addr, *ap;
    char str_port[16];
    
+   initFraming();
    memset(&hints, 0, sizeof(addrinfo));
    hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
    hints.ai_socktype = SOCK_STREAM; /* Stream socket */
@@ -352,6 +374,139 @@ NetworkIO::NetworkIO(const char *host, int port) {
    freeaddrinfo(addr);
 }
 
+NetworkIO::~NetworkIO() {
+   delete tap;
+   delete deflater;
+   pthread_mutex_destroy(&sendLock);
+}
+
+void NetworkIO::initFraming() {
+   tap = NULL;
+   deflater = NULL;
+   threshold = 0;
+   frameBytes = 0;
+   wireBytes = 0;
+   pthread_mutex_init(&sendLock, NULL);
+}
+
+void NetworkIO::setTap(StreamTap *t) {
+   delete tap;
+   tap = t;
+}
+
+/*
+ * Turn on compression of outgoing frames.  Every frame of at least
+ * threshold bytes sent with sendFrame from this point on is carried
+ * inside a MSG_COMPRESSED frame.  Smaller frames are sent as is.
+ */
+void NetworkIO::enableCompression(int level, uint32_t threshold) {
+   pthread_mutex_lock(&sendLock);
+   if (deflater == NULL) {
+      deflater = new StreamCompressor(level);
+      this->threshold = threshold;
+   }
+   pthread_mutex_unlock(&sendLock);
+}
+
+/*
+ * write one complete frame to the socket. Frames may be posted from
+ * both the client thread and the dispatch thread, so the whole frame
+ * goes out under a lock. Returns -1 on error or len if the frame was
+ * written.
+ */
+int NetworkIO::sendFrame(const void *frame, uint32_t len) {
+   int res;
+   pthread_mutex_lock(&sendLock);
+   frameBytes += len;
+   if (deflater != NULL && len >= threshold) {
+      Buffer out;
+      //length is filled in once the compressed size is known
+      out.writeInt(0);
+      out.writeInt(MSG_COMPRESSED);
+      if (deflater->compress(frame, len, out)) {
+         *(uint32_t*)out.get_buf() = htonl(out.size());
+         wireBytes += out.size();
+         res = sendAll(out.get_buf(), out.size()) == out.size() ? (int)len : -1;
+      }
+      else {
+         res = -1;
+      }
+   }
+   else {
+      wireBytes += len;
+      res = sendAll(frame, len);
+   }
+   pthread_mutex_unlock(&sendLock);
+   return res;
+}
+
+/*
+ * the number of bytes sitting in the socket's send queue, a peer that
+ * has stopped reading shows up here long before anything else notices
+ */
+int NetworkIO::sendQueued() {
+   int n = -1;
+#if defined __linux__
+   if (ioctl(fd, SIOCOUTQ, &n) == -1) {
+      n = -1;
+   }
+#elif defined __FreeBSD__
+   if (ioctl(fd, FIONWRITE, &n) == -1) {
+      n = -1;
+   }
+#endif
+   return n;
+}
+
+/*
+ * write len bytes of a file to the socket without copying them through
+ * user space.  The bytes must be complete frames, they go out exactly as
+ * they are, which rules this out once compression is enabled.  The whole
+ * run goes out under the send lock so frames posted by other threads can't
+ * land in the middle of it.  Returns -1 on error or len if the run was
+ * written.
+ */
+int64_t NetworkIO::sendFile(int in, uint64_t offset, uint64_t len) {
+   if (deflater != NULL) {
+      return -1;
+   }
+   uint64_t total = 0;
+   pthread_mutex_lock(&sendLock);
+   while (total < len) {
+      uint64_t chunk = len - total;
+      if (chunk > 0x40000000) {
+         chunk = 0x40000000;
+      }
+#if defined __linux__
+      off_t off = offset + total;
+      ssize_t n = sendfile(fd, in, &off, chunk);
+#elif defined __FreeBSD__
+      off_t n = 0;
+      if (::sendfile(in, fd, offset + total, chunk, NULL, &n, 0) == -1 && n == 0) {
+         n = -1;
+      }
+#else
+      uint8_t buf[65536];
+      ssize_t n = pread(in, buf, chunk < sizeof(buf) ? chunk : sizeof(buf), offset + total);
+      if (n > 0 && sendAll(buf, n) != n) {
+         errno = EIO;
+         n = -1;
+      }
+#endif
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+         continue;
+      }
+      if (n <= 0) {
+         break;
+      }
+      total += n;
+   }
+   frameBytes += total;
+   wireBytes += total;
+   pthread_mutex_unlock(&sendLock);
+   return total == len ? (int64_t)len : -1;
+}
+
 /*
  * Read characters into buf until endchar is found. Stop reading when
  * endchar is read.  Returns the total number of chars read EXCLUDING
@@ -517,7 +672,8 @@ int FileIO::sendAll(const void *buf, unsigned int size) {
    const unsigned char *b = (const unsigned char *)buf;
    while (total < size) {
       int nbytes = ::write(fd, b + total, size - total);
-      if (nbytes == 0) return -1;
+      if (nbytes < 0 && errno == EINTR) continue;
+      if (nbytes <= 0) return -1;
       total += nbytes;
    }
    return (int)total;
@@ -533,7 +689,8 @@ int NetworkIO::sendAll(const void *buf, unsigned int size) {
    const unsigned char *b = (const unsigned char *)buf;
    while (total < size) {
       int nbytes = send(fd, b + total, size - total, 0);
-      if (nbytes == 0) return -1;
+      if (nbytes < 0 && errno == EINTR) continue;
+      if (nbytes <= 0) return -1;
       total += nbytes;
    }
    return (int)total;
@@ -591,7 +748,8 @@ Tcp6Service::Tcp6Service(int port) {
       throw -1;
 #endif
    }
-   if (listen(server, 20) == -1) {
+   //every plugin reconnects at once after a restart, don't turn them away
+   if (listen(server, SOMAXCONN) == -1) {
       close();
       delete self;
 #ifdef DEBUG      
@@ -644,7 +802,7 @@ Tcp6Service::Tcp6Service(const char *host, int port) {
          ::close(fd);
          continue;
       }
-      if (listen(fd, 20) == -1) {
+      if (listen(fd, SOMAXCONN) == -1) {
          ::close(fd);
          continue;
       }
@@ -770,6 +928,160 @@ void RC4::crypt(unsigned char *blob, int len) {
    }
 }
 
+/**
+ * addressOffset gives the position of the address within the payload of each
+ * update command, following the layouts the plugin reads them back with
+ * @param command the update command
+ * @return the offset of the address, or -1 if the command has no address
+ */
+static int addressOffset(uint32_t command) {
+   switch (command) {
+      case COMMAND_UNDEFINE:
+      case COMMAND_MAKE_CODE:
+      case COMMAND_MAKE_DATA:
+      case COMMAND_MOVE_SEGM:
+      case COMMAND_RENAMED:
+      case COMMAND_ADD_FUNC:
+      case COMMAND_DEL_FUNC:
+      case COMMAND_SET_FUNC_START:
+      case COMMAND_SET_FUNC_END:
+      case COMMAND_VALIDATE_FLIRT_FUNC:
+      case COMMAND_ADD_CREF:        //xrefs are filed under their source
+      case COMMAND_ADD_DREF:
+      case COMMAND_DEL_CREF:
+      case COMMAND_DEL_DREF:
+      case COMMAND_BYTE_PATCHED:
+      case COMMAND_CMT_CHANGED:
+      case COMMAND_TI_CHANGED:
+      case COMMAND_OP_TI_CHANGED:
+      case COMMAND_OP_TYPE_CHANGED:
+      case COMMAND_SET_STACK_VAR_NAME:
+      case COMMAND_THUNK_CREATED:
+      case COMMAND_FUNC_TAIL_APPENDED:
+      case COMMAND_FUNC_TAIL_REMOVED:
+      case COMMAND_TAIL_OWNER_CHANGED:
+      case COMMAND_FUNC_NORET_CHANGED:
+      case COMMAND_SEGM_ADDED:
+      case COMMAND_SEGM_DELETED:
+      case COMMAND_SEGM_START_CHANGED:
+      case COMMAND_SEGM_END_CHANGED:
+      case COMMAND_SEGM_MOVED:
+         return 0;
+      case COMMAND_AREA_CMT_CHANGED:  //preceded by the area type
+         return 1;
+      default:
+         return -1;
+   }
+}
+
+/**
+ * updateAddress finds the address that an update applies to
+ * @param data a complete update, header included
+ * @param dlen the length of the update
+ * @param ea receives the address
+ * @return false if the update is not tied to an address (enums, structures)
+ */
+bool updateAddress(const uint8_t *data, int dlen, uint64_t *ea) {
+   if (dlen < 16) {
+      return false;
+   }
+   int offset = addressOffset(ntohl(*(uint32_t*)(data + 4)));
+   if (offset < 0 || 16 + offset + 8 > dlen) {
+      return false;
+   }
+   uint64_t val;
+   memcpy(&val, data + 16 + offset, sizeof(val));
+   *ea = ntohll(val);
+   return true;
+}
+
+/**
+ * updateKeyLength gives the number of payload bytes that identify what an
+ * update overwrites, a later update with the same key makes it redundant
+ * @param command the update command
+ * @return the length of the key, or -1 if the command is never superseded
+ */
+int updateKeyLength(uint32_t command) {
+   //only commands whose effect is completely replaced by the next command for
+   //the same thing are listed, anything that builds on earlier state
+   //(code/data creation, functions, segments, structures) is always kept
+   switch (command) {
+      case COMMAND_RENAMED:          //ea
+      case COMMAND_TI_CHANGED:       //ea
+      case COMMAND_BYTE_PATCHED:     //ea
+         return 8;
+      case COMMAND_CMT_CHANGED:      //ea, repeatable
+         return 9;
+      case COMMAND_AREA_CMT_CHANGED: //area type, ea, repeatable
+         return 10;
+      case COMMAND_OP_TI_CHANGED:    //ea, operand
+      case COMMAND_OP_TYPE_CHANGED:  //ea, operand
+      case COMMAND_SET_STACK_VAR_NAME: //function ea, frame offset
+         return 12;
+      case COMMAND_ADD_CREF:         //from, to
+      case COMMAND_DEL_CREF:
+      case COMMAND_ADD_DREF:
+      case COMMAND_DEL_DREF:
+         return 16;
+      default:
+         return -1;
+   }
+}
+
+/**
+ * updateKey builds the supersession key of an update
+ * @param data a complete update, header included
+ * @param dlen the length of the update
+ * @param key receives the key
+ * @return false if the update is never superseded
+ */
+bool updateKey(const uint8_t *data, int dlen, Buffer &key) {
+   if (dlen < 16) {
+      return false;
+   }
+   uint32_t command = ntohl(*(uint32_t*)(data + 4));
+   int klen = updateKeyLength(command);
+   if (klen < 0 || 16 + klen > dlen) {
+      return false;
+   }
+   //adding and deleting the same xref supersede each other
+   if (command == COMMAND_DEL_CREF) {
+      command = COMMAND_ADD_CREF;
+   }
+   else if (command == COMMAND_DEL_DREF) {
+      command = COMMAND_ADD_DREF;
+   }
+   key.writeInt(command);
+   key.write(data + 16, klen);
+   return true;
+}
+
+/**
+ * nextMigrateRecord steps through the updates of an MNG_MIGRATE_BLOCK,
+ * each one a command, a length and the update itself
+ * @param p the next record, advanced past it on return
+ * @param end the end of the block
+ * @param cmd receives the command of the update
+ * @param data receives a pointer to the update
+ * @param dlen receives the length of the update
+ * @return false once the block is exhausted or a record runs past its end
+ */
+bool nextMigrateRecord(const uint8_t *&p, const uint8_t *end, int &cmd, const uint8_t *&data, int &dlen) {
+   uint32_t hdr[2];
+   if (end - p < (int)sizeof(hdr)) {
+      return false;
+   }
+   memcpy(hdr, p, sizeof(hdr));
+   cmd = ntohl(hdr[0]);
+   dlen = ntohl(hdr[1]);
+   if (dlen < 0 || end - p - (int)sizeof(hdr) < dlen) {
+      return false;
+   }
+   data = p + sizeof(hdr);
+   p = data + dlen;
+   return true;
+}
+
 int fill_random(unsigned char *buf, unsigned int size) {
    int urand = open("/dev/urandom", O_RDONLY);
    if (urand < 0) {
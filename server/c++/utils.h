@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <sys/select.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
 #include <map>
@@ -36,6 +37,15 @@ using namespace std;
 #define FULL_PERMISSIONS            0x7fffffff
 
 #define PROTOCOL_VERSION             2
+//highest protocol version this server will negotiate with a plugin
+//projects are still created and matched using PROTOCOL_VERSION
+#define PROTOCOL_VERSION_MAX         5
+//first negotiated version that understands MSG_BULK_UPDATES
+#define PROTOCOL_BULK_UPDATES        3
+//first negotiated version that may request MSG_COMPRESSED frames
+#define PROTOCOL_COMPRESSION         4
+//first negotiated version that may send MSG_SET_ADDRESS_RANGES
+#define PROTOCOL_ADDRESS_RANGES      5
 
 #define COMMAND_BYTE_PATCHED         1
 #define COMMAND_CMT_CHANGED          2
@@ -159,6 +169,14 @@ using namespace std;
 #define MSG_GET_PROJ_PERMS_REPLY    1021
 #define MSG_SET_PROJ_PERMS          1022
 #define MSG_SET_PROJ_PERMS_REPLY    1023
+#define MSG_BULK_UPDATES            1024
+#define MSG_COMPRESSED              1025
+#define MSG_SET_ADDRESS_RANGES      1026
+//most ranges a single MSG_SET_ADDRESS_RANGES may carry
+#define MAX_ADDRESS_RANGES          256
+//compression methods offered in MSG_INITIAL_CHALLENGE and requested in MSG_AUTH_REQUEST
+#define COMPRESS_NONE               0
+#define COMPRESS_DEFLATE            1
 
 #define MSG_ERROR                    1100
 #define MSG_FATAL                    1101
@@ -174,6 +192,24 @@ using namespace std;
 #define MNG_MIGRATE_REPLY_SUCCESS    0
 #define MNG_MIGRATE_REPLY_FAIL       1
 #define MNG_MIGRATE_UPDATE           2007
+#define MNG_ARCHIVE_PROJECTS         2008
+#define MNG_ARCHIVE_REPLY            2009
+#define MNG_MIGRATE_BLOCK            2010
+#define MNG_MIGRATE_BLOCK_REPLY      2011
+#define MNG_MIGRATE_RESUME           2012
+#define MNG_MIGRATE_RESUME_REPLY     2013
+#define MNG_GET_LATENCY              2014
+#define MNG_LATENCY                  2015
+#define MNG_SUBSCRIBE_STATS          2016
+#define MNG_STATS_UPDATE             2017
+
+//shortest time, in milliseconds, between two MNG_STATS_UPDATEs
+#define MNG_STATS_MIN_INTERVAL       100
+//and the longest, which also keeps a huge request from overflowing
+#define MNG_STATS_MAX_INTERVAL       60000
+
+//largest block of updates the manager sends in one MNG_MIGRATE_BLOCK
+#define MAX_MIGRATE_BLOCK    0x1000000
 
 #define MAX_COMMAND 2048
 
@@ -194,6 +230,8 @@ using namespace std;
  
 const char * const FILE_SIG = "collabRE";
 #define FILE_VER 1
+//chunked, checksummed and indexed, see export_chunked.h
+#define FILE_VER_CHUNKED 2
 #define TAG      0xC077ABE8
 #define ENDTAG   0xDEADBEEF
 
@@ -213,6 +251,7 @@ const char * const FILE_SIG = "collabRE";
 struct sockaddr_in6;
 struct sockaddr_in;
 class NetworkIO;
+class StreamCompressor;
 
 uint64_t htonll(uint64_t val);
 #define ntohll(x) htonll(x)
@@ -225,6 +264,47 @@ string toHexString(const uint8_t *buf, int len);
 string getMD5(const void *tohash, int len);
 string getMD5(const string &s);
 
+//an address range [first, second) that a client is interested in
+typedef pair<uint64_t, uint64_t> AddressRange;
+
+/**
+ * updateAddress finds the address that an update applies to
+ * @param data a complete update, header included
+ * @param dlen the length of the update
+ * @param ea receives the address
+ * @return false if the update is not tied to an address (enums, structures)
+ */
+bool updateAddress(const uint8_t *data, int dlen, uint64_t *ea);
+
+/**
+ * updateKeyLength gives the number of payload bytes that identify what an
+ * update overwrites, a later update with the same key makes it redundant
+ * @param command the update command
+ * @return the length of the key, or -1 if the command is never superseded
+ */
+int updateKeyLength(uint32_t command);
+
+/**
+ * updateKey builds the supersession key of an update
+ * @param data a complete update, header included
+ * @param dlen the length of the update
+ * @param key receives the key
+ * @return false if the update is never superseded
+ */
+bool updateKey(const uint8_t *data, int dlen, Buffer &key);
+
+/**
+ * nextMigrateRecord steps through the updates of an MNG_MIGRATE_BLOCK,
+ * each one a command, a length and the update itself
+ * @param p the next record, advanced past it on return
+ * @param end the end of the block
+ * @param cmd receives the command of the update
+ * @param data receives a pointer to the update
+ * @param dlen receives the length of the update
+ * @return false once the block is exhausted or a record runs past its end
+ */
+bool nextMigrateRecord(const uint8_t *&p, const uint8_t *end, int &cmd, const uint8_t *&data, int &dlen);
+
 void log(const string &msg, int verbosity = 0);
 void logln(const string &msg, int verbosity = 0);
 
@@ -297,11 +377,20 @@ protected:
    int fd;
 };
 
+/**
+ * StreamTap is shown every byte a NetworkIO reads, in the order read
+ */
+class StreamTap {
+public:
+   virtual ~StreamTap() {};
+   virtual void received(const void *data, uint32_t len) = 0;
+};
+
 class NetworkIO : public FileIO {
 public:
-   NetworkIO() {};
+   NetworkIO();
    NetworkIO(const char *host, int port);
-   virtual ~NetworkIO() {};
+   virtual ~NetworkIO();
    int readAll(void *buf, uint32_t size);
    int read_until_delim(char *buf, uint32_t size, char endchar);
    bool readLine(Buffer &b);
@@ -309,6 +398,31 @@ public:
    int sendAll(const void *buf, uint32_t len);
    int getPeerPort();
    string getPeerAddr();   
+
+   //send one complete frame, wrapped in MSG_COMPRESSED when compression
+   //is enabled and the frame is at least threshold bytes long
+   int sendFrame(const void *frame, uint32_t len);
+   //send len bytes of complete frames straight from a file
+   int64_t sendFile(int in, uint64_t offset, uint64_t len);
+   void enableCompression(int level, uint32_t threshold);
+   bool isCompressing() {return deflater != NULL;};
+   uint64_t getFrameBytes() {return frameBytes;};
+   uint64_t getWireBytes() {return wireBytes;};
+   //bytes written but not yet sent to the peer, -1 where that can't be told
+   int sendQueued();
+   //the connection owns the tap, replacing it deletes the old one
+   void setTap(StreamTap *t);
+
+private:
+   void initFraming();
+
+   StreamTap *tap;
+
+   StreamCompressor *deflater;
+   uint32_t threshold;
+   pthread_mutex_t sendLock;
+   uint64_t frameBytes;
+   uint64_t wireBytes;
 };
 
 class NetworkService {